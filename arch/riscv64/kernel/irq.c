@@ -0,0 +1,140 @@
+/* RISC-V external interrupt handling (PLIC) */
+
+#include <minix/config.h>
+#include <minix/board.h>
+#include <asm/io.h>
+#include <asm/irq.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+
+/* Registered handlers */
+static struct {
+    irq_handler_t handler;
+    void *dev;
+} irq_table[NR_IRQS];
+
+#ifdef PLIC_BASE
+
+/* Per-context register strides */
+#define PLIC_ENABLE_STRIDE      0x80
+#define PLIC_CONTEXT_STRIDE     0x1000
+
+/* S-mode context of a hart (M-mode contexts are the even ones) */
+#define PLIC_S_CONTEXT(hart)    (2 * (hart) + 1)
+
+/* Boot hart; external interrupts are routed here */
+#define PLIC_BOOT_HART          0
+
+#define PLIC_PRIORITY(irq)      (PLIC_BASE + PLIC_PRIORITY_OFFSET + (irq) * 4)
+#define PLIC_ENABLE(ctx, irq)   (PLIC_BASE + PLIC_ENABLE_OFFSET + \
+                                 (ctx) * PLIC_ENABLE_STRIDE + ((irq) / 32) * 4)
+#define PLIC_THRESHOLD(ctx)     (PLIC_BASE + PLIC_THRESHOLD_OFFSET + \
+                                 (ctx) * PLIC_CONTEXT_STRIDE)
+#define PLIC_CLAIM(ctx)         (PLIC_BASE + PLIC_CLAIM_OFFSET + \
+                                 (ctx) * PLIC_CONTEXT_STRIDE)
+
+static void plic_enable(unsigned int irq, int enable)
+{
+    unsigned long reg = PLIC_ENABLE(PLIC_S_CONTEXT(PLIC_BOOT_HART), irq);
+    unsigned long val = readl(reg);
+
+    if (enable) {
+        val |= (1UL << (irq % 32));
+    } else {
+        val &= ~(1UL << (irq % 32));
+    }
+    writel(val & 0xFFFFFFFFUL, reg);
+}
+
+/* Initialize the PLIC */
+void plic_init(void)
+{
+    int ctx = PLIC_S_CONTEXT(PLIC_BOOT_HART);
+    unsigned int irq;
+
+    /* All sources masked until a driver asks for them */
+    for (irq = 1; irq < NR_IRQS; irq++) {
+        plic_enable(irq, 0);
+    }
+
+    /* Accept any priority above 0 */
+    writel(0, PLIC_THRESHOLD(ctx));
+
+    early_puts("[IRQ] PLIC initialized\n");
+}
+
+/* Claim, dispatch and complete pending external interrupts */
+void plic_handle_irq(void)
+{
+    int ctx = PLIC_S_CONTEXT(PLIC_BOOT_HART);
+    unsigned int irq;
+
+    while ((irq = (unsigned int)readl(PLIC_CLAIM(ctx))) != 0) {
+        if (irq < NR_IRQS && irq_table[irq].handler) {
+            irq_table[irq].handler(irq, irq_table[irq].dev);
+        } else {
+            early_puts("[IRQ] Spurious external interrupt ");
+            early_puthex(irq);
+            early_puts("\n");
+        }
+        writel(irq, PLIC_CLAIM(ctx));
+    }
+}
+
+#else /* !PLIC_BASE */
+
+void plic_init(void)
+{
+}
+
+void plic_handle_irq(void)
+{
+}
+
+static void plic_enable(unsigned int irq, int enable)
+{
+    (void)irq;
+    (void)enable;
+}
+
+#endif /* PLIC_BASE */
+
+/* Register a handler and enable the interrupt source */
+int request_irq(unsigned int irq, irq_handler_t handler, void *dev)
+{
+    if (irq == 0 || irq >= NR_IRQS || handler == NULL) {
+        return -1;
+    }
+
+    if (irq_table[irq].handler) {
+        return -1;  /* Already claimed */
+    }
+
+    irq_table[irq].handler = handler;
+    irq_table[irq].dev = dev;
+
+#ifdef PLIC_BASE
+    writel(1, PLIC_PRIORITY(irq));
+#endif
+    plic_enable(irq, 1);
+
+    return 0;
+}
+
+/* Disable the interrupt source and drop its handler */
+void free_irq(unsigned int irq)
+{
+    if (irq == 0 || irq >= NR_IRQS) {
+        return;
+    }
+
+    plic_enable(irq, 0);
+    irq_table[irq].handler = NULL;
+    irq_table[irq].dev = NULL;
+}
@@ -16,7 +16,12 @@ void console_init(void);
 void trap_init(void);
 void mm_init(void);
 void sched_init(void);
+void wait_table_init(void);
+void smp_init(void);
+void timer_init(void);
+void init_timers(void);
 void drivers_init(void);
+void kswapd_init(void);
 void board_init(void);
 void schedule(void);
 void shell_init(void);
@@ -29,8 +34,8 @@ void early_puthex(unsigned long val);
 
 void kinit(void)
 {
-    /* Initialize stack pointer for trap handling */
-    asm volatile ("csrw sscratch, %0" :: "r"(&__stack_end));
+    /* sscratch = 0 while in kernel (see trap_asm.S) */
+    asm volatile ("csrw sscratch, zero");
 
     /* Clear BSS section */
     unsigned long *p = &__bss_start;
@@ -43,12 +48,20 @@ void kinit(void)
 
     /* Initialize kernel subsystems */
     trap_init();
+    board_irq_init();
     mm_init();
+    wait_table_init();
     sched_init();
+    init_timers();
+    timer_init();
+    smp_init();
     drivers_init();
 
+    /* Reclaim thread: runs on whichever hart is free */
+    kswapd_init();
+
     /* Enable interrupts */
-    set_csr(CSR_SIE, SR_SIE | SR_SPIE);
+    set_csr(sstatus, SSTATUS_SIE);
 
     /* Print brief startup message */
     early_puts("\nMinix RV64 ready\n");
@@ -0,0 +1,389 @@
+/* Minimal M-mode SBI runtime
+ *
+ * The kernel boots bare metal (no OpenSBI), so M-mode services the
+ * S-mode kernel needs are provided here: the HSM extension to start
+ * secondary harts, the IPI extension for inter-hart software
+ * interrupts, the RFENCE extension for remote TLB flushes and the
+ * TIME extension for the supervisor timer. When the hart implements
+ * Sstc, S-mode is also given direct access to stimecmp. Runs in
+ * M-mode with translation off; the kernel image is identity mapped so
+ * the same code and data addresses work.
+ */
+
+#include <minix/config.h>
+#include <minix/board.h>
+#include <asm/csr.h>
+#include <asm/io.h>
+#include <asm/sbi.h>
+#include <types.h>
+
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+extern void sbi_trap_vector(void);
+
+/* Hart is not present (never entered _start) */
+#define SBI_HSM_ABSENT          (-1)
+
+/* CSRs newer than some assemblers */
+#define CSR_MENVCFG             0x30a
+#define CSR_MCOUNTEREN          0x306
+#define MENVCFG_STCE            (1UL << 63)
+#define MCOUNTEREN_TM           (1UL << 1)
+
+/* Registers saved by sbi_trap_vector (see mtrap.S) */
+struct sbi_trap_regs {
+    unsigned long ra, t0, t1, t2;
+    unsigned long a0, a1, a2, a3, a4, a5, a6, a7;
+    unsigned long t3, t4, t5, t6;
+};
+
+/* Per-hart HSM state. Lives in .data: secondary harts read it before
+ * the boot hart has cleared .bss
+ */
+static struct {
+    volatile long status;
+    volatile unsigned long start_addr;
+    volatile unsigned long opaque;
+} hsm[SMP_CPUS] __attribute__((section(".data"))) = {
+    [0 ... SMP_CPUS - 1] = { .status = SBI_HSM_ABSENT },
+};
+
+/* Requests carried by a hart's machine software interrupt */
+static volatile int ipi_pending[SMP_CPUS] __attribute__((section(".data")));
+static volatile int rfence_pending[SMP_CPUS] __attribute__((section(".data")));
+
+/* One remote fence at a time; its range is read by the targets */
+static volatile int rfence_lock __attribute__((section(".data"))) = 0;
+static volatile unsigned long rfence_start __attribute__((section(".data")));
+static volatile unsigned long rfence_size __attribute__((section(".data")));
+
+/* Ranges longer than this flush the whole TLB */
+#define RFENCE_MAX_PAGES        64
+
+/* Sstc is usable from S-mode (all harts are assumed alike) */
+volatile int sbi_sstc_enabled __attribute__((section(".data"))) = 0;
+
+/* An illegal instruction while probing a CSR sets probe_failed */
+static volatile int probing __attribute__((section(".data"))) = 0;
+static volatile int probe_failed __attribute__((section(".data"))) = 0;
+
+#ifdef CLINT_BASE
+#define CLINT_MSIP(hart)    (CLINT_BASE + CLINT_MSIP_OFFSET + (hart) * 4)
+#define CLINT_MTIMECMP(hart) (CLINT_BASE + CLINT_MTIMECMP_OFFSET + (hart) * 8)
+
+static void set_msip(unsigned long hart, u32 val)
+{
+    writel(val, CLINT_MSIP(hart));
+}
+
+static void set_mtimecmp(unsigned long hart, u64 val)
+{
+    *(volatile u64 *)CLINT_MTIMECMP(hart) = val;
+}
+#else
+static void set_msip(unsigned long hart, u32 val)
+{
+    (void)hart;
+    (void)val;
+}
+
+static void set_mtimecmp(unsigned long hart, u64 val)
+{
+    (void)hart;
+    (void)val;
+}
+#endif
+
+/* ============================================
+ * Boot
+ * ============================================ */
+
+/* Per-hart M-mode setup, called from _start on the hart's M stack */
+void sbi_init(unsigned long hartid)
+{
+    unsigned long sp;
+
+    /* Trap stack is the stack we are running on now */
+    asm volatile ("mv %0, sp" : "=r"(sp));
+    write_csr(mscratch, sp);
+    write_csr(mtvec, (unsigned long)&sbi_trap_vector);
+
+    /* Machine software interrupt carries IPIs, remote fences and
+     * hart_start requests; the machine timer is enabled by set_timer
+     */
+    set_msip(hartid, 0);
+    write_csr(mie, 1UL << IRQ_M_SOFT);
+
+    /* Let S-mode read the time CSR */
+    asm volatile ("csrs %0, %1" :: "i"(CSR_MCOUNTEREN), "r"(MCOUNTEREN_TM));
+
+    /* Hand stimecmp to S-mode if the hart has Sstc. menvcfg itself
+     * may not exist, so the access is probed
+     */
+    {
+        unsigned long envcfg = 0;
+
+        probe_failed = 0;
+        probing = 1;
+        asm volatile ("csrs %0, %1" :: "i"(CSR_MENVCFG), "r"(MENVCFG_STCE));
+        asm volatile ("csrr %0, %1" : "=r"(envcfg) : "i"(CSR_MENVCFG));
+        probing = 0;
+
+        if (hartid == 0) {
+            sbi_sstc_enabled = !probe_failed && (envcfg & MENVCFG_STCE);
+        }
+    }
+
+    hsm[hartid].status = (hartid == 0) ? SBI_HSM_STARTED : SBI_HSM_STOPPED;
+}
+
+/* Secondary harts wait here until hart_start, then enter S-mode */
+void sbi_hart_park(unsigned long hartid)
+{
+    unsigned long mstatus;
+
+    while (hsm[hartid].status != SBI_HSM_START_PENDING) {
+        asm volatile ("wfi");
+    }
+    set_msip(hartid, 0);
+    __sync_synchronize();
+
+    /* mret to S-mode, translation off, S interrupts disabled */
+    mstatus = read_csr(mstatus);
+    mstatus = (mstatus & ~SR_MPP) | (1UL << 11);
+    write_csr(mstatus, mstatus);
+    write_csr(satp, 0);
+    write_csr(mepc, hsm[hartid].start_addr);
+
+    hsm[hartid].status = SBI_HSM_STARTED;
+
+    {
+        register unsigned long a0 asm("a0") = hartid;
+        register unsigned long a1 asm("a1") = hsm[hartid].opaque;
+        asm volatile ("mret" :: "r"(a0), "r"(a1));
+    }
+    __builtin_unreachable();
+}
+
+/* ============================================
+ * SBI Calls
+ * ============================================ */
+
+static long sbi_hsm_hart_start(unsigned long hartid, unsigned long addr,
+                               unsigned long opaque)
+{
+    if (hartid >= SMP_CPUS || hsm[hartid].status == SBI_HSM_ABSENT) {
+        return SBI_ERR_INVALID_PARAM;
+    }
+    if (hsm[hartid].status != SBI_HSM_STOPPED) {
+        return SBI_ERR_ALREADY_AVAILABLE;
+    }
+
+    hsm[hartid].start_addr = addr;
+    hsm[hartid].opaque = opaque;
+    __sync_synchronize();
+    hsm[hartid].status = SBI_HSM_START_PENDING;
+    set_msip(hartid, 1);
+    return SBI_SUCCESS;
+}
+
+/* Flush this hart's TLB entries for [start, start + size) */
+static void sbi_sfence_vma(unsigned long start, unsigned long size)
+{
+    unsigned long va;
+
+    if (size == (unsigned long)-1 || size > RFENCE_MAX_PAGES * 4096UL) {
+        asm volatile ("sfence.vma" ::: "memory");
+        return;
+    }
+    for (va = start & ~4095UL; va < start + size; va += 4096) {
+        asm volatile ("sfence.vma %0" :: "r"(va) : "memory");
+    }
+}
+
+/* Run a fence another hart asked of this one */
+static void sbi_rfence_service(unsigned long hartid)
+{
+    if (rfence_pending[hartid]) {
+        sbi_sfence_vma(rfence_start, rfence_size);
+        __sync_synchronize();
+        rfence_pending[hartid] = 0;
+    }
+}
+
+static int sbi_hart_in_mask(unsigned long i, unsigned long mask, unsigned long base)
+{
+    /* hart_mask_base == -1 means every hart */
+    if (base == (unsigned long)-1) {
+        return 1;
+    }
+    return i >= base && i - base < 64 && (mask & (1UL << (i - base)));
+}
+
+/* Interrupt every started hart in the mask to flush the range, then
+ * wait until all of them have. Harts here with M interrupts off, in
+ * another call, keep servicing their own requests while they wait
+ */
+static long sbi_remote_sfence(unsigned long mask, unsigned long base,
+                              unsigned long start, unsigned long size)
+{
+    unsigned long self = read_csr(mhartid);
+    unsigned long i;
+    int busy;
+
+    while (__sync_lock_test_and_set(&rfence_lock, 1)) {
+        sbi_rfence_service(self);
+    }
+
+    rfence_start = start;
+    rfence_size = size;
+    for (i = 0; i < SMP_CPUS; i++) {
+        if (i == self || !sbi_hart_in_mask(i, mask, base) ||
+            hsm[i].status != SBI_HSM_STARTED) {
+            continue;
+        }
+        rfence_pending[i] = 1;
+        __sync_synchronize();
+        set_msip(i, 1);
+    }
+
+    if (sbi_hart_in_mask(self, mask, base)) {
+        sbi_sfence_vma(start, size);
+    }
+
+    do {
+        busy = 0;
+        for (i = 0; i < SMP_CPUS; i++) {
+            busy |= rfence_pending[i];
+        }
+    } while (busy);
+
+    __sync_lock_release(&rfence_lock);
+    return SBI_SUCCESS;
+}
+
+static void sbi_handle_ecall(struct sbi_trap_regs *regs)
+{
+    long error = SBI_SUCCESS;
+    long value = 0;
+    unsigned long i;
+
+    switch (regs->a7) {
+    case SBI_EXT_BASE:
+        if (regs->a6 == SBI_BASE_PROBE_EXT) {
+            value = (regs->a0 == SBI_EXT_BASE || regs->a0 == SBI_EXT_HSM ||
+                     regs->a0 == SBI_EXT_IPI || regs->a0 == SBI_EXT_TIME ||
+                     regs->a0 == SBI_EXT_RFENCE);
+        } else {
+            error = SBI_ERR_NOT_SUPPORTED;
+        }
+        break;
+
+    case SBI_EXT_HSM:
+        if (regs->a6 == SBI_HSM_HART_START) {
+            error = sbi_hsm_hart_start(regs->a0, regs->a1, regs->a2);
+        } else if (regs->a6 == SBI_HSM_HART_STATUS) {
+            if (regs->a0 >= SMP_CPUS || hsm[regs->a0].status == SBI_HSM_ABSENT) {
+                error = SBI_ERR_INVALID_PARAM;
+            } else {
+                value = hsm[regs->a0].status;
+            }
+        } else {
+            error = SBI_ERR_NOT_SUPPORTED;
+        }
+        break;
+
+    case SBI_EXT_TIME:
+        if (regs->a6 != SBI_TIME_SET_TIMER) {
+            error = SBI_ERR_NOT_SUPPORTED;
+            break;
+        }
+        /* Retire the pending supervisor tick and arm the next one */
+        set_mtimecmp(read_csr(mhartid), regs->a0);
+        clear_csr(mip, 1UL << IRQ_S_TIMER);
+        set_csr(mie, 1UL << IRQ_M_TIMER);
+        break;
+
+    case SBI_EXT_IPI:
+        if (regs->a6 != SBI_IPI_SEND_IPI) {
+            error = SBI_ERR_NOT_SUPPORTED;
+            break;
+        }
+        for (i = 0; i < SMP_CPUS; i++) {
+            if (sbi_hart_in_mask(i, regs->a0, regs->a1) &&
+                hsm[i].status == SBI_HSM_STARTED) {
+                ipi_pending[i] = 1;
+                __sync_synchronize();
+                set_msip(i, 1);
+            }
+        }
+        break;
+
+    case SBI_EXT_RFENCE:
+        if (regs->a6 != SBI_RFENCE_REMOTE_SFENCE_VMA) {
+            error = SBI_ERR_NOT_SUPPORTED;
+            break;
+        }
+        error = sbi_remote_sfence(regs->a0, regs->a1, regs->a2, regs->a3);
+        break;
+
+    default:
+        error = SBI_ERR_NOT_SUPPORTED;
+        break;
+    }
+
+    regs->a0 = (unsigned long)error;
+    regs->a1 = (unsigned long)value;
+}
+
+/* ============================================
+ * M-mode Trap Handler
+ * ============================================ */
+
+void sbi_trap_handler(struct sbi_trap_regs *regs)
+{
+    unsigned long mcause = read_csr(mcause);
+    unsigned long hartid = read_csr(mhartid);
+
+    if (mcause == ((1UL << 63) | IRQ_M_SOFT)) {
+        /* A remote fence is done here; an IPI is forwarded as a
+         * supervisor software interrupt
+         */
+        set_msip(hartid, 0);
+        __sync_synchronize();
+        sbi_rfence_service(hartid);
+        if (ipi_pending[hartid]) {
+            ipi_pending[hartid] = 0;
+            set_csr(mip, 1UL << IRQ_S_SOFT);
+        }
+        return;
+    }
+
+    if (mcause == ((1UL << 63) | IRQ_M_TIMER)) {
+        /* Timer: hand the tick to S-mode until the next set_timer */
+        clear_csr(mie, 1UL << IRQ_M_TIMER);
+        set_csr(mip, 1UL << IRQ_S_TIMER);
+        return;
+    }
+
+    if (mcause == EXC_INST_ILLEGAL && probing) {
+        probe_failed = 1;
+        write_csr(mepc, read_csr(mepc) + 4);
+        return;
+    }
+
+    if (mcause == EXC_ECALL_S) {
+        sbi_handle_ecall(regs);
+        write_csr(mepc, read_csr(mepc) + 4);
+        return;
+    }
+
+    early_puts("[SBI] Unexpected M-mode trap, mcause=");
+    early_puthex(mcause);
+    early_puts(" mepc=");
+    early_puthex(read_csr(mepc));
+    early_puts("\n");
+    while (1) {
+        asm volatile ("wfi");
+    }
+}
@@ -0,0 +1,158 @@
+/* RISC-V SMP bring-up and inter-processor interrupts
+ *
+ * Secondary harts are started through the SBI HSM extension. Each
+ * gets an idle task whose kernel stack it runs on from the first
+ * instruction; it then joins the scheduler through cpu_idle(). The
+ * hart id doubles as the CPU number and is kept in tp while in the
+ * kernel.
+ */
+
+#include <minix/config.h>
+#include <minix/task.h>
+#include <minix/sched.h>
+#include <minix/smp.h>
+#include <minix/mm.h>
+#include <minix/time.h>
+#include <asm/csr.h>
+#include <asm/sbi.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+extern void secondary_entry(void);
+extern void trap_init_hart(void);
+
+/* Spins to wait for a started hart before giving up on it */
+#define SMP_BOOT_TIMEOUT    10000000UL
+
+/* Boot hart is online from the start */
+volatile unsigned long cpu_online_mask = 1;
+
+static struct task_struct *idle_tasks[SMP_CPUS];
+
+/* Build the idle task of a secondary hart */
+static struct task_struct *fork_idle(int cpu)
+{
+    struct task_struct *idle;
+    struct thread_info *ti;
+
+    idle = alloc_task_struct();
+    if (!idle) {
+        return NULL;
+    }
+
+    ti = alloc_thread_info();
+    if (!ti) {
+        free_task_struct(idle);
+        return NULL;
+    }
+    setup_thread_info(ti, idle);
+
+    idle->state = TASK_RUNNING;
+    idle->flags = PF_KTHREAD | PF_IDLE;
+    idle->prio = MAX_PRIO - 1;
+    idle->static_prio = MAX_PRIO - 1;
+    idle->normal_prio = MAX_PRIO - 1;
+    idle->policy = SCHED_NORMAL;
+    idle->time_slice = DEF_TIMESLICE;
+    idle->stack = ti;
+    idle->parent = &init_task;
+    idle->real_parent = &init_task;
+    idle->group_leader = idle;
+    idle->comm[0] = 'i';
+    idle->comm[1] = 'd';
+    idle->comm[2] = 'l';
+    idle->comm[3] = 'e';
+    idle->comm[4] = '\0';
+    INIT_LIST_HEAD(&idle->tasks);
+    INIT_LIST_HEAD(&idle->children);
+    INIT_LIST_HEAD(&idle->sibling);
+    INIT_LIST_HEAD(&idle->run_list);
+
+    init_idle(idle, cpu);
+    return idle;
+}
+
+/* First C code on a secondary hart (from secondary_entry in start.S) */
+void secondary_start_kernel(unsigned long hartid)
+{
+    int cpu = (int)hartid;
+
+    /* sscratch = 0 while in kernel (see trap_asm.S) */
+    asm volatile ("csrw sscratch, zero");
+
+    enable_mmu_secondary();
+    trap_init_hart();
+
+    set_current(idle_tasks[cpu]);
+    __sync_fetch_and_or(&cpu_online_mask, 1UL << cpu);
+
+    timer_init_hart();
+
+    set_csr(sstatus, SSTATUS_SIE);
+    cpu_idle();
+}
+
+/* Start every secondary hart the SBI reports as present */
+void smp_init(void)
+{
+    int cpu;
+
+    for (cpu = 1; cpu < SMP_CPUS; cpu++) {
+        unsigned long timeout;
+
+        if (sbi_hart_get_status(cpu) != SBI_HSM_STOPPED) {
+            continue;
+        }
+
+        idle_tasks[cpu] = fork_idle(cpu);
+        if (!idle_tasks[cpu]) {
+            early_puts("[SMP] Cannot allocate idle task\n");
+            break;
+        }
+
+        if (sbi_hart_start(cpu, (unsigned long)&secondary_entry,
+                           (unsigned long)idle_tasks[cpu]->stack + THREAD_SIZE) != SBI_SUCCESS) {
+            early_puts("[SMP] hart_start failed for hart ");
+            early_puthex(cpu);
+            early_puts("\n");
+            continue;
+        }
+
+        for (timeout = SMP_BOOT_TIMEOUT; timeout && !cpu_online(cpu); timeout--) {
+            /* Wait */
+        }
+        if (!cpu_online(cpu)) {
+            early_puts("[SMP] Hart ");
+            early_puthex(cpu);
+            early_puts(" did not come online\n");
+        }
+    }
+
+    early_puts("✓ SMP: ");
+    early_puthex(num_online_cpus());
+    early_puts(" harts online\n");
+}
+
+/* ============================================
+ * Inter-Processor Interrupts
+ * ============================================ */
+
+void smp_send_reschedule(int cpu)
+{
+    if (cpu == smp_processor_id()) {
+        set_tsk_need_resched(get_current());
+        return;
+    }
+    sbi_send_ipi(1UL << cpu, 0);
+}
+
+void smp_handle_ipi(void)
+{
+    /* Only reschedule requests are sent for now */
+    set_tsk_need_resched(get_current());
+}
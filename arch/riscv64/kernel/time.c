@@ -0,0 +1,328 @@
+/* RISC-V supervisor timer, clock events and the scheduler tick
+ *
+ * Each hart programs its own next deadline, through the Sstc stimecmp
+ * CSR when the M-mode runtime enabled it and through SBI set_timer
+ * otherwise. The deadline is the earlier of the hart's next periodic
+ * tick and its first one-shot timer event.
+ *
+ * While a task runs, the periodic tick is its time-slice clock and
+ * drives the timer wheel. Every hart ticks on the same grid of whole
+ * periods since boot, so interrupt latency does not make ticks drift
+ * and a jiffy starts with a tick. An idle hart stops its tick (NO_HZ)
+ * and only wakes for its next event or an interrupt, so jiffies are
+ * kept from the time CSR by whichever hart is ticking.
+ */
+
+#include <minix/config.h>
+#include <minix/time.h>
+#include <minix/sched.h>
+#include <minix/smp.h>
+#include <minix/timer.h>
+#include <asm/irq.h>
+#include <asm/sbi.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+
+/* Sstc supervisor timer compare */
+#define CSR_STIMECMP        0x14d
+
+/* Deadline that never arrives */
+#define TIME_NEVER          (~0ULL)
+
+/* Per-hart clock event device */
+struct clock_event {
+    spinlock_t lock;                /* Protects events */
+    struct list_head events;        /* Pending timer events, by expiry */
+    u64 next_tick;                  /* Next periodic tick */
+    u64 programmed;                 /* Deadline currently in the timer */
+    int tick_stopped;               /* Idle with the tick off */
+};
+
+static struct clock_event clock_events[SMP_CPUS];
+
+volatile unsigned long jiffies = 0;
+volatile unsigned long nohz_idle_mask = 0;
+
+/* Time CSR value jiffies was last advanced at */
+static spinlock_t jiffies_lock = SPIN_LOCK_INIT;
+static u64 last_jiffies_update;
+
+static void timer_program(u64 when)
+{
+    if (sbi_sstc_enabled) {
+        asm volatile ("csrw %0, %1" :: "i"(CSR_STIMECMP), "r"(when));
+    } else {
+        sbi_set_timer(when);
+    }
+}
+
+/* Program the earlier of the next tick and the first event */
+static void clockevent_reprogram(struct clock_event *ce)
+{
+    u64 deadline = ce->tick_stopped ? TIME_NEVER : ce->next_tick;
+
+    spin_lock(&ce->lock);
+    if (!list_empty(&ce->events)) {
+        struct timer_event *ev = list_first_entry(&ce->events,
+                                                  struct timer_event, node);
+        if (ev->expires < deadline) {
+            deadline = ev->expires;
+        }
+    }
+    spin_unlock(&ce->lock);
+
+    ce->programmed = deadline;
+    timer_program(deadline);
+}
+
+/* Catch jiffies up with the time CSR */
+static void tick_do_update_jiffies(u64 now)
+{
+    if (now < last_jiffies_update + TICK_CYCLES) {
+        return;
+    }
+
+    spin_lock(&jiffies_lock);
+    while (last_jiffies_update + TICK_CYCLES <= now) {
+        last_jiffies_update += TICK_CYCLES;
+        jiffies++;
+    }
+    spin_unlock(&jiffies_lock);
+}
+
+/* Time CSR value at which jiffies reaches j */
+u64 jiffies_to_time(unsigned long j)
+{
+    unsigned long flags, now_j;
+    u64 base;
+
+    flags = local_irq_save();
+    spin_lock(&jiffies_lock);
+    base = last_jiffies_update;
+    now_j = jiffies;
+    spin_unlock(&jiffies_lock);
+    local_irq_restore(flags);
+
+    if ((long)(j - now_j) <= 0) {
+        return base;
+    }
+    return base + (u64)(j - now_j) * TICK_CYCLES;
+}
+
+/* First jiffy that starts at or after time CSR value when */
+unsigned long time_to_jiffies(u64 when)
+{
+    unsigned long flags, now_j;
+    u64 base;
+
+    flags = local_irq_save();
+    spin_lock(&jiffies_lock);
+    base = last_jiffies_update;
+    now_j = jiffies;
+    spin_unlock(&jiffies_lock);
+    local_irq_restore(flags);
+
+    if (when <= base) {
+        return now_j;
+    }
+    return now_j + (unsigned long)((when - base + TICK_CYCLES - 1) / TICK_CYCLES);
+}
+
+/* ============================================
+ * Timer Events
+ * ============================================ */
+
+void timer_event_init(struct timer_event *ev,
+                      void (*function)(struct timer_event *ev), void *data)
+{
+    INIT_LIST_HEAD(&ev->node);
+    ev->expires = 0;
+    ev->function = function;
+    ev->data = data;
+    ev->cpu = -1;
+}
+
+void timer_event_add(struct timer_event *ev, u64 expires)
+{
+    struct clock_event *ce;
+    struct timer_event *pos;
+    unsigned long flags;
+    int first;
+
+    timer_event_del(ev);
+
+    flags = local_irq_save();
+    ce = &clock_events[smp_processor_id()];
+
+    spin_lock(&ce->lock);
+    ev->expires = expires;
+    ev->cpu = smp_processor_id();
+
+    /* Insert before the first later event (FIFO among equals) */
+    list_for_each_entry(pos, &ce->events, node) {
+        if (pos->expires > expires) {
+            break;
+        }
+    }
+    list_add_tail(&ev->node, &pos->node);
+    first = (ce->events.next == &ev->node);
+    spin_unlock(&ce->lock);
+
+    if (first && expires < ce->programmed) {
+        ce->programmed = expires;
+        timer_program(expires);
+    }
+
+    local_irq_restore(flags);
+}
+
+int timer_event_del(struct timer_event *ev)
+{
+    struct clock_event *ce;
+    unsigned long flags;
+    int cpu, pending = 0;
+
+    cpu = ev->cpu;
+    if (cpu < 0) {
+        return 0;
+    }
+
+    flags = local_irq_save();
+    ce = &clock_events[cpu];
+
+    /* A stale early deadline left in the timer only costs a wakeup */
+    spin_lock(&ce->lock);
+    if (ev->cpu == cpu) {
+        list_del(&ev->node);
+        ev->cpu = -1;
+        pending = 1;
+    }
+    spin_unlock(&ce->lock);
+
+    local_irq_restore(flags);
+    return pending;
+}
+
+/* Run every event on this hart that is due by now */
+static void run_timer_events(struct clock_event *ce, u64 now)
+{
+    struct timer_event *ev;
+
+    while (1) {
+        spin_lock(&ce->lock);
+        if (list_empty(&ce->events)) {
+            spin_unlock(&ce->lock);
+            return;
+        }
+        ev = list_first_entry(&ce->events, struct timer_event, node);
+        if (ev->expires > now) {
+            spin_unlock(&ce->lock);
+            return;
+        }
+        list_del(&ev->node);
+        ev->cpu = -1;
+        spin_unlock(&ce->lock);
+
+        /* Unlocked: the callback may re-add the event */
+        ev->function(ev);
+    }
+}
+
+/* ============================================
+ * Tick
+ * ============================================ */
+
+/* All harts tick on the jiffies grid, so a jiffy starts with a tick */
+static u64 next_tick_after(u64 now)
+{
+    tick_do_update_jiffies(now);
+    return last_jiffies_update + TICK_CYCLES;
+}
+
+/* Start the tick on the calling hart */
+void timer_init_hart(void)
+{
+    struct clock_event *ce = &clock_events[smp_processor_id()];
+
+    spin_lock_init(&ce->lock);
+    INIT_LIST_HEAD(&ce->events);
+    ce->tick_stopped = 0;
+    ce->next_tick = next_tick_after(get_cycles());
+    clockevent_reprogram(ce);
+}
+
+/* Start the tick on the boot hart; called before secondaries start */
+void timer_init(void)
+{
+    last_jiffies_update = get_cycles();
+    timer_init_hart();
+
+    early_puts("✓ Timer: ");
+    early_puthex(HZ);
+    early_puts(sbi_sstc_enabled ? " Hz tick (stimecmp), NO_HZ idle\n"
+                                : " Hz tick (SBI), NO_HZ idle\n");
+}
+
+/* Supervisor timer interrupt */
+void timer_interrupt(void)
+{
+    struct clock_event *ce = &clock_events[smp_processor_id()];
+    u64 now = get_cycles();
+    int tick = 0;
+
+    tick_do_update_jiffies(now);
+
+    /* Account once for every tick that elapsed, e.g. with interrupts
+     * disabled
+     */
+    if (!ce->tick_stopped && ce->next_tick <= now) {
+        do {
+            ce->next_tick += TICK_CYCLES;
+        } while (ce->next_tick <= now);
+        tick = 1;
+    }
+
+    run_timer_events(ce, now);
+    clockevent_reprogram(ce);
+
+    if (tick) {
+        scheduler_tick();
+    }
+}
+
+/* ============================================
+ * NO_HZ Idle
+ * ============================================ */
+
+void tick_nohz_idle_enter(void)
+{
+    int cpu = smp_processor_id();
+    struct clock_event *ce = &clock_events[cpu];
+
+    ce->tick_stopped = 1;
+    __sync_fetch_and_or(&nohz_idle_mask, 1UL << cpu);
+
+    /* Only the next kernel timer needs the hart back */
+    timer_nohz_arm();
+    clockevent_reprogram(ce);
+}
+
+void tick_nohz_idle_exit(void)
+{
+    int cpu = smp_processor_id();
+    struct clock_event *ce = &clock_events[cpu];
+    u64 now = get_cycles();
+
+    __sync_fetch_and_and(&nohz_idle_mask, ~(1UL << cpu));
+
+    /* Restart the tick on the grid; a due event fires right away */
+    ce->tick_stopped = 0;
+    ce->next_tick = next_tick_after(now);
+    clockevent_reprogram(ce);
+}
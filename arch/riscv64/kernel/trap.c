@@ -1,9 +1,17 @@
 /* RISC-V trap and exception handling */
 
 #include <minix/config.h>
+#include <minix/task.h>
+#include <minix/smp.h>
+#include <minix/time.h>
 #include <asm/csr.h>
+#include <asm/irq.h>
 #include <types.h>
 
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
 /* Trap frame structure - saved registers on exception/interrupt */
 struct trap_frame {
     unsigned long ra;     /* x1  - Return address */
@@ -85,6 +93,11 @@ void do_trap(struct trap_frame *tf)
     } else {
         handle_exception(tf);
     }
+
+    /* Preempt on the way back to user mode */
+    while (!(tf->sstatus & SSTATUS_SPP) && need_resched()) {
+        schedule();
+    }
 }
 
 /* Handle interrupts */
@@ -94,20 +107,19 @@ void handle_interrupt(struct trap_frame *tf)
 
     switch (cause) {
     case IRQ_S_SOFT:
-        /* Software interrupt - used for IPI */
-        /* Clear the interrupt */
-        /* TODO: Handle software interrupt */
+        /* Software interrupt - IPI forwarded by the SBI */
+        clear_csr(sip, 1UL << IRQ_S_SOFT);
+        smp_handle_ipi();
         break;
 
     case IRQ_S_TIMER:
-        /* Timer interrupt - scheduler tick */
-        /* TODO: Call scheduler_tick() */
-        /* For now, just acknowledge by clearing SIP.STIP via SBI */
+        /* Timer interrupt - reprogram and run the scheduler tick */
+        timer_interrupt();
         break;
 
     case IRQ_S_EXT:
-        /* External interrupt - PLIC */
-        /* TODO: Call PLIC handler to dispatch to device drivers */
+        /* External interrupt - PLIC dispatches to device drivers */
+        plic_handle_irq();
         break;
 
     default:
@@ -162,9 +174,6 @@ void do_page_fault(struct trap_frame *tf, int fault_type)
     unsigned long fault_addr = tf->stval;
     int is_user = !(tf->sstatus & SSTATUS_SPP);
 
-    /* These variables will be used when we implement demand paging */
-    (void)fault_addr;  /* Used in dump_trap_info via tf->stval */
-
     page_fault_count++;
 
     /* Determine fault type string */
@@ -184,16 +193,24 @@ void do_page_fault(struct trap_frame *tf, int fault_type)
         break;
     }
 
-    /*
-     * For now, we don't have user processes, so all faults in kernel
-     * mode are errors. In the future, this would:
-     *
-     * 1. Check if fault address is in a valid VMA (vm_area_struct)
-     * 2. For demand paging: allocate page and map it
-     * 3. For COW: copy page and update mapping
-     * 4. For stack growth: extend stack VMA
-     * 5. Otherwise: send SIGSEGV to user process
-     */
+    /* User fault: demand paging or COW, driven by the VMA list */
+    if (is_user) {
+        struct task_struct *tsk = get_current();
+        struct vm_area_struct *vma = NULL;
+        unsigned int flags = 0;
+
+        if (fault_type == FAULT_STORE)
+            flags |= FAULT_FLAG_WRITE;
+        else if (fault_type == FAULT_INST_FETCH)
+            flags |= FAULT_FLAG_EXEC;
+
+        if (tsk && tsk->mm)
+            vma = find_vma(tsk->mm, fault_addr);
+
+        if (vma && handle_mm_fault(vma, fault_addr, flags) == 0) {
+            return;
+        }
+    }
 
     /* For kernel faults, print diagnostic and halt */
     if (!is_user) {
@@ -216,21 +233,10 @@ void do_page_fault(struct trap_frame *tf, int fault_type)
         }
     }
 
-    /* User mode fault - for now, just kill the process */
-    /* In the future, this would:
-     * 1. Look up VMA for fault_addr
-     * 2. Check permissions (read/write/exec)
-     * 3. Handle demand paging or COW
-     * 4. If no valid VMA, send SIGSEGV
-     */
+    /* User mode fault with no valid mapping: kill the process */
     dump_trap_info(tf, type_str);
-    early_puts("\n  User process fault - would send SIGSEGV\n");
-
-    /* For now, halt since we don't have process management */
-    early_puts("  System halted (no process management yet)\n");
-    while (1) {
-        asm volatile("wfi");
-    }
+    early_puts("\n  Segmentation fault - sending SIGSEGV\n");
+    do_exit(SIGSEGV);
 }
 
 /* Handle exceptions */
@@ -334,24 +340,33 @@ unsigned long get_page_fault_count(void)
     return page_fault_count;
 }
 
-/* Initialize trap handling */
-void trap_init(void)
+/* Per-hart trap setup: vector and interrupt enables */
+void trap_init_hart(void)
 {
-    early_puts("[TRAP] Initializing trap handling...\n");
+    unsigned long sie = 0;
 
-    /* Set trap vector - all traps go to trap_vector */
+    /* Traps taken in the kernel go to trap_vector; user mode runs with
+     * stvec on the trampoline instead (trap_asm.S)
+     */
     asm volatile ("csrw stvec, %0" :: "r"(&trap_vector));
 
-    /* Enable supervisor external and timer interrupts in SIE */
-    unsigned long sie = 0;
+    /* Enable supervisor external, timer and software interrupts in SIE */
     sie |= (1UL << IRQ_S_EXT);    /* External interrupts */
     sie |= (1UL << IRQ_S_TIMER);  /* Timer interrupts */
-    sie |= (1UL << IRQ_S_SOFT);   /* Software interrupts */
+    sie |= (1UL << IRQ_S_SOFT);   /* Software interrupts (IPI) */
     asm volatile ("csrw sie, %0" :: "r"(sie));
+}
+
+/* Initialize trap handling */
+void trap_init(void)
+{
+    early_puts("[TRAP] Initializing trap handling...\n");
+
+    trap_init_hart();
 
     early_puts("[TRAP] Trap vector: ");
     early_puthex((unsigned long)&trap_vector);
     early_puts("\n[TRAP] SIE: ");
-    early_puthex(sie);
+    early_puthex(read_csr(sie));
     early_puts("\n[TRAP] Trap handling initialized\n");
 }
@@ -0,0 +1,198 @@
+/* Address space IDs
+ *
+ * Every process address space is given an ASID, which satp carries
+ * along with the root page table. Switching processes then keeps the
+ * TLB: entries of other address spaces just stop matching. ASIDs come
+ * from a bitmap, tagged with the generation they were handed out in
+ * (mm->context_id = generation | ASID). When the bitmap runs out the
+ * generation moves on and the bitmap starts over; each hart flushes
+ * its whole TLB once, at its next switch, and each address space takes
+ * a new ASID the next time it runs. ASID 0 is the kernel page table's.
+ *
+ * With CLONE_VM one address space can run on several harts at once.
+ * Each hart that loads it is recorded in mm->cpu_mask, and page table
+ * changes that take away a mapping are flushed on all of them with an
+ * SBI remote fence (flush_tlb_user_page, flush_tlb_user_mm). Entries a
+ * hart kept for an address space are therefore never stale, and one
+ * that moves between harts keeps its ASID without a flush.
+ *
+ * The kernel itself always runs on its own page table (ASID 0). The
+ * satp chosen here is only loaded by the trampoline on the way back
+ * to user mode (trap_asm.S).
+ */
+
+#include <minix/config.h>
+#include <minix/mm.h>
+#include <minix/mm_types.h>
+#include <minix/smp.h>
+#include <asm/csr.h>
+#include <asm/spinlock.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+#define SATP_SV39           (8UL << 60)
+#define SATP_ASID_MASK      0xFFFFUL
+#define MAX_ASIDS           (SATP_ASID_MASK + 1)
+#define BITS_PER_LONG       64
+
+static unsigned long asid_bits = 0;     /* 0: no ASIDs, flush on every switch */
+static unsigned long asid_mask = 0;
+static volatile unsigned long asid_generation = 0;
+static unsigned long asid_map[MAX_ASIDS / BITS_PER_LONG];
+static unsigned long next_asid = 1;
+
+/* satp of the address space each hart returns to user mode in */
+unsigned long hart_user_satp[SMP_CPUS];
+
+/* Harts owing a full flush since the last rollover */
+static volatile unsigned long tlb_flush_pending = 0;
+
+static spinlock_t asid_lock = SPIN_LOCK_INIT;
+
+/* Statistics */
+static unsigned long asid_allocs = 0;
+static unsigned long asid_rollovers = 0;
+static unsigned long asid_full_flushes = 0;
+
+/* External functions */
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+
+/* Find out how many ASID bits satp implements: the field is WARL, so
+ * writing all ones and reading back shows them. Needs enough ASIDs
+ * that harts do not roll over all the time
+ */
+void asid_init(void)
+{
+    unsigned long old, val;
+
+    old = read_csr(satp);
+    write_csr(satp, old | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    val = (read_csr(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    write_csr(satp, old);
+    asm volatile ("sfence.vma" ::: "memory");
+
+    while (val & 1) {
+        asid_bits++;
+        val >>= 1;
+    }
+
+    if ((1UL << asid_bits) <= 2 * SMP_CPUS) {
+        early_puts("[MMU] ASIDs not used (");
+        early_puthex(asid_bits);
+        early_puts(" bits)\n");
+        asid_bits = 0;
+        return;
+    }
+
+    asid_mask = (1UL << asid_bits) - 1;
+    asid_generation = 1UL << asid_bits;
+    asid_map[0] = 1;                    /* ASID 0: kernel */
+
+    early_puts("[MMU] ASIDs: ");
+    early_puthex(asid_bits);
+    early_puts(" bits\n");
+}
+
+/* Give mm a free ASID of the current generation, starting a new one
+ * if there is none left; asid_lock held
+ */
+static void new_context(struct mm_struct *mm)
+{
+    unsigned long nr = 1UL << asid_bits;
+    unsigned long asid, i;
+
+    for (i = 0; i < nr; i++) {
+        asid = next_asid + i;
+        if (asid >= nr) {
+            asid -= nr;
+        }
+        if (!(asid_map[asid / BITS_PER_LONG] & (1UL << (asid % BITS_PER_LONG)))) {
+            goto found;
+        }
+    }
+
+    /* Rollover: every hart flushes before it loads any new ASID */
+    asid_generation += 1UL << asid_bits;
+    for (i = 0; i < (nr + BITS_PER_LONG - 1) / BITS_PER_LONG; i++) {
+        asid_map[i] = 0;
+    }
+    asid_map[0] = 1;
+    tlb_flush_pending = cpu_online_mask;
+    asid_rollovers++;
+    asid = 1;
+
+found:
+    asid_map[asid / BITS_PER_LONG] |= 1UL << (asid % BITS_PER_LONG);
+    next_asid = asid + 1;
+    mm->context_id = asid_generation | asid;
+    asid_allocs++;
+}
+
+/* Make mm's page table and ASID the ones this hart runs user mode in */
+void switch_mm_asid(struct mm_struct *mm)
+{
+    unsigned long cpu = smp_processor_id();
+    unsigned long pgd = (unsigned long)mm->pgd >> PAGE_SHIFT;
+    unsigned long context, flags;
+    int flush_all = 0;
+
+    /* Recorded before the hart can walk mm's table (see mm_other_harts) */
+    if (!(mm->cpu_mask & (1UL << cpu)))
+        __sync_fetch_and_or(&mm->cpu_mask, 1UL << cpu);
+
+    /* No ASIDs: the trampoline flushes on every switch */
+    if (!asid_bits) {
+        hart_user_satp[cpu] = SATP_SV39 | pgd;
+        return;
+    }
+
+    /* Fast path: an ASID of this generation, no rollover flush owed */
+    context = mm->context_id;
+    if (!((context ^ asid_generation) >> asid_bits) &&
+        !(tlb_flush_pending & (1UL << cpu))) {
+        hart_user_satp[cpu] = SATP_SV39 | ((context & asid_mask) << SATP_ASID_SHIFT) | pgd;
+        return;
+    }
+
+    spin_lock_irqsave(&asid_lock, flags);
+    if ((mm->context_id ^ asid_generation) >> asid_bits) {
+        /* Fresh this generation: no hart holds entries for it */
+        new_context(mm);
+    }
+    if (tlb_flush_pending & (1UL << cpu)) {
+        tlb_flush_pending &= ~(1UL << cpu);
+        flush_all = 1;
+        asid_full_flushes++;
+    }
+    context = mm->context_id;
+    spin_unlock_irqrestore(&asid_lock, flags);
+
+    hart_user_satp[cpu] = SATP_SV39 | ((context & asid_mask) << SATP_ASID_SHIFT) | pgd;
+    if (flush_all) {
+        asm volatile ("sfence.vma" ::: "memory");
+    }
+}
+
+void asid_stats(void)
+{
+    early_puts("\n=== ASID Statistics ===\n");
+    if (!asid_bits) {
+        early_puts("ASIDs not used: full flush on every switch\n");
+        return;
+    }
+    early_puts("bits=");
+    early_puthex(asid_bits);
+    early_puts(" generation=");
+    early_puthex(asid_generation >> asid_bits);
+    early_puts(" allocated=");
+    early_puthex(asid_allocs);
+    early_puts("\nrollovers=");
+    early_puthex(asid_rollovers);
+    early_puts(" full flushes=");
+    early_puthex(asid_full_flushes);
+    early_puts("\n");
+}
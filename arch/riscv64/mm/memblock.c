@@ -0,0 +1,382 @@
+/* Boot memory map
+ *
+ * RAM banks and reserved ranges known at boot, kept as small sorted
+ * tables of merged ranges. They come from the device tree the loader
+ * passed in a1 (/memory nodes, /reserved-memory children and the
+ * memory reservation map), or from the board's DRAM definition when
+ * there is none. page_init() gives every unreserved page of every
+ * bank to the buddy allocator, and boot code that needs memory before
+ * then takes it with memblock_alloc().
+ */
+
+#include <minix/config.h>
+#include <minix/board.h>
+#include <minix/fdt.h>
+#include <minix/mm.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+#define MEMBLOCK_MAX_REGIONS    16
+
+#define PHYS_ADDR_LIMIT         (1UL << MAX_PHYSMEM_BITS)
+
+struct memblock_region {
+    unsigned long base;
+    unsigned long size;
+};
+
+struct memblock_type {
+    int cnt;
+    struct memblock_region regions[MEMBLOCK_MAX_REGIONS];
+    const char *name;
+};
+
+static struct memblock_type memblock_memory = { .name = "memory" };
+static struct memblock_type memblock_reserved = { .name = "reserved" };
+
+/* Kernel image bounds from the linker script */
+extern char _start[];
+extern char _end[];
+
+/* External functions */
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+extern int strcmp(const char *s1, const char *s2);
+extern int strncmp(const char *s1, const char *s2, unsigned long n);
+
+/* Insert [base, base + size), merging with every range it overlaps or
+ * touches so the table stays sorted and disjoint
+ */
+static int memblock_insert(struct memblock_type *type,
+                           unsigned long base, unsigned long size)
+{
+    unsigned long end = base + size;
+    int i, j;
+
+    if (size == 0)
+        return 0;
+
+    for (i = 0; i < type->cnt; ) {
+        struct memblock_region *r = &type->regions[i];
+
+        if (r->base <= end && base <= r->base + r->size) {
+            if (r->base < base)
+                base = r->base;
+            if (r->base + r->size > end)
+                end = r->base + r->size;
+            for (j = i; j < type->cnt - 1; j++)
+                type->regions[j] = type->regions[j + 1];
+            type->cnt--;
+            continue;
+        }
+        i++;
+    }
+
+    if (type->cnt >= MEMBLOCK_MAX_REGIONS) {
+        early_puts("[MEM] WARNING: too many ");
+        early_puts(type->name);
+        early_puts(" regions, dropping ");
+        early_puthex(base);
+        early_puts("\n");
+        return -1;
+    }
+
+    for (i = 0; i < type->cnt && type->regions[i].base < base; i++)
+        ;
+    for (j = type->cnt; j > i; j--)
+        type->regions[j] = type->regions[j - 1];
+    type->regions[i].base = base;
+    type->regions[i].size = end - base;
+    type->cnt++;
+
+    return 0;
+}
+
+/* Only whole pages of a bank are usable */
+int memblock_add(unsigned long base, unsigned long size)
+{
+    unsigned long end = base + size;
+
+    if (end < base || end > PHYS_ADDR_LIMIT)
+        end = PHYS_ADDR_LIMIT;
+    base = (base + PAGE_SIZE - 1) & PAGE_MASK;
+    end &= PAGE_MASK;
+    if (base >= end)
+        return 0;
+
+    return memblock_insert(&memblock_memory, base, end - base);
+}
+
+/* Any page a reservation touches is reserved whole */
+int memblock_reserve(unsigned long base, unsigned long size)
+{
+    unsigned long end = base + size;
+
+    if (size == 0)
+        return 0;
+    if (end < base || end > PHYS_ADDR_LIMIT)
+        end = PHYS_ADDR_LIMIT;
+    base &= PAGE_MASK;
+    end = (end + PAGE_SIZE - 1) & PAGE_MASK;
+    if (base >= end)
+        return 0;
+
+    return memblock_insert(&memblock_reserved, base, end - base);
+}
+
+int memblock_memory_region(int n, unsigned long *base, unsigned long *end)
+{
+    if (n < 0 || n >= memblock_memory.cnt)
+        return -1;
+
+    *base = memblock_memory.regions[n].base;
+    *end = *base + memblock_memory.regions[n].size;
+    return 0;
+}
+
+int memblock_next_free(unsigned long *pos, unsigned long *start, unsigned long *end)
+{
+    int i, j;
+
+    for (i = 0; i < memblock_memory.cnt; i++) {
+        struct memblock_region *m = &memblock_memory.regions[i];
+        unsigned long s = m->base;
+        unsigned long e = m->base + m->size;
+
+        if (e <= *pos)
+            continue;
+        if (s < *pos)
+            s = *pos;
+
+        /* Reserved ranges are sorted and disjoint: skip the ones
+         * covering s, stop at the first one above it
+         */
+        for (j = 0; j < memblock_reserved.cnt; j++) {
+            struct memblock_region *r = &memblock_reserved.regions[j];
+
+            if (r->base + r->size <= s)
+                continue;
+            if (r->base >= e)
+                break;
+            if (r->base <= s) {
+                s = r->base + r->size;
+                continue;
+            }
+            e = r->base;
+            break;
+        }
+
+        if (s < e) {
+            *start = s;
+            *end = e;
+            *pos = e;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+unsigned long memblock_alloc(unsigned long size, unsigned long align)
+{
+    unsigned long pos = 0, start, end, addr;
+
+    if (align < PAGE_SIZE)
+        align = PAGE_SIZE;
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+
+    while (memblock_next_free(&pos, &start, &end) == 0) {
+        addr = (start + align - 1) & ~(align - 1);
+        if (addr >= start && addr + size <= end) {
+            if (memblock_reserve(addr, size) < 0)
+                return 0;
+            return addr;
+        }
+    }
+
+    return 0;
+}
+
+/* ============================================
+ * Device Tree Scan
+ * ============================================ */
+
+/* Per-node state while walking the tree */
+struct dt_node {
+    const u32 *reg;             /* reg property, if any */
+    u32 reg_len;
+    int is_memory;              /* Memory bank node */
+    int disabled;               /* status other than "okay" */
+};
+
+/* Add (or reserve) every (address, size) pair of a reg property */
+static int dt_add_reg(struct dt_node *node, int ac, int sc, int reserve)
+{
+    const u32 *p = node->reg;
+    int entry = (ac + sc) * 4;
+    int n = 0;
+    u32 left;
+    u64 base, size;
+
+    if (!p || ac < 1 || ac > 2 || sc < 1 || sc > 2)
+        return 0;
+
+    for (left = node->reg_len; left >= (u32)entry; left -= entry) {
+        base = fdt_read_cells(p, ac);
+        size = fdt_read_cells(p + ac, sc);
+        p += ac + sc;
+        if (size == 0)
+            continue;
+        if (reserve)
+            memblock_reserve(base, size);
+        else
+            memblock_add(base, size);
+        n++;
+    }
+
+    return n;
+}
+
+static void dt_node_init(struct dt_node *node)
+{
+    node->reg = NULL;
+    node->reg_len = 0;
+    node->is_memory = 0;
+    node->disabled = 0;
+}
+
+/* Scan the tree for memory banks and reservations; returns the number
+ * of banks found, -1 on a malformed blob
+ */
+static int dt_scan_memory(const void *fdt)
+{
+    struct fdt_token tok;
+    struct dt_node node, child;
+    int root_ac = 2, root_sc = 1;       /* Defaults from the specification */
+    int rsv_ac = 2, rsv_sc = 1;
+    int in_rsv = 0;                     /* Inside /reserved-memory */
+    int off = 0, depth = 0, banks = 0;
+    u64 addr, size;
+    int i;
+
+    dt_node_init(&node);
+    dt_node_init(&child);
+
+    while ((off = fdt_next_token(fdt, off, &tok)) >= 0) {
+        switch (tok.type) {
+        case FDT_BEGIN_NODE:
+            depth++;
+            if (depth == 2) {
+                dt_node_init(&node);
+                /* "memory" or "memory@<unit>" */
+                node.is_memory = !strncmp(tok.name, "memory", 6) &&
+                                 (tok.name[6] == '\0' || tok.name[6] == '@');
+                in_rsv = !strcmp(tok.name, "reserved-memory");
+                rsv_ac = root_ac;
+                rsv_sc = root_sc;
+            } else if (depth == 3) {
+                dt_node_init(&child);
+            }
+            break;
+
+        case FDT_PROP:
+            if (depth == 1) {
+                if (!strcmp(tok.name, "#address-cells") && tok.len == 4)
+                    root_ac = fdt32_to_cpu(*(const u32 *)tok.data);
+                else if (!strcmp(tok.name, "#size-cells") && tok.len == 4)
+                    root_sc = fdt32_to_cpu(*(const u32 *)tok.data);
+            } else if (depth == 2 || (depth == 3 && in_rsv)) {
+                struct dt_node *n = (depth == 2) ? &node : &child;
+
+                if (!strcmp(tok.name, "reg")) {
+                    n->reg = (const u32 *)tok.data;
+                    n->reg_len = tok.len;
+                } else if (!strcmp(tok.name, "device_type")) {
+                    if (tok.len >= 7 && !strcmp((const char *)tok.data, "memory"))
+                        n->is_memory = 1;
+                } else if (!strcmp(tok.name, "status")) {
+                    n->disabled = strcmp((const char *)tok.data, "okay") &&
+                                  strcmp((const char *)tok.data, "ok");
+                } else if (depth == 2 && in_rsv && tok.len == 4) {
+                    if (!strcmp(tok.name, "#address-cells"))
+                        rsv_ac = fdt32_to_cpu(*(const u32 *)tok.data);
+                    else if (!strcmp(tok.name, "#size-cells"))
+                        rsv_sc = fdt32_to_cpu(*(const u32 *)tok.data);
+                }
+            }
+            break;
+
+        case FDT_END_NODE:
+            if (depth == 2) {
+                if (node.is_memory && !in_rsv && !node.disabled)
+                    banks += dt_add_reg(&node, root_ac, root_sc, 0);
+                in_rsv = 0;
+            } else if (depth == 3 && in_rsv && !child.disabled) {
+                /* Dynamically placed regions (no reg) are not ours to honour */
+                dt_add_reg(&child, rsv_ac, rsv_sc, 1);
+            }
+            depth--;
+            break;
+
+        case FDT_END:
+            goto done;
+        }
+    }
+
+    early_puts("[MEM] WARNING: malformed device tree\n");
+    return -1;
+
+done:
+    for (i = 0; fdt_get_mem_rsv(fdt, i, &addr, &size) == 0; i++)
+        memblock_reserve(addr, size);
+
+    return banks;
+}
+
+static void memblock_dump(struct memblock_type *type)
+{
+    int i;
+
+    for (i = 0; i < type->cnt; i++) {
+        early_puts("[MEM]   ");
+        early_puts(type->name);
+        early_puts(": ");
+        early_puthex(type->regions[i].base);
+        early_puts(" - ");
+        early_puthex(type->regions[i].base + type->regions[i].size);
+        early_puts("\n");
+    }
+}
+
+void memblock_init(void)
+{
+    const void *fdt = (const void *)boot_fdt;
+    int banks = 0;
+
+    if (fdt && fdt_check_header(fdt) == 0) {
+        early_puts("[MEM] Device tree at ");
+        early_puthex(boot_fdt);
+        early_puts("\n");
+        banks = dt_scan_memory(fdt);
+    } else {
+        fdt = NULL;
+        early_puts("[MEM] No device tree\n");
+    }
+
+    if (banks <= 0) {
+        early_puts("[MEM] Using board default memory map\n");
+        memblock_memory.cnt = 0;
+        memblock_add(BOARD_DRAM_BASE, BOARD_DRAM_SIZE);
+    }
+
+    /* The kernel image (with its stacks) and the tree itself */
+    memblock_reserve((unsigned long)_start, (unsigned long)(_end - _start));
+    if (fdt)
+        memblock_reserve(boot_fdt, fdt_totalsize(fdt));
+
+    memblock_dump(&memblock_memory);
+    memblock_dump(&memblock_reserved);
+}
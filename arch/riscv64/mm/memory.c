@@ -0,0 +1,649 @@
+/* MinixRV64 Donz Build - User Address Space Management
+ *
+ * VMA list handling, demand paging and copy-on-write page sharing
+ * Following HowToFitPosix.md Stage 2 design
+ */
+
+#include <minix/config.h>
+#include <minix/mm.h>
+#include <minix/mm_types.h>
+#include <minix/task.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* External functions */
+extern void early_puts(const char *s);
+extern struct task_struct *get_current(void);
+
+/* ============================================
+ * VMA Management
+ * ============================================ */
+
+/* Allocate VMA */
+struct vm_area_struct *vm_area_alloc(struct mm_struct *mm)
+{
+    struct vm_area_struct *vma;
+    unsigned char *ptr;
+    unsigned long i;
+
+    vma = (struct vm_area_struct *)kmalloc(sizeof(struct vm_area_struct));
+    if (!vma)
+        return NULL;
+
+    ptr = (unsigned char *)vma;
+    for (i = 0; i < sizeof(struct vm_area_struct); i++) {
+        ptr[i] = 0;
+    }
+
+    vma->vm_mm = mm;
+    return vma;
+}
+
+/* Free VMA */
+void vm_area_free(struct vm_area_struct *vma)
+{
+    if (vma) {
+        vm_image_put(vma->vm_image);
+        kfree(vma);
+    }
+}
+
+/* Wrap a program image without copying it; VMAs fault pages straight
+ * from data, which release (NULL for static images) frees once the last
+ * reference is gone
+ */
+struct vm_image *vm_image_alloc(const void *data, unsigned long size,
+                                void (*release)(struct vm_image *image))
+{
+    struct vm_image *image;
+
+    image = (struct vm_image *)kmalloc(sizeof(struct vm_image));
+    if (!image)
+        return NULL;
+
+    atomic_set(&image->count, 1);
+    image->data = (const unsigned char *)data;
+    image->size = size;
+    image->release = release;
+
+    return image;
+}
+
+void vm_image_get(struct vm_image *image)
+{
+    if (image)
+        atomic_inc(&image->count);
+}
+
+void vm_image_put(struct vm_image *image)
+{
+    if (image && atomic_dec_and_test(&image->count)) {
+        if (image->release)
+            image->release(image);
+        kfree(image);
+    }
+}
+
+/* Insert VMA into mm, keeping the list sorted by address */
+int insert_vm_area(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+    struct vm_area_struct *prev = NULL;
+    struct vm_area_struct *next = mm->mmap;
+
+    if (vma->vm_start >= vma->vm_end || vma->vm_end > TASK_SIZE)
+        return -1;
+
+    while (next && next->vm_start < vma->vm_start) {
+        prev = next;
+        next = next->vm_next;
+    }
+
+    /* Reject overlapping areas */
+    if (prev && prev->vm_end > vma->vm_start)
+        return -1;
+    if (next && next->vm_start < vma->vm_end)
+        return -1;
+
+    vma->vm_prev = prev;
+    vma->vm_next = next;
+    if (prev) {
+        prev->vm_next = vma;
+    } else {
+        mm->mmap = vma;
+    }
+    if (next) {
+        next->vm_prev = vma;
+    }
+
+    vma->vm_mm = mm;
+    mm->map_count++;
+    mm->total_vm += (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+    return 0;
+}
+
+/* Unlink VMA from mm (the VMA itself is not freed) */
+static void remove_vm_area(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+    if (vma->vm_prev) {
+        vma->vm_prev->vm_next = vma->vm_next;
+    } else {
+        mm->mmap = vma->vm_next;
+    }
+    if (vma->vm_next) {
+        vma->vm_next->vm_prev = vma->vm_prev;
+    }
+
+    vma->vm_next = NULL;
+    vma->vm_prev = NULL;
+    mm->map_count--;
+    mm->total_vm -= (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+}
+
+/* Find VMA containing address */
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+    struct vm_area_struct *vma;
+
+    if (!mm)
+        return NULL;
+
+    for (vma = mm->mmap; vma; vma = vma->vm_next) {
+        if (addr < vma->vm_start)
+            break;
+        if (addr < vma->vm_end)
+            return vma;
+    }
+
+    return NULL;
+}
+
+/* ============================================
+ * Page Range Operations
+ * ============================================ */
+
+/* Drop all user pages mapped in [start, end) */
+void zap_page_range(struct mm_struct *mm, unsigned long start, unsigned long end)
+{
+    unsigned long addr;
+    pte_t *pte;
+
+    if (!mm || !mm->pgd)
+        return;
+
+    for (addr = start & PAGE_MASK; addr < end; addr += PAGE_SIZE) {
+        pte = get_pte((pgd_t *)mm->pgd, addr, 0);
+        if (!pte || !(*pte & PTE_V))
+            continue;
+
+        /* The range may only partly cover a NAPOT group */
+        if (pte_napot(*pte))
+            napot_split((pgd_t *)mm->pgd, addr);
+
+        /* free_page() only releases the frame on the last reference */
+        free_page(pte_to_pa(*pte));
+        *pte = 0;
+    }
+
+    /* Other harts running mm (CLONE_VM) may still hold the entries */
+    flush_tlb_user_mm(mm);
+}
+
+/* Copy page range for COW
+ *
+ * Both parent and child end up pointing at the same frames. Private
+ * writable pages lose PTE_W and gain PTE_COW in both page tables, so
+ * the first store from either side takes do_cow_fault(). Cost is
+ * proportional to the number of mapped PTEs, not to memory contents.
+ */
+int copy_page_range(struct mm_struct *dst, struct mm_struct *src,
+                    struct vm_area_struct *vma)
+{
+    unsigned long addr, pa;
+    pte_t *src_pte, *dst_pte;
+    pte_t pte;
+    int cow = is_cow_mapping(vma->vm_flags);
+    unsigned long i;
+
+    if (!src->pgd || !dst->pgd)
+        return 0;
+
+    for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+        src_pte = get_pte((pgd_t *)src->pgd, addr, 0);
+        if (!src_pte || !(*src_pte & PTE_V))
+            continue;
+
+        pte = *src_pte;
+
+        /* NAPOT groups are read-only: share the whole group, as one
+         * group in the child too if it can be, else page by page
+         */
+        if (pte_napot(pte)) {
+            pa = pte_page_pa(pte, addr);
+            if (!(addr & (NAPOT_SIZE - 1)) &&
+                map_page_64k((pgd_t *)dst->pgd, addr, pa,
+                             pte & PTE_FLAGS_MASK) == 0) {
+                for (i = 0; i < NAPOT_PAGES; i++) {
+                    get_page(pa + i * PAGE_SIZE);
+                }
+                addr += NAPOT_SIZE - PAGE_SIZE;
+                continue;
+            }
+            pte = pa_to_pte(pa, pte & PTE_FLAGS_MASK);
+        }
+
+        dst_pte = get_pte((pgd_t *)dst->pgd, addr, 1);
+        if (!dst_pte)
+            return -1;
+
+        /* Private writable mapping: write-protect in parent too */
+        if (cow && (pte & PTE_W)) {
+            pte = (pte & ~PTE_W) | PTE_COW;
+            *src_pte = pte;
+        }
+
+        get_page(pte_to_pa(pte));
+        *dst_pte = pte;
+    }
+
+    /* Parent's TLBs, on every hart it runs on, may still hold writable
+     * entries
+     */
+    flush_tlb_user_mm(src);
+
+    return 0;
+}
+
+/* Handle COW fault
+ *
+ * Called for a store to a present PTE_COW page. If we hold the last
+ * reference the page is simply made writable again; otherwise it is
+ * copied into a fresh frame and the shared reference is dropped.
+ */
+int do_cow_fault(struct vm_area_struct *vma, unsigned long address)
+{
+    struct mm_struct *mm = vma->vm_mm;
+    pte_t *pte;
+    unsigned long old_pa, new_pa;
+    unsigned long flags;
+    unsigned long *src, *dst;
+    unsigned long i;
+
+    address &= PAGE_MASK;
+
+    if (!(vma->vm_flags & VM_WRITE))
+        return -1;
+
+    pte = get_pte((pgd_t *)mm->pgd, address, 0);
+    if (!pte || !(*pte & PTE_V) || !(*pte & PTE_COW))
+        return -1;
+
+    old_pa = pte_to_pa(*pte);
+    flags = (*pte & PTE_FLAGS_MASK & ~PTE_COW) | PTE_W | PTE_A | PTE_D;
+
+    /* Last reference: reuse the frame in place */
+    if (page_count(old_pa) == 1) {
+        *pte = pa_to_pte(old_pa, flags);
+        flush_tlb_page(address);
+        return 0;
+    }
+
+    /* User fault: no lock is held, so wait for reclaim if needed */
+    new_pa = alloc_pages_gfp(0, GFP_KERNEL);
+    if (!new_pa) {
+        early_puts("[COW] Out of memory\n");
+        return -1;
+    }
+
+    src = (unsigned long *)old_pa;
+    dst = (unsigned long *)new_pa;
+    for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++) {
+        dst[i] = src[i];
+    }
+
+    *pte = pa_to_pte(new_pa, flags);
+    /* Other harts running mm must not keep reading the shared frame */
+    flush_tlb_user_page(mm, address);
+
+    /* Drop our reference to the shared frame */
+    free_page(old_pa);
+
+    return 0;
+}
+
+/* ============================================
+ * Demand Paging
+ * ============================================ */
+
+/* PTE permission bits for a user page in vma */
+static unsigned long vma_pte_flags(struct vm_area_struct *vma)
+{
+    unsigned long flags = PTE_V | PTE_U | PTE_A;
+
+    if (vma->vm_flags & VM_READ)
+        flags |= PTE_R;
+    if (vma->vm_flags & VM_WRITE)
+        flags |= PTE_W | PTE_D;
+    if (vma->vm_flags & VM_EXEC)
+        flags |= PTE_X;
+
+    return flags;
+}
+
+/* Fill the frame at pa for the user page at address: the backing
+ * image (if any), zeroes for the rest
+ */
+static void fill_user_page(struct vm_area_struct *vma, unsigned long address,
+                           unsigned long pa)
+{
+    unsigned char *dst = (unsigned char *)pa;
+    const unsigned char *src;
+    unsigned long copy = 0;
+    unsigned long i;
+
+    /* Image-backed part of the page */
+    if (vma->vm_private_data && address < vma->vm_file_end) {
+        src = (const unsigned char *)vma->vm_private_data +
+              (address - vma->vm_start);
+        copy = vma->vm_file_end - address;
+        if (copy > PAGE_SIZE)
+            copy = PAGE_SIZE;
+        for (i = 0; i < copy; i++) {
+            dst[i] = src[i];
+        }
+    }
+
+    /* Zero-fill the remainder (BSS / anonymous) */
+    for (i = copy; i < PAGE_SIZE; i++) {
+        dst[i] = 0;
+    }
+}
+
+/* Fault in the whole 64KB-aligned chunk around address as one NAPOT
+ * range (one TLB entry). Only for read-only VMAs such as program text:
+ * they never see COW or changes to single pages. -1 if the chunk is
+ * not wholly in the VMA and unmapped, or no 64KB block is free; the
+ * caller then maps the single page
+ */
+static int do_napot_page(struct vm_area_struct *vma, unsigned long address,
+                         pte_t *pte)
+{
+    unsigned long start = address & ~(NAPOT_SIZE - 1);
+    unsigned long pa, i;
+
+    if (!has_svnapot() || (vma->vm_flags & VM_WRITE) ||
+        start < vma->vm_start || start + NAPOT_SIZE > vma->vm_end)
+        return -1;
+
+    /* The 16 entries share address's page table */
+    pte -= (address - start) >> PAGE_SHIFT;
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        if (pte[i] & PTE_V)
+            return -1;
+    }
+
+    pa = alloc_pages(NAPOT_ORDER);
+    if (!pa)
+        return -1;
+    split_page(pa, NAPOT_ORDER);
+
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        fill_user_page(vma, start + i * PAGE_SIZE, pa + i * PAGE_SIZE);
+    }
+
+    if (map_page_64k((pgd_t *)vma->vm_mm->pgd, start, pa, vma_pte_flags(vma)) < 0) {
+        for (i = 0; i < NAPOT_PAGES; i++) {
+            free_page(pa + i * PAGE_SIZE);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/* First touch of a page: allocate one frame, fill it from the backing
+ * image (if any) and zero the rest, then map it. Anonymous and BSS
+ * pages are therefore zeroed only when they are actually used.
+ */
+static int do_anonymous_page(struct vm_area_struct *vma, unsigned long address,
+                             pte_t *pte)
+{
+    unsigned long pa;
+
+    if (do_napot_page(vma, address, pte) == 0)
+        return 0;
+
+    pa = alloc_pages_gfp(0, GFP_KERNEL);
+    if (!pa) {
+        early_puts("[FAULT] Out of memory\n");
+        return -1;
+    }
+
+    fill_user_page(vma, address, pa);
+
+    *pte = pa_to_pte(pa, vma_pte_flags(vma));
+    flush_tlb_page(address);
+
+    return 0;
+}
+
+/* Resolve a user page fault inside vma */
+int handle_mm_fault(struct vm_area_struct *vma, unsigned long address,
+                    unsigned int flags)
+{
+    struct mm_struct *mm = vma->vm_mm;
+    pte_t *pte;
+
+    if (address < vma->vm_start || address >= vma->vm_end)
+        return -1;
+
+    /* Access permission check */
+    if ((flags & FAULT_FLAG_WRITE) && !(vma->vm_flags & VM_WRITE))
+        return -1;
+    if ((flags & FAULT_FLAG_EXEC) && !(vma->vm_flags & VM_EXEC))
+        return -1;
+    if (!(flags & (FAULT_FLAG_WRITE | FAULT_FLAG_EXEC)) &&
+        !(vma->vm_flags & VM_READ))
+        return -1;
+
+    address &= PAGE_MASK;
+
+    pte = get_pte((pgd_t *)mm->pgd, address, 1);
+    if (!pte)
+        return -1;
+
+    /* Not present yet: demand page */
+    if (!(*pte & PTE_V))
+        return do_anonymous_page(vma, address, pte);
+
+    /* Present but write-protected for COW */
+    if ((flags & FAULT_FLAG_WRITE) && (*pte & PTE_COW))
+        return do_cow_fault(vma, address);
+
+    /* Present and permitted: stale TLB entry */
+    flush_tlb_page(address);
+    return 0;
+}
+
+/* Fault in a user page and return its physical address */
+unsigned long get_user_page(struct mm_struct *mm, unsigned long address,
+                            unsigned int flags)
+{
+    struct vm_area_struct *vma;
+    pte_t *pte;
+
+    vma = find_vma(mm, address);
+    if (!vma)
+        return 0;
+
+    pte = get_pte((pgd_t *)mm->pgd, address, 0);
+    if (!pte || !(*pte & PTE_V) ||
+        ((flags & FAULT_FLAG_WRITE) && !(*pte & PTE_W))) {
+        if (handle_mm_fault(vma, address, flags) < 0)
+            return 0;
+        pte = get_pte((pgd_t *)mm->pgd, address, 0);
+    }
+
+    return pte_page_pa(*pte, address);
+}
+
+/* ============================================
+ * User Memory Access
+ * ============================================ */
+
+/* The kernel runs on kernel_pgd, which does not map user addresses:
+ * user buffers are reached page by page through the frame behind them
+ * in the current task's page table, faulting pages in as a user access
+ * would. RAM is identity-mapped, so the frame address is usable as is.
+ */
+
+/* Physical address behind user address uaddr of the current task,
+ * faulted in for writing if write is set; 0 if not accessible
+ */
+unsigned long user_addr_to_phys(unsigned long uaddr, int write)
+{
+    struct task_struct *p = get_current();
+
+    if (!p || !p->mm || uaddr >= TASK_SIZE)
+        return 0;
+    return get_user_page(p->mm, uaddr, write ? FAULT_FLAG_WRITE : 0);
+}
+
+/* Copy n bytes between a kernel buffer and user address uaddr;
+ * to_user selects the direction. Returns 0 or -1
+ */
+static int copy_user(unsigned long uaddr, unsigned char *k, unsigned long n,
+                     int to_user)
+{
+    if (n > TASK_SIZE || uaddr > TASK_SIZE - n)
+        return -1;
+
+    while (n > 0) {
+        unsigned long off = uaddr & (PAGE_SIZE - 1);
+        unsigned long chunk = PAGE_SIZE - off;
+        unsigned char *u;
+        unsigned long pa, i;
+
+        if (chunk > n)
+            chunk = n;
+
+        pa = user_addr_to_phys(uaddr, to_user);
+        if (!pa)
+            return -1;
+
+        u = (unsigned char *)pa;
+        for (i = 0; i < chunk; i++) {
+            if (to_user)
+                u[i] = k[i];
+            else
+                k[i] = u[i];
+        }
+
+        uaddr += chunk;
+        k += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+}
+
+int copy_from_user(void *dst, const void *usrc, unsigned long n)
+{
+    return copy_user((unsigned long)usrc, (unsigned char *)dst, n, 0);
+}
+
+int copy_to_user(void *udst, const void *src, unsigned long n)
+{
+    return copy_user((unsigned long)udst, (unsigned char *)src, n, 1);
+}
+
+long strncpy_from_user(char *dst, const char *usrc, long n)
+{
+    unsigned long uaddr = (unsigned long)usrc;
+    long len = 0;
+
+    while (len < n) {
+        unsigned long chunk = PAGE_SIZE - (uaddr & (PAGE_SIZE - 1));
+        unsigned long pa, i;
+        const char *u;
+
+        if (chunk > (unsigned long)(n - len))
+            chunk = n - len;
+
+        /* A page at a time: the string may end before the next one */
+        pa = user_addr_to_phys(uaddr, 0);
+        if (!pa)
+            return -1;
+
+        u = (const char *)pa;
+        for (i = 0; i < chunk; i++) {
+            dst[len] = u[i];
+            if (u[i] == '\0')
+                return len;
+            len++;
+        }
+        uaddr += chunk;
+    }
+
+    return -1;
+}
+
+/* Move the program break
+ *
+ * The heap is one anonymous VMA starting at start_brk. Growing only
+ * extends vm_end; pages are supplied by handle_mm_fault() on first
+ * touch. Shrinking drops the pages above the new break.
+ */
+unsigned long do_brk(struct mm_struct *mm, unsigned long brk)
+{
+    struct vm_area_struct *vma;
+    unsigned long new_end, old_end;
+
+    if (brk < mm->start_brk || brk > TASK_SIZE)
+        return mm->brk;
+
+    new_end = (brk + PAGE_SIZE - 1) & PAGE_MASK;
+    vma = find_vma(mm, mm->start_brk);
+    old_end = vma ? vma->vm_end : mm->start_brk;
+
+    if (new_end > old_end) {
+        /* Refuse to grow into the next mapping */
+        struct vm_area_struct *next = vma ? vma->vm_next : mm->mmap;
+        while (next && next->vm_end <= old_end)
+            next = next->vm_next;
+        if (next && next->vm_start < new_end)
+            return mm->brk;
+
+        if (vma) {
+            mm->total_vm += (new_end - old_end) >> PAGE_SHIFT;
+            vma->vm_end = new_end;
+        } else {
+            vma = vm_area_alloc(mm);
+            if (!vma)
+                return mm->brk;
+            vma->vm_start = mm->start_brk;
+            vma->vm_end = new_end;
+            vma->vm_flags = VM_READ | VM_WRITE | VM_MAYREAD | VM_MAYWRITE;
+            if (insert_vm_area(mm, vma) < 0) {
+                vm_area_free(vma);
+                return mm->brk;
+            }
+        }
+    } else if (new_end < old_end) {
+        zap_page_range(mm, new_end, old_end);
+        if (new_end == mm->start_brk) {
+            remove_vm_area(mm, vma);
+            vm_area_free(vma);
+        } else {
+            mm->total_vm -= (old_end - new_end) >> PAGE_SHIFT;
+            vma->vm_end = new_end;
+        }
+    }
+
+    mm->brk = brk;
+    mm->data_vm = (new_end - mm->start_brk) >> PAGE_SHIFT;
+    return mm->brk;
+}
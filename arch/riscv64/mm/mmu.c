@@ -7,18 +7,27 @@
 #include <early_print.h>
 
 /* External functions */
+void memblock_init(void);
 void page_init(void);
 void kmem_init(void);
 int pgtable_init(void);
 void enable_mmu(void);
 void get_mem_info(unsigned long *total, unsigned long *free);
 void vmalloc_init(void);
+void asid_init(void);
+void svnapot_init(void);
 
 /* Initialize MMU */
 void mm_init(void)
 {
     early_puts("\n=== Memory Management Initialization ===\n");
 
+    /* Find RAM and reserved ranges (device tree or board default) */
+    memblock_init();
+
+    /* Optional MMU extensions the device tree lists */
+    svnapot_init();
+
     /* Initialize buddy allocator for physical pages */
     page_init();
 
@@ -28,6 +37,7 @@ void mm_init(void)
     /* Initialize page tables and enable MMU */
     if (pgtable_init() == 0) {
         enable_mmu();
+        asid_init();
         early_puts("✓ MMU enabled with SV39 paging\n");
     } else {
         early_puts("✗ Page table initialization failed\n");
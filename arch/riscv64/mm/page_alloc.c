@@ -1,6 +1,30 @@
-/* Buddy allocator for RISC-V 64-bit */
+/* Buddy allocator for RISC-V 64-bit
+ *
+ * Order-0 pages go through a per-hart cache (pcp) in front of the
+ * buddy free lists: allocation and free are a list pop/push with
+ * interrupts off, and pages move to and from the buddy lists in
+ * batches under the zone lock.
+ *
+ * The page array is sparse: physical memory is cut into fixed-size
+ * sections and only sections holding RAM get a slice of mem_map, so
+ * banks far apart or with holes between them cost nothing for the gap.
+ *
+ * Boot seeds wholly free max-order blocks straight onto the top free
+ * list with only their head page set up. The other page structures of
+ * such a block are initialized the first time the block leaves the
+ * list, so boot time does not grow with the size of memory.
+ *
+ * Allocations that leave the buddy lists below the low watermark wake
+ * kswapd to reclaim from the registered caches; one that finds nothing
+ * free waits for it, when the caller may sleep, before giving up.
+ */
 
 #include <minix/config.h>
+#include <minix/smp.h>
+#include <minix/mm.h>
+#include <minix/board.h>
+#include <asm/csr.h>
+#include <asm/spinlock.h>
 #include <types.h>
 
 #ifndef NULL
@@ -13,23 +37,28 @@
 #define PAGE_SHIFT          12
 #define PAGE_MASK           (~(PAGE_SIZE - 1))
 
-/* Physical memory layout for QEMU virt machine */
-#define PHYS_MEMORY_BASE    0x80000000UL
-#define PHYS_MEMORY_SIZE    (128 * 1024 * 1024)  /* 128MB */
-
-/* Kernel reserved memory (first 4MB for kernel code/data/stack) */
-#define KERNEL_RESERVED     (4 * 1024 * 1024)
-
 /* Buddy allocator parameters */
 #define MAX_ORDER           11                   /* Max 2^11 = 2048 pages = 8MB */
 #define BUDDY_MAX_PAGES     (1UL << MAX_ORDER)
 
+/* Memory sections: 128MB each, so a largest buddy block never spans two */
+#define SECTION_SHIFT       27
+#define PFN_SECTION_SHIFT   (SECTION_SHIFT - PAGE_SHIFT)
+#define PAGES_PER_SECTION   (1UL << PFN_SECTION_SHIFT)
+#define NR_MEM_SECTIONS     (1UL << (MAX_PHYSMEM_BITS - SECTION_SHIFT))
+
 /* Page structure for buddy allocator */
 struct page {
     unsigned long flags;        /* Page flags */
     int order;                  /* Order if this is head of a free block */
-    struct page *next;          /* Next in free list */
-    struct page *prev;          /* Prev in free list */
+    unsigned int section;       /* Memory section the page belongs to */
+    union {
+        struct {
+            struct page *next;  /* Next in free list */
+            struct page *prev;  /* Prev in free list */
+        };
+        void *slab;             /* Owning slab, with PG_SLAB */
+    };
     unsigned long ref_count;    /* Reference count */
 };
 
@@ -38,6 +67,8 @@ struct page {
 #define PG_USED         (1UL << 1)
 #define PG_RESERVED     (1UL << 2)
 #define PG_HEAD         (1UL << 3)  /* Head of a compound page */
+#define PG_PCP          (1UL << 4)  /* Free on a per-hart list, not in buddy */
+#define PG_SLAB         (1UL << 5)  /* Backs a slab */
 
 /* Free area structure for each order */
 struct free_area {
@@ -45,17 +76,49 @@ struct free_area {
     unsigned long nr_free;      /* Number of free blocks */
 };
 
+#define BLOCKS_PER_SECTION  (PAGES_PER_SECTION / BUDDY_MAX_PAGES)
+
+/* A section's slice of the page array, NULL if it has no RAM */
+struct mem_section {
+    struct page *mem_map;
+    unsigned long deferred;     /* Max-order blocks with tails not set up */
+};
+
 /* Global memory management data */
-static struct page *mem_map = NULL;          /* Array of page structures */
+static struct mem_section mem_section[NR_MEM_SECTIONS];
 static unsigned long mem_map_pages = 0;      /* Pages used for mem_map */
-static unsigned long start_pfn = 0;          /* First managed page frame number */
-static unsigned long end_pfn = 0;            /* Last managed page frame number */
+static unsigned long present_pages = 0;      /* Pages of RAM in all banks */
 static unsigned long total_pages = 0;        /* Total managed pages */
-static unsigned long free_page_count = 0;    /* Current free pages */
+static unsigned long deferred_pages = 0;     /* Page structures not set up yet */
+static unsigned long free_page_count = 0;    /* Free pages on the buddy lists */
+
+/* Reclaim watermarks, from the managed page count */
+#define WMARK_MIN_PAGES     64
+#define WMARK_MAX_PAGES     4096
+
+static unsigned long watermark[NR_WMARK];
 
 /* Free areas for each order */
 static struct free_area free_area[MAX_ORDER + 1];
 
+/* Protects free_area and free_page_count */
+static spinlock_t zone_lock = SPIN_LOCK_INIT;
+
+/* Per-hart order-0 page lists */
+#define PCP_HIGH            96      /* Drain when the list grows past this */
+#define PCP_BATCH           16      /* Pages moved per refill or drain */
+
+struct per_cpu_pages {
+    struct page *list;              /* Free pages, linked through next */
+    unsigned long count;            /* Pages on list */
+    unsigned long hits;             /* Allocations served from the list */
+    unsigned long refills;          /* Batches taken from the buddy lists */
+    unsigned long drains;           /* Batches returned to them */
+    unsigned long fallbacks;        /* Order-0 allocations the buddy served */
+};
+
+static struct per_cpu_pages pcp[SMP_CPUS];
+
 /* External functions */
 extern void early_puts(const char *s);
 extern void early_puthex(unsigned long val);
@@ -72,18 +135,27 @@ static inline unsigned long phys_to_pfn(unsigned long phys)
     return phys >> PAGE_SHIFT;
 }
 
+static inline unsigned long pfn_to_section_nr(unsigned long pfn)
+{
+    return pfn >> PFN_SECTION_SHIFT;
+}
+
 /* Get page structure from page frame number */
 static inline struct page *pfn_to_page(unsigned long pfn)
 {
-    if (pfn < start_pfn || pfn >= end_pfn)
+    unsigned long nr = pfn_to_section_nr(pfn);
+
+    if (nr >= NR_MEM_SECTIONS || !mem_section[nr].mem_map)
         return NULL;
-    return &mem_map[pfn - start_pfn];
+    return &mem_section[nr].mem_map[pfn & (PAGES_PER_SECTION - 1)];
 }
 
 /* Get page frame number from page structure */
 static inline unsigned long page_to_pfn(struct page *page)
 {
-    return (page - mem_map) + start_pfn;
+    unsigned long nr = page->section;
+
+    return (nr << PFN_SECTION_SHIFT) + (page - mem_section[nr].mem_map);
 }
 
 /* Get physical address from page structure */
@@ -126,28 +198,63 @@ static struct page *find_buddy(struct page *page, int order)
     unsigned long pfn = page_to_pfn(page);
     unsigned long buddy_pfn = pfn ^ (1UL << order);
 
-    if (buddy_pfn < start_pfn || buddy_pfn >= end_pfn)
-        return NULL;
-
+    /* NULL if the buddy lies in a section without RAM */
     return pfn_to_page(buddy_pfn);
 }
 
-/* Allocate pages of given order (2^order pages) */
-unsigned long alloc_pages(int order)
+/* Set up nr page structures */
+static void init_pages(struct page *page, unsigned long nr,
+                       unsigned long section, unsigned long flags)
+{
+    while (nr-- > 0) {
+        page->flags = flags;
+        page->order = -1;
+        page->section = section;
+        page->next = NULL;
+        page->prev = NULL;
+        page->ref_count = 0;
+        page++;
+    }
+}
+
+/* Bit of a max-order block in its section's deferred mask */
+static inline unsigned long deferred_bit(unsigned long pfn)
+{
+    return 1UL << ((pfn & (PAGES_PER_SECTION - 1)) >> MAX_ORDER);
+}
+
+/* First time a boot-seeded max-order block leaves the free list: set up
+ * the page structures behind its head; zone locked
+ */
+static void deferred_init_block(struct page *page)
+{
+    unsigned long pfn = page_to_pfn(page);
+    struct mem_section *ms = &mem_section[pfn_to_section_nr(pfn)];
+    unsigned long bit = deferred_bit(pfn);
+
+    if (!(ms->deferred & bit))
+        return;
+
+    init_pages(page + 1, BUDDY_MAX_PAGES - 1, page->section, 0);
+    ms->deferred &= ~bit;
+    deferred_pages -= BUDDY_MAX_PAGES - 1;
+}
+
+/* Take a free block of the given order off the buddy lists; zone locked */
+static struct page *__rmqueue(int order)
 {
     int current_order;
     struct page *page;
     struct page *buddy;
 
-    if (order < 0 || order > MAX_ORDER)
-        return 0;
-
     /* Find a free block of sufficient size */
     for (current_order = order; current_order <= MAX_ORDER; current_order++) {
         if (free_area[current_order].free_list) {
             /* Found a free block */
             page = free_area[current_order].free_list;
             list_del(&free_area[current_order], page);
+            if (current_order == MAX_ORDER && deferred_pages)
+                deferred_init_block(page);
 
             /* Split larger blocks down to requested size */
             while (current_order > order) {
@@ -162,45 +269,19 @@ unsigned long alloc_pages(int order)
                 list_add(&free_area[current_order], buddy);
             }
 
-            /* Mark page as used */
-            page->flags = PG_USED | PG_HEAD;
-            page->order = order;
-            page->ref_count = 1;
-
             /* Update free page count */
             free_page_count -= (1 << order);
-
-            return page_to_phys(page);
+            return page;
         }
     }
 
-    return 0;  /* No memory available */
+    return NULL;  /* No memory available */
 }
 
-/* Free pages of given order */
-void free_pages(unsigned long addr, int order)
+/* Return a block to the buddy lists, merging with free buddies; zone locked */
+static void __free_one_page(struct page *page, int order)
 {
-    struct page *page;
     struct page *buddy;
-    unsigned long pfn;
-
-    if (addr == 0 || order < 0 || order > MAX_ORDER)
-        return;
-
-    pfn = phys_to_pfn(addr);
-    page = pfn_to_page(pfn);
-
-    if (!page || !(page->flags & PG_HEAD)) {
-        early_puts("[BUDDY] ERROR: free_pages invalid page\n");
-        return;
-    }
-
-    /* Decrease reference count */
-    if (page->ref_count > 0) {
-        page->ref_count--;
-        if (page->ref_count > 0)
-            return;  /* Still in use */
-    }
 
     /* Mark as free */
     page->flags = PG_FREE | PG_HEAD;
@@ -225,13 +306,196 @@ void free_pages(unsigned long addr, int order)
         }
 
         order++;
-        page->order = order;
     }
 
     /* Add to free list */
+    page->order = order;
     list_add(&free_area[order], page);
 }
 
+/* Move up to PCP_BATCH pages from the buddy lists to a pcp list */
+static void pcp_refill(struct per_cpu_pages *p)
+{
+    struct page *page;
+    int i;
+
+    spin_lock(&zone_lock);
+    for (i = 0; i < PCP_BATCH; i++) {
+        page = __rmqueue(0);
+        if (!page)
+            break;
+        page->flags = PG_PCP;
+        page->order = -1;
+        page->next = p->list;
+        p->list = page;
+        p->count++;
+    }
+    spin_unlock(&zone_lock);
+
+    if (i > 0)
+        p->refills++;
+}
+
+/* Return up to nr pages from a pcp list to the buddy lists */
+static void pcp_drain(struct per_cpu_pages *p, unsigned long nr)
+{
+    struct page *page;
+
+    spin_lock(&zone_lock);
+    while (nr-- > 0 && p->list) {
+        page = p->list;
+        p->list = page->next;
+        page->next = NULL;
+        p->count--;
+        __free_one_page(page, 0);
+    }
+    spin_unlock(&zone_lock);
+
+    p->drains++;
+}
+
+/* Give this hart's cached pages back, e.g. before a large allocation */
+void drain_local_pages(void)
+{
+    unsigned long flags = local_irq_save();
+    struct per_cpu_pages *p = &pcp[smp_processor_id()];
+
+    if (p->count)
+        pcp_drain(p, p->count);
+    local_irq_restore(flags);
+}
+
+/* Single page from this hart's list, refilling it in a batch if empty */
+static struct page *rmqueue_pcp(void)
+{
+    struct per_cpu_pages *p;
+    struct page *page;
+    unsigned long flags;
+
+    flags = local_irq_save();
+    p = &pcp[smp_processor_id()];
+
+    if (p->list) {
+        p->hits++;
+    } else {
+        pcp_refill(p);
+        p->fallbacks++;
+    }
+
+    page = p->list;
+    if (page) {
+        p->list = page->next;
+        page->next = NULL;
+        p->count--;
+    }
+    local_irq_restore(flags);
+
+    return page;
+}
+
+/* Failed allocations that wait for kswapd before giving up */
+#define MAX_RECLAIM_RETRIES 3
+
+/* Allocate 2^order pages; a caller that may sleep waits for kswapd up
+ * to MAX_RECLAIM_RETRIES times
+ */
+unsigned long alloc_pages_gfp(int order, gfp_t gfp)
+{
+    struct page *page;
+    unsigned long flags;
+    int retries = MAX_RECLAIM_RETRIES;
+
+    if (order < 0 || order > MAX_ORDER)
+        return 0;
+
+retry:
+    if (order == 0) {
+        page = rmqueue_pcp();
+    } else {
+        spin_lock_irqsave(&zone_lock, flags);
+        page = __rmqueue(order);
+        spin_unlock_irqrestore(&zone_lock, flags);
+
+        /* Cached order-0 pages may be what keeps blocks from merging */
+        if (!page && pcp[smp_processor_id()].count) {
+            drain_local_pages();
+            spin_lock_irqsave(&zone_lock, flags);
+            page = __rmqueue(order);
+            spin_unlock_irqrestore(&zone_lock, flags);
+        }
+    }
+
+    /* Only the buddy count: pages cached on the harts are few */
+    if (free_page_count < watermark[WMARK_LOW])
+        wakeup_kswapd();
+
+    if (!page) {
+        if (retries-- > 0 && reclaim_throttle(gfp))
+            goto retry;
+        return 0;
+    }
+
+    /* Mark page as used */
+    page->flags = PG_USED | PG_HEAD;
+    page->order = order;
+    page->ref_count = 1;
+
+    return page_to_phys(page);
+}
+
+/* Allocate pages of given order (2^order pages); never sleeps */
+unsigned long alloc_pages(int order)
+{
+    return alloc_pages_gfp(order, GFP_ATOMIC);
+}
+
+/* Free pages of given order */
+void free_pages(unsigned long addr, int order)
+{
+    struct page *page;
+    struct per_cpu_pages *p;
+    unsigned long pfn;
+    unsigned long flags;
+
+    if (addr == 0 || order < 0 || order > MAX_ORDER)
+        return;
+
+    pfn = phys_to_pfn(addr);
+    page = pfn_to_page(pfn);
+
+    if (!page || !(page->flags & PG_HEAD)) {
+        early_puts("[BUDDY] ERROR: free_pages invalid page\n");
+        return;
+    }
+
+    /* Decrease reference count */
+    if (page->ref_count > 0) {
+        if (__sync_sub_and_fetch(&page->ref_count, 1) > 0)
+            return;  /* Still in use */
+    }
+
+    if (order > 0) {
+        spin_lock_irqsave(&zone_lock, flags);
+        __free_one_page(page, order);
+        spin_unlock_irqrestore(&zone_lock, flags);
+        return;
+    }
+
+    /* Order 0: onto this hart's list, draining a batch past the mark */
+    flags = local_irq_save();
+    p = &pcp[smp_processor_id()];
+
+    page->flags = PG_PCP;
+    page->order = -1;
+    page->next = p->list;
+    p->list = page;
+    p->count++;
+
+    if (p->count > PCP_HIGH)
+        pcp_drain(p, PCP_BATCH);
+    local_irq_restore(flags);
+}
+
 /* Convenience function: allocate single page */
 unsigned long alloc_page(void)
 {
@@ -244,25 +508,139 @@ void free_page(unsigned long addr)
     free_pages(addr, 0);
 }
 
+/* Take an extra reference on an allocated page (COW sharing) */
+void get_page(unsigned long addr)
+{
+    struct page *page = pfn_to_page(phys_to_pfn(addr));
+
+    if (!page || !(page->flags & PG_USED)) {
+        early_puts("[BUDDY] ERROR: get_page on free page\n");
+        return;
+    }
+
+    __sync_fetch_and_add(&page->ref_count, 1);
+}
+
+/* Get reference count of an allocated page */
+unsigned long page_count(unsigned long addr)
+{
+    struct page *page = pfn_to_page(phys_to_pfn(addr));
+
+    if (!page || !(page->flags & PG_USED))
+        return 0;
+
+    return page->ref_count;
+}
+
+/* Order of the allocated block at addr, -1 if addr does not start one */
+int page_order(unsigned long addr)
+{
+    struct page *page = pfn_to_page(phys_to_pfn(addr));
+
+    if (!page || (page->flags & (PG_USED | PG_HEAD)) != (PG_USED | PG_HEAD))
+        return -1;
+
+    return page->order;
+}
+
+/* Turn the allocated block at addr into 2^order independent pages,
+ * each with its own reference and freed with free_page()
+ */
+void split_page(unsigned long addr, int order)
+{
+    struct page *page = pfn_to_page(phys_to_pfn(addr));
+    unsigned long i;
+
+    if (!page || (page->flags & (PG_USED | PG_HEAD)) != (PG_USED | PG_HEAD) ||
+        page->order != order)
+        return;
+
+    for (i = 0; i < (1UL << order); i++) {
+        page[i].flags = PG_USED | PG_HEAD;
+        page[i].order = 0;
+        page[i].ref_count = 1;
+    }
+}
+
+/* Tag the 2^order allocated pages at addr as backing slab (NULL untags) */
+void set_page_slab(unsigned long addr, int order, void *slab)
+{
+    struct page *page = pfn_to_page(phys_to_pfn(addr));
+    unsigned long i;
+
+    if (!page)
+        return;
+
+    /* An allocated block never spans sections, so its pages are adjacent */
+    for (i = 0; i < (1UL << order); i++) {
+        if (slab)
+            page[i].flags |= PG_SLAB;
+        else
+            page[i].flags &= ~PG_SLAB;
+        page[i].slab = slab;
+    }
+}
+
+/* Slab the page holding addr belongs to, NULL if it is not a slab page */
+void *page_slab(unsigned long addr)
+{
+    struct page *page = pfn_to_page(phys_to_pfn(addr));
+
+    if (!page || !(page->flags & PG_SLAB))
+        return NULL;
+
+    return page->slab;
+}
+
+/* Pages sitting on the per-hart lists */
+static unsigned long nr_pcp_pages(void)
+{
+    unsigned long nr = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++)
+        nr += pcp[cpu].count;
+    return nr;
+}
+
+/* Get number of free pages (buddy lists and per-hart lists) */
+unsigned long nr_free_pages(void)
+{
+    return free_page_count + nr_pcp_pages();
+}
+
+unsigned long zone_watermark(int wmark)
+{
+    if (wmark < 0 || wmark >= NR_WMARK)
+        return 0;
+    return watermark[wmark];
+}
+
 /* Get memory statistics */
 void get_mem_info(unsigned long *total, unsigned long *free)
 {
     if (total) *total = total_pages * PAGE_SIZE;
-    if (free) *free = free_page_count * PAGE_SIZE;
+    if (free) *free = nr_free_pages() * PAGE_SIZE;
 }
 
 /* Print buddy allocator statistics */
 void buddy_stats(void)
 {
-    int order;
+    int order, cpu;
 
     early_puts("\n=== Buddy Allocator Statistics ===\n");
     early_puts("Total pages: ");
     early_puthex(total_pages);
     early_puts("\nFree pages:  ");
-    early_puthex(free_page_count);
+    early_puthex(nr_free_pages());
     early_puts("\nUsed pages:  ");
-    early_puthex(total_pages - free_page_count);
+    early_puthex(total_pages - nr_free_pages());
+    early_puts("\nDeferred page structures: ");
+    early_puthex(deferred_pages);
+    early_puts("\nWatermarks: low=");
+    early_puthex(watermark[WMARK_LOW]);
+    early_puts(" high=");
+    early_puthex(watermark[WMARK_HIGH]);
     early_puts("\n\nFree blocks by order:\n");
 
     for (order = 0; order <= MAX_ORDER; order++) {
@@ -276,142 +654,243 @@ void buddy_stats(void)
             early_puts(" blocks\n");
         }
     }
+
+    early_puts("\nPer-hart page lists:\n");
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        if (!cpu_online(cpu))
+            continue;
+        early_puts("  Hart ");
+        early_puthex(cpu);
+        early_puts(": count=");
+        early_puthex(pcp[cpu].count);
+        early_puts(" hits=");
+        early_puthex(pcp[cpu].hits);
+        early_puts(" fallbacks=");
+        early_puthex(pcp[cpu].fallbacks);
+        early_puts(" refills=");
+        early_puthex(pcp[cpu].refills);
+        early_puts(" drains=");
+        early_puthex(pcp[cpu].drains);
+        early_puts("\n");
+    }
 }
 
-/* Initialize page allocator with buddy system */
-void page_init(void)
+/* 1/128 of managed memory, within bounds; high leaves kswapd some slack
+ * so it is not woken again by the next few allocations
+ */
+static void setup_watermarks(void)
 {
-    unsigned long managed_start;
-    unsigned long managed_end;
-    unsigned long mem_map_size;
-    unsigned long pfn;
-    int order;
-
-    early_puts("[BUDDY] Initializing buddy allocator...\n");
-
-    /* Calculate managed memory region */
-    managed_start = PHYS_MEMORY_BASE + KERNEL_RESERVED;
-    managed_end = PHYS_MEMORY_BASE + PHYS_MEMORY_SIZE;
+    unsigned long low = total_pages / 128;
 
-    start_pfn = phys_to_pfn(managed_start);
-    end_pfn = phys_to_pfn(managed_end);
-    total_pages = end_pfn - start_pfn;
+    if (low < WMARK_MIN_PAGES)
+        low = WMARK_MIN_PAGES;
+    if (low > WMARK_MAX_PAGES)
+        low = WMARK_MAX_PAGES;
 
-    early_puts("[BUDDY] Memory range: ");
-    early_puthex(managed_start);
-    early_puts(" - ");
-    early_puthex(managed_end);
-    early_puts("\n");
+    watermark[WMARK_LOW] = low;
+    watermark[WMARK_HIGH] = low + low / 2;
+}
 
-    /* Calculate space needed for mem_map array */
-    mem_map_size = total_pages * sizeof(struct page);
-    mem_map_pages = (mem_map_size + PAGE_SIZE - 1) / PAGE_SIZE;
+/* Give a section its slice of the page array, taken from boot memory */
+static int sparse_alloc_section(unsigned long nr)
+{
+    unsigned long size = PAGES_PER_SECTION * sizeof(struct page);
+    struct page *map;
 
-    /* Place mem_map at the beginning of managed memory */
-    mem_map = (struct page *)managed_start;
+    map = (struct page *)memblock_alloc(size, PAGE_SIZE);
+    if (!map)
+        return -1;
 
-    early_puts("[BUDDY] Page array: ");
-    early_puthex((unsigned long)mem_map);
-    early_puts(" (");
-    early_puthex(mem_map_pages);
-    early_puts(" pages)\n");
+    mem_section[nr].mem_map = map;
+    mem_section[nr].deferred = 0;
+    mem_map_pages += (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    return 0;
+}
 
-    /* Initialize all page structures */
-    for (pfn = start_pfn; pfn < end_pfn; pfn++) {
-        struct page *page = pfn_to_page(pfn);
-        page->flags = 0;
-        page->order = -1;
-        page->next = NULL;
-        page->prev = NULL;
-        page->ref_count = 0;
-    }
+/* Note the wholly free max-order blocks in [pfn, end) */
+static void mark_deferred_blocks(unsigned long pfn, unsigned long end)
+{
+    pfn = (pfn + BUDDY_MAX_PAGES - 1) & ~(BUDDY_MAX_PAGES - 1);
 
-    /* Initialize free areas */
-    for (order = 0; order <= MAX_ORDER; order++) {
-        free_area[order].free_list = NULL;
-        free_area[order].nr_free = 0;
+    for (; pfn + BUDDY_MAX_PAGES <= end; pfn += BUDDY_MAX_PAGES) {
+        if (pfn_to_page(pfn))
+            mem_section[pfn_to_section_nr(pfn)].deferred |= deferred_bit(pfn);
     }
+}
 
-    /* Mark pages used by mem_map as reserved */
-    for (pfn = start_pfn; pfn < start_pfn + mem_map_pages; pfn++) {
-        struct page *page = pfn_to_page(pfn);
-        page->flags = PG_RESERVED;
-    }
+/* Set up a section's page array: just the head of each block seeded
+ * whole, every page of the rest (holes, reservations, range edges)
+ */
+static void init_section(unsigned long nr)
+{
+    struct mem_section *ms = &mem_section[nr];
+    unsigned long i;
 
-    /* Add remaining pages to buddy system */
-    /* Start from first page after mem_map, aligned to max order */
-    pfn = start_pfn + mem_map_pages;
+    for (i = 0; i < BLOCKS_PER_SECTION; i++) {
+        struct page *page = &ms->mem_map[i * BUDDY_MAX_PAGES];
 
-    /* Ensure starting pfn is at least 2-page aligned for THREAD_SIZE allocations */
-    /* This guarantees alloc_pages(1) returns 8KB-aligned addresses */
-    if (pfn & 1) {
-        struct page *page = pfn_to_page(pfn);
-        page->flags = PG_RESERVED;  /* Mark unaligned page as reserved */
-        pfn++;
+        if (ms->deferred & (1UL << i)) {
+            init_pages(page, 1, nr, PG_RESERVED);
+            deferred_pages += BUDDY_MAX_PAGES - 1;
+        } else {
+            init_pages(page, BUDDY_MAX_PAGES, nr, PG_RESERVED);
+        }
     }
+}
 
-    free_page_count = 0;
+/* Add [pfn, end) to the free lists in the largest aligned blocks */
+static void free_pfn_range(unsigned long pfn, unsigned long end)
+{
+    int order;
+
+    while (pfn < end) {
+        /* Part of a section whose page array could not be allocated */
+        if (!pfn_to_page(pfn)) {
+            pfn = (pfn_to_section_nr(pfn) + 1) << PFN_SECTION_SHIFT;
+            continue;
+        }
 
-    /* Add pages in largest possible chunks */
-    while (pfn < end_pfn) {
         /* Find largest order that fits */
         for (order = MAX_ORDER; order >= 0; order--) {
             unsigned long block_size = 1UL << order;
-            unsigned long aligned_pfn = (pfn + block_size - 1) & ~(block_size - 1);
 
-            /* Check if we can allocate this block */
-            if (aligned_pfn == pfn && pfn + block_size <= end_pfn) {
+            if (!(pfn & (block_size - 1)) && pfn + block_size <= end) {
                 struct page *page = pfn_to_page(pfn);
                 page->flags = PG_FREE | PG_HEAD;
                 page->order = order;
                 list_add(&free_area[order], page);
                 free_page_count += block_size;
+                total_pages += block_size;
                 pfn += block_size;
                 break;
             }
         }
+    }
+}
+
+/* Initialize page allocator with buddy system, over the RAM banks and
+ * reservations memblock_init() found
+ */
+void page_init(void)
+{
+    unsigned long base, end, pos, nr;
+    u64 t0, cycles;
+    int i, order;
+
+    early_puts("[BUDDY] Initializing buddy allocator...\n");
+    t0 = read_csr(time);
+
+    /* Initialize free areas */
+    for (order = 0; order <= MAX_ORDER; order++) {
+        free_area[order].free_list = NULL;
+        free_area[order].nr_free = 0;
+    }
 
-        /* If no order fits (shouldn't happen), skip one page */
-        if (order < 0) {
-            pfn++;
+    /* Page arrays for every section with RAM, before anything is freed */
+    for (i = 0; memblock_memory_region(i, &base, &end) == 0; i++) {
+        present_pages += (end - base) >> PAGE_SHIFT;
+
+        for (nr = pfn_to_section_nr(phys_to_pfn(base));
+             nr <= pfn_to_section_nr(phys_to_pfn(end - 1)); nr++) {
+            if (mem_section[nr].mem_map)
+                continue;
+            if (sparse_alloc_section(nr) < 0) {
+                early_puts("[BUDDY] WARNING: no memory for the page array of section ");
+                early_puthex(nr);
+                early_puts("\n");
+            }
         }
     }
 
-    early_puts("[BUDDY] Total managed pages: ");
+    early_puts("[BUDDY] Page array: ");
+    early_puthex(mem_map_pages);
+    early_puts(" pages\n");
+
+    pos = 0;
+    while (memblock_next_free(&pos, &base, &end) == 0)
+        mark_deferred_blocks(phys_to_pfn(base), phys_to_pfn(end));
+
+    for (nr = 0; nr < NR_MEM_SECTIONS; nr++) {
+        if (mem_section[nr].mem_map)
+            init_section(nr);
+    }
+
+    /* Everything in a bank that is not reserved goes to the buddy lists */
+    free_page_count = 0;
+    total_pages = 0;
+    pos = 0;
+    while (memblock_next_free(&pos, &base, &end) == 0) {
+        early_puts("[BUDDY] Free range: ");
+        early_puthex(base);
+        early_puts(" - ");
+        early_puthex(end);
+        early_puts("\n");
+        free_pfn_range(phys_to_pfn(base), phys_to_pfn(end));
+    }
+
+    setup_watermarks();
+    cycles = read_csr(time) - t0;
+
+    early_puts("[BUDDY] Present pages: ");
+    early_puthex(present_pages);
+    early_puts("\n[BUDDY] Total managed pages: ");
     early_puthex(total_pages);
     early_puts("\n[BUDDY] Free pages: ");
     early_puthex(free_page_count);
     early_puts("\n[BUDDY] Reserved pages: ");
-    early_puthex(total_pages - free_page_count);
-    early_puts("\n[BUDDY] Buddy allocator initialized\n");
+    early_puthex(present_pages - total_pages);
+    early_puts("\n[BUDDY] Deferred page structures: ");
+    early_puthex(deferred_pages);
+    early_puts("\n[BUDDY] Memory init: ");
+    early_puthex(cycles);
+    early_puts(" cycles (");
+    early_puthex(cycles * 1000000 / BOARD_TIMEBASE_FREQ);
+    early_puts(" us)\n[BUDDY] Buddy allocator initialized\n");
 }
 
-/* Map page to virtual address - stub for now */
+/* Map a page into the kernel page table (flags 0: read/write) */
 unsigned long map_page(unsigned long phys_addr, unsigned long virt_addr, int flags)
 {
-    /* Will be implemented in pgtable.c */
-    (void)phys_addr;
-    (void)virt_addr;
-    (void)flags;
-    return 0;
+    unsigned long pte_flags = flags ? (unsigned long)flags : PTE_KERNEL_RW;
+
+    if (map_page_4k(get_kernel_pgd(), virt_addr, phys_addr, pte_flags) < 0)
+        return 0;
+    return virt_addr;
 }
 
-/* Unmap page - stub for now */
+/* Unmap a page from the kernel page table */
 void unmap_page(unsigned long virt_addr)
 {
-    (void)virt_addr;
+    unmap_page_pte(get_kernel_pgd(), virt_addr);
 }
 
-/* Convert virtual to physical address (identity mapping for now) */
+/* Direct-map addresses translate by offset. The rest of the kernel
+ * half (vmalloc, ioremap, fixmap) is translated through the kernel page
+ * table. The Sv39 lower half is the kernel's identity map, which only
+ * kernel_pgd holds: there the address is the physical address.
+ */
 unsigned long virt_to_phys(unsigned long virt_addr)
 {
-    return virt_addr;
+    unsigned long pa;
+
+    if (virt_addr >= PAGE_OFFSET && virt_addr - PAGE_OFFSET < DIRECT_MAP_SIZE)
+        return virt_addr - PAGE_OFFSET;
+    if (virt_addr < IDENTITY_MAP_END)
+        return virt_addr;
+
+    pa = (virt_addr > PAGE_OFFSET) ? lookup_pa(virt_addr) : 0;
+    if (!pa) {
+        early_puts("[BUDDY] WARNING: virt_to_phys on unmapped address ");
+        early_puthex(virt_addr);
+        early_puts("\n");
+    }
+    return pa;
 }
 
-/* Convert physical to virtual address (identity mapping for now) */
+/* Direct-map address of a physical address */
 unsigned long phys_to_virt(unsigned long phys_addr)
 {
-    return phys_addr;
+    return phys_addr + PAGE_OFFSET;
 }
 
 /* Flush TLB entry */
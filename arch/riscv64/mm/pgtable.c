@@ -1,8 +1,13 @@
 /* RISC-V SV39 page table management */
 
 #include <minix/config.h>
+#include <minix/smp.h>
+#include <minix/fdt.h>
+#include <minix/mm_types.h>
 #include <types.h>
 #include <asm/csr.h>
+#include <asm/irq.h>
+#include <asm/sbi.h>
 
 #ifndef NULL
 #define NULL ((void *)0)
@@ -42,7 +47,16 @@
 #define PTE_G               (1UL << 5)    /* Global */
 #define PTE_A               (1UL << 6)    /* Accessed */
 #define PTE_D               (1UL << 7)    /* Dirty */
+#define PTE_N               (1UL << 63)   /* Svnapot: part of a NAPOT range */
 #define PTE_PPN_SHIFT       10
+#define PTE_FLAGS_MASK      0x3FFUL
+
+/* Svnapot 64KB ranges: 16 identical level-0 entries, naturally aligned.
+ * Each encodes the block address with PPN bit 3 set (ppn[3:0] = 1000)
+ */
+#define NAPOT_PAGES         16
+#define NAPOT_SIZE          (NAPOT_PAGES * PAGE_SIZE)
+#define NAPOT_PPN_64K       (1UL << 15)
 
 /* Convenience flag combinations */
 #define PTE_KERNEL          (PTE_V | PTE_R | PTE_W | PTE_A | PTE_D)
@@ -65,25 +79,41 @@ typedef unsigned long pte_t;
 typedef unsigned long pgd_t;
 typedef unsigned long pmd_t;
 
-/* Kernel virtual address space layout (for future use):
+/* Kernel virtual address space layout:
  * 0x0000_0000_0000_0000 - 0x0000_003F_FFFF_FFFF : User space (256GB)
  * 0xFFFF_FFC0_0000_0000 - 0xFFFF_FFDF_FFFF_FFFF : Direct mapping (physical)
  * 0xFFFF_FFE0_0000_0000 - 0xFFFF_FFEF_FFFF_FFFF : vmalloc area
  * 0xFFFF_FFF0_0000_0000 - 0xFFFF_FFFF_FFFF_FFFF : Fixed mappings
+ * 0xFFFF_FFFF_FFFF_F000                         : Trap trampoline page
+ *
+ * The direct mapping holds all RAM at PAGE_OFFSET + physical address
+ * (see phys_to_virt). The kernel image, MMIO and the memory the kernel
+ * allocates are still also identity mapped (VA == PA) in the low half,
+ * since the kernel runs at its physical address and uses the physical
+ * addresses the allocators return as pointers.
  *
- * For now, we use identity mapping (VA == PA) until we need kernel virtual addresses.
+ * Process page tables share only the high half: the low half is all
+ * user space. The kernel never runs on them; the trampoline switches
+ * page tables on every trap from and return to user (trap_asm.S).
  */
 
 /* Memory layout constants */
 #define PHYS_MEMORY_BASE    0x80000000UL
 #define MMIO_BASE           0x00000000UL
 #define MMIO_END            0x40000000UL  /* 1GB for MMIO */
+#define TRAMPOLINE_VA       0xFFFFFFFFFFFFF000UL  /* Must match trap_asm.S */
 
 /* Root page table - 4KB aligned */
 static pgd_t kernel_pgd[PTRS_PER_PGD] __attribute__((aligned(4096)));
 
-/* SATP value for kernel */
-static unsigned long kernel_satp = 0;
+/* SATP value for kernel (read by the trampoline) */
+unsigned long kernel_satp = 0;
+
+/* Every hart implements Svnapot (device tree) */
+static int svnapot_enabled = 0;
+
+/* NAPOT ranges currently mapped, in all page tables */
+static volatile unsigned long nr_napot_maps = 0;
 
 /* External functions */
 extern unsigned long alloc_page(void);
@@ -92,6 +122,11 @@ extern unsigned long virt_to_phys(unsigned long addr);
 extern unsigned long phys_to_virt(unsigned long addr);
 extern void early_puts(const char *s);
 extern void early_puthex(unsigned long val);
+extern char trampoline[];
+extern int memblock_memory_region(int n, unsigned long *base, unsigned long *end);
+extern int strcmp(const char *s1, const char *s2);
+extern int strncmp(const char *s1, const char *s2, unsigned long n);
+extern unsigned long strlen(const char *s);
 
 /* Get PGD index from virtual address */
 static inline unsigned long pgd_index(unsigned long va)
@@ -135,6 +170,15 @@ static inline pte_t phys_to_pte(unsigned long phys, unsigned long flags)
     return ((phys >> PAGE_SHIFT) << PTE_PPN_SHIFT) | flags;
 }
 
+/* Physical address of the page at va mapped by a leaf entry */
+static inline unsigned long pte_page_phys(pte_t pte, unsigned long va)
+{
+    if (pte & PTE_N)
+        return (pte_to_phys(pte) & ~(NAPOT_SIZE - 1)) |
+               (va & (NAPOT_SIZE - 1) & PAGE_MASK);
+    return pte_to_phys(pte);
+}
+
 /* Allocate a page table (returns physical address) */
 static unsigned long pgtable_alloc(void)
 {
@@ -149,8 +193,7 @@ static unsigned long pgtable_alloc(void)
     return page;
 }
 
-/* Free a page table (for future use) */
-static void pgtable_free(unsigned long page) __attribute__((unused));
+/* Free a page table */
 static void pgtable_free(unsigned long page)
 {
     free_page(page);
@@ -208,6 +251,111 @@ static pte_t *walk_pgtable(pgd_t *pgd, unsigned long va, int create)
     return &pte_table[idx];
 }
 
+/* Walk to the 4KB PTE for va (user page tables).
+ * Unlike walk_pgtable(), a superpage leaf on the way down is never
+ * returned: callers always get a level-0 entry or NULL.
+ */
+pte_t *get_pte(pgd_t *pgd, unsigned long va, int create)
+{
+    pmd_t *pmd_table;
+    pte_t *pte_table;
+    unsigned long idx;
+    unsigned long phys;
+
+    if (!pgd)
+        return NULL;
+
+    idx = pgd_index(va);
+    if (!pte_valid(pgd[idx])) {
+        if (!create)
+            return NULL;
+        phys = pgtable_alloc();
+        if (!phys)
+            return NULL;
+        pgd[idx] = phys_to_pte(phys, PTE_V);
+    }
+    if (pte_leaf(pgd[idx]))
+        return NULL;
+
+    pmd_table = (pmd_t *)pte_to_phys(pgd[idx]);
+    idx = pmd_index(va);
+    if (!pte_valid(pmd_table[idx])) {
+        if (!create)
+            return NULL;
+        phys = pgtable_alloc();
+        if (!phys)
+            return NULL;
+        pmd_table[idx] = phys_to_pte(phys, PTE_V);
+    }
+    if (pte_leaf(pmd_table[idx]))
+        return NULL;
+
+    pte_table = (pte_t *)pte_to_phys(pmd_table[idx]);
+    return &pte_table[pte_index(va)];
+}
+
+/* Map 64KB at a 64KB-aligned va and pa with one Svnapot range: the 16
+ * level-0 entries hold the same NAPOT encoding and share a TLB entry.
+ * Fails without Svnapot, over a superpage, or if any of the 16 entries
+ * is valid (the caller falls back to 4KB pages)
+ */
+int map_page_64k(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags)
+{
+    pte_t *pte;
+    pte_t entry;
+    int i;
+
+    if (!svnapot_enabled || ((va | pa) & (NAPOT_SIZE - 1)))
+        return -1;
+
+    pte = get_pte(pgd, va, 1);
+    if (!pte)
+        return -1;
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        if (pte_valid(pte[i]))
+            return -1;
+    }
+
+    entry = phys_to_pte(pa | NAPOT_PPN_64K, flags | PTE_V) | PTE_N;
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        pte[i] = entry;
+    }
+    __sync_fetch_and_add(&nr_napot_maps, 1);
+
+    asm volatile ("sfence.vma %0" :: "r"(va) : "memory");
+
+    return 0;
+}
+
+/* Rewrite the NAPOT range holding va as 16 ordinary entries to the same
+ * pages, so that one of them can be changed on its own
+ */
+void napot_split(pgd_t *pgd, unsigned long va)
+{
+    pte_t *pte;
+    unsigned long pa, flags;
+    int i;
+
+    va &= ~(NAPOT_SIZE - 1);
+    pte = get_pte(pgd, va, 0);
+    if (!pte || !(*pte & PTE_N))
+        return;
+
+    /* Hardware may set A/D in any one of the entries */
+    pa = pte_page_phys(*pte, va);
+    flags = 0;
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        flags |= pte[i] & PTE_FLAGS_MASK;
+    }
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        pte[i] = phys_to_pte(pa + i * PAGE_SIZE, flags);
+    }
+    __sync_fetch_and_sub(&nr_napot_maps, 1);
+
+    /* Any address in the range flushes its NAPOT translation */
+    asm volatile ("sfence.vma %0" :: "r"(va) : "memory");
+}
+
 /* Map a single 4KB page */
 int map_page_4k(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags)
 {
@@ -220,6 +368,8 @@ int map_page_4k(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long fl
     pte = walk_pgtable(pgd, va, 1);
     if (!pte)
         return -1;
+    if (*pte & PTE_N)
+        napot_split(pgd, va);
 
     /* Set the mapping */
     *pte = phys_to_pte(pa, flags | PTE_V);
@@ -230,7 +380,9 @@ int map_page_4k(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long fl
     return 0;
 }
 
-/* Map a 2MB megapage */
+/* Map a 2MB megapage. Fails if a page table already covers the slot:
+ * replacing it would drop its mappings and leak it
+ */
 int map_page_2m(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags)
 {
     pmd_t *pmd_table;
@@ -249,10 +401,14 @@ int map_page_2m(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long fl
             return -1;
         pgd[pgd_idx] = phys_to_pte(phys, PTE_V);
     }
+    if (pte_leaf(pgd[pgd_idx]))
+        return -1;
 
     /* Get PMD table */
     pmd_table = (pmd_t *)pte_to_phys(pgd[pgd_idx]);
     pmd_idx = pmd_index(va);
+    if (pte_valid(pmd_table[pmd_idx]) && !pte_leaf(pmd_table[pmd_idx]))
+        return -1;
 
     /* Set megapage mapping (leaf entry at PMD level) */
     pmd_table[pmd_idx] = phys_to_pte(pa, flags | PTE_V);
@@ -262,7 +418,7 @@ int map_page_2m(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long fl
     return 0;
 }
 
-/* Map a 1GB gigapage */
+/* Map a 1GB gigapage (fails over an existing page table, as above) */
 int map_page_1g(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags)
 {
     unsigned long pgd_idx;
@@ -272,6 +428,8 @@ int map_page_1g(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long fl
     pa &= ~((1UL << PGDIR_SHIFT) - 1);
 
     pgd_idx = pgd_index(va);
+    if (pte_valid(pgd[pgd_idx]) && !pte_leaf(pgd[pgd_idx]))
+        return -1;
 
     /* Set gigapage mapping (leaf entry at PGD level) */
     pgd[pgd_idx] = phys_to_pte(pa, flags | PTE_V);
@@ -288,13 +446,17 @@ void unmap_page_pte(pgd_t *pgd, unsigned long va)
 
     va &= PAGE_MASK;
     pte = walk_pgtable(pgd, va, 0);
+    if (pte && (*pte & PTE_N))
+        napot_split(pgd, va);
     if (pte && pte_valid(*pte)) {
         *pte = 0;
         asm volatile ("sfence.vma %0" :: "r"(va) : "memory");
     }
 }
 
-/* Map a memory region with 4KB pages */
+/* Map a memory region with 4KB pages, as 64KB NAPOT ranges where va
+ * and pa line up and Svnapot is available
+ */
 int map_region(pgd_t *pgd, unsigned long va_start, unsigned long pa_start,
                unsigned long size, unsigned long flags)
 {
@@ -303,6 +465,13 @@ int map_region(pgd_t *pgd, unsigned long va_start, unsigned long pa_start,
     unsigned long end = (va_start + size + PAGE_SIZE - 1) & PAGE_MASK;
 
     while (va < end) {
+        if (svnapot_enabled && !((va | pa) & (NAPOT_SIZE - 1)) &&
+            end - va >= NAPOT_SIZE &&
+            map_page_64k(pgd, va, pa, flags) == 0) {
+            va += NAPOT_SIZE;
+            pa += NAPOT_SIZE;
+            continue;
+        }
         if (map_page_4k(pgd, va, pa, flags) < 0)
             return -1;
         va += PAGE_SIZE;
@@ -361,7 +530,7 @@ unsigned long lookup_pa(unsigned long va)
     if (!pte || !pte_valid(*pte))
         return 0;
 
-    return pte_to_phys(*pte) | (va & (PAGE_SIZE - 1));
+    return pte_page_phys(*pte, va) | (va & (PAGE_SIZE - 1));
 }
 
 /* Change page protection flags */
@@ -371,6 +540,8 @@ int protect_page(unsigned long va, unsigned long flags)
 
     if (!pte || !pte_valid(*pte))
         return -1;
+    if (*pte & PTE_N)
+        napot_split(kernel_pgd, va);
 
     /* Preserve PPN, update flags */
     unsigned long phys = pte_to_phys(*pte);
@@ -391,17 +562,190 @@ void flush_tlb_mm(unsigned long asid)
     }
 }
 
+/* Page by page up to this many pages, the whole TLB beyond */
+#define TLB_FLUSH_MAX_PAGES 64
+
 void flush_tlb_range(unsigned long start, unsigned long size)
 {
-    unsigned long end = start + size;
-    (void)end;  /* For now just flush all */
+    unsigned long va;
+
+    if (size > TLB_FLUSH_MAX_PAGES * PAGE_SIZE) {
+        asm volatile ("sfence.vma" ::: "memory");
+        return;
+    }
+    for (va = start & PAGE_MASK; va < start + size; va += PAGE_SIZE)
+        asm volatile ("sfence.vma %0" :: "r"(va) : "memory");
+}
+
+/* Flush a kernel range on every online hart: locally, then one SBI
+ * remote fence for the others, which returns once they have flushed
+ */
+void flush_tlb_kernel_range(unsigned long start, unsigned long size)
+{
+    unsigned long others = cpu_online_mask & ~(1UL << smp_processor_id());
+
+    flush_tlb_range(start, size);
+    if (others)
+        sbi_remote_sfence_vma(others, 0, start, size);
+}
+
+/* Harts other than this one that may hold entries of mm. The barrier
+ * orders the caller's PTE stores before the read of the mask, as
+ * switch_mm_asid() sets a hart's bit before it can walk the table
+ */
+static unsigned long mm_other_harts(struct mm_struct *mm)
+{
+    __sync_synchronize();
+    return mm->cpu_mask & cpu_online_mask & ~(1UL << smp_processor_id());
+}
+
+/* Flush a user page on every hart mm has run on; interrupts stay off
+ * so that the hart cannot change between the local flush and the mask
+ */
+void flush_tlb_user_page(struct mm_struct *mm, unsigned long addr)
+{
+    unsigned long others, flags;
+
+    flags = local_irq_save();
+    asm volatile ("sfence.vma %0" :: "r"(addr) : "memory");
+    others = mm_other_harts(mm);
+    if (others)
+        sbi_remote_sfence_vma(others, 0, addr & PAGE_MASK, PAGE_SIZE);
+    local_irq_restore(flags);
+}
+
+/* Flush everything on every hart mm has run on */
+void flush_tlb_user_mm(struct mm_struct *mm)
+{
+    unsigned long others, flags;
+
+    flags = local_irq_save();
     asm volatile ("sfence.vma" ::: "memory");
+    others = mm_other_harts(mm);
+    if (others)
+        sbi_remote_sfence_vma(others, 0, 0, (unsigned long)-1);
+    local_irq_restore(flags);
+}
+
+/* Clear the kernel mappings in [start, start + size) without any TLB
+ * flush; the caller flushes the range before reusing it. Superpage
+ * leaves and NAPOT ranges must lie wholly inside the range. Page
+ * tables are kept
+ */
+void unmap_kernel_range_noflush(unsigned long start, unsigned long size)
+{
+    unsigned long va = start & PAGE_MASK;
+    unsigned long end = start + size;
+    pgd_t *pgde;
+    pmd_t *pmde;
+    pte_t *pte;
+
+    while (va < end) {
+        pgde = &kernel_pgd[pgd_index(va)];
+        if (pte_leaf(*pgde))
+            *pgde = 0;
+        if (!pte_valid(*pgde)) {
+            va = (va + (1UL << PGDIR_SHIFT)) & ~((1UL << PGDIR_SHIFT) - 1);
+            continue;
+        }
+
+        pmde = &((pmd_t *)pte_to_phys(*pgde))[pmd_index(va)];
+        if (pte_leaf(*pmde))
+            *pmde = 0;
+        if (!pte_valid(*pmde)) {
+            va = (va + (1UL << PMD_SHIFT)) & ~((1UL << PMD_SHIFT) - 1);
+            continue;
+        }
+
+        pte = &((pte_t *)pte_to_phys(*pmde))[pte_index(va)];
+        if ((*pte & PTE_N) && !(va & (NAPOT_SIZE - 1)))
+            __sync_fetch_and_sub(&nr_napot_maps, 1);
+        *pte = 0;
+        va += PAGE_SIZE;
+    }
+}
+
+/* Does the "_"-separated ISA string name extension ext? */
+static int isa_has_ext(const char *isa, unsigned long len, const char *ext)
+{
+    unsigned long i = 0, n;
+
+    while (i < len && isa[i]) {
+        for (n = 0; i + n < len && isa[i + n] && isa[i + n] != '_'; n++)
+            ;
+        if (i > 0 && !strncmp(&isa[i], ext, n) && ext[n] == '\0')
+            return 1;
+        i += n + 1;
+    }
+    return 0;
+}
+
+/* Svnapot is only used when every hart in the device tree lists it,
+ * in riscv,isa-extensions if the nodes have it, else in riscv,isa
+ */
+void svnapot_init(void)
+{
+    const void *fdt = (const void *)boot_fdt;
+    struct fdt_token tok;
+    const char *s;
+    unsigned long n;
+    int isa = 0, isa_napot = 0, ext = 0, ext_napot = 0;
+    int off = 0;
+
+    if (!fdt || fdt_check_header(fdt) < 0)
+        return;
+
+    while ((off = fdt_next_token(fdt, off, &tok)) >= 0 && tok.type != FDT_END) {
+        if (tok.type != FDT_PROP)
+            continue;
+        s = (const char *)tok.data;
+        if (!strcmp(tok.name, "riscv,isa")) {
+            isa++;
+            isa_napot += isa_has_ext(s, tok.len, "svnapot");
+        } else if (!strcmp(tok.name, "riscv,isa-extensions")) {
+            ext++;
+            for (n = 0; n < tok.len; n += strlen(&s[n]) + 1) {
+                if (!strcmp(&s[n], "svnapot")) {
+                    ext_napot++;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (ext)
+        svnapot_enabled = (ext_napot == ext);
+    else
+        svnapot_enabled = (isa && isa_napot == isa);
+
+    early_puts(svnapot_enabled ? "[MMU] Svnapot: 64KB ranges\n" :
+                                 "[MMU] Svnapot not available\n");
+}
+
+int has_svnapot(void)
+{
+    return svnapot_enabled;
+}
+
+void napot_stats(void)
+{
+    early_puts("\n=== NAPOT Mappings ===\n");
+    if (!svnapot_enabled) {
+        early_puts("Svnapot not available\n");
+        return;
+    }
+    early_puts("64KB ranges mapped=");
+    early_puthex(nr_napot_maps);
+    early_puts(" pages=");
+    early_puthex(nr_napot_maps * NAPOT_PAGES);
+    early_puts("\n");
 }
 
 /* Initialize kernel page tables */
 int pgtable_init(void)
 {
-    unsigned long i;
+    unsigned long i, base, end, va;
+    int n;
 
     early_puts("[MMU] Initializing SV39 page tables...\n");
 
@@ -424,6 +768,44 @@ int pgtable_init(void)
         return -1;
     }
 
+    /* Identity map the rest of RAM the page allocator hands out, a
+     * gigapage at a time
+     */
+    for (n = 0; memblock_memory_region(n, &base, &end) == 0; n++) {
+        for (va = base & ~((1UL << PGDIR_SHIFT) - 1); va < end;
+             va += 1UL << PGDIR_SHIFT) {
+            if (kernel_pgd[pgd_index(va)] & PTE_V)
+                continue;
+            early_puts("[MMU] Mapping RAM: ");
+            early_puthex(va);
+            early_puts("\n");
+            map_page_1g(kernel_pgd, va, va, PTE_KERNEL);
+        }
+    }
+
+    /* Direct map of all RAM in the high half: gigapages where a bank
+     * covers whole aligned gigabytes, megapages and pages at its edges
+     */
+    for (n = 0; memblock_memory_region(n, &base, &end) == 0; n++) {
+        early_puts("[MMU] Direct map: ");
+        early_puthex(phys_to_virt(base));
+        early_puts(" -> ");
+        early_puthex(base);
+        early_puts("\n");
+        if (map_region_large(kernel_pgd, phys_to_virt(base), base, end - base,
+                             PTE_KERNEL) < 0) {
+            early_puts("[MMU] ERROR: Failed to build direct map\n");
+            return -1;
+        }
+    }
+
+    /* Trap trampoline: the one piece of kernel text process page tables map */
+    if (map_page_4k(kernel_pgd, TRAMPOLINE_VA, (unsigned long)trampoline,
+                    PTE_KERNEL_EXEC) < 0) {
+        early_puts("[MMU] ERROR: Failed to map trampoline\n");
+        return -1;
+    }
+
     /* Compute SATP value */
     kernel_satp = SATP_SV39_MODE | (virt_to_phys((unsigned long)kernel_pgd) >> PAGE_SHIFT);
 
@@ -466,12 +848,89 @@ void enable_mmu(void)
     early_puts("[MMU] MMU enabled successfully\n");
 }
 
+/* Switch a secondary hart onto the kernel page table */
+void enable_mmu_secondary(void)
+{
+    asm volatile ("csrw satp, %0" :: "r"(kernel_satp));
+    asm volatile ("sfence.vma" ::: "memory");
+}
+
 /* Get kernel page directory */
 pgd_t *get_kernel_pgd(void)
 {
     return kernel_pgd;
 }
 
+/* Give every top-level slot of [start, end) in the kernel table a table
+ * of its own now. Process tables copy the kernel's top level when they
+ * are made, so mappings added below these slots later are seen by all.
+ */
+int pgtable_prealloc_kernel(unsigned long start, unsigned long end)
+{
+    unsigned long va, phys;
+
+    for (va = start & ~((1UL << PGDIR_SHIFT) - 1); va < end;
+         va += 1UL << PGDIR_SHIFT) {
+        if (pte_valid(kernel_pgd[pgd_index(va)]))
+            continue;
+        phys = pgtable_alloc();
+        if (!phys)
+            return -1;
+        kernel_pgd[pgd_index(va)] = phys_to_pte(phys, PTE_V);
+    }
+
+    return 0;
+}
+
+/* Allocate a process root page table.
+ * The kernel's high-half top-level entries (direct map, vmalloc,
+ * trampoline) are copied; the low half is left to user space.
+ */
+pgd_t *pgd_alloc(void)
+{
+    pgd_t *pgd;
+    unsigned long i;
+
+    pgd = (pgd_t *)pgtable_alloc();
+    if (!pgd)
+        return NULL;
+
+    for (i = PTRS_PER_PGD / 2; i < PTRS_PER_PGD; i++) {
+        pgd[i] = kernel_pgd[i];
+    }
+
+    return pgd;
+}
+
+/* Free a process page table.
+ * Only intermediate tables owned by the process are released; entries
+ * shared with kernel_pgd are left alone. Leaf pages must already have
+ * been dropped (see zap_page_range()).
+ */
+void pgd_free(pgd_t *pgd)
+{
+    pmd_t *pmd_table;
+    unsigned long i, j;
+
+    if (!pgd || pgd == kernel_pgd)
+        return;
+
+    /* The high half is the kernel's, shared (see pgd_alloc) */
+    for (i = 0; i < PTRS_PER_PGD / 2; i++) {
+        if (!pte_valid(pgd[i]) || pte_leaf(pgd[i]))
+            continue;
+
+        pmd_table = (pmd_t *)pte_to_phys(pgd[i]);
+        for (j = 0; j < PTRS_PER_PMD; j++) {
+            if (pte_valid(pmd_table[j]) && !pte_leaf(pmd_table[j]))
+                pgtable_free(pte_to_phys(pmd_table[j]));
+        }
+        pgtable_free((unsigned long)pmd_table);
+    }
+
+    pgtable_free((unsigned long)pgd);
+}
+
 /* Debug: dump page table entry */
 void dump_pte(unsigned long va)
 {
@@ -1,6 +1,33 @@
-/* Slab allocator for kernel objects */
+/* Slab allocator for kernel objects
+ *
+ * Each hart keeps two magazines of free objects per cache (Bonwick's
+ * loaded and previous). Allocation and free pop or push the loaded
+ * magazine with interrupts off and touch no shared state; when both
+ * magazines are empty (or full) a batch of objects moves between them
+ * and the cache's slab lists under the cache lock.
+ *
+ * A slab is a buddy block of 2^order pages, the order picked per cache
+ * to waste little of it. Caches of large objects keep the slab header
+ * off the slab, in a small cache of its own, so a 4KB object fills a
+ * page exactly. Pages record their slab, so any object address leads
+ * back to it. kmalloc sizes beyond the largest class come straight
+ * from the buddy allocator, whose block order kfree reads back.
+ *
+ * Space a slab cannot fill with objects shifts where its objects
+ * start, by a cache line more for each new slab (its colour), so the
+ * same field of objects in different slabs falls in different cache
+ * sets. Caches may have a constructor, run once when a slab is made,
+ * and a destructor, run when it is freed: objects are handed out in
+ * their constructed state and must be freed in it.
+ *
+ * A few slabs that become empty stay on the cache for reuse; a
+ * shrinker hands them back to the buddy allocator under pressure.
+ */
 
 #include <minix/config.h>
+#include <minix/smp.h>
+#include <minix/mm.h>
+#include <asm/spinlock.h>
 #include <types.h>
 
 #ifndef NULL
@@ -11,8 +38,11 @@
 #define PAGE_MASK          (~(PAGE_SIZE - 1))
 
 /* External functions */
-extern unsigned long alloc_page(void);
-extern void free_page(unsigned long addr);
+extern unsigned long alloc_pages(int order);
+extern void free_pages(unsigned long addr, int order);
+extern int page_order(unsigned long addr);
+extern void set_page_slab(unsigned long addr, int order, void *slab);
+extern void *page_slab(unsigned long addr);
 extern void early_puts(const char *s);
 extern void early_puthex(unsigned long val);
 
@@ -27,16 +57,51 @@ extern void early_puthex(unsigned long val);
 /* Minimum object size (must hold a pointer for free list) */
 #define MIN_OBJ_SIZE    sizeof(void *)
 
-/* Slab structure - placed at the beginning of each slab page */
+/* Objects per magazine; a cache uses fewer if a slab holds fewer */
+#define MAG_MAX_ROUNDS  32
+
+/* Largest slab: 2^3 = 8 pages */
+#define SLAB_MAX_ORDER  3
+
+/* Objects at least this big keep their slab header off the slab */
+#define OFF_SLAB_MIN    (PAGE_SIZE / 8)
+
+/* Empty slabs a cache keeps before freeing them straight away */
+#define SLAB_EMPTY_MAX  4
+
+/* Largest buddy order kmalloc asks for (matches the buddy MAX_ORDER) */
+#define KMALLOC_MAX_ORDER 11
+
+/* Slab structure - at the start of the slab, or off-slab */
 struct slab {
     struct slab *next;              /* Next slab in list */
     struct slab *prev;              /* Previous slab in list */
     struct slab_cache *cache;       /* Parent cache */
+    unsigned long base;             /* First page of the slab */
+    unsigned long s_mem;            /* First object, after header and colour */
     void *free_list;                /* Free object list */
     unsigned int inuse;             /* Number of objects in use */
     unsigned int total;             /* Total objects in this slab */
 };
 
+/* A stack of free objects */
+struct magazine {
+    unsigned int rounds;            /* Objects held */
+    void *objs[MAG_MAX_ROUNDS];
+};
+
+/* Per-hart magazine pair, only touched by its hart with interrupts off */
+struct kmem_cpu_cache {
+    struct magazine *loaded;        /* Allocations pop, frees push */
+    struct magazine *previous;      /* Full or empty, swapped in when loaded runs out */
+    struct magazine mags[2];
+    unsigned long allocs;           /* Statistics: allocations on this hart */
+    unsigned long frees;            /* Statistics: frees on this hart */
+    unsigned long refills;          /* Batches taken from the slab lists */
+    unsigned long drains;           /* Batches returned to them */
+    unsigned long req_bytes;        /* Statistics: bytes kmalloc callers asked for */
+};
+
 /* Slab cache structure */
 struct slab_cache {
     const char *name;               /* Cache name for debugging */
@@ -44,11 +109,23 @@ struct slab_cache {
     unsigned long align;            /* Alignment requirement */
     unsigned int objs_per_slab;     /* Objects per slab */
     unsigned int slab_count;        /* Number of slabs */
+    unsigned int empty_count;       /* Slabs on slabs_empty */
+    int order;                      /* Pages per slab, as a buddy order */
+    int off_slab;                   /* Header lives in slab_header_cache */
+    unsigned long waste;            /* Bytes per slab not holding objects */
+    unsigned long free_offset;      /* Where a free object keeps its link */
+    unsigned int colour;            /* Number of colours the leftover allows */
+    unsigned int colour_off;        /* Bytes per colour */
+    unsigned int colour_next;       /* Colour of the next slab */
+    void (*ctor)(void *obj);        /* Constructor, or NULL */
+    void (*dtor)(void *obj);        /* Destructor, or NULL */
+    unsigned int mag_rounds;        /* Magazine capacity */
+    spinlock_t lock;                /* Protects the slab lists */
     struct slab *slabs_partial;     /* Partially used slabs */
     struct slab *slabs_full;        /* Fully used slabs */
-    struct slab *slabs_empty;       /* Empty slabs (for caching) */
-    unsigned long total_allocs;     /* Statistics: total allocations */
-    unsigned long total_frees;      /* Statistics: total frees */
+    struct slab *slabs_empty;       /* Empty slabs, until reclaimed */
+    unsigned long reclaimed;        /* Statistics: empty slabs shrunk */
+    struct kmem_cpu_cache cpu[SMP_CPUS];
 };
 
 /* Global slab caches for kmalloc */
@@ -57,6 +134,13 @@ static struct slab_cache all_caches[MAX_SLAB_CACHES];
 static int num_caches = 0;
 static int slab_initialized = 0;
 
+/* Off-slab headers; its own headers are always on-slab */
+static struct slab_cache *slab_header_cache = NULL;
+
+/* Buddy-backed kmalloc beyond the largest class */
+static unsigned long kmalloc_large_allocs = 0;
+static unsigned long kmalloc_large_pages = 0;
+
 /* Simple string copy (for future use) */
 static void strcpy_safe(char *dst, const char *src, int max) __attribute__((unused));
 static void strcpy_safe(char *dst, const char *src, int max)
@@ -68,7 +152,13 @@ static void strcpy_safe(char *dst, const char *src, int max)
     dst[i] = '\0';
 }
 
-/* Initialize a slab with free objects */
+/* Free-list link of a free object */
+static inline void **obj_link(struct slab_cache *cache, void *obj)
+{
+    return (void **)((unsigned long)obj + cache->free_offset);
+}
+
+/* Initialize a slab with free objects; cache locked */
 static void slab_init_objs(struct slab *slab, struct slab_cache *cache)
 {
     unsigned long base;
@@ -76,16 +166,27 @@ static void slab_init_objs(struct slab *slab, struct slab_cache *cache)
     void **prev_ptr;
     unsigned int i;
 
-    /* Objects start after the slab header, aligned */
-    base = (unsigned long)slab + sizeof(struct slab);
-    base = (base + cache->align - 1) & ~(cache->align - 1);
+    /* Objects start after an on-slab header, aligned, then coloured */
+    base = slab->base;
+    if (!cache->off_slab) {
+        base += sizeof(struct slab);
+        base = (base + cache->align - 1) & ~(cache->align - 1);
+    }
+    base += cache->colour_next * cache->colour_off;
+    if (++cache->colour_next >= cache->colour) {
+        cache->colour_next = 0;
+    }
+    slab->s_mem = base;
 
-    /* Build free list - each free object contains pointer to next */
+    /* Build free list - each free object links to the next */
     prev_ptr = &slab->free_list;
     for (i = 0; i < cache->objs_per_slab; i++) {
         obj_addr = base + i * cache->obj_size;
+        if (cache->ctor) {
+            cache->ctor((void *)obj_addr);
+        }
         *prev_ptr = (void *)obj_addr;
-        prev_ptr = (void **)obj_addr;
+        prev_ptr = obj_link(cache, (void *)obj_addr);
     }
     *prev_ptr = NULL;  /* End of list */
 
@@ -93,37 +194,66 @@ static void slab_init_objs(struct slab *slab, struct slab_cache *cache)
     slab->total = cache->objs_per_slab;
 }
 
-/* Allocate a new slab */
+void *kmem_cache_alloc(struct slab_cache *cache);
+void kmem_cache_free(struct slab_cache *cache, void *obj);
+
+/* Allocate a new slab; cache locked */
 static struct slab *slab_alloc(struct slab_cache *cache)
 {
     struct slab *slab;
     unsigned long page;
 
-    /* Allocate a page for the slab */
-    page = alloc_page();
+    /* Allocate the slab's pages */
+    page = alloc_pages(cache->order);
     if (page == 0) {
         return NULL;
     }
 
-    /* Initialize slab header */
-    slab = (struct slab *)page;
+    /* Initialize slab header; the header cache is on-slab, so this
+     * never nests deeper than one level
+     */
+    if (cache->off_slab) {
+        slab = (struct slab *)kmem_cache_alloc(slab_header_cache);
+        if (!slab) {
+            free_pages(page, cache->order);
+            return NULL;
+        }
+    } else {
+        slab = (struct slab *)page;
+    }
     slab->next = NULL;
     slab->prev = NULL;
     slab->cache = cache;
+    slab->base = page;
 
     /* Initialize objects */
     slab_init_objs(slab, cache);
+    set_page_slab(page, cache->order, slab);
 
     cache->slab_count++;
 
     return slab;
 }
 
-/* Free a slab */
+/* Free a slab; cache locked */
 static void slab_free(struct slab *slab)
 {
-    slab->cache->slab_count--;
-    free_page((unsigned long)slab);
+    struct slab_cache *cache = slab->cache;
+    unsigned long page = slab->base;
+    unsigned int i;
+
+    if (cache->dtor) {
+        for (i = 0; i < slab->total; i++) {
+            cache->dtor((void *)(slab->s_mem + i * cache->obj_size));
+        }
+    }
+
+    cache->slab_count--;
+    set_page_slab(page, cache->order, NULL);
+    if (cache->off_slab) {
+        kmem_cache_free(slab_header_cache, slab);
+    }
+    free_pages(page, cache->order);
 }
 
 /* Add slab to a list */
@@ -152,12 +282,61 @@ static void slab_list_remove(struct slab **list, struct slab *slab)
     slab->prev = NULL;
 }
 
-/* Create a new slab cache */
-struct slab_cache *kmem_cache_create(const char *name, unsigned long size)
+/* Pick the slab order: the smallest that wastes at most 1/8 of the
+ * slab, else the one wasting the least proportionally
+ */
+static int cache_estimate(struct slab_cache *cache)
+{
+    unsigned long hdr = 0, bytes, objs, waste;
+    unsigned long best_bytes = 0, best_waste = 0, best_objs = 0;
+    int order, best_order = -1;
+
+    if (!cache->off_slab) {
+        hdr = (sizeof(struct slab) + cache->align - 1) & ~(cache->align - 1);
+    }
+
+    for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+        bytes = (unsigned long)PAGE_SIZE << order;
+        if (bytes < hdr + cache->obj_size) {
+            continue;
+        }
+        objs = (bytes - hdr) / cache->obj_size;
+        waste = bytes - objs * cache->obj_size;
+
+        if (best_order < 0 || waste * best_bytes < best_waste * bytes) {
+            best_order = order;
+            best_bytes = bytes;
+            best_waste = waste;
+            best_objs = objs;
+        }
+        if (waste * 8 <= bytes) {
+            break;
+        }
+    }
+
+    if (best_order < 0) {
+        return -1;
+    }
+
+    cache->order = best_order;
+    cache->objs_per_slab = best_objs;
+    cache->waste = best_waste;
+
+    /* Colours: whole cache lines of what the header leaves unused */
+    cache->colour_off = L1_CACHE_BYTES;
+    cache->colour = (best_waste - hdr) / cache->colour_off + 1;
+    cache->colour_next = 0;
+    return 0;
+}
+
+/* Create a new slab cache; ctor and dtor may be NULL */
+struct slab_cache *kmem_cache_create(const char *name, unsigned long size,
+                                     void (*ctor)(void *obj),
+                                     void (*dtor)(void *obj))
 {
     struct slab_cache *cache;
     unsigned long obj_size;
-    unsigned long usable_space;
+    int cpu;
 
     if (num_caches >= MAX_SLAB_CACHES) {
         return NULL;
@@ -174,35 +353,189 @@ struct slab_cache *kmem_cache_create(const char *name, unsigned long size)
     /* Align to 8 bytes */
     obj_size = (obj_size + 7) & ~7UL;
 
+    /* A constructed object must not be overwritten by the free-list
+     * link, so it goes in a word of its own after the object
+     */
+    cache->free_offset = 0;
+    if (ctor) {
+        cache->free_offset = obj_size;
+        obj_size += sizeof(void *);
+    }
+
     /* Initialize cache */
     cache->name = name;
     cache->obj_size = obj_size;
     cache->align = 8;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->off_slab = (obj_size >= OFF_SLAB_MIN && slab_header_cache != NULL);
 
-    /* Calculate objects per slab */
-    usable_space = PAGE_SIZE - sizeof(struct slab);
-    usable_space = usable_space & ~(cache->align - 1);  /* Align */
-    cache->objs_per_slab = usable_space / obj_size;
-
-    if (cache->objs_per_slab == 0) {
+    if (cache_estimate(cache) < 0) {
         num_caches--;
         return NULL;  /* Object too large for slab */
     }
 
     cache->slab_count = 0;
+    cache->empty_count = 0;
+    cache->reclaimed = 0;
     cache->slabs_partial = NULL;
     cache->slabs_full = NULL;
     cache->slabs_empty = NULL;
-    cache->total_allocs = 0;
-    cache->total_frees = 0;
+    spin_lock_init(&cache->lock);
+
+    cache->mag_rounds = cache->objs_per_slab;
+    if (cache->mag_rounds > MAG_MAX_ROUNDS) {
+        cache->mag_rounds = MAG_MAX_ROUNDS;
+    }
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        struct kmem_cpu_cache *cc = &cache->cpu[cpu];
+
+        cc->mags[0].rounds = 0;
+        cc->mags[1].rounds = 0;
+        cc->loaded = &cc->mags[0];
+        cc->previous = &cc->mags[1];
+        cc->allocs = 0;
+        cc->frees = 0;
+        cc->refills = 0;
+        cc->drains = 0;
+        cc->req_bytes = 0;
+    }
 
     return cache;
 }
 
-/* Destroy a slab cache */
+/* Take one object off the slab lists; cache locked */
+static void *slab_get_obj(struct slab_cache *cache)
+{
+    struct slab *slab;
+    void *obj;
+
+    /* Try to find a slab with free objects */
+    slab = cache->slabs_partial;
+
+    if (!slab) {
+        /* Try empty slabs first */
+        if (cache->slabs_empty) {
+            slab = cache->slabs_empty;
+            slab_list_remove(&cache->slabs_empty, slab);
+            cache->empty_count--;
+            slab_list_add(&cache->slabs_partial, slab);
+        } else {
+            /* Allocate new slab */
+            slab = slab_alloc(cache);
+            if (!slab) {
+                return NULL;
+            }
+            slab_list_add(&cache->slabs_partial, slab);
+        }
+    }
+
+    /* Get object from free list */
+    obj = slab->free_list;
+    slab->free_list = *obj_link(cache, obj);
+    slab->inuse++;
+
+    /* Move slab to full list if needed */
+    if (slab->inuse == slab->total) {
+        slab_list_remove(&cache->slabs_partial, slab);
+        slab_list_add(&cache->slabs_full, slab);
+    }
+
+    return obj;
+}
+
+/* Put one object back on its slab; cache locked */
+static void slab_put_obj(struct slab_cache *cache, void *obj)
+{
+    struct slab *slab = (struct slab *)page_slab((unsigned long)obj);
+    int was_full = (slab->inuse == slab->total);
+
+    /* Add object back to free list */
+    *obj_link(cache, obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+
+    /* Move slab between lists as needed */
+    if (was_full) {
+        slab_list_remove(&cache->slabs_full, slab);
+        slab_list_add(&cache->slabs_partial, slab);
+    } else if (slab->inuse == 0) {
+        slab_list_remove(&cache->slabs_partial, slab);
+        /* Keep a few empty slabs for reuse, free the rest */
+        if (cache->empty_count < SLAB_EMPTY_MAX) {
+            slab_list_add(&cache->slabs_empty, slab);
+            cache->empty_count++;
+        } else {
+            slab_free(slab);
+        }
+    }
+}
+
+/* Fill a magazine from the slab lists; returns the objects added */
+static unsigned int magazine_refill(struct slab_cache *cache, struct magazine *mag)
+{
+    unsigned int added = 0;
+    void *obj;
+
+    spin_lock(&cache->lock);
+    while (mag->rounds < cache->mag_rounds) {
+        obj = slab_get_obj(cache);
+        if (!obj) {
+            break;
+        }
+        mag->objs[mag->rounds++] = obj;
+        added++;
+    }
+    spin_unlock(&cache->lock);
+
+    return added;
+}
+
+/* Empty a magazine back to the slab lists */
+static void magazine_drain(struct slab_cache *cache, struct magazine *mag)
+{
+    spin_lock(&cache->lock);
+    while (mag->rounds > 0) {
+        slab_put_obj(cache, mag->objs[--mag->rounds]);
+    }
+    spin_unlock(&cache->lock);
+}
+
+static inline void magazine_swap(struct kmem_cpu_cache *cc)
+{
+    struct magazine *tmp = cc->loaded;
+
+    cc->loaded = cc->previous;
+    cc->previous = tmp;
+}
+
+/* Return this hart's cached objects of a cache to its slab lists */
+void kmem_cache_drain_local(struct slab_cache *cache)
+{
+    unsigned long flags = local_irq_save();
+    struct kmem_cpu_cache *cc = &cache->cpu[smp_processor_id()];
+
+    magazine_drain(cache, cc->loaded);
+    magazine_drain(cache, cc->previous);
+    local_irq_restore(flags);
+}
+
+/* Destroy a slab cache; the caller guarantees nobody still uses it */
 void kmem_cache_destroy(struct slab_cache *cache)
 {
     struct slab *slab, *next;
+    unsigned long flags;
+    int cpu;
+
+    flags = local_irq_save();
+
+    /* Objects cached on any hart go back to their slabs first */
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        magazine_drain(cache, &cache->cpu[cpu].mags[0]);
+        magazine_drain(cache, &cache->cpu[cpu].mags[1]);
+    }
+
+    spin_lock(&cache->lock);
 
     /* Free all slabs */
     for (slab = cache->slabs_partial; slab; slab = next) {
@@ -221,96 +554,225 @@ void kmem_cache_destroy(struct slab_cache *cache)
     cache->slabs_partial = NULL;
     cache->slabs_full = NULL;
     cache->slabs_empty = NULL;
+    cache->empty_count = 0;
+
+    spin_unlock(&cache->lock);
+    local_irq_restore(flags);
 }
 
-/* Allocate object from cache */
-void *kmem_cache_alloc(struct slab_cache *cache)
+/* ============================================
+ * Shrinker
+ * ============================================ */
+
+/* Empty slabs across all caches */
+static unsigned long slab_shrink_count(struct shrinker *s)
 {
-    struct slab *slab;
-    void *obj;
+    unsigned long nr = 0;
+    int i;
 
-    if (!cache) {
-        return NULL;
+    (void)s;
+    for (i = 0; i < num_caches; i++) {
+        nr += all_caches[i].empty_count;
     }
+    return nr;
+}
 
-    /* Try to find a slab with free objects */
-    slab = cache->slabs_partial;
+/* Free up to nr empty slabs. Objects cached on this hart go back first
+ * so their slabs can empty; other harts' magazines are theirs alone.
+ * The header cache comes last, after the slabs whose headers it gets.
+ */
+static unsigned long slab_shrink_scan(struct shrinker *s, unsigned long nr)
+{
+    struct slab_cache *cache;
+    struct slab *slab;
+    unsigned long flags, freed = 0;
+    int i;
 
-    if (!slab) {
-        /* Try empty slabs first */
-        if (cache->slabs_empty) {
+    (void)s;
+    for (i = num_caches - 1; i >= 0 && freed < nr; i--) {
+        cache = &all_caches[i];
+        kmem_cache_drain_local(cache);
+
+        spin_lock_irqsave(&cache->lock, flags);
+        while (freed < nr && cache->slabs_empty) {
             slab = cache->slabs_empty;
             slab_list_remove(&cache->slabs_empty, slab);
-            slab_list_add(&cache->slabs_partial, slab);
-        } else {
-            /* Allocate new slab */
-            slab = slab_alloc(cache);
-            if (!slab) {
-                return NULL;
-            }
-            slab_list_add(&cache->slabs_partial, slab);
+            cache->empty_count--;
+            cache->reclaimed++;
+            slab_free(slab);
+            freed++;
         }
+        spin_unlock_irqrestore(&cache->lock, flags);
     }
+    return freed;
+}
 
-    /* Get object from free list */
-    obj = slab->free_list;
-    slab->free_list = *(void **)obj;
-    slab->inuse++;
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .count_objects = slab_shrink_count,
+    .scan_objects = slab_shrink_scan,
+    .seeks = 1,                     /* Empty: nothing to rebuild */
+};
 
-    /* Move slab to full list if needed */
-    if (slab->inuse == slab->total) {
-        slab_list_remove(&cache->slabs_partial, slab);
-        slab_list_add(&cache->slabs_full, slab);
+/* Allocate object from cache, for a caller that needs size bytes */
+static void *__kmem_cache_alloc(struct slab_cache *cache, unsigned long size)
+{
+    struct kmem_cpu_cache *cc;
+    unsigned long flags;
+    void *obj = NULL;
+
+    flags = local_irq_save();
+    cc = &cache->cpu[smp_processor_id()];
+
+    /* Loaded empty: the previous magazine is full or empty too */
+    if (cc->loaded->rounds == 0) {
+        if (cc->previous->rounds > 0) {
+            magazine_swap(cc);
+        } else if (magazine_refill(cache, cc->loaded) > 0) {
+            cc->refills++;
+        }
     }
 
-    cache->total_allocs++;
+    if (cc->loaded->rounds > 0) {
+        obj = cc->loaded->objs[--cc->loaded->rounds];
+        cc->allocs++;
+        cc->req_bytes += size;
+    }
 
+    local_irq_restore(flags);
     return obj;
 }
 
+/* Allocate object from cache */
+void *kmem_cache_alloc(struct slab_cache *cache)
+{
+    if (!cache) {
+        return NULL;
+    }
+
+    return __kmem_cache_alloc(cache, cache->obj_size);
+}
+
 /* Free object to cache */
 void kmem_cache_free(struct slab_cache *cache, void *obj)
 {
+    struct kmem_cpu_cache *cc;
     struct slab *slab;
-    unsigned long page;
-    int was_full;
+    unsigned long flags;
 
     if (!cache || !obj) {
         return;
     }
 
-    /* Find which slab this object belongs to */
-    page = (unsigned long)obj & PAGE_MASK;
-    slab = (struct slab *)page;
-
     /* Verify it belongs to this cache */
-    if (slab->cache != cache) {
+    slab = (struct slab *)page_slab((unsigned long)obj);
+    if (!slab || slab->cache != cache) {
         early_puts("[SLAB] ERROR: kmem_cache_free wrong cache!\n");
         return;
     }
 
-    was_full = (slab->inuse == slab->total);
+    flags = local_irq_save();
+    cc = &cache->cpu[smp_processor_id()];
 
-    /* Add object back to free list */
-    *(void **)obj = slab->free_list;
-    slab->free_list = obj;
-    slab->inuse--;
+    /* Loaded full: swap in previous if it has room, else empty it.
+     * Either way a full magazine of frees stays cached on this hart.
+     */
+    if (cc->loaded->rounds == cache->mag_rounds) {
+        if (cc->previous->rounds > 0) {
+            magazine_drain(cache, cc->previous);
+            cc->drains++;
+        }
+        magazine_swap(cc);
+    }
 
-    /* Move slab between lists as needed */
-    if (was_full) {
-        slab_list_remove(&cache->slabs_full, slab);
-        slab_list_add(&cache->slabs_partial, slab);
-    } else if (slab->inuse == 0) {
-        slab_list_remove(&cache->slabs_partial, slab);
-        /* Keep one empty slab for caching, free the rest */
-        if (cache->slabs_empty == NULL) {
-            slab_list_add(&cache->slabs_empty, slab);
-        } else {
-            slab_free(slab);
+    cc->loaded->objs[cc->loaded->rounds++] = obj;
+    cc->frees++;
+
+    local_irq_restore(flags);
+}
+
+/* Allocate nr objects into p; all or nothing. Returns nr, or 0 */
+int kmem_cache_alloc_bulk(struct slab_cache *cache, unsigned long nr, void **p)
+{
+    struct kmem_cpu_cache *cc;
+    unsigned long flags;
+    unsigned long i = 0;
+
+    if (!cache || nr == 0) {
+        return 0;
+    }
+
+    flags = local_irq_save();
+    cc = &cache->cpu[smp_processor_id()];
+
+    /* Whatever this hart has cached first, then the slab lists in one go */
+    while (i < nr && cc->loaded->rounds > 0) {
+        p[i++] = cc->loaded->objs[--cc->loaded->rounds];
+    }
+    while (i < nr && cc->previous->rounds > 0) {
+        p[i++] = cc->previous->objs[--cc->previous->rounds];
+    }
+
+    if (i < nr) {
+        spin_lock(&cache->lock);
+        while (i < nr) {
+            p[i] = slab_get_obj(cache);
+            if (!p[i]) {
+                break;
+            }
+            i++;
+        }
+        spin_unlock(&cache->lock);
+        cc->refills++;
+    }
+
+    if (i < nr) {
+        /* Out of memory: give back what we got */
+        spin_lock(&cache->lock);
+        while (i > 0) {
+            slab_put_obj(cache, p[--i]);
+        }
+        spin_unlock(&cache->lock);
+        local_irq_restore(flags);
+        return 0;
+    }
+
+    cc->allocs += nr;
+    cc->req_bytes += nr * cache->obj_size;
+    local_irq_restore(flags);
+    return (int)nr;
+}
+
+/* Free nr objects from p */
+void kmem_cache_free_bulk(struct slab_cache *cache, unsigned long nr, void **p)
+{
+    struct kmem_cpu_cache *cc;
+    unsigned long flags;
+    unsigned long i = 0;
+
+    if (!cache) {
+        return;
+    }
+
+    flags = local_irq_save();
+    cc = &cache->cpu[smp_processor_id()];
+
+    /* Top up the loaded magazine, the rest goes straight to the slabs */
+    while (i < nr && cc->loaded->rounds < cache->mag_rounds) {
+        cc->loaded->objs[cc->loaded->rounds++] = p[i++];
+    }
+
+    if (i < nr) {
+        spin_lock(&cache->lock);
+        while (i < nr) {
+            slab_put_obj(cache, p[i++]);
         }
+        spin_unlock(&cache->lock);
+        cc->drains++;
     }
 
-    cache->total_frees++;
+    cc->frees += nr;
+    local_irq_restore(flags);
 }
 
 /* Get cache index for size */
@@ -327,6 +789,28 @@ static int kmalloc_index(unsigned long size)
     return -1;  /* Too large */
 }
 
+/* Multi-page kmalloc straight from the buddy allocator; the block's
+ * order stays in its head page for kfree
+ */
+static void *kmalloc_large(unsigned long size)
+{
+    unsigned long addr;
+    int order = 0;
+
+    while (((unsigned long)PAGE_SIZE << order) < size) {
+        if (++order > KMALLOC_MAX_ORDER) {
+            return NULL;
+        }
+    }
+
+    addr = alloc_pages(order);
+    if (addr) {
+        __sync_fetch_and_add(&kmalloc_large_allocs, 1);
+        __sync_fetch_and_add(&kmalloc_large_pages, 1UL << order);
+    }
+    return (void *)addr;
+}
+
 /* Simple kmalloc implementation */
 void *kmalloc(unsigned long size)
 {
@@ -337,23 +821,14 @@ void *kmalloc(unsigned long size)
         return NULL;
     }
 
+    /* Whole pages until the caches exist */
     if (!slab_initialized) {
-        /* Fallback: allocate full page before slab is initialized */
-        if (size <= PAGE_SIZE) {
-            return (void *)alloc_page();
-        }
-        return NULL;
+        return kmalloc_large(size);
     }
 
     index = kmalloc_index(size);
     if (index < 0) {
-        /* Too large for slab, allocate pages directly */
-        unsigned long pages_needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-        if (pages_needed == 1) {
-            return (void *)alloc_page();
-        }
-        /* TODO: Use buddy allocator for multi-page allocations */
-        return NULL;
+        return kmalloc_large(size);
     }
 
     cache = kmalloc_caches[index];
@@ -361,63 +836,111 @@ void *kmalloc(unsigned long size)
         return NULL;
     }
 
-    return kmem_cache_alloc(cache);
+    return __kmem_cache_alloc(cache, size);
 }
 
-/* Free memory - determines cache from object address */
+/* Free memory - the page says whether it is a slab object or a block */
 void kfree(void *ptr)
 {
     struct slab *slab;
     unsigned long page;
+    int order;
 
     if (!ptr) {
         return;
     }
 
-    if (!slab_initialized) {
-        /* Before slab init, just free the page */
-        free_page((unsigned long)ptr & PAGE_MASK);
+    slab = (struct slab *)page_slab((unsigned long)ptr);
+    if (slab) {
+        kmem_cache_free(slab->cache, ptr);
         return;
     }
 
-    /* Find the slab header */
     page = (unsigned long)ptr & PAGE_MASK;
-    slab = (struct slab *)page;
-
-    /* Check if this is a slab-allocated object */
-    if (slab->cache && slab->cache >= &all_caches[0] &&
-        slab->cache < &all_caches[MAX_SLAB_CACHES]) {
-        kmem_cache_free(slab->cache, ptr);
-    } else {
-        /* Not a slab allocation, free the page directly */
-        free_page(page);
+    order = page_order(page);
+    if (order < 0) {
+        early_puts("[SLAB] ERROR: kfree of unknown pointer ");
+        early_puthex((unsigned long)ptr);
+        early_puts("\n");
+        return;
     }
+
+    __sync_fetch_and_sub(&kmalloc_large_allocs, 1);
+    __sync_fetch_and_sub(&kmalloc_large_pages, 1UL << order);
+    free_pages(page, order);
 }
 
 /* Debug: print slab cache statistics */
 void kmalloc_stats(void)
 {
-    int i;
+    int i, cpu;
     struct slab_cache *cache;
+    unsigned long allocs, frees, refills, drains, cached, req_bytes;
 
     early_puts("\n=== Slab Allocator Statistics ===\n");
 
-    for (i = 0; i < 8; i++) {
-        cache = kmalloc_caches[i];
-        if (cache) {
-            early_puts("Cache: ");
-            early_puts(cache->name);
-            early_puts("  size=");
-            early_puthex(cache->obj_size);
-            early_puts("  slabs=");
-            early_puthex(cache->slab_count);
-            early_puts("  allocs=");
-            early_puthex(cache->total_allocs);
-            early_puts("  frees=");
-            early_puthex(cache->total_frees);
-            early_puts("\n");
+    for (i = 0; i < num_caches; i++) {
+        cache = &all_caches[i];
+
+        allocs = frees = refills = drains = cached = req_bytes = 0;
+        for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+            struct kmem_cpu_cache *cc = &cache->cpu[cpu];
+
+            allocs += cc->allocs;
+            frees += cc->frees;
+            refills += cc->refills;
+            drains += cc->drains;
+            cached += cc->loaded->rounds + cc->previous->rounds;
+            req_bytes += cc->req_bytes;
         }
+
+        early_puts("Cache: ");
+        early_puts(cache->name);
+        early_puts("  size=");
+        early_puthex(cache->obj_size);
+        early_puts("  slabs=");
+        early_puthex(cache->slab_count);
+        early_puts("  allocs=");
+        early_puthex(allocs);
+        early_puts("  frees=");
+        early_puthex(frees);
+        early_puts("\n  magazine=");
+        early_puthex(cache->mag_rounds);
+        early_puts("  cached=");
+        early_puthex(cached);
+        early_puts("  refills=");
+        early_puthex(refills);
+        early_puts("  drains=");
+        early_puthex(drains);
+        early_puts("  empty=");
+        early_puthex(cache->empty_count);
+        early_puts("  reclaimed=");
+        early_puthex(cache->reclaimed);
+
+        /* Internal fragmentation: slab bytes holding no object, and the
+         * average bytes per object callers did not ask for
+         */
+        early_puts("\n  order=");
+        early_puthex(cache->order);
+        early_puts(cache->off_slab ? " (off-slab)" : "");
+        early_puts("  objs/slab=");
+        early_puthex(cache->objs_per_slab);
+        early_puts("  waste/slab=");
+        early_puthex(cache->waste);
+        early_puts("  waste=");
+        early_puthex(cache->waste * cache->slab_count);
+        early_puts("  colours=");
+        early_puthex(cache->colour);
+        early_puts("  slack/obj=");
+        early_puthex(allocs ? cache->obj_size - req_bytes / allocs : 0);
+        early_puts("\n");
     }
+
+    early_puts("Large kmalloc: blocks=");
+    early_puthex(kmalloc_large_allocs);
+    early_puts("  pages=");
+    early_puthex(kmalloc_large_pages);
+    early_puts("\n");
 }
 
 /* Debug: dump slab cache info */
@@ -522,9 +1045,13 @@ void kmem_init(void)
 
     early_puts("[SLAB] Initializing slab allocator...\n");
 
+    /* First, so that later caches of large objects can go off-slab */
+    slab_header_cache = kmem_cache_create("slab-header", sizeof(struct slab),
+                                          NULL, NULL);
+
     /* Create kmalloc caches */
     for (i = 0; i < 8; i++) {
-        kmalloc_caches[i] = kmem_cache_create(names[i], sizes[i]);
+        kmalloc_caches[i] = kmem_cache_create(names[i], sizes[i], NULL, NULL);
         if (!kmalloc_caches[i]) {
             early_puts("[SLAB] ERROR: Failed to create cache ");
             early_puts(names[i]);
@@ -533,6 +1060,7 @@ void kmem_init(void)
     }
 
     slab_initialized = 1;
+    register_shrinker(&slab_shrinker);
 
     early_puts("[SLAB] Slab allocator initialized\n");
 }
@@ -1,37 +1,74 @@
-/* vmalloc - Kernel virtual memory allocator */
+/* vmalloc - Kernel virtual memory allocator
+ *
+ * Areas are carved out of [VMALLOC_START, VMALLOC_END), the slot the
+ * kernel layout sets aside for them (see pgtable.c). Two balanced (AVL)
+ * trees keyed by address keep track of the space: one holds the areas
+ * in use, for lookup when they are freed, the other the free ranges
+ * between them. Every node also records the largest range in its
+ * subtree, so the lowest free range that fits a request is found in a
+ * single walk down the free tree. Allocation, free and lookup are all
+ * O(log n) in the number of areas.
+ *
+ * Freeing an area clears its page table entries but flushes no TLB:
+ * the range is queued instead, and is not handed out again until it
+ * has been flushed. Once LAZY_MAX_PAGES of such stale address space
+ * has built up (or an allocation finds no room), the whole queue is
+ * purged with one ranged flush on every hart and goes back to the
+ * free tree, so a driver mapping and unmapping a buffer per request
+ * does not pay a fence on each teardown.
+ *
+ * Areas of 2MB or more are 2MB aligned, and are mapped with 2MB leaves
+ * wherever the memory behind a whole 2MB chunk is contiguous: blocks
+ * of that size from the buddy allocator for vmalloc, and the device
+ * range itself for ioremap. Only the rest uses 4KB pages.
+ */
 
 #include <minix/config.h>
+#include <minix/mm.h>
+#include <minix/board.h>
+#include <asm/csr.h>
+#include <asm/spinlock.h>
 #include <types.h>
 
 #ifndef NULL
 #define NULL ((void *)0)
 #endif
 
-/* Page size definitions */
-#define PAGE_SIZE           4096
-#define PAGE_SHIFT          12
-#define PAGE_MASK           (~(PAGE_SIZE - 1))
-
-/* vmalloc region: for now we use a simple region after kernel memory
- * In a full implementation, this would be in high kernel virtual addresses
- * For identity-mapped kernel, we use physical addresses directly
+/* vmalloc region: the top-level slots reserved for it in the Sv39
+ * layout. Their page-middle tables are allocated at init so process
+ * page tables, which copy the kernel's top level, see every area.
  */
-#define VMALLOC_START       0x84000000UL    /* After kernel + 64MB */
-#define VMALLOC_END         0x88000000UL    /* 64MB vmalloc space */
+#define VMALLOC_START       0xFFFFFFE000000000UL
+#define VMALLOC_END         0xFFFFFFF000000000UL    /* 64GB vmalloc space */
 #define VMALLOC_SIZE        (VMALLOC_END - VMALLOC_START)
 
-/* Maximum vmalloc areas */
-#define MAX_VMALLOC_AREAS   64
+/* 2MB leaves (page-middle level) */
+#define PMD_SIZE            (1UL << 21)
+#define PAGES_PER_PMD       (PMD_SIZE >> PAGE_SHIFT)
+#define PMD_ORDER           9
+
+/* Stale address space allowed before a purge (32MB) */
+#define LAZY_MAX_PAGES      ((32UL << 20) >> PAGE_SHIFT)
+
+/* Node of either tree: an area in use or a free range [start, end) */
+struct vmap_node {
+    struct vmap_node *left;
+    struct vmap_node *right;
+    unsigned long start;
+    unsigned long end;
+    unsigned long subtree_max;  /* Largest end - start in this subtree */
+    int height;                 /* AVL height, 1 for a leaf */
+};
 
 /* VM area structure */
 struct vm_struct {
+    struct vmap_node node;      /* In the busy tree, or (left) purge list;
+                                   must stay first */
     void *addr;                 /* Virtual address */
     unsigned long size;         /* Size in bytes (including guard page) */
     unsigned long flags;        /* VM area flags */
     unsigned long nr_pages;     /* Number of pages */
     unsigned long *pages;       /* Array of physical page addresses */
-    struct vm_struct *next;     /* Next VM area */
-    int in_use;                 /* Is this structure in use? */
 };
 
 /* VM area flags */
@@ -40,48 +77,356 @@ struct vm_struct {
 #define VM_IOREMAP          (1UL << 2)      /* ioremap area */
 
 /* External functions */
-extern unsigned long alloc_page(void);
-extern unsigned long alloc_pages(int order);
-extern void free_page(unsigned long addr);
-extern void free_pages(unsigned long addr, int order);
-extern int map_page_4k(void *pgd, unsigned long va, unsigned long pa, unsigned long flags);
-extern void unmap_page_pte(void *pgd, unsigned long va);
-extern void *get_kernel_pgd(void);
+extern void *memset(void *s, int c, unsigned long n);
 extern void early_puts(const char *s);
 extern void early_puthex(unsigned long val);
 
-/* Page table entry flags for vmalloc */
-#define PTE_V               (1UL << 0)
-#define PTE_R               (1UL << 1)
-#define PTE_W               (1UL << 2)
-#define PTE_A               (1UL << 6)
-#define PTE_D               (1UL << 7)
-#define PTE_KERNEL_RW       (PTE_V | PTE_R | PTE_W | PTE_A | PTE_D)
-
-/* Static pool of VM structures */
-static struct vm_struct vm_areas[MAX_VMALLOC_AREAS];
-static struct vm_struct *vmlist = NULL;
-static unsigned long vmalloc_pos = VMALLOC_START;
+static struct vmap_node *busy_root = NULL;     /* Areas in use */
+static struct vmap_node *free_root = NULL;     /* Free ranges */
+static unsigned long nr_areas = 0;
+static unsigned long nr_free_ranges = 0;
+
+/* Freed areas waiting for a TLB flush, linked through node.left */
+static struct vmap_node *purge_list = NULL;
+static unsigned long lazy_pages = 0;
+
+/* Statistics */
+static unsigned long nr_purges = 0;
+static unsigned long nr_purged_areas = 0;
+static unsigned long nr_huge_maps = 0;      /* 2MB leaves installed */
+
+/* Protects both trees and the purge list */
+static spinlock_t vmap_lock = SPIN_LOCK_INIT;
+
+static struct slab_cache *vm_cache = NULL;     /* struct vm_struct */
+static struct slab_cache *vmap_node_cache = NULL;
 static int vmalloc_initialized = 0;
 
+/* ============================================
+ * Augmented AVL Tree
+ * ============================================ */
+
+static inline int node_height(struct vmap_node *n)
+{
+    return n ? n->height : 0;
+}
+
+static inline unsigned long node_max(struct vmap_node *n)
+{
+    return n ? n->subtree_max : 0;
+}
+
+/* Recompute height and subtree maximum from the children */
+static void node_update(struct vmap_node *n)
+{
+    int hl = node_height(n->left);
+    int hr = node_height(n->right);
+    unsigned long max = n->end - n->start;
+
+    n->height = (hl > hr ? hl : hr) + 1;
+    if (node_max(n->left) > max) {
+        max = node_max(n->left);
+    }
+    if (node_max(n->right) > max) {
+        max = node_max(n->right);
+    }
+    n->subtree_max = max;
+}
+
+static struct vmap_node *rotate_right(struct vmap_node *n)
+{
+    struct vmap_node *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static struct vmap_node *rotate_left(struct vmap_node *n)
+{
+    struct vmap_node *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+/* Restore the AVL property at n after one of its subtrees changed */
+static struct vmap_node *node_balance(struct vmap_node *n)
+{
+    int bf;
+
+    node_update(n);
+    bf = node_height(n->left) - node_height(n->right);
+
+    if (bf > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left);
+        }
+        return rotate_right(n);
+    }
+    if (bf < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right);
+        }
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static struct vmap_node *tree_insert(struct vmap_node *root, struct vmap_node *node)
+{
+    if (!root) {
+        node->left = NULL;
+        node->right = NULL;
+        node_update(node);
+        return node;
+    }
+
+    if (node->start < root->start) {
+        root->left = tree_insert(root->left, node);
+    } else {
+        root->right = tree_insert(root->right, node);
+    }
+    return node_balance(root);
+}
+
+/* Unlink the lowest node of a subtree into *min */
+static struct vmap_node *tree_remove_min(struct vmap_node *root,
+                                         struct vmap_node **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = tree_remove_min(root->left, min);
+    return node_balance(root);
+}
+
+static struct vmap_node *tree_remove(struct vmap_node *root, struct vmap_node *node)
+{
+    struct vmap_node *min;
+
+    if (!root) {
+        return NULL;
+    }
+
+    if (node->start < root->start) {
+        root->left = tree_remove(root->left, node);
+    } else if (node->start > root->start) {
+        root->right = tree_remove(root->right, node);
+    } else {
+        /* Ranges never overlap, so this is node itself */
+        if (!root->left) {
+            return root->right;
+        }
+        if (!root->right) {
+            return root->left;
+        }
+        root->right = tree_remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = root->right;
+        root = min;
+    }
+    return node_balance(root);
+}
+
+/* Recompute the maxima on the path to a node whose range changed in
+ * place (without passing a neighbour, so its position still holds)
+ */
+static void tree_propagate(struct vmap_node *root, struct vmap_node *node)
+{
+    if (!root) {
+        return;
+    }
+
+    if (node->start < root->start) {
+        tree_propagate(root->left, node);
+    } else if (node->start > root->start) {
+        tree_propagate(root->right, node);
+    }
+    node_update(root);
+}
+
+/* Node whose range contains addr */
+static struct vmap_node *tree_lookup(struct vmap_node *n, unsigned long addr)
+{
+    while (n) {
+        if (addr < n->start) {
+            n = n->left;
+        } else if (addr >= n->end) {
+            n = n->right;
+        } else {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+/* Last node starting below addr and first starting at or above it */
+static void tree_neighbours(struct vmap_node *n, unsigned long addr,
+                            struct vmap_node **prev, struct vmap_node **next)
+{
+    *prev = NULL;
+    *next = NULL;
+
+    while (n) {
+        if (n->start < addr) {
+            *prev = n;
+            n = n->right;
+        } else {
+            *next = n;
+            n = n->left;
+        }
+    }
+}
+
+/* ============================================
+ * Address Space Allocation
+ * ============================================ */
+
+/* Lowest free range at least need bytes long: go left whenever the
+ * left subtree has one, else take this node, else go right
+ */
+static struct vmap_node *find_lowest_fit(unsigned long need)
+{
+    struct vmap_node *n = free_root;
+
+    if (node_max(n) < need) {
+        return NULL;
+    }
+
+    while (n) {
+        if (node_max(n->left) >= need) {
+            n = n->left;
+        } else if (n->end - n->start >= need) {
+            return n;
+        } else {
+            n = n->right;
+        }
+    }
+    return NULL;
+}
+
+/* Take size bytes aligned to align from the free tree; 0 if no room.
+ * vmap_lock held
+ */
+static unsigned long alloc_vmap_range(unsigned long size, unsigned long align)
+{
+    struct vmap_node *f, *split = NULL;
+    unsigned long addr;
+
+    /* Any range this long fits the request whatever its alignment */
+    f = find_lowest_fit(size + align - PAGE_SIZE);
+    if (!f) {
+        return 0;
+    }
+
+    addr = (f->start + align - 1) & ~(align - 1);
+
+    if (addr > f->start && addr + size < f->end) {
+        /* Taken from the middle: the tail becomes a range of its own */
+        split = (struct vmap_node *)kmem_cache_alloc(vmap_node_cache);
+        if (!split) {
+            return 0;
+        }
+        split->start = addr + size;
+        split->end = f->end;
+        f->end = addr;
+        tree_propagate(free_root, f);
+        free_root = tree_insert(free_root, split);
+        nr_free_ranges++;
+    } else if (addr == f->start && addr + size == f->end) {
+        free_root = tree_remove(free_root, f);
+        kmem_cache_free(vmap_node_cache, f);
+        nr_free_ranges--;
+    } else if (addr == f->start) {
+        f->start += size;
+        tree_propagate(free_root, f);
+    } else {
+        f->end = addr;
+        tree_propagate(free_root, f);
+    }
+
+    return addr;
+}
+
+/* Give [start, end) back, merging with free neighbours; vmap_lock held */
+static void free_vmap_range(unsigned long start, unsigned long end)
+{
+    struct vmap_node *prev, *next, *n;
+
+    tree_neighbours(free_root, start, &prev, &next);
+
+    if (prev && prev->end == start) {
+        if (next && next->start == end) {
+            prev->end = next->end;
+            free_root = tree_remove(free_root, next);
+            kmem_cache_free(vmap_node_cache, next);
+            nr_free_ranges--;
+        } else {
+            prev->end = end;
+        }
+        tree_propagate(free_root, prev);
+    } else if (next && next->start == end) {
+        next->start = start;
+        tree_propagate(free_root, next);
+    } else {
+        n = (struct vmap_node *)kmem_cache_alloc(vmap_node_cache);
+        if (!n) {
+            early_puts("[VMALLOC] WARNING: no memory to free range ");
+            early_puthex(start);
+            early_puts("\n");
+            return;
+        }
+        n->start = start;
+        n->end = end;
+        free_root = tree_insert(free_root, n);
+        nr_free_ranges++;
+    }
+}
+
+/* ============================================
+ * VM Areas
+ * ============================================ */
+
 /* Initialize vmalloc subsystem */
 void vmalloc_init(void)
 {
-    int i;
+    struct vmap_node *n;
 
     early_puts("[VMALLOC] Initializing vmalloc...\n");
 
-    /* Initialize VM area pool */
-    for (i = 0; i < MAX_VMALLOC_AREAS; i++) {
-        vm_areas[i].in_use = 0;
-        vm_areas[i].addr = NULL;
-        vm_areas[i].size = 0;
-        vm_areas[i].pages = NULL;
-        vm_areas[i].next = NULL;
+    vm_cache = kmem_cache_create("vm_struct", sizeof(struct vm_struct), NULL, NULL);
+    vmap_node_cache = kmem_cache_create("vmap_node", sizeof(struct vmap_node),
+                                        NULL, NULL);
+    if (!vm_cache || !vmap_node_cache) {
+        early_puts("[VMALLOC] ERROR: cannot create caches\n");
+        return;
     }
 
-    vmlist = NULL;
-    vmalloc_pos = VMALLOC_START;
+    if (pgtable_prealloc_kernel(VMALLOC_START, VMALLOC_END) < 0) {
+        early_puts("[VMALLOC] ERROR: cannot allocate page tables\n");
+        return;
+    }
+
+    /* All of the range starts out as one free range */
+    n = (struct vmap_node *)kmem_cache_alloc(vmap_node_cache);
+    if (!n) {
+        return;
+    }
+    n->start = VMALLOC_START;
+    n->end = VMALLOC_END;
+    free_root = tree_insert(NULL, n);
+    nr_free_ranges = 1;
+    busy_root = NULL;
+    nr_areas = 0;
+
     vmalloc_initialized = 1;
 
     early_puts("[VMALLOC] Range: ");
@@ -91,91 +436,180 @@ void vmalloc_init(void)
     early_puts("\n[VMALLOC] Initialized\n");
 }
 
-/* Allocate a VM structure */
-static struct vm_struct *alloc_vm_struct(void)
+/* Flush the TLBs for every queued area, on all harts at once, and
+ * return their ranges to the free tree
+ */
+static void purge_vmap_areas(void)
 {
-    int i;
+    struct vmap_node *list, *n;
+    unsigned long start = ~0UL, end = 0;
+    unsigned long count = 0, irqflags;
+
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    list = purge_list;
+    purge_list = NULL;
+    lazy_pages = 0;
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    if (!list) {
+        return;
+    }
 
-    for (i = 0; i < MAX_VMALLOC_AREAS; i++) {
-        if (!vm_areas[i].in_use) {
-            vm_areas[i].in_use = 1;
-            return &vm_areas[i];
+    for (n = list; n; n = n->left) {
+        if (n->start < start) {
+            start = n->start;
+        }
+        if (n->end > end) {
+            end = n->end;
         }
     }
 
-    return NULL;
-}
+    flush_tlb_kernel_range(start, end - start);
 
-/* Free a VM structure */
-static void free_vm_struct(struct vm_struct *vm)
-{
-    vm->in_use = 0;
-    vm->addr = NULL;
-    vm->size = 0;
-    vm->flags = 0;
-    vm->nr_pages = 0;
-    vm->pages = NULL;
-    vm->next = NULL;
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    for (n = list; n; n = n->left) {
+        free_vmap_range(n->start, n->end);
+        count++;
+    }
+    nr_purges++;
+    nr_purged_areas += count;
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    while (list) {
+        n = list;
+        list = n->left;
+        kmem_cache_free(vm_cache, n);
+    }
 }
 
-/* Find virtual address space for allocation */
-static unsigned long find_vmalloc_area(unsigned long size)
+/* Reserve address space for nr_pages and a guard page after them */
+static struct vm_struct *get_vm_area(unsigned long nr_pages, unsigned long align,
+                                     unsigned long flags)
 {
     struct vm_struct *vm;
-    unsigned long addr = VMALLOC_START;
-    unsigned long end;
+    unsigned long size = (nr_pages + 1) * PAGE_SIZE;
+    unsigned long addr, irqflags;
+
+    vm = (struct vm_struct *)kmem_cache_alloc(vm_cache);
+    if (!vm) {
+        early_puts("[VMALLOC] ERROR: No VM structures available\n");
+        return NULL;
+    }
 
-    /* Add guard page to size */
-    size += PAGE_SIZE;
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    addr = alloc_vmap_range(size, align);
+    if (!addr && purge_list) {
+        /* The room may be in ranges still waiting for their flush */
+        spin_unlock_irqrestore(&vmap_lock, irqflags);
+        purge_vmap_areas();
+        spin_lock_irqsave(&vmap_lock, irqflags);
+        addr = alloc_vmap_range(size, align);
+    }
+    if (addr) {
+        vm->node.start = addr;
+        vm->node.end = addr + size;
+        busy_root = tree_insert(busy_root, &vm->node);
+        nr_areas++;
+    }
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
 
-    /* Align size to page boundary */
-    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (!addr) {
+        kmem_cache_free(vm_cache, vm);
+        early_puts("[VMALLOC] ERROR: No virtual space available\n");
+        return NULL;
+    }
 
-    /* Simple linear search through existing areas */
-    for (vm = vmlist; vm != NULL; vm = vm->next) {
-        end = (unsigned long)vm->addr;
+    vm->addr = (void *)addr;
+    vm->size = size;
+    vm->flags = flags;
+    vm->nr_pages = nr_pages;
+    vm->pages = NULL;
+    return vm;
+}
 
-        /* Check if there's enough space before this area */
-        if (addr + size <= end) {
-            return addr;
-        }
+/* Find VM area by address */
+static struct vm_struct *find_vm_area(void *addr)
+{
+    struct vmap_node *n;
+    unsigned long irqflags;
 
-        /* Move past this area */
-        addr = (unsigned long)vm->addr + vm->size;
-    }
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    n = tree_lookup(busy_root, (unsigned long)addr);
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
 
-    /* Check if there's space at the end */
-    if (addr + size <= VMALLOC_END) {
-        return addr;
-    }
+    return (struct vm_struct *)n;
+}
 
-    return 0;  /* No space available */
+/* Unmap an area (mapped or not yet, in part or whole) and queue its
+ * address space for the next purge. Stale TLB entries may reach the
+ * area until then; only a use after free could follow them
+ */
+static void remove_vm_area(struct vm_struct *vm)
+{
+    unsigned long irqflags;
+    int purge;
+
+    unmap_kernel_range_noflush((unsigned long)vm->addr, vm->nr_pages * PAGE_SIZE);
+
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    busy_root = tree_remove(busy_root, &vm->node);
+    nr_areas--;
+    vm->node.left = purge_list;
+    purge_list = &vm->node;
+    lazy_pages += vm->size >> PAGE_SHIFT;
+    purge = lazy_pages > LAZY_MAX_PAGES;
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    if (purge) {
+        purge_vmap_areas();
+    }
 }
 
-/* Insert VM area into sorted list */
-static void insert_vm_struct(struct vm_struct *vm)
+/* Map nr physically contiguous pages at va: one 2MB leaf for a whole
+ * aligned chunk, unless a page table already covers it, else 4KB pages.
+ * No 1GB leaves: this range's top-level entries are page tables shared
+ * with every process (see vmalloc_init)
+ */
+static int vmap_chunk(unsigned long va, unsigned long pa, unsigned long nr)
 {
-    struct vm_struct **pprev = &vmlist;
+    void *pgd = get_kernel_pgd();
+    unsigned long i;
 
-    while (*pprev && (*pprev)->addr < vm->addr) {
-        pprev = &(*pprev)->next;
+    if (nr == PAGES_PER_PMD && !(va & (PMD_SIZE - 1)) && !(pa & (PMD_SIZE - 1)) &&
+        map_page_2m(pgd, va, pa, PTE_KERNEL_RW) == 0) {
+        nr_huge_maps++;
+        return 0;
     }
 
-    vm->next = *pprev;
-    *pprev = vm;
+    for (i = 0; i < nr; i++) {
+        if (map_page_4k(pgd, va + i * PAGE_SIZE, pa + i * PAGE_SIZE,
+                        PTE_KERNEL_RW) < 0) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-/* Remove VM area from list */
-static void remove_vm_struct(struct vm_struct *vm)
+/* Free the first nr pages a vmalloc area owns and the area itself */
+static void vmalloc_release(struct vm_struct *vm, unsigned long nr)
 {
-    struct vm_struct **pprev = &vmlist;
+    unsigned long *pages = vm->pages;
+    unsigned long i;
+    int order;
 
-    while (*pprev && *pprev != vm) {
-        pprev = &(*pprev)->next;
-    }
+    remove_vm_area(vm);
 
-    if (*pprev) {
-        *pprev = vm->next;
+    if (pages) {
+        /* 2MB blocks are freed whole, from their first page */
+        for (i = 0; i < nr; i += 1UL << order) {
+            order = page_order(pages[i]);
+            if (order < 0) {
+                order = 0;
+                continue;
+            }
+            free_pages(pages[i], order);
+        }
+        kfree(pages);
     }
 }
 
@@ -185,8 +619,8 @@ static void *__vmalloc(unsigned long size, unsigned long flags)
     struct vm_struct *vm;
     unsigned long addr;
     unsigned long nr_pages;
-    unsigned long i;
-    void *pgd;
+    unsigned long i, j, n;
+    int huge;
 
     if (!vmalloc_initialized || size == 0) {
         return NULL;
@@ -194,70 +628,61 @@ static void *__vmalloc(unsigned long size, unsigned long flags)
 
     /* Calculate number of pages needed */
     nr_pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    huge = nr_pages >= PAGES_PER_PMD;
 
-    /* Allocate VM structure */
-    vm = alloc_vm_struct();
+    vm = get_vm_area(nr_pages, huge ? PMD_SIZE : PAGE_SIZE, flags);
     if (!vm) {
-        early_puts("[VMALLOC] ERROR: No VM structures available\n");
         return NULL;
     }
+    addr = (unsigned long)vm->addr;
 
-    /* Find virtual address space */
-    addr = find_vmalloc_area(size);
-    if (!addr) {
-        free_vm_struct(vm);
-        early_puts("[VMALLOC] ERROR: No virtual space available\n");
+    /* The pages are the area's to free */
+    vm->pages = (unsigned long *)kmalloc(nr_pages * sizeof(unsigned long));
+    if (!vm->pages) {
+        remove_vm_area(vm);
         return NULL;
     }
 
-    /* Initialize VM structure */
-    vm->addr = (void *)addr;
-    vm->size = (nr_pages + 1) * PAGE_SIZE;  /* +1 for guard page */
-    vm->flags = flags;
-    vm->nr_pages = nr_pages;
-    vm->pages = NULL;  /* We don't track individual pages for now */
-
-    /* Get kernel page directory */
-    pgd = get_kernel_pgd();
-
-    /* Allocate and map pages */
-    for (i = 0; i < nr_pages; i++) {
-        unsigned long page = alloc_page();
-        if (!page) {
-            /* Allocation failed - unmap and free already allocated pages */
-            unsigned long j;
-            for (j = 0; j < i; j++) {
-                unmap_page_pte(pgd, addr + j * PAGE_SIZE);
-                /* Note: We can't easily free pages since we don't track them */
+    /* Allocate and map pages, a 2MB block per whole 2MB chunk while the
+     * buddy allocator has them to spare (no waiting for reclaim: single
+     * pages will do), single pages for the rest, which may wait
+     */
+    for (i = 0; i < nr_pages; i += n) {
+        unsigned long page = 0;
+
+        n = 1;
+        if (huge && nr_pages - i >= PAGES_PER_PMD) {
+            page = alloc_pages(PMD_ORDER);
+            if (page) {
+                n = PAGES_PER_PMD;
+            } else {
+                huge = 0;
             }
-            free_vm_struct(vm);
+        }
+        if (!page) {
+            page = alloc_pages_gfp(0, GFP_KERNEL);
+        }
+        if (!page) {
+            vmalloc_release(vm, i);
             early_puts("[VMALLOC] ERROR: Page allocation failed\n");
             return NULL;
         }
 
-        /* Map the page */
-        if (map_page_4k(pgd, addr + i * PAGE_SIZE, page, PTE_KERNEL_RW) < 0) {
-            free_page(page);
-            /* Unmap and free already allocated pages */
-            unsigned long j;
-            for (j = 0; j < i; j++) {
-                unmap_page_pte(pgd, addr + j * PAGE_SIZE);
-            }
-            free_vm_struct(vm);
+        for (j = 0; j < n; j++) {
+            vm->pages[i + j] = page + j * PAGE_SIZE;
+        }
+
+        /* Map the chunk */
+        if (vmap_chunk(addr + i * PAGE_SIZE, page, n) < 0) {
+            vmalloc_release(vm, i + n);
             early_puts("[VMALLOC] ERROR: Page mapping failed\n");
             return NULL;
         }
 
-        /* Zero the page */
-        unsigned long *p = (unsigned long *)(addr + i * PAGE_SIZE);
-        for (unsigned long k = 0; k < (PAGE_SIZE / sizeof(unsigned long)); k++) {
-            p[k] = 0;
-        }
+        /* Zero it */
+        memset((void *)(addr + i * PAGE_SIZE), 0, n * PAGE_SIZE);
     }
 
-    /* Insert into VM list */
-    insert_vm_struct(vm);
-
     return (void *)addr;
 }
 
@@ -275,27 +700,10 @@ void *vzalloc(unsigned long size)
     return ptr;
 }
 
-/* Find VM area by address */
-static struct vm_struct *find_vm_area(void *addr)
-{
-    struct vm_struct *vm;
-
-    for (vm = vmlist; vm != NULL; vm = vm->next) {
-        if (vm->addr == addr) {
-            return vm;
-        }
-    }
-
-    return NULL;
-}
-
 /* vfree - free vmalloc'd memory */
 void vfree(void *addr)
 {
     struct vm_struct *vm;
-    unsigned long va;
-    unsigned long i;
-    void *pgd;
 
     if (!addr || !vmalloc_initialized) {
         return;
@@ -303,28 +711,12 @@ void vfree(void *addr)
 
     /* Find the VM area */
     vm = find_vm_area(addr);
-    if (!vm) {
+    if (!vm || vm->addr != addr || !(vm->flags & VM_ALLOC)) {
         early_puts("[VMALLOC] WARNING: vfree on unknown address\n");
         return;
     }
 
-    /* Get kernel page directory */
-    pgd = get_kernel_pgd();
-
-    /* Unmap and free all pages */
-    va = (unsigned long)vm->addr;
-    for (i = 0; i < vm->nr_pages; i++) {
-        /* Get physical address before unmapping */
-        /* For now we just unmap without freeing physical pages
-         * since we don't track them. A full implementation would
-         * store the page addresses in vm->pages and free them here.
-         */
-        unmap_page_pte(pgd, va + i * PAGE_SIZE);
-    }
-
-    /* Remove from list and free structure */
-    remove_vm_struct(vm);
-    free_vm_struct(vm);
+    vmalloc_release(vm, vm->nr_pages);
 }
 
 /* vmap - map array of pages to virtually contiguous region */
@@ -332,7 +724,6 @@ void *vmap(unsigned long *pages, unsigned long nr_pages, unsigned long flags)
 {
     struct vm_struct *vm;
     unsigned long addr;
-    unsigned long size;
     unsigned long i;
     void *pgd;
 
@@ -340,26 +731,11 @@ void *vmap(unsigned long *pages, unsigned long nr_pages, unsigned long flags)
         return NULL;
     }
 
-    size = nr_pages * PAGE_SIZE;
-
-    /* Allocate VM structure */
-    vm = alloc_vm_struct();
+    vm = get_vm_area(nr_pages, PAGE_SIZE, VM_MAP | flags);
     if (!vm) {
         return NULL;
     }
-
-    /* Find virtual address space */
-    addr = find_vmalloc_area(size);
-    if (!addr) {
-        free_vm_struct(vm);
-        return NULL;
-    }
-
-    /* Initialize VM structure */
-    vm->addr = (void *)addr;
-    vm->size = (nr_pages + 1) * PAGE_SIZE;
-    vm->flags = VM_MAP | flags;
-    vm->nr_pages = nr_pages;
+    addr = (unsigned long)vm->addr;
     vm->pages = pages;  /* Store reference to user's page array */
 
     /* Get kernel page directory */
@@ -368,19 +744,11 @@ void *vmap(unsigned long *pages, unsigned long nr_pages, unsigned long flags)
     /* Map all pages */
     for (i = 0; i < nr_pages; i++) {
         if (map_page_4k(pgd, addr + i * PAGE_SIZE, pages[i], PTE_KERNEL_RW) < 0) {
-            /* Unmap already mapped pages */
-            unsigned long j;
-            for (j = 0; j < i; j++) {
-                unmap_page_pte(pgd, addr + j * PAGE_SIZE);
-            }
-            free_vm_struct(vm);
+            remove_vm_area(vm);
             return NULL;
         }
     }
 
-    /* Insert into VM list */
-    insert_vm_struct(vm);
-
     return (void *)addr;
 }
 
@@ -388,16 +756,13 @@ void *vmap(unsigned long *pages, unsigned long nr_pages, unsigned long flags)
 void vunmap(void *addr)
 {
     struct vm_struct *vm;
-    unsigned long va;
-    unsigned long i;
-    void *pgd;
 
     if (!addr || !vmalloc_initialized) {
         return;
     }
 
     vm = find_vm_area(addr);
-    if (!vm) {
+    if (!vm || vm->addr != addr) {
         return;
     }
 
@@ -407,16 +772,8 @@ void vunmap(void *addr)
         return;
     }
 
-    pgd = get_kernel_pgd();
-
     /* Unmap pages (don't free - vmap doesn't own them) */
-    va = (unsigned long)vm->addr;
-    for (i = 0; i < vm->nr_pages; i++) {
-        unmap_page_pte(pgd, va + i * PAGE_SIZE);
-    }
-
-    remove_vm_struct(vm);
-    free_vm_struct(vm);
+    remove_vm_area(vm);
 }
 
 /* ioremap - map physical I/O memory into kernel virtual space */
@@ -426,8 +783,8 @@ void *ioremap(unsigned long phys_addr, unsigned long size)
     unsigned long addr;
     unsigned long offset;
     unsigned long nr_pages;
-    unsigned long i;
-    void *pgd;
+    unsigned long skip = 0, align = PAGE_SIZE;
+    unsigned long i, n;
 
     if (!vmalloc_initialized || size == 0) {
         return NULL;
@@ -440,45 +797,34 @@ void *ioremap(unsigned long phys_addr, unsigned long size)
     /* Calculate pages needed */
     nr_pages = (size + offset + PAGE_SIZE - 1) >> PAGE_SHIFT;
 
-    /* Allocate VM structure */
-    vm = alloc_vm_struct();
-    if (!vm) {
-        return NULL;
+    /* Start the mapping as far into a 2MB aligned area as the device
+     * range is into its 2MB chunk, so both cross 2MB lines together
+     */
+    if (nr_pages >= PAGES_PER_PMD) {
+        skip = (phys_addr & (PMD_SIZE - 1)) >> PAGE_SHIFT;
+        align = PMD_SIZE;
     }
 
-    /* Find virtual address space */
-    addr = find_vmalloc_area(nr_pages * PAGE_SIZE);
-    if (!addr) {
-        free_vm_struct(vm);
+    vm = get_vm_area(skip + nr_pages, align, VM_IOREMAP);
+    if (!vm) {
         return NULL;
     }
-
-    /* Initialize VM structure */
-    vm->addr = (void *)addr;
-    vm->size = (nr_pages + 1) * PAGE_SIZE;
-    vm->flags = VM_IOREMAP;
-    vm->nr_pages = nr_pages;
-    vm->pages = NULL;
-
-    /* Get kernel page directory */
-    pgd = get_kernel_pgd();
+    addr = (unsigned long)vm->addr + skip * PAGE_SIZE;
 
     /* Map physical pages (no caching for I/O) */
-    for (i = 0; i < nr_pages; i++) {
+    for (i = 0; i < nr_pages; i += n) {
+        n = 1;
+        if (!((addr + i * PAGE_SIZE) & (PMD_SIZE - 1)) &&
+            nr_pages - i >= PAGES_PER_PMD) {
+            n = PAGES_PER_PMD;
+        }
         /* Use uncached mapping for I/O (implementation-dependent) */
-        if (map_page_4k(pgd, addr + i * PAGE_SIZE,
-                        phys_addr + i * PAGE_SIZE, PTE_KERNEL_RW) < 0) {
-            unsigned long j;
-            for (j = 0; j < i; j++) {
-                unmap_page_pte(pgd, addr + j * PAGE_SIZE);
-            }
-            free_vm_struct(vm);
+        if (vmap_chunk(addr + i * PAGE_SIZE, phys_addr + i * PAGE_SIZE, n) < 0) {
+            remove_vm_area(vm);
             return NULL;
         }
     }
 
-    insert_vm_struct(vm);
-
     return (void *)(addr + offset);
 }
 
@@ -486,63 +832,258 @@ void *ioremap(unsigned long phys_addr, unsigned long size)
 void iounmap(void *addr)
 {
     struct vm_struct *vm;
-    unsigned long va;
-    unsigned long base_addr;
-    unsigned long i;
-    void *pgd;
 
     if (!addr || !vmalloc_initialized) {
         return;
     }
 
-    /* Align address to page boundary */
-    base_addr = (unsigned long)addr & PAGE_MASK;
-
-    vm = find_vm_area((void *)base_addr);
+    vm = find_vm_area(addr);
     if (!vm || !(vm->flags & VM_IOREMAP)) {
         early_puts("[VMALLOC] WARNING: iounmap on non-ioremap area\n");
         return;
     }
 
-    pgd = get_kernel_pgd();
+    remove_vm_area(vm);
+}
 
-    va = (unsigned long)vm->addr;
-    for (i = 0; i < vm->nr_pages; i++) {
-        unmap_page_pte(pgd, va + i * PAGE_SIZE);
+/* ============================================
+ * Debug and Benchmark
+ * ============================================ */
+
+/* In address order */
+static void dump_areas(struct vmap_node *n)
+{
+    struct vm_struct *vm = (struct vm_struct *)n;
+
+    if (!n) {
+        return;
     }
 
-    remove_vm_struct(vm);
-    free_vm_struct(vm);
+    dump_areas(n->left);
+
+    early_puts("  ");
+    early_puthex((unsigned long)vm->addr);
+    early_puts(" - ");
+    early_puthex((unsigned long)vm->addr + vm->size);
+    early_puts(" (");
+    early_puthex(vm->size);
+    early_puts(" bytes, ");
+    early_puthex(vm->nr_pages);
+    early_puts(" pages)");
+
+    if (vm->flags & VM_ALLOC) early_puts(" ALLOC");
+    if (vm->flags & VM_MAP) early_puts(" MAP");
+    if (vm->flags & VM_IOREMAP) early_puts(" IOREMAP");
+
+    early_puts("\n");
+
+    dump_areas(n->right);
+}
+
+static void dump_tree_stats(void)
+{
+    early_puts("Total areas: ");
+    early_puthex(nr_areas);
+    early_puts("  free ranges: ");
+    early_puthex(nr_free_ranges);
+    early_puts("  largest free: ");
+    early_puthex(node_max(free_root));
+    early_puts("\nLazy pages: ");
+    early_puthex(lazy_pages);
+    early_puts("  purges: ");
+    early_puthex(nr_purges);
+    early_puts("  areas purged: ");
+    early_puthex(nr_purged_areas);
+    early_puts("  2MB maps: ");
+    early_puthex(nr_huge_maps);
+    early_puts("\nTree heights: busy=");
+    early_puthex(node_height(busy_root));
+    early_puts(" free=");
+    early_puthex(node_height(free_root));
+    early_puts("\n");
 }
 
 /* Debug: dump vmalloc areas */
 void vmalloc_dump(void)
 {
-    struct vm_struct *vm;
-    int count = 0;
+    unsigned long irqflags;
 
     early_puts("\n=== vmalloc Areas ===\n");
 
-    for (vm = vmlist; vm != NULL; vm = vm->next) {
-        early_puts("  ");
-        early_puthex((unsigned long)vm->addr);
-        early_puts(" - ");
-        early_puthex((unsigned long)vm->addr + vm->size);
-        early_puts(" (");
-        early_puthex(vm->size);
-        early_puts(" bytes, ");
-        early_puthex(vm->nr_pages);
-        early_puts(" pages)");
-
-        if (vm->flags & VM_ALLOC) early_puts(" ALLOC");
-        if (vm->flags & VM_MAP) early_puts(" MAP");
-        if (vm->flags & VM_IOREMAP) early_puts(" IOREMAP");
-
-        early_puts("\n");
-        count++;
-    }
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    dump_areas(busy_root);
+    dump_tree_stats();
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+}
 
-    early_puts("Total areas: ");
-    early_puthex(count);
+static void bench_report(const char *what, unsigned long ops, u64 ticks)
+{
+    early_puts("  ");
+    early_puts(what);
+    early_puts(": ops=");
+    early_puthex(ops);
+    early_puts(" ticks/op=");
+    early_puthex(ops ? ticks / ops : 0);
+    early_puts(" ns/op=");
+    early_puthex(ops ? ticks * 1000000000UL / BOARD_TIMEBASE_FREQ / ops : 0);
     early_puts("\n");
 }
+
+/* Sizes of 1-4 pages from a fixed LCG, so runs are comparable */
+static unsigned long bench_pages(unsigned long *seed)
+{
+    *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+    return 1 + ((*seed >> 33) & 3);
+}
+
+/* Stress the allocator with n areas: allocate them all, free every
+ * other one, refill the holes with new sizes, look each one up and
+ * free the rest. A page is then mapped and unmapped n times, as a
+ * driver would a buffer per request, a few 8MB buffers (plus a page
+ * of tail) are allocated and freed, and the address space alone (no
+ * pages, no mapping) is timed like the areas. Times are time CSR ticks
+ * per operation.
+ */
+void vmalloc_bench(unsigned long n)
+{
+    void **areas;
+    unsigned long *ranges, *sizes;
+    unsigned long i, ok, seed = 1, irqflags;
+    unsigned long page[1];
+    void *p;
+    u64 t0;
+
+    if (!vmalloc_initialized || n == 0) {
+        return;
+    }
+
+    areas = (void **)kmalloc(n * sizeof(void *));
+    ranges = (unsigned long *)kmalloc(n * sizeof(unsigned long));
+    sizes = (unsigned long *)kmalloc(n * sizeof(unsigned long));
+    if (!areas || !ranges || !sizes) {
+        early_puts("vmbench: out of memory\n");
+        kfree(areas);
+        kfree(ranges);
+        kfree(sizes);
+        return;
+    }
+
+    early_puts("\n=== vmalloc Benchmark ===\n");
+
+    t0 = read_csr(time);
+    for (i = 0, ok = 0; i < n; i++) {
+        areas[i] = vmalloc(bench_pages(&seed) * PAGE_SIZE);
+        if (areas[i]) {
+            ok++;
+        }
+    }
+    bench_report("vmalloc", ok, read_csr(time) - t0);
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    dump_tree_stats();
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    t0 = read_csr(time);
+    for (i = 1, ok = 0; i < n; i += 2) {
+        if (areas[i]) {
+            vfree(areas[i]);
+            areas[i] = NULL;
+            ok++;
+        }
+    }
+    bench_report("vfree (every other)", ok, read_csr(time) - t0);
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    dump_tree_stats();
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    t0 = read_csr(time);
+    for (i = 1, ok = 0; i < n; i += 2) {
+        areas[i] = vmalloc(bench_pages(&seed) * PAGE_SIZE);
+        if (areas[i]) {
+            ok++;
+        }
+    }
+    bench_report("vmalloc (fragmented)", ok, read_csr(time) - t0);
+
+    t0 = read_csr(time);
+    for (i = 0, ok = 0; i < n; i++) {
+        if (areas[i] && find_vm_area(areas[i])) {
+            ok++;
+        }
+    }
+    bench_report("lookup", ok, read_csr(time) - t0);
+
+    t0 = read_csr(time);
+    for (i = 0, ok = 0; i < n; i++) {
+        if (areas[i]) {
+            vfree(areas[i]);
+            ok++;
+        }
+    }
+    bench_report("vfree", ok, read_csr(time) - t0);
+
+    page[0] = alloc_page();
+    if (page[0]) {
+        t0 = read_csr(time);
+        for (i = 0, ok = 0; i < n; i++) {
+            p = vmap(page, 1, 0);
+            if (p) {
+                vunmap(p);
+                ok++;
+            }
+        }
+        bench_report("vmap+vunmap", ok, read_csr(time) - t0);
+        free_page(page[0]);
+    }
+
+    /* Large buffers, backed by 2MB leaves where memory allows */
+    t0 = read_csr(time);
+    for (i = 0, ok = 0; i < 16; i++) {
+        p = vmalloc(4 * PMD_SIZE + PAGE_SIZE);
+        if (p) {
+            vfree(p);
+            ok++;
+        }
+    }
+    bench_report("vmalloc+vfree 8MB", ok, read_csr(time) - t0);
+
+    /* The trees alone; sizes drawn before timing */
+    for (i = 0; i < n; i++) {
+        sizes[i] = bench_pages(&seed) * PAGE_SIZE;
+    }
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    t0 = read_csr(time);
+    for (i = 0, ok = 0; i < n; i++) {
+        ranges[i] = alloc_vmap_range(sizes[i], PAGE_SIZE);
+        if (ranges[i]) {
+            ok++;
+        }
+    }
+    bench_report("range alloc", ok, read_csr(time) - t0);
+
+    t0 = read_csr(time);
+    for (i = 0, ok = 0; i < n; i += 2) {
+        if (ranges[i]) {
+            free_vmap_range(ranges[i], ranges[i] + sizes[i]);
+            ranges[i] = 0;
+            ok++;
+        }
+    }
+    bench_report("range free (every other)", ok, read_csr(time) - t0);
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    /* Back to one free range: give the rest back */
+    early_puts("  releasing...\n");
+    purge_vmap_areas();
+    spin_lock_irqsave(&vmap_lock, irqflags);
+    for (i = 0; i < n; i++) {
+        if (ranges[i]) {
+            free_vmap_range(ranges[i], ranges[i] + sizes[i]);
+        }
+    }
+    spin_unlock_irqrestore(&vmap_lock, irqflags);
+
+    vmalloc_dump();
+    kfree(areas);
+    kfree(ranges);
+    kfree(sizes);
+}
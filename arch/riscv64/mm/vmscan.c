@@ -0,0 +1,248 @@
+/* Memory reclaim
+ *
+ * Caches holding memory they could give back (empty slabs, cached
+ * blocks, cached file pages) register a shrinker. When free pages fall
+ * below the low watermark the page allocator wakes kswapd, which asks
+ * the shrinkers for a growing share of their objects, 1/4096 first and
+ * everything last, until free pages are back above the high watermark.
+ *
+ * An allocation that fails in a context that may sleep (the caller
+ * passed GFP_KERNEL, and is not the idle task or kswapd itself) waits
+ * for a kswapd pass and tries again rather than failing at once.
+ */
+
+#include <minix/config.h>
+#include <minix/mm.h>
+#include <minix/task.h>
+#include <minix/sched.h>
+#include <minix/time.h>
+#include <minix/timer.h>
+#include <asm/spinlock.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Scan 1/2^priority of each cache per pass, from 1/4096 down to all */
+#define DEF_PRIORITY        12
+
+/* Longest a failed allocation waits for kswapd */
+#define RECLAIM_THROTTLE    (HZ / 10)
+
+static struct shrinker *shrinker_list = NULL;
+static spinlock_t shrinker_lock = SPIN_LOCK_INIT;
+
+static struct task_struct *kswapd_task = NULL;
+static volatile int kswapd_pending = 0;
+static DECLARE_WAIT_QUEUE_HEAD(kswapd_wait);    /* kswapd sleeps here */
+static DECLARE_WAIT_QUEUE_HEAD(kswapd_done);    /* Throttled allocators */
+
+/* Statistics */
+static unsigned long kswapd_wakeups = 0;
+static volatile unsigned long kswapd_passes = 0;
+static unsigned long kswapd_reclaimed = 0;      /* Pages */
+static unsigned long kswapd_failed = 0;         /* Passes ending below high */
+static unsigned long throttled = 0;
+
+/* External functions */
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+extern struct task_struct *find_task_by_pid(pid_t pid);
+
+void register_shrinker(struct shrinker *s)
+{
+    s->nr_scanned = 0;
+    s->nr_freed = 0;
+    if (s->seeks <= 0)
+        s->seeks = DEFAULT_SEEKS;
+
+    spin_lock(&shrinker_lock);
+    s->next = shrinker_list;
+    shrinker_list = s;
+    spin_unlock(&shrinker_lock);
+}
+
+void unregister_shrinker(struct shrinker *s)
+{
+    struct shrinker **pp;
+
+    spin_lock(&shrinker_lock);
+    for (pp = &shrinker_list; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    spin_unlock(&shrinker_lock);
+}
+
+/* Objects that are expensive to recreate (high seeks) are scanned less */
+unsigned long shrink_slab(int priority)
+{
+    struct shrinker *s;
+    unsigned long count, scan, n, freed = 0;
+
+    spin_lock(&shrinker_lock);
+    for (s = shrinker_list; s; s = s->next) {
+        count = s->count_objects(s);
+        if (count == 0)
+            continue;
+
+        scan = (count >> priority) * 4 / s->seeks;
+        if (scan == 0)
+            scan = 1;
+        if (scan > count)
+            scan = count;
+
+        n = s->scan_objects(s, scan);
+        s->nr_scanned += scan;
+        s->nr_freed += n;
+        freed += n;
+    }
+    spin_unlock(&shrinker_lock);
+
+    return freed;
+}
+
+/* One reclaim pass: raise the pressure until free pages reach high */
+static void kswapd_balance(void)
+{
+    unsigned long before = nr_free_pages();
+    unsigned long now;
+    int priority;
+
+    for (priority = DEF_PRIORITY; priority >= 0; priority--) {
+        if (nr_free_pages() >= zone_watermark(WMARK_HIGH))
+            break;
+
+        shrink_slab(priority);
+
+        /* Pages freed here sit on this hart's list: merge them back */
+        drain_local_pages();
+    }
+
+    now = nr_free_pages();
+    if (now > before)
+        kswapd_reclaimed += now - before;
+    if (now < zone_watermark(WMARK_HIGH))
+        kswapd_failed++;
+}
+
+static int kswapd(void *arg)
+{
+    struct task_struct *tsk = get_current();
+    DEFINE_WAIT(wait);
+
+    (void)arg;
+    tsk->flags |= PF_MEMALLOC;
+
+    for (;;) {
+        /* A wakeup after prepare_to_wait() finds us on the queue */
+        prepare_to_wait(&kswapd_wait, &wait, TASK_INTERRUPTIBLE);
+        if (!kswapd_pending)
+            schedule();
+        finish_wait(&kswapd_wait, &wait);
+
+        kswapd_pending = 0;
+        kswapd_balance();
+        kswapd_passes++;
+        wake_up_all(&kswapd_done);
+    }
+
+    return 0;
+}
+
+void wakeup_kswapd(void)
+{
+    if (!kswapd_task || kswapd_pending)
+        return;
+
+    kswapd_pending = 1;
+    kswapd_wakeups++;
+    wake_up(&kswapd_wait);
+}
+
+int reclaim_throttle(gfp_t gfp)
+{
+    struct task_struct *p = get_current();
+    unsigned long pass;
+    DEFINE_WAIT(wait);
+
+    if (!(gfp & __GFP_RECLAIM))
+        return 0;
+    if (!kswapd_task || !p || (p->flags & (PF_IDLE | PF_MEMALLOC)))
+        return 0;
+
+    /* Woken when kswapd next finishes a pass, or after the timeout */
+    pass = kswapd_passes;
+    wakeup_kswapd();
+    prepare_to_wait(&kswapd_done, &wait, TASK_UNINTERRUPTIBLE);
+    if (kswapd_passes == pass)
+        schedule_timeout(RECLAIM_THROTTLE);
+    finish_wait(&kswapd_done, &wait);
+
+    throttled++;
+    return 1;
+}
+
+void kswapd_init(void)
+{
+    pid_t pid = kernel_thread(kswapd, NULL, 0);
+    struct task_struct *p;
+
+    if (pid < 0) {
+        early_puts("[RECLAIM] ERROR: cannot start kswapd\n");
+        return;
+    }
+
+    p = find_task_by_pid(pid);
+    if (p) {
+        p->comm[0] = 'k';
+        p->comm[1] = 's';
+        p->comm[2] = 'w';
+        p->comm[3] = 'a';
+        p->comm[4] = 'p';
+        p->comm[5] = 'd';
+        p->comm[6] = '\0';
+    }
+    kswapd_task = p;
+
+    early_puts("[RECLAIM] kswapd started, watermarks low=");
+    early_puthex(zone_watermark(WMARK_LOW));
+    early_puts(" high=");
+    early_puthex(zone_watermark(WMARK_HIGH));
+    early_puts(" pages\n");
+}
+
+void reclaim_stats(void)
+{
+    struct shrinker *s;
+
+    early_puts("\n=== Reclaim Statistics ===\n");
+    early_puts("kswapd: wakeups=");
+    early_puthex(kswapd_wakeups);
+    early_puts(" passes=");
+    early_puthex(kswapd_passes);
+    early_puts(" reclaimed=");
+    early_puthex(kswapd_reclaimed);
+    early_puts(" pages short=");
+    early_puthex(kswapd_failed);
+    early_puts(" throttled=");
+    early_puthex(throttled);
+    early_puts("\n");
+
+    spin_lock(&shrinker_lock);
+    for (s = shrinker_list; s; s = s->next) {
+        early_puts("  ");
+        early_puts(s->name);
+        early_puts(": objects=");
+        early_puthex(s->count_objects(s));
+        early_puts(" scanned=");
+        early_puthex(s->nr_scanned);
+        early_puts(" freed=");
+        early_puthex(s->nr_freed);
+        early_puts("\n");
+    }
+    spin_unlock(&shrinker_lock);
+}
@@ -0,0 +1,373 @@
+/* Block Request Queue
+ *
+ * Callers submit bios with completion callbacks. A bio that extends
+ * a pending request in the same direction is merged into it (front
+ * or back), so sequential single-block readers end up as one large
+ * transfer. Pending requests are kept sorted by block number and
+ * dispatched C-LOOK style: the next request at or after the current
+ * elevator position, wrapping to the lowest block at the end.
+ *
+ * blk_start_plug()/blk_finish_plug() hold dispatch while a caller
+ * builds a batch, giving adjacent bios a chance to merge first.
+ *
+ * Drivers complete requests from their interrupt handler, so
+ * blk_end_request() only moves the request to the queue's done list.
+ * The bio callbacks, the request free and the next dispatch run from
+ * blk_run_queue() and blk_poll() in process context. The queue lock is
+ * not held across driver calls, which may reap completions themselves.
+ */
+
+#include <minix/config.h>
+#include <types.h>
+#include <minix/blockdev.h>
+#include <minix/blockdev_priv.h>
+#include <minix/mm.h>
+#include <asm/irq.h>
+#include <asm/spinlock.h>
+#include <early_print.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Defaults for drivers that do not set their own limits */
+#define BLK_DEF_MAX_SEGMENTS    32
+#define BLK_DEF_MAX_BLOCKS      128
+
+static struct slab_cache *request_cache = NULL;
+
+/* Page-bounded pieces needed to describe a bio's buffer */
+static unsigned int bio_segments(block_dev_t *dev, bio_t *bio)
+{
+    unsigned long start = (unsigned long)bio->buf;
+    unsigned long end = start + (unsigned long)bio->count * dev->block_size;
+
+    return (unsigned int)(((end - 1) >> PAGE_SHIFT) - (start >> PAGE_SHIFT) + 1);
+}
+
+/* ============================================
+ * Elevator
+ * ============================================ */
+
+/* Insert in block order */
+static void elv_insert(request_queue_t *q, request_t *rq)
+{
+    request_t **pp = &q->head;
+
+    while (*pp && (*pp)->block_num <= rq->block_num) {
+        pp = &(*pp)->next;
+    }
+    rq->next = *pp;
+    *pp = rq;
+}
+
+static void elv_remove(request_queue_t *q, request_t *rq)
+{
+    request_t **pp = &q->head;
+
+    while (*pp) {
+        if (*pp == rq) {
+            *pp = rq->next;
+            rq->next = NULL;
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+/* Next request at or after the elevator position, else wrap around */
+static request_t *elv_next(request_queue_t *q)
+{
+    request_t *rq;
+
+    for (rq = q->head; rq; rq = rq->next) {
+        if (rq->block_num >= q->last_pos) {
+            return rq;
+        }
+    }
+    return q->head;
+}
+
+/* Try to merge bio into a pending request */
+static int elv_merge(block_dev_t *dev, bio_t *bio)
+{
+    request_queue_t *q = &dev->queue;
+    unsigned int segs = bio_segments(dev, bio);
+    request_t *rq;
+
+    for (rq = q->head; rq; rq = rq->next) {
+        if (rq->write != bio->write ||
+            rq->count + bio->count > q->max_blocks ||
+            rq->nr_segments + segs > q->max_segments) {
+            continue;
+        }
+
+        if (rq->block_num + rq->count == bio->block_num) {
+            /* Back merge */
+            rq->biotail->next = bio;
+            rq->biotail = bio;
+        } else if (bio->block_num + bio->count == rq->block_num) {
+            /* Front merge: the request now starts lower, and may belong
+             * ahead of a request for the other direction
+             */
+            bio->next = rq->bio;
+            rq->bio = bio;
+            rq->block_num = bio->block_num;
+            elv_remove(q, rq);
+            elv_insert(q, rq);
+        } else {
+            continue;
+        }
+
+        rq->count += bio->count;
+        rq->nr_segments += segs;
+        q->nr_merges++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* ============================================
+ * Completion and Dispatch
+ * ============================================ */
+
+/* Complete every bio of a request and free it */
+static void end_bios(request_t *rq, int error)
+{
+    bio_t *bio = rq->bio;
+
+    while (bio) {
+        bio_t *next = bio->next;
+        bio->next = NULL;
+        if (bio->end_io) {
+            bio->end_io(bio, error);
+        }
+        bio = next;
+    }
+
+    kmem_cache_free(request_cache, rq);
+}
+
+/* Execute a request through the synchronous driver ops */
+static void execute_sync(block_dev_t *dev, request_t *rq)
+{
+    bio_t *bio;
+    int error = 0;
+
+    for (bio = rq->bio; bio; bio = bio->next) {
+        int res;
+        if (bio->write) {
+            res = dev->ops->write_block(bio->block_num, bio->buf, bio->count);
+        } else {
+            res = dev->ops->read_block(bio->block_num, bio->buf, bio->count);
+        }
+        if (res < 0) {
+            error = 1;
+        }
+    }
+
+    end_bios(rq, error);
+}
+
+/* Called by drivers when a dispatched request finishes; safe from
+ * interrupt context
+ */
+void blk_end_request(request_t *rq, int error)
+{
+    request_queue_t *q = &rq->dev->queue;
+    unsigned long flags;
+
+    spin_lock_irqsave(&q->lock, flags);
+    q->nr_inflight--;
+    rq->error = error;
+    rq->next = q->done;
+    q->done = rq;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* End the requests the driver has completed */
+static void blk_end_done(request_queue_t *q)
+{
+    unsigned long flags;
+    request_t *rq, *next, *list = NULL;
+
+    spin_lock_irqsave(&q->lock, flags);
+    /* Done list is newest first: reverse into completion order */
+    for (rq = q->done; rq; rq = next) {
+        next = rq->next;
+        rq->next = list;
+        list = rq;
+    }
+    q->done = NULL;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    for (rq = list; rq; rq = next) {
+        next = rq->next;
+        rq->next = NULL;
+        end_bios(rq, rq->error);
+    }
+}
+
+/* Dispatch pending requests to the driver */
+void blk_run_queue(block_dev_t *dev)
+{
+    request_queue_t *q = &dev->queue;
+    unsigned long flags;
+    request_t *rq;
+
+    blk_end_done(q);
+
+    spin_lock_irqsave(&q->lock, flags);
+
+    if (q->running) {
+        spin_unlock_irqrestore(&q->lock, flags);
+        return;
+    }
+    q->running = 1;
+
+    while ((rq = elv_next(q)) != NULL) {
+        elv_remove(q, rq);
+        q->last_pos = rq->block_num + rq->count;
+
+        if (dev->ops->submit_request &&
+            rq->nr_segments <= q->max_segments && rq->count <= q->max_blocks) {
+            /* Count it first: the completion may arrive before return */
+            q->nr_inflight++;
+            spin_unlock_irqrestore(&q->lock, flags);
+            if (dev->ops->submit_request(rq) < 0) {
+                /* Device full: retry when a request completes */
+                spin_lock_irqsave(&q->lock, flags);
+                q->nr_inflight--;
+                elv_insert(q, rq);
+                break;
+            }
+            spin_lock_irqsave(&q->lock, flags);
+        } else {
+            /* No async path, or a bio too large for the driver */
+            spin_unlock_irqrestore(&q->lock, flags);
+            execute_sync(dev, rq);
+            spin_lock_irqsave(&q->lock, flags);
+        }
+        q->nr_dispatched++;
+    }
+
+    q->running = 0;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    if (dev->ops->kick) {
+        dev->ops->kick();
+    }
+}
+
+/* ============================================
+ * Submission
+ * ============================================ */
+
+/* Queue a bio; end_io is called when it completes */
+void submit_bio(block_dev_t *dev, bio_t *bio)
+{
+    request_queue_t *q = &dev->queue;
+    unsigned long flags;
+    request_t *rq;
+
+    bio->next = NULL;
+
+    spin_lock_irqsave(&q->lock, flags);
+
+    if (!elv_merge(dev, bio)) {
+        rq = request_cache ? (request_t *)kmem_cache_alloc(request_cache) : NULL;
+        if (rq == NULL) {
+            /* No request memory: bypass the queue */
+            int res;
+
+            spin_unlock_irqrestore(&q->lock, flags);
+            if (bio->write) {
+                res = dev->ops->write_block(bio->block_num, bio->buf, bio->count);
+            } else {
+                res = dev->ops->read_block(bio->block_num, bio->buf, bio->count);
+            }
+            if (bio->end_io) {
+                bio->end_io(bio, res < 0);
+            }
+            return;
+        }
+
+        rq->dev = dev;
+        rq->block_num = bio->block_num;
+        rq->count = bio->count;
+        rq->write = bio->write;
+        rq->nr_segments = bio_segments(dev, bio);
+        rq->bio = bio;
+        rq->biotail = bio;
+        rq->error = 0;
+        rq->next = NULL;
+        elv_insert(q, rq);
+    }
+
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    if (!q->plugged) {
+        blk_run_queue(dev);
+    }
+}
+
+/* Hold dispatch while the caller queues a batch */
+void blk_start_plug(block_dev_t *dev)
+{
+    dev->queue.plugged++;
+}
+
+/* Release the plug and dispatch the batch */
+void blk_finish_plug(block_dev_t *dev)
+{
+    if (dev->queue.plugged > 0 && --dev->queue.plugged == 0) {
+        blk_run_queue(dev);
+    }
+}
+
+/* Drive completions for a caller waiting on its bios */
+void blk_poll(block_dev_t *dev)
+{
+    if (dev->ops->poll) {
+        dev->ops->poll();
+    }
+
+    /* End what completed and refill the device */
+    if (!dev->queue.plugged) {
+        blk_run_queue(dev);
+    } else {
+        blk_end_done(&dev->queue);
+    }
+}
+
+/* Apply default limits to a newly registered device */
+void blk_queue_setup(block_dev_t *dev)
+{
+    request_queue_t *q = &dev->queue;
+
+    spin_lock_init(&q->lock);
+    q->head = NULL;
+    q->done = NULL;
+    q->last_pos = 0;
+    q->plugged = 0;
+    q->running = 0;
+    q->nr_inflight = 0;
+    if (q->max_segments == 0) {
+        q->max_segments = BLK_DEF_MAX_SEGMENTS;
+    }
+    if (q->max_blocks == 0) {
+        q->max_blocks = BLK_DEF_MAX_BLOCKS;
+    }
+}
+
+/* Initialize request queue support */
+int blk_queue_init(void)
+{
+    request_cache = kmem_cache_create("request", sizeof(request_t), NULL, NULL);
+    if (request_cache == NULL) {
+        early_puts("BLOCKDEV: Failed to create request cache\n");
+        return -1;
+    }
+    return 0;
+}
@@ -3,6 +3,9 @@
 #include <minix/config.h>
 #include <types.h>
 #include <minix/blockdev.h>
+#include <minix/blockdev_priv.h>
+#include <minix/mm.h>
+#include <asm/spinlock.h>
 #include <early_print.h>
 
 #ifndef NULL
@@ -16,22 +19,327 @@
 static block_dev_t *block_devices[MAX_BLOCK_DEVS];
 static int num_block_devices = 0;
 
-/* Block cache */
-#define BLOCK_CACHE_SIZE 64
-typedef struct {
-    void *dev_ptr;          /* Block device pointer */
-    u32 block_num;
-    void *data;
-    int dirty;
-} block_cache_entry_t;
-
-static block_cache_entry_t block_cache[BLOCK_CACHE_SIZE];
-static int cache_hits = 0;
-static int cache_misses = 0;
+/* Buffer cache
+ *
+ * Each cached block is a slab-allocated buffer_head that owns its
+ * data. Buffers are found through a hash on (dev, block) and kept on
+ * a global LRU list; the least recently used buffer is evicted once
+ * the cache holds bcache_max buffers, or by kswapd under memory
+ * pressure. bcache_lock covers the hash, the LRU and the count; reads
+ * and buffer allocations are done outside it.
+ */
+#define BCACHE_HASH_SIZE        256
+#define BCACHE_DEFAULT_SIZE     256     /* Default capacity (buffers) */
+
+typedef struct buffer_head {
+    block_dev_t *dev;               /* Owning device */
+    u32 block_num;                  /* Block number on device */
+    void *data;                     /* Block data, owned by the buffer */
+    u32 size;                       /* Size of data */
+    int dirty;                      /* Needs write-back */
+    struct buffer_head *hash_next;  /* Hash chain */
+    struct buffer_head *lru_prev;   /* LRU (head = most recent) */
+    struct buffer_head *lru_next;
+} buffer_head_t;
+
+static struct slab_cache *bh_cache = NULL;
+static buffer_head_t *bh_hash[BCACHE_HASH_SIZE];
+static buffer_head_t *lru_head = NULL;
+static buffer_head_t *lru_tail = NULL;
+static unsigned long bcache_count = 0;
+static unsigned long bcache_max = BCACHE_DEFAULT_SIZE;
+static spinlock_t bcache_lock = SPIN_LOCK_INIT;
+
+/* Bios a reader or writer keeps in flight before waiting */
+#define BIO_BATCH_SIZE          8
+
+struct bio_batch {
+    bio_t bios[BIO_BATCH_SIZE];
+    int nr;
+    volatile int pending;           /* Bios not yet completed */
+    int error;
+};
 
 /* Forward declarations */
 extern void *kmalloc(unsigned long size);
 extern void kfree(void *ptr);
+extern void *memcpy(void *dest, const void *src, unsigned long n);
+
+/* ============================================
+ * Buffer Cache Internals
+ * ============================================ */
+
+static unsigned int bh_hashfn(block_dev_t *dev, u32 block_num)
+{
+    unsigned long h = ((unsigned long)dev >> 4) ^ block_num;
+
+    h ^= h >> 8;
+    return (unsigned int)(h % BCACHE_HASH_SIZE);
+}
+
+/* Page order needed for a block of this size */
+static int bh_data_order(u32 size)
+{
+    int order = 0;
+
+    while (((u32)PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+/* Block data: small blocks come from kmalloc, page-sized ones from buddy */
+static void *bh_data_alloc(u32 size)
+{
+    if (size < PAGE_SIZE) {
+        return kmalloc(size);
+    }
+    return (void *)alloc_pages_gfp(bh_data_order(size), GFP_KERNEL);
+}
+
+static void bh_data_free(void *data, u32 size)
+{
+    if (size < PAGE_SIZE) {
+        kfree(data);
+    } else {
+        free_pages((unsigned long)data, bh_data_order(size));
+    }
+}
+
+static void lru_del(buffer_head_t *bh)
+{
+    if (bh->lru_prev) {
+        bh->lru_prev->lru_next = bh->lru_next;
+    } else {
+        lru_head = bh->lru_next;
+    }
+    if (bh->lru_next) {
+        bh->lru_next->lru_prev = bh->lru_prev;
+    } else {
+        lru_tail = bh->lru_prev;
+    }
+    bh->lru_prev = NULL;
+    bh->lru_next = NULL;
+}
+
+static void lru_add(buffer_head_t *bh)
+{
+    bh->lru_prev = NULL;
+    bh->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = bh;
+    } else {
+        lru_tail = bh;
+    }
+    lru_head = bh;
+}
+
+/* Find a cached buffer and mark it most recently used; bcache_lock held */
+static buffer_head_t *bh_lookup(block_dev_t *dev, u32 block_num)
+{
+    buffer_head_t *bh;
+
+    for (bh = bh_hash[bh_hashfn(dev, block_num)]; bh; bh = bh->hash_next) {
+        if (bh->dev == dev && bh->block_num == block_num) {
+            if (bh != lru_head) {
+                lru_del(bh);
+                lru_add(bh);
+            }
+            return bh;
+        }
+    }
+
+    return NULL;
+}
+
+/* Write back a dirty buffer */
+static int bh_writeback(buffer_head_t *bh)
+{
+    if (!bh->dirty) {
+        return 0;
+    }
+    if (bh->dev->ops->write_block == NULL ||
+        bh->dev->ops->write_block(bh->block_num, bh->data, 1) < 0) {
+        return -1;
+    }
+    bh->dirty = 0;
+    return 0;
+}
+
+/* Unhash, write back and free a buffer; bcache_lock held */
+static void bh_release(buffer_head_t *bh)
+{
+    buffer_head_t **pp;
+
+    bh_writeback(bh);
+
+    pp = &bh_hash[bh_hashfn(bh->dev, bh->block_num)];
+    while (*pp) {
+        if (*pp == bh) {
+            *pp = bh->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+
+    lru_del(bh);
+    bh_data_free(bh->data, bh->size);
+    kmem_cache_free(bh_cache, bh);
+    bcache_count--;
+}
+
+/* Evict least recently used buffers until count <= limit; bcache_lock held */
+static void bcache_trim(unsigned long limit)
+{
+    while (bcache_count > limit && lru_tail) {
+        bh_release(lru_tail);
+    }
+}
+
+/* Insert a copy of a block into the cache, unless it is there already.
+ * The buffer is allocated before taking the lock: allocation may wait
+ * for reclaim, which shrinks this cache.
+ */
+static void bh_insert(block_dev_t *dev, u32 block_num, const void *src)
+{
+    buffer_head_t *bh;
+    unsigned long flags;
+    unsigned int h;
+
+    if (bh_cache == NULL || bcache_max == 0) {
+        return;
+    }
+
+    bh = (buffer_head_t *)kmem_cache_alloc(bh_cache);
+    if (bh == NULL) {
+        return;
+    }
+
+    bh->data = bh_data_alloc(dev->block_size);
+    if (bh->data == NULL) {
+        kmem_cache_free(bh_cache, bh);
+        return;
+    }
+
+    bh->dev = dev;
+    bh->block_num = block_num;
+    bh->size = dev->block_size;
+    bh->dirty = 0;
+    memcpy(bh->data, src, dev->block_size);
+
+    spin_lock_irqsave(&bcache_lock, flags);
+    if (bcache_max == 0 || bh_lookup(dev, block_num)) {
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        bh_data_free(bh->data, bh->size);
+        kmem_cache_free(bh_cache, bh);
+        return;
+    }
+
+    bcache_trim(bcache_max - 1);
+
+    h = bh_hashfn(dev, block_num);
+    bh->hash_next = bh_hash[h];
+    bh_hash[h] = bh;
+    lru_add(bh);
+    bcache_count++;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+/* ============================================
+ * Bio Batches
+ * ============================================ */
+
+/* Largest bio the device queue accepts whatever the buffer alignment */
+static u32 bio_max_blocks(block_dev_t *dev)
+{
+    request_queue_t *q = &dev->queue;
+    u32 max = (u32)((q->max_segments - 1) * PAGE_SIZE / dev->block_size);
+
+    if (max > q->max_blocks) {
+        max = q->max_blocks;
+    }
+    return max ? max : 1;
+}
+
+static void bio_batch_end_io(bio_t *bio, int error)
+{
+    struct bio_batch *b = (struct bio_batch *)bio->private;
+
+    if (error) {
+        b->error = 1;
+    }
+    b->pending--;
+}
+
+static void bio_batch_start(block_dev_t *dev, struct bio_batch *b)
+{
+    b->nr = 0;
+    b->pending = 0;
+    b->error = 0;
+    blk_start_plug(dev);
+}
+
+/* Dispatch the batch, wait for it and cache the blocks that were read */
+static int bio_batch_wait(block_dev_t *dev, struct bio_batch *b)
+{
+    int i;
+    u32 j;
+
+    blk_finish_plug(dev);
+    while (b->pending > 0) {
+        blk_poll(dev);
+    }
+
+    if (b->error) {
+        return -1;
+    }
+
+    for (i = 0; i < b->nr; i++) {
+        bio_t *bio = &b->bios[i];
+        if (bio->write) {
+            continue;
+        }
+        for (j = 0; j < bio->count; j++) {
+            bh_insert(dev, bio->block_num + j,
+                      (u8 *)bio->buf + j * dev->block_size);
+        }
+    }
+    return 0;
+}
+
+/* Queue a range as bios, draining the batch whenever it fills up */
+static int bio_batch_add(block_dev_t *dev, struct bio_batch *b, u32 block_num,
+                         u8 *buf, u32 count, int write)
+{
+    u32 max = bio_max_blocks(dev);
+
+    while (count > 0) {
+        u32 n = (count < max) ? count : max;
+        bio_t *bio;
+
+        if (b->nr == BIO_BATCH_SIZE) {
+            if (bio_batch_wait(dev, b) < 0) {
+                return -1;
+            }
+            bio_batch_start(dev, b);
+        }
+
+        bio = &b->bios[b->nr++];
+        bio->block_num = block_num;
+        bio->count = n;
+        bio->buf = buf;
+        bio->write = write;
+        bio->end_io = bio_batch_end_io;
+        bio->private = b;
+        b->pending++;
+        submit_bio(dev, bio);
+
+        block_num += n;
+        buf += n * dev->block_size;
+        count -= n;
+    }
+    return 0;
+}
 
 /**
  * Register a block device
@@ -48,6 +356,8 @@ int blockdev_register(block_dev_t *dev)
         return -1;
     }
 
+    blk_queue_setup(dev);
+
     block_devices[num_block_devices] = dev;
     num_block_devices++;
 
@@ -98,55 +408,59 @@ block_dev_t *blockdev_find(const char *name)
  */
 ssize_t blockdev_read(block_dev_t *dev, u32 block_num, void *buf, u32 count)
 {
-    int i, found = -1;
-    ssize_t result;
+    u8 *dst = (u8 *)buf;
+    struct bio_batch batch;
+    u32 i = 0;
 
     if (dev == NULL || dev->ops == NULL || dev->ops->read_block == NULL) {
         return -1;
     }
 
-    if (buf == NULL) {
+    if (buf == NULL || dev->block_size == 0) {
         return -1;
     }
 
-    /* Check block cache */
-    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].data &&
-            block_cache[i].dev_ptr == (void *)dev &&
-            block_cache[i].block_num == block_num) {
+    /* Misses are queued as bios and read concurrently; each run of
+     * missing blocks is one bio, so the queue sees adjacent reads
+     * already merged
+     */
+    bio_batch_start(dev, &batch);
+
+    while (i < count) {
+        buffer_head_t *bh;
+        unsigned long flags;
+        u32 run;
+
+        spin_lock_irqsave(&bcache_lock, flags);
+        bh = bh_lookup(dev, block_num + i);
+        if (bh) {
             /* Cache hit */
-            cache_hits++;
-            if (count == 1) {
-                /* Copy from cache */
-                u8 *src = (u8 *)block_cache[i].data;
-                u8 *dst = (u8 *)buf;
-                u32 size = dev->block_size;
-                while (size--) {
-                    *dst++ = *src++;
-                }
-                return dev->block_size;
-            }
-            break;
+            dev->cache_hits++;
+            memcpy(dst + i * dev->block_size, bh->data, dev->block_size);
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            i++;
+            continue;
         }
-    }
-
-    cache_misses++;
 
-    /* Not in cache or multiple blocks, read from device */
-    result = dev->ops->read_block(block_num, buf, count);
+        run = 1;
+        while (i + run < count && !bh_lookup(dev, block_num + i + run)) {
+            run++;
+        }
+        spin_unlock_irqrestore(&bcache_lock, flags);
 
-    if (result > 0 && count == 1) {
-        /* Add to cache */
-        if (found == -1) {
-            found = cache_misses % BLOCK_CACHE_SIZE;
+        dev->cache_misses += run;
+        if (bio_batch_add(dev, &batch, block_num + i,
+                          dst + i * dev->block_size, run, 0) < 0) {
+            return -1;
         }
-        block_cache[found].dev_ptr = (void *)dev;
-        block_cache[found].block_num = block_num;
-        block_cache[found].data = buf;
-        block_cache[found].dirty = 0;
+        i += run;
     }
 
-    return result;
+    if (bio_batch_wait(dev, &batch) < 0) {
+        return -1;
+    }
+
+    return (ssize_t)count * dev->block_size;
 }
 
 /**
@@ -159,7 +473,10 @@ ssize_t blockdev_read(block_dev_t *dev, u32 block_num, void *buf, u32 count)
  */
 ssize_t blockdev_write(block_dev_t *dev, u32 block_num, const void *buf, u32 count)
 {
-    int i;
+    const u8 *src = (const u8 *)buf;
+    struct bio_batch batch;
+    unsigned long flags;
+    u32 i;
 
     if (dev == NULL || dev->ops == NULL || dev->ops->write_block == NULL) {
         return -1;
@@ -169,17 +486,24 @@ ssize_t blockdev_write(block_dev_t *dev, u32 block_num, const void *buf, u32 cou
         return -1;
     }
 
-    /* Mark cache as dirty */
-    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].data &&
-            block_cache[i].dev_ptr == (void *)dev &&
-            block_cache[i].block_num == block_num) {
-            block_cache[i].dirty = 1;
-            break;
+    /* Write-through; cached copies are updated so later hits stay coherent */
+    bio_batch_start(dev, &batch);
+    if (bio_batch_add(dev, &batch, block_num, (u8 *)buf, count, 1) < 0 ||
+        bio_batch_wait(dev, &batch) < 0) {
+        return -1;
+    }
+
+    spin_lock_irqsave(&bcache_lock, flags);
+    for (i = 0; i < count; i++) {
+        buffer_head_t *bh = bh_lookup(dev, block_num + i);
+        if (bh) {
+            memcpy(bh->data, src + i * dev->block_size, dev->block_size);
+            bh->dirty = 0;
         }
     }
+    spin_unlock_irqrestore(&bcache_lock, flags);
 
-    return dev->ops->write_block(block_num, buf, count);
+    return (ssize_t)count * dev->block_size;
 }
 
 /**
@@ -187,30 +511,103 @@ ssize_t blockdev_write(block_dev_t *dev, u32 block_num, const void *buf, u32 cou
  */
 int blockdev_flush(block_dev_t *dev)
 {
-    int i, result = 0;
-
-    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].data &&
-            block_cache[i].dev_ptr == (void *)dev &&
-            block_cache[i].dirty) {
-            /* Flush dirty block */
-            if (dev->ops->write_block) {
-                ssize_t res = dev->ops->write_block(
-                    block_cache[i].block_num,
-                    block_cache[i].data,
-                    1);
-                if (res < 0) {
-                    result = -1;
-                } else {
-                    block_cache[i].dirty = 0;
-                }
-            }
+    buffer_head_t *bh;
+    unsigned long flags;
+    int result = 0;
+
+    spin_lock_irqsave(&bcache_lock, flags);
+    for (bh = lru_head; bh; bh = bh->lru_next) {
+        if (bh->dev == dev && bh_writeback(bh) < 0) {
+            result = -1;
         }
     }
+    spin_unlock_irqrestore(&bcache_lock, flags);
 
     return result;
 }
 
+/**
+ * Resize the buffer cache
+ * @nr_buffers: new capacity in buffers (0 disables caching)
+ */
+void blockdev_set_cache_size(unsigned long nr_buffers)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&bcache_lock, flags);
+    bcache_max = nr_buffers;
+    bcache_trim(bcache_max);
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+/* ============================================
+ * Shrinker
+ * ============================================ */
+
+static unsigned long bcache_shrink_count(struct shrinker *s)
+{
+    (void)s;
+    return bcache_count;
+}
+
+/* Reclaim runs beside readers: skip a pass rather than wait for them */
+static unsigned long bcache_shrink_scan(struct shrinker *s, unsigned long nr)
+{
+    unsigned long flags, freed = 0;
+
+    (void)s;
+    flags = local_irq_save();
+    if (!spin_trylock(&bcache_lock)) {
+        local_irq_restore(flags);
+        return 0;
+    }
+    while (freed < nr && lru_tail) {
+        bh_release(lru_tail);
+        freed++;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    return freed;
+}
+
+static struct shrinker bcache_shrinker = {
+    .name = "buffer_head",
+    .count_objects = bcache_shrink_count,
+    .scan_objects = bcache_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+/**
+ * Print buffer cache statistics
+ */
+void blockdev_stats(void)
+{
+    int i;
+
+    early_puts("\n=== Buffer Cache Statistics ===\n");
+    early_puts("Buffers: ");
+    early_puthex(bcache_count);
+    early_puts(" / ");
+    early_puthex(bcache_max);
+    early_puts("\n");
+
+    for (i = 0; i < num_block_devices; i++) {
+        block_dev_t *dev = block_devices[i];
+
+        early_puts("  ");
+        early_puts(dev->name);
+        early_puts(": hits=");
+        early_puthex(dev->cache_hits);
+        early_puts(" misses=");
+        early_puthex(dev->cache_misses);
+        early_puts(" merges=");
+        early_puthex(dev->queue.nr_merges);
+        early_puts(" requests=");
+        early_puthex(dev->queue.nr_dispatched);
+        early_puts("\n");
+    }
+}
+
 /**
  * Initialize block device subsystem
  */
@@ -220,13 +617,19 @@ int blockdev_init(void)
 
     early_puts("✓ Block device ready\n");
 
-    /* Initialize cache */
-    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        block_cache[i].data = NULL;
-        block_cache[i].dev_ptr = NULL;
-        block_cache[i].block_num = 0;
-        block_cache[i].dirty = 0;
+    /* Initialize buffer cache */
+    for (i = 0; i < BCACHE_HASH_SIZE; i++) {
+        bh_hash[i] = NULL;
     }
 
+    bh_cache = kmem_cache_create("buffer_head", sizeof(buffer_head_t), NULL, NULL);
+    if (bh_cache == NULL) {
+        early_puts("BLOCKDEV: Buffer cache disabled\n");
+    } else {
+        register_shrinker(&bcache_shrinker);
+    }
+
+    blk_queue_init();
+
     return 0;
 }
@@ -0,0 +1,670 @@
+/* VirtIO Block Device Driver (virtio-mmio)
+ *
+ * Registers the first virtio-blk device found on the MMIO bus as
+ * "vda". Requests are built as descriptor chains on a single split
+ * virtqueue: header, one data descriptor per physically contiguous
+ * segment, status byte. Several chains can be outstanding at once;
+ * completions are reaped from the used ring by the PLIC interrupt
+ * handler (or by polling while a synchronous caller waits).
+ *
+ * vblk.lock serializes submission, notification and reaping across
+ * harts; completion callbacks run with it held and must not submit.
+ */
+
+#include <minix/config.h>
+#include <minix/board.h>
+#include <minix/blockdev.h>
+#include <minix/blockdev_priv.h>
+#include <minix/virtio.h>
+#include <minix/mm.h>
+#include <asm/io.h>
+#include <asm/irq.h>
+#include <asm/spinlock.h>
+#include <types.h>
+#include <early_print.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+#ifdef VIRTIO_BASE
+
+/* Driver limits */
+#define VBLK_QUEUE_SIZE         16      /* Descriptors in the virtqueue */
+#define VBLK_SECTOR_SIZE        512
+#define VBLK_MAX_SEGS           (VBLK_QUEUE_SIZE - 2)   /* Data descriptors per request */
+#define VBLK_MIN_QUEUE_SIZE     3       /* Header, one data, status */
+#define VBLK_MAX_REQ_SECTORS    128     /* 64KB per request */
+
+/* Request types and status */
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_S_OK         0
+
+/* Request header (device-readable) */
+struct virtio_blk_req_hdr {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+};
+
+/* In-flight request, indexed by its head descriptor */
+struct vblk_request {
+    struct virtio_blk_req_hdr hdr;
+    volatile u8 status;             /* Written by device */
+    vblk_end_io_t end_io;
+    void *arg;
+};
+
+/* Driver state */
+static struct {
+    spinlock_t lock;                /* Descriptors, rings and reqs[] */
+    unsigned long base;             /* MMIO base */
+    unsigned int irq;
+    u32 version;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    u16 num;                        /* Queue size */
+    u16 free_head;                  /* Free descriptor list */
+    u16 num_free;
+    u16 last_used;                  /* Next used ring entry to reap */
+    u16 pending_kick;               /* Submitted since last notify */
+    u16 max_segs;                   /* Data descriptors a chain may use */
+    struct vblk_request reqs[VBLK_QUEUE_SIZE];
+    u64 capacity;                   /* In sectors */
+} vblk;
+
+/* Synchronous I/O completion tracking */
+struct vblk_sync {
+    volatile int pending;
+    int error;
+};
+
+static int vblk_read_block(u32 block_num, void *buf, u32 count);
+static int vblk_write_block(u32 block_num, const void *buf, u32 count);
+static u32 vblk_get_block_size(void);
+static u64 vblk_get_total_blocks(void);
+static int vblk_submit_request(request_t *rq);
+
+static block_dev_ops_t vblk_ops = {
+    .read_block = vblk_read_block,
+    .write_block = vblk_write_block,
+    .get_block_size = vblk_get_block_size,
+    .get_total_blocks = vblk_get_total_blocks,
+    .submit_request = vblk_submit_request,
+    .kick = virtio_blk_kick,
+    .poll = virtio_blk_poll,
+    .name = "virtio-blk",
+};
+
+static block_dev_t vblk_dev = {
+    .name = "vda",
+    .ops = &vblk_ops,
+    .block_size = VBLK_SECTOR_SIZE,
+    .queue = {
+        .max_segments = VBLK_MAX_SEGS,
+        .max_blocks = VBLK_MAX_REQ_SECTORS,
+    },
+};
+
+static inline u32 vblk_read(unsigned long off)
+{
+    return (u32)readl(vblk.base + off);
+}
+
+static inline void vblk_write(unsigned long off, u32 val)
+{
+    writel(val, vblk.base + off);
+}
+
+/* ============================================
+ * Virtqueue Management
+ * ============================================ */
+
+static int alloc_desc_chain(int n, u16 *head)
+{
+    u16 idx, prev = 0;
+    int i;
+
+    if (vblk.num_free < n) {
+        return -1;
+    }
+
+    idx = vblk.free_head;
+    *head = idx;
+    for (i = 0; i < n; i++) {
+        prev = idx;
+        idx = vblk.desc[idx].next;
+    }
+
+    vblk.free_head = idx;
+    vblk.num_free -= n;
+    vblk.desc[prev].flags &= ~VRING_DESC_F_NEXT;
+
+    return 0;
+}
+
+static void free_desc_chain(u16 head)
+{
+    u16 idx = head;
+    int n = 1;
+
+    while (vblk.desc[idx].flags & VRING_DESC_F_NEXT) {
+        idx = vblk.desc[idx].next;
+        n++;
+    }
+
+    vblk.desc[idx].next = vblk.free_head;
+    vblk.desc[idx].flags = VRING_DESC_F_NEXT;
+    vblk.free_head = head;
+    vblk.num_free += n;
+}
+
+/* Reap completed requests from the used ring; vblk.lock held */
+static void vblk_complete(void)
+{
+    volatile u16 *used_idx = &vblk.used->idx;
+
+    while (vblk.last_used != *used_idx) {
+        struct vring_used_elem *e;
+        struct vblk_request *req;
+        vblk_end_io_t end_io;
+        void *arg;
+        int error;
+
+        rmb();
+        e = &vblk.used->ring[vblk.last_used % vblk.num];
+        req = &vblk.reqs[e->id];
+
+        error = (req->status != VIRTIO_BLK_S_OK);
+        end_io = req->end_io;
+        arg = req->arg;
+
+        free_desc_chain((u16)e->id);
+        vblk.last_used++;
+
+        if (end_io) {
+            end_io(arg, error);
+        }
+    }
+}
+
+static void vblk_irq(unsigned int irq, void *dev)
+{
+    u32 status;
+
+    (void)irq;
+    (void)dev;
+
+    status = vblk_read(VIRTIO_MMIO_INTERRUPT_STATUS);
+    vblk_write(VIRTIO_MMIO_INTERRUPT_ACK, status & 0x3);
+
+    if (status & VIRTIO_INT_USED_RING) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&vblk.lock, flags);
+        vblk_complete();
+        spin_unlock_irqrestore(&vblk.lock, flags);
+    }
+}
+
+/* ============================================
+ * Request Submission
+ * ============================================ */
+
+/* Queue a request without notifying the device
+ * @return: 0 on success, -1 if the virtqueue has no room (retry after
+ *          completions) or the request is malformed
+ */
+int virtio_blk_submit(u64 sector, const struct vblk_seg *segs, int nsegs,
+                      int write, vblk_end_io_t end_io, void *arg)
+{
+    struct vblk_request *req;
+    unsigned long flags;
+    u16 head, idx;
+    int i;
+
+    if (vblk.base == 0 || nsegs <= 0 || nsegs > vblk.max_segs) {
+        return -1;
+    }
+
+    spin_lock_irqsave(&vblk.lock, flags);
+
+    if (alloc_desc_chain(nsegs + 2, &head) < 0) {
+        spin_unlock_irqrestore(&vblk.lock, flags);
+        return -1;
+    }
+
+    req = &vblk.reqs[head];
+    req->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req->hdr.reserved = 0;
+    req->hdr.sector = sector;
+    req->status = 0xFF;
+    req->end_io = end_io;
+    req->arg = arg;
+
+    /* Header */
+    idx = head;
+    vblk.desc[idx].addr = virt_to_phys((unsigned long)&req->hdr);
+    vblk.desc[idx].len = sizeof(req->hdr);
+    vblk.desc[idx].flags = VRING_DESC_F_NEXT;
+
+    /* Data segments */
+    for (i = 0; i < nsegs; i++) {
+        idx = vblk.desc[idx].next;
+        vblk.desc[idx].addr = virt_to_phys((unsigned long)segs[i].buf);
+        vblk.desc[idx].len = segs[i].len;
+        vblk.desc[idx].flags = VRING_DESC_F_NEXT |
+                               (write ? 0 : VRING_DESC_F_WRITE);
+    }
+
+    /* Status */
+    idx = vblk.desc[idx].next;
+    vblk.desc[idx].addr = virt_to_phys((unsigned long)&req->status);
+    vblk.desc[idx].len = 1;
+    vblk.desc[idx].flags = VRING_DESC_F_WRITE;
+
+    /* Publish to the available ring */
+    vblk.avail->ring[vblk.avail->idx % vblk.num] = head;
+    wmb();
+    vblk.avail->idx++;
+    vblk.pending_kick++;
+
+    spin_unlock_irqrestore(&vblk.lock, flags);
+    return 0;
+}
+
+/* Notify the device of everything queued since the last kick */
+void virtio_blk_kick(void)
+{
+    unsigned long flags;
+
+    if (vblk.base == 0) {
+        return;
+    }
+
+    spin_lock_irqsave(&vblk.lock, flags);
+    if (vblk.pending_kick) {
+        wmb();
+        vblk.pending_kick = 0;
+        vblk_write(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+    }
+    spin_unlock_irqrestore(&vblk.lock, flags);
+}
+
+/* Reap completions without waiting for the interrupt */
+void virtio_blk_poll(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&vblk.lock, flags);
+    vblk_complete();
+    spin_unlock_irqrestore(&vblk.lock, flags);
+}
+
+/* ============================================
+ * Synchronous block_dev_ops
+ * ============================================ */
+
+static void vblk_sync_end_io(void *arg, int error)
+{
+    struct vblk_sync *sync = (struct vblk_sync *)arg;
+
+    if (error) {
+        sync->error = 1;
+    }
+    sync->pending--;
+}
+
+/* Split a buffer into physically contiguous (page-bounded) segments
+ * covering at most max_bytes, returns bytes covered
+ */
+static u32 vblk_build_segs(u8 *buf, u32 max_bytes, struct vblk_seg *segs,
+                           int *nsegs)
+{
+    u32 covered = 0;
+    int n = 0;
+
+    while (covered < max_bytes && n < vblk.max_segs) {
+        unsigned long addr = (unsigned long)(buf + covered);
+        u32 len = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+
+        if (len > max_bytes - covered) {
+            len = max_bytes - covered;
+        }
+
+        segs[n].buf = buf + covered;
+        segs[n].len = len;
+        covered += len;
+        n++;
+    }
+
+    *nsegs = n;
+    return covered;
+}
+
+/* Transfer one sector through a buffer that does not cross a page */
+static int vblk_rw_bounce(u32 block_num, u8 *buf, int write)
+{
+    u8 bounce[VBLK_SECTOR_SIZE] __attribute__((aligned(VBLK_SECTOR_SIZE)));
+    struct vblk_seg seg;
+    struct vblk_sync sync;
+    int i;
+
+    if (write) {
+        for (i = 0; i < VBLK_SECTOR_SIZE; i++) {
+            bounce[i] = buf[i];
+        }
+    }
+
+    seg.buf = bounce;
+    seg.len = VBLK_SECTOR_SIZE;
+    sync.pending = 1;
+    sync.error = 0;
+    while (virtio_blk_submit(block_num, &seg, 1, write,
+                             vblk_sync_end_io, &sync) < 0) {
+        virtio_blk_kick();
+        virtio_blk_poll();
+    }
+
+    virtio_blk_kick();
+    while (sync.pending > 0) {
+        virtio_blk_poll();
+    }
+
+    if (!write && !sync.error) {
+        for (i = 0; i < VBLK_SECTOR_SIZE; i++) {
+            buf[i] = bounce[i];
+        }
+    }
+    return sync.error ? -1 : 0;
+}
+
+/* Issue a transfer as several in-flight requests, then wait for all */
+static int vblk_rw(u32 block_num, u8 *buf, u32 count, int write)
+{
+    struct vblk_seg segs[VBLK_MAX_SEGS];
+    struct vblk_sync sync;
+    u32 done = 0;
+
+    sync.pending = 0;
+    sync.error = 0;
+
+    while (done < count) {
+        u32 n = count - done;
+        u32 bytes;
+        int nsegs;
+
+        if (n > VBLK_MAX_REQ_SECTORS) {
+            n = VBLK_MAX_REQ_SECTORS;
+        }
+
+        bytes = vblk_build_segs(buf + done * VBLK_SECTOR_SIZE,
+                                n * VBLK_SECTOR_SIZE, segs, &nsegs);
+        n = bytes / VBLK_SECTOR_SIZE;
+
+        /* Segments ran out before the first whole sector: only when a
+         * single segment is allowed and the sector crosses a page end
+         */
+        if (n == 0) {
+            if (vblk_rw_bounce(block_num + done,
+                               buf + done * VBLK_SECTOR_SIZE, write) < 0) {
+                sync.error = 1;
+            }
+            done++;
+            continue;
+        }
+
+        /* Ran out of segments mid-sector (unaligned buffer): the part
+         * past the last whole sector is dropped from the last segment,
+         * which is at least that long, and sent with the next request
+         */
+        segs[nsegs - 1].len -= bytes % VBLK_SECTOR_SIZE;
+
+        sync.pending++;
+        while (virtio_blk_submit(block_num + done, segs, nsegs, write,
+                                 vblk_sync_end_io, &sync) < 0) {
+            /* Queue full: let the device drain some requests */
+            virtio_blk_kick();
+            virtio_blk_poll();
+        }
+        done += n;
+    }
+
+    virtio_blk_kick();
+    while (sync.pending > 0) {
+        virtio_blk_poll();
+    }
+
+    return sync.error ? -1 : (int)(count * VBLK_SECTOR_SIZE);
+}
+
+static int vblk_read_block(u32 block_num, void *buf, u32 count)
+{
+    return vblk_rw(block_num, (u8 *)buf, count, 0);
+}
+
+static int vblk_write_block(u32 block_num, const void *buf, u32 count)
+{
+    return vblk_rw(block_num, (u8 *)buf, count, 1);
+}
+
+/* ============================================
+ * Request queue interface
+ * ============================================ */
+
+static void vblk_rq_end_io(void *arg, int error)
+{
+    blk_end_request((request_t *)arg, error);
+}
+
+/* Map every bio of a merged request onto one descriptor chain; the
+ * queue limits guarantee the request fits in vblk.max_segs segments
+ */
+static int vblk_submit_request(request_t *rq)
+{
+    struct vblk_seg segs[VBLK_MAX_SEGS];
+    int nsegs = 0;
+    bio_t *bio;
+
+    for (bio = rq->bio; bio; bio = bio->next) {
+        int n;
+
+        vblk_build_segs((u8 *)bio->buf, bio->count * VBLK_SECTOR_SIZE,
+                        segs + nsegs, &n);
+        nsegs += n;
+    }
+
+    return virtio_blk_submit(rq->block_num, segs, nsegs, rq->write,
+                             vblk_rq_end_io, rq);
+}
+
+static u32 vblk_get_block_size(void)
+{
+    return VBLK_SECTOR_SIZE;
+}
+
+static u64 vblk_get_total_blocks(void)
+{
+    return vblk.capacity;
+}
+
+/* ============================================
+ * Probe and Initialization
+ * ============================================ */
+
+static int vblk_setup_queue(void)
+{
+    unsigned long ring;
+    u32 max;
+    u16 i;
+
+    vblk_write(VIRTIO_MMIO_QUEUE_SEL, 0);
+    max = vblk_read(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (max < VBLK_MIN_QUEUE_SIZE) {
+        return -1;
+    }
+
+    vblk.num = (max < VBLK_QUEUE_SIZE) ? (u16)max : VBLK_QUEUE_SIZE;
+    vblk_write(VIRTIO_MMIO_QUEUE_NUM, vblk.num);
+
+    /* A chain must fit the queue, or submission would never succeed */
+    vblk.max_segs = vblk.num - 2;
+    vblk_dev.queue.max_segments = vblk.max_segs;
+
+    /* Descriptors + avail ring in page 0, used ring page-aligned in page 1 */
+    ring = alloc_pages(1);
+    if (!ring) {
+        return -1;
+    }
+    for (i = 0; i < 2 * PAGE_SIZE / sizeof(unsigned long); i++) {
+        ((unsigned long *)ring)[i] = 0;
+    }
+
+    vblk.desc = (struct vring_desc *)ring;
+    vblk.avail = (struct vring_avail *)(ring + vblk.num * sizeof(struct vring_desc));
+    vblk.used = (struct vring_used *)(ring + PAGE_SIZE);
+
+    /* Free list through desc[].next */
+    for (i = 0; i < vblk.num; i++) {
+        vblk.desc[i].next = (u16)(i + 1);
+        vblk.desc[i].flags = VRING_DESC_F_NEXT;
+    }
+    vblk.free_head = 0;
+    vblk.num_free = vblk.num;
+    vblk.last_used = 0;
+
+    if (vblk.version == 1) {
+        vblk_write(VIRTIO_MMIO_GUEST_PAGE_SIZE, PAGE_SIZE);
+        vblk_write(VIRTIO_MMIO_QUEUE_ALIGN, PAGE_SIZE);
+        vblk_write(VIRTIO_MMIO_QUEUE_PFN, (u32)(virt_to_phys(ring) >> PAGE_SHIFT));
+    } else {
+        unsigned long pa;
+
+        pa = virt_to_phys((unsigned long)vblk.desc);
+        vblk_write(VIRTIO_MMIO_QUEUE_DESC_LOW, (u32)pa);
+        vblk_write(VIRTIO_MMIO_QUEUE_DESC_HIGH, (u32)(pa >> 32));
+        pa = virt_to_phys((unsigned long)vblk.avail);
+        vblk_write(VIRTIO_MMIO_QUEUE_AVAIL_LOW, (u32)pa);
+        vblk_write(VIRTIO_MMIO_QUEUE_AVAIL_HIGH, (u32)(pa >> 32));
+        pa = virt_to_phys((unsigned long)vblk.used);
+        vblk_write(VIRTIO_MMIO_QUEUE_USED_LOW, (u32)pa);
+        vblk_write(VIRTIO_MMIO_QUEUE_USED_HIGH, (u32)(pa >> 32));
+        vblk_write(VIRTIO_MMIO_QUEUE_READY, 1);
+    }
+
+    return 0;
+}
+
+int virtio_blk_init(void)
+{
+    unsigned long base = 0;
+    u32 status;
+    int slot;
+
+    /* Find the first virtio-blk device on the MMIO bus */
+    for (slot = 0; slot < VIRTIO_MMIO_SLOTS; slot++) {
+        unsigned long b = VIRTIO_BASE + slot * VIRTIO_SIZE;
+        if (readl(b + VIRTIO_MMIO_MAGIC_VALUE) == VIRTIO_MMIO_MAGIC &&
+            readl(b + VIRTIO_MMIO_DEVICE_ID) == VIRTIO_ID_BLOCK) {
+            base = b;
+            break;
+        }
+    }
+
+    if (base == 0) {
+        return -1;  /* No disk attached */
+    }
+
+    spin_lock_init(&vblk.lock);
+    vblk.base = base;
+    vblk.irq = VIRTIO_MMIO_IRQ_BASE + slot;
+    vblk.version = vblk_read(VIRTIO_MMIO_VERSION);
+
+    /* Reset, then acknowledge */
+    vblk_write(VIRTIO_MMIO_STATUS, 0);
+    status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    vblk_write(VIRTIO_MMIO_STATUS, status);
+
+    /* No optional features needed; a modern device must also be told
+     * the driver speaks virtio 1.0, or it refuses FEATURES_OK
+     */
+    if (vblk.version >= 2) {
+        vblk_write(VIRTIO_MMIO_DEVICE_FEATURES_SEL, VIRTIO_F_VERSION_1 / 32);
+        if (!(vblk_read(VIRTIO_MMIO_DEVICE_FEATURES) &
+              (1U << (VIRTIO_F_VERSION_1 % 32)))) {
+            goto fail;
+        }
+        vblk_write(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+        vblk_write(VIRTIO_MMIO_DRIVER_FEATURES, 0);
+        vblk_write(VIRTIO_MMIO_DRIVER_FEATURES_SEL, VIRTIO_F_VERSION_1 / 32);
+        vblk_write(VIRTIO_MMIO_DRIVER_FEATURES, 1U << (VIRTIO_F_VERSION_1 % 32));
+
+        status |= VIRTIO_STATUS_FEATURES_OK;
+        vblk_write(VIRTIO_MMIO_STATUS, status);
+        if (!(vblk_read(VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+            goto fail;
+        }
+    } else {
+        vblk_write(VIRTIO_MMIO_DRIVER_FEATURES, 0);
+    }
+
+    if (vblk_setup_queue() < 0) {
+        goto fail;
+    }
+
+    vblk.capacity = (u64)vblk_read(VIRTIO_MMIO_CONFIG) |
+                    ((u64)vblk_read(VIRTIO_MMIO_CONFIG + 4) << 32);
+
+    if (request_irq(vblk.irq, vblk_irq, NULL) < 0) {
+        early_puts("virtio-blk: IRQ busy, polling only\n");
+    }
+
+    status |= VIRTIO_STATUS_DRIVER_OK;
+    vblk_write(VIRTIO_MMIO_STATUS, status);
+
+    vblk_dev.total_blocks = vblk.capacity;
+    blockdev_register(&vblk_dev);
+
+    early_puts("virtio-blk: vda sectors=");
+    early_puthex(vblk.capacity);
+    early_puts("\n");
+
+    return 0;
+
+fail:
+    vblk_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_FAILED);
+    vblk.base = 0;
+    early_puts("virtio-blk: device setup failed\n");
+    return -1;
+}
+
+#else /* !VIRTIO_BASE */
+
+int virtio_blk_init(void)
+{
+    return -1;
+}
+
+int virtio_blk_submit(u64 sector, const struct vblk_seg *segs, int nsegs,
+                      int write, vblk_end_io_t end_io, void *arg)
+{
+    (void)sector;
+    (void)segs;
+    (void)nsegs;
+    (void)write;
+    (void)end_io;
+    (void)arg;
+    return -1;
+}
+
+void virtio_blk_kick(void)
+{
+}
+
+void virtio_blk_poll(void)
+{
+}
+
+#endif /* VIRTIO_BASE */
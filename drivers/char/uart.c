@@ -3,7 +3,9 @@
 #include <minix/config.h>
 #include <minix/board.h>
 #include <minix/uart.h>
+#include <minix/task.h>
 #include <asm/io.h>
+#include <asm/irq.h>
 #include <types.h>
 
 #ifndef NULL
@@ -25,8 +27,12 @@ static struct {
     uart_stats_t stats;
     uart_config_t config;
     volatile int tx_busy;
+    volatile int rx_irq;    /* RX is interrupt driven into rx_buffer */
 } uart_state;
 
+/* Readers blocked in uart_getc_wait() */
+static DECLARE_WAIT_QUEUE_HEAD(uart_rx_wait);
+
 /* UART register offsets (standard 16550) */
 #define UART_RBR                0x00    /* Receiver Buffer Register */
 #define UART_THR                0x00    /* Transmitter Holding Register */
@@ -201,11 +207,31 @@ int uart_haschar(void)
     return (lsr & 0x01) ? 1 : 0;
 }
 
+/* Take a byte the RX interrupt buffered; -1 if there is none */
+static int uart_rx_get(void)
+{
+    unsigned long flags;
+    char c;
+    int ret;
+
+    flags = local_irq_save();
+    ret = buffer_get(&uart_state.rx_buffer, &c);
+    local_irq_restore(flags);
+
+    return (ret < 0) ? -1 : (unsigned char)c;
+}
+
 /* Get character (blocking) */
 char uart_getchar(void)
 {
     static unsigned char last_read = 0xFF;  /* Use 0xFF as initial invalid value */
     unsigned char ch;
+    int c;
+
+    if (uart_state.rx_irq) {
+        c = uart_rx_get();
+        return (c < 0) ? '\0' : (char)c;
+    }
 
     /* WORKAROUND: Skip LSR check - directly try to read RBR
      * Reading LSR causes system hang on QEMU
@@ -231,7 +257,13 @@ extern void early_puts(const char *s);
 
 int uart_getc(void)
 {
-    volatile unsigned int lsr = uart_read_reg(BOARD_UART_BASE, UART_LSR);
+    volatile unsigned int lsr;
+
+    if (uart_state.rx_irq) {
+        return uart_rx_get();
+    }
+
+    lsr = uart_read_reg(BOARD_UART_BASE, UART_LSR);
 
     if (!(lsr & 0x01))
         return -1;
@@ -239,6 +271,33 @@ int uart_getc(void)
     return uart_read_reg(BOARD_UART_BASE, UART_RBR) & 0xFF;
 }
 
+/* Get character, sleeping until one arrives when RX is interrupt
+ * driven (polling otherwise)
+ */
+int uart_getc_wait(void)
+{
+    DEFINE_WAIT(wait);
+    int c;
+
+    if (!uart_state.rx_irq) {
+        while ((c = uart_getc()) < 0) {
+            /* Poll */
+        }
+        return c;
+    }
+
+    while (1) {
+        prepare_to_wait_exclusive(&uart_rx_wait, &wait, TASK_INTERRUPTIBLE);
+        c = uart_rx_get();
+        if (c >= 0) {
+            break;
+        }
+        schedule();
+    }
+    finish_wait(&uart_rx_wait, &wait);
+    return c;
+}
+
 /* Print string */
 void uart_puts(const char *s)
 {
@@ -426,13 +485,22 @@ void uart_interrupt_handler(void)
     iir = uart_read_reg(BOARD_UART_BASE, UART_IIR);
 
     /* Check interrupt type */
-    if ((iir & 0x0F) == 0x04) {
-        /* Received Data Available */
+    if ((iir & 0x0F) == 0x04 || (iir & 0x0F) == 0x0C) {
+        /* Received Data Available / character timeout */
+        int n = 0;
+
         while (uart_rx_ready(BOARD_UART_BASE)) {
             c = uart_read_reg(BOARD_UART_BASE, UART_RBR) & 0xFF;
-            buffer_put(&uart_state.rx_buffer, c);
+            if (buffer_put(&uart_state.rx_buffer, c) == 0) {
+                n++;
+            }
             uart_state.stats.rx_bytes++;
         }
+
+        /* One reader per byte */
+        if (n) {
+            wake_up_nr(&uart_rx_wait, n);
+        }
     } else if ((iir & 0x0F) == 0x02) {
         /* Transmitter Holding Register Empty */
         if (buffer_get(&uart_state.tx_buffer, &c) == 0) {
@@ -444,4 +512,27 @@ void uart_interrupt_handler(void)
             uart_state.tx_busy = 0;
         }
     }
-}
\ No newline at end of file
+}
+
+static void uart_irq(unsigned int irq, void *dev)
+{
+    (void)irq;
+    (void)dev;
+    uart_interrupt_handler();
+}
+
+/* Switch RX to interrupts so readers can sleep; needs a PLIC */
+int uart_irq_init(void)
+{
+#ifdef PLIC_BASE
+    if (request_irq(BOARD_UART_IRQ, uart_irq, NULL) < 0) {
+        return -1;
+    }
+
+    uart_state.rx_irq = 1;
+    uart_enable_rx_interrupt();
+    return 0;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,694 @@
+/* Page Cache Implementation
+ *
+ * File data is cached in 4KB pages owned by the buddy allocator.
+ * Each file gets an address_space holding a radix tree from page
+ * index to cached page. address_spaces are keyed by (filesystem ops,
+ * inode number) rather than by inode pointer: filesystems hand out a
+ * fresh inode_t per lookup and free them on unmount, so a pointer may
+ * be recycled for a different file. Unmount drops the whole
+ * filesystem's pages, since inode numbers restart on the next mount.
+ *
+ * All cached pages sit on one global LRU list. When the buddy
+ * allocator's free page count drops below PAGECACHE_MIN_FREE the
+ * least recently used pages are dropped before new ones are read in,
+ * and kswapd drops them through a shrinker under memory pressure.
+ *
+ * pc_lock covers the mappings, trees and LRU. It is not held while a
+ * missing page is read in: the page is added afterwards, unless a
+ * concurrent reader added it first. Nor is it held while data is
+ * copied out to the reader, who pins the frame with get_page() instead.
+ */
+
+#include <minix/config.h>
+#include <types.h>
+#include <minix/vfs.h>
+#include <minix/mm.h>
+#include <minix/pagecache.h>
+#include <asm/spinlock.h>
+#include <early_print.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Radix tree geometry: 64 slots per node, 6 bits of index per level */
+#define RADIX_MAP_SHIFT     6
+#define RADIX_MAP_SIZE      (1UL << RADIX_MAP_SHIFT)
+#define RADIX_MAP_MASK      (RADIX_MAP_SIZE - 1)
+#define RADIX_MAX_HEIGHT    8
+
+/* Mapping hash table size */
+#define MAPPING_HASH_SIZE   64
+
+/* Radix tree node */
+struct radix_node {
+    void *slots[RADIX_MAP_SIZE];
+    unsigned int count;             /* Non-NULL slots */
+};
+
+/* Per-file cache of pages */
+struct address_space {
+    fs_ops_t *ops;                  /* Owning filesystem */
+    u64 ino;                        /* Inode number within it */
+    struct radix_node *root;        /* Radix tree root */
+    unsigned int height;            /* Radix tree height (0 = empty) */
+    unsigned long nrpages;          /* Cached pages */
+    struct address_space *next;     /* Hash chain */
+};
+
+/* Cached page */
+struct cached_page {
+    struct address_space *mapping;  /* Owning mapping */
+    unsigned long index;            /* Page index within file */
+    unsigned long pa;               /* Page frame */
+    unsigned long valid;            /* Bytes filled from the filesystem */
+    struct cached_page *lru_prev;
+    struct cached_page *lru_next;
+};
+
+/* Mapping hash */
+static struct address_space *mapping_hash[MAPPING_HASH_SIZE];
+
+/* Global LRU: head is most recently used, tail is reclaimed first */
+static struct cached_page *lru_head = NULL;
+static struct cached_page *lru_tail = NULL;
+
+/* Protects the mappings, their trees, the LRU and the counts below */
+static spinlock_t pc_lock = SPIN_LOCK_INIT;
+
+/* Statistics */
+static unsigned long nr_cached = 0;
+static unsigned long pc_hits = 0;
+static unsigned long pc_misses = 0;
+static unsigned long pc_evictions = 0;
+
+/* External functions */
+extern void *memcpy(void *dest, const void *src, unsigned long n);
+extern void *memset(void *s, int c, unsigned long n);
+
+/* ============================================
+ * Mapping Lookup
+ * ============================================ */
+
+static unsigned int mapping_hashfn(fs_ops_t *ops, u64 ino)
+{
+    return (unsigned int)((((unsigned long)ops >> 4) ^ ino) % MAPPING_HASH_SIZE);
+}
+
+static struct address_space *find_mapping(fs_ops_t *ops, u64 ino, int create)
+{
+    unsigned int h = mapping_hashfn(ops, ino);
+    struct address_space *as;
+
+    for (as = mapping_hash[h]; as; as = as->next) {
+        if (as->ops == ops && as->ino == ino)
+            return as;
+    }
+
+    if (!create)
+        return NULL;
+
+    as = (struct address_space *)kmalloc(sizeof(struct address_space));
+    if (!as)
+        return NULL;
+
+    as->ops = ops;
+    as->ino = ino;
+    as->root = NULL;
+    as->height = 0;
+    as->nrpages = 0;
+    as->next = mapping_hash[h];
+    mapping_hash[h] = as;
+
+    return as;
+}
+
+static void release_mapping(struct address_space *as)
+{
+    unsigned int h = mapping_hashfn(as->ops, as->ino);
+    struct address_space **pp;
+
+    for (pp = &mapping_hash[h]; *pp; pp = &(*pp)->next) {
+        if (*pp == as) {
+            *pp = as->next;
+            /* Root left behind by a failed insert */
+            if (as->root && as->root->count == 0)
+                kfree(as->root);
+            kfree(as);
+            return;
+        }
+    }
+}
+
+/* ============================================
+ * Radix Tree
+ * ============================================ */
+
+static struct radix_node *radix_node_alloc(void)
+{
+    struct radix_node *node;
+
+    node = (struct radix_node *)kmalloc(sizeof(struct radix_node));
+    if (node)
+        memset(node, 0, sizeof(struct radix_node));
+
+    return node;
+}
+
+/* Largest index a tree of this height can hold */
+static unsigned long radix_maxindex(unsigned int height)
+{
+    unsigned int bits = height * RADIX_MAP_SHIFT;
+
+    if (bits >= sizeof(unsigned long) * 8)
+        return ~0UL;
+    return (1UL << bits) - 1;
+}
+
+static struct cached_page *radix_lookup(struct address_space *as,
+                                        unsigned long index)
+{
+    struct radix_node *node = as->root;
+    unsigned int shift;
+
+    if (!node || index > radix_maxindex(as->height))
+        return NULL;
+
+    shift = (as->height - 1) * RADIX_MAP_SHIFT;
+    while (shift > 0) {
+        node = (struct radix_node *)node->slots[(index >> shift) & RADIX_MAP_MASK];
+        if (!node)
+            return NULL;
+        shift -= RADIX_MAP_SHIFT;
+    }
+
+    return (struct cached_page *)node->slots[index & RADIX_MAP_MASK];
+}
+
+static int radix_insert(struct address_space *as, unsigned long index,
+                        struct cached_page *page)
+{
+    struct radix_node *node, *child;
+    unsigned int shift, offset;
+
+    /* Grow the tree until index fits */
+    if (!as->root) {
+        as->root = radix_node_alloc();
+        if (!as->root)
+            return -1;
+        as->height = 1;
+    }
+
+    while (index > radix_maxindex(as->height)) {
+        if (as->height >= RADIX_MAX_HEIGHT)
+            return -1;
+        node = radix_node_alloc();
+        if (!node)
+            return -1;
+        node->slots[0] = as->root;
+        node->count = 1;
+        as->root = node;
+        as->height++;
+    }
+
+    /* Walk down, creating interior nodes */
+    node = as->root;
+    shift = (as->height - 1) * RADIX_MAP_SHIFT;
+    while (shift > 0) {
+        offset = (index >> shift) & RADIX_MAP_MASK;
+        child = (struct radix_node *)node->slots[offset];
+        if (!child) {
+            child = radix_node_alloc();
+            if (!child)
+                return -1;
+            node->slots[offset] = child;
+            node->count++;
+        }
+        node = child;
+        shift -= RADIX_MAP_SHIFT;
+    }
+
+    offset = index & RADIX_MAP_MASK;
+    if (node->slots[offset])
+        return -1;
+
+    node->slots[offset] = page;
+    node->count++;
+    return 0;
+}
+
+static void radix_delete(struct address_space *as, unsigned long index)
+{
+    struct radix_node *path[RADIX_MAX_HEIGHT];
+    unsigned int offsets[RADIX_MAX_HEIGHT];
+    struct radix_node *node = as->root;
+    unsigned int shift;
+    int level = 0;
+
+    if (!node || index > radix_maxindex(as->height))
+        return;
+
+    shift = (as->height - 1) * RADIX_MAP_SHIFT;
+    for (;;) {
+        path[level] = node;
+        offsets[level] = (index >> shift) & RADIX_MAP_MASK;
+        if (shift == 0)
+            break;
+        node = (struct radix_node *)node->slots[offsets[level]];
+        if (!node)
+            return;
+        shift -= RADIX_MAP_SHIFT;
+        level++;
+    }
+
+    if (!path[level]->slots[offsets[level]])
+        return;
+
+    /* Clear the leaf slot and free nodes that became empty */
+    while (level >= 0) {
+        node = path[level];
+        node->slots[offsets[level]] = NULL;
+        node->count--;
+        if (node->count > 0)
+            return;
+        kfree(node);
+        level--;
+    }
+
+    as->root = NULL;
+    as->height = 0;
+}
+
+/* ============================================
+ * LRU
+ * ============================================ */
+
+static void lru_del(struct cached_page *page)
+{
+    if (page->lru_prev) {
+        page->lru_prev->lru_next = page->lru_next;
+    } else {
+        lru_head = page->lru_next;
+    }
+    if (page->lru_next) {
+        page->lru_next->lru_prev = page->lru_prev;
+    } else {
+        lru_tail = page->lru_prev;
+    }
+    page->lru_prev = NULL;
+    page->lru_next = NULL;
+}
+
+static void lru_add(struct cached_page *page)
+{
+    page->lru_prev = NULL;
+    page->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = page;
+    } else {
+        lru_tail = page;
+    }
+    lru_head = page;
+}
+
+static void lru_touch(struct cached_page *page)
+{
+    if (page != lru_head) {
+        lru_del(page);
+        lru_add(page);
+    }
+}
+
+/* ============================================
+ * Page Management
+ * ============================================ */
+
+/* Remove a page from its mapping and the LRU, and free it */
+static void drop_page(struct cached_page *page)
+{
+    struct address_space *as = page->mapping;
+
+    radix_delete(as, page->index);
+    lru_del(page);
+    free_page(page->pa);
+    kfree(page);
+
+    nr_cached--;
+    as->nrpages--;
+    if (as->nrpages == 0)
+        release_mapping(as);
+}
+
+/* Drop up to nr least-recently-used pages; pc_lock held */
+static unsigned long __pagecache_shrink(unsigned long nr)
+{
+    unsigned long freed = 0;
+
+    while (freed < nr && lru_tail) {
+        drop_page(lru_tail);
+        freed++;
+    }
+
+    pc_evictions += freed;
+    return freed;
+}
+
+/* Drop up to nr least-recently-used pages */
+unsigned long pagecache_shrink(unsigned long nr)
+{
+    unsigned long flags, freed;
+
+    spin_lock_irqsave(&pc_lock, flags);
+    freed = __pagecache_shrink(nr);
+    spin_unlock_irqrestore(&pc_lock, flags);
+
+    return freed;
+}
+
+/* Read one page of file data through the filesystem; no lock held, as
+ * the page allocation may wait for reclaim
+ */
+static struct cached_page *read_page(fs_ops_t *ops, file_t *file,
+                                     unsigned long index)
+{
+    struct cached_page *page;
+    file_t tmp;
+    ssize_t n;
+
+    page = (struct cached_page *)kmalloc(sizeof(struct cached_page));
+    if (!page)
+        return NULL;
+
+    page->pa = alloc_pages_gfp(0, GFP_KERNEL);
+    if (!page->pa) {
+        kfree(page);
+        return NULL;
+    }
+    memset((void *)page->pa, 0, PAGE_SIZE);
+
+    /* Fill via the filesystem's own read hook at the page offset */
+    tmp = *file;
+    tmp.pos = (u64)index << PAGE_SHIFT;
+    page->valid = 0;
+    while (page->valid < PAGE_SIZE) {
+        n = ops->read(&tmp, (char *)page->pa + page->valid,
+                      PAGE_SIZE - page->valid);
+        if (n <= 0)
+            break;
+        page->valid += n;
+    }
+
+    page->mapping = NULL;
+    page->index = index;
+    page->lru_prev = NULL;
+    page->lru_next = NULL;
+
+    return page;
+}
+
+/* Cache a page read_page() filled, unless another reader cached the
+ * same one meanwhile; returns the cached page, NULL if it could not be
+ * added. pc_lock held
+ */
+static struct cached_page *add_page(fs_ops_t *ops, inode_t *inode,
+                                    struct cached_page *page)
+{
+    struct address_space *as;
+    struct cached_page *old;
+
+    as = find_mapping(ops, inode->ino, 1);
+    if (as) {
+        old = radix_lookup(as, page->index);
+        if (old) {
+            free_page(page->pa);
+            kfree(page);
+            lru_touch(old);
+            return old;
+        }
+
+        if (radix_insert(as, page->index, page) == 0) {
+            page->mapping = as;
+            lru_add(page);
+            nr_cached++;
+            as->nrpages++;
+            return page;
+        }
+
+        if (as->nrpages == 0)
+            release_mapping(as);
+    }
+
+    free_page(page->pa);
+    kfree(page);
+    return NULL;
+}
+
+/* ============================================
+ * VFS Entry Points
+ * ============================================ */
+
+/* Read through the page cache */
+ssize_t pagecache_read(fs_ops_t *ops, file_t *file, void *buf, size_t count)
+{
+    inode_t *inode = file->inode;
+    struct address_space *as;
+    struct cached_page *page;
+    char *dst = (char *)buf;
+    size_t done = 0;
+    unsigned long flags;
+
+    /* Only regular files are cached */
+    if ((inode->mode & S_IFMT) != S_IFREG)
+        return ops->read(file, buf, count);
+
+    if (file->pos >= inode->size)
+        return 0;
+    if (count > inode->size - file->pos)
+        count = inode->size - file->pos;
+
+    /* Make room under memory pressure before caching more pages */
+    spin_lock_irqsave(&pc_lock, flags);
+    while (nr_free_pages() < PAGECACHE_MIN_FREE &&
+           __pagecache_shrink(PAGECACHE_SHRINK_BATCH) > 0)
+        ;
+    spin_unlock_irqrestore(&pc_lock, flags);
+
+    while (done < count) {
+        unsigned long index = file->pos >> PAGE_SHIFT;
+        unsigned long offset = file->pos & (PAGE_SIZE - 1);
+        unsigned long chunk, valid, pa;
+        int last;
+
+        spin_lock_irqsave(&pc_lock, flags);
+        as = find_mapping(ops, inode->ino, 0);
+        page = as ? radix_lookup(as, index) : NULL;
+        if (page) {
+            pc_hits++;
+            lru_touch(page);
+        } else {
+            pc_misses++;
+            spin_unlock_irqrestore(&pc_lock, flags);
+            page = read_page(ops, file, index);
+            spin_lock_irqsave(&pc_lock, flags);
+            if (page)
+                page = add_page(ops, inode, page);
+            if (!page) {
+                /* No memory for caching: fall back to a direct read */
+                ssize_t n;
+
+                spin_unlock_irqrestore(&pc_lock, flags);
+                n = ops->read(file, dst + done, count - done);
+                if (n > 0)
+                    done += n;
+                else if (done == 0)
+                    return n;
+                return (ssize_t)done;
+            }
+        }
+
+        valid = page->valid;
+        if (offset >= valid) {
+            spin_unlock_irqrestore(&pc_lock, flags);
+            break;
+        }
+
+        /* Pin the frame and copy unlocked: the copy may fault, and
+         * reclaim takes pc_lock. A concurrent drop leaves the frame
+         * to our reference
+         */
+        pa = page->pa;
+        get_page(pa);
+        spin_unlock_irqrestore(&pc_lock, flags);
+
+        chunk = valid - offset;
+        if (chunk > count - done)
+            chunk = count - done;
+
+        memcpy(dst + done, (char *)pa + offset, chunk);
+        free_page(pa);
+        done += chunk;
+        file->pos += chunk;
+
+        /* Short page: end of data the filesystem could supply */
+        last = (valid < PAGE_SIZE && offset + chunk >= valid);
+        if (last)
+            break;
+    }
+
+    return (ssize_t)done;
+}
+
+/* Keep cached pages coherent with a write-through */
+void pagecache_write(fs_ops_t *ops, inode_t *inode, u64 pos,
+                     const void *buf, size_t count)
+{
+    struct address_space *as;
+    struct cached_page *page;
+    const char *src = (const char *)buf;
+    u64 end = pos + count;
+    unsigned long flags;
+
+    while (pos < end) {
+        unsigned long index = pos >> PAGE_SHIFT;
+        unsigned long offset = pos & (PAGE_SIZE - 1);
+        unsigned long chunk = PAGE_SIZE - offset;
+        unsigned long pa;
+
+        if (chunk > end - pos)
+            chunk = end - pos;
+
+        /* The mapping goes away with its last page: look it up afresh */
+        spin_lock_irqsave(&pc_lock, flags);
+        as = find_mapping(ops, inode->ino, 0);
+        if (!as) {
+            spin_unlock_irqrestore(&pc_lock, flags);
+            return;
+        }
+        page = radix_lookup(as, index);
+        if (!page) {
+            spin_unlock_irqrestore(&pc_lock, flags);
+            src += chunk;
+            pos += chunk;
+            continue;
+        }
+
+        /* Pin the frame and copy unlocked, as pagecache_read() does */
+        pa = page->pa;
+        get_page(pa);
+        spin_unlock_irqrestore(&pc_lock, flags);
+
+        memcpy((char *)pa + offset, src, chunk);
+
+        /* Still cached in the same frame: extend its data */
+        spin_lock_irqsave(&pc_lock, flags);
+        as = find_mapping(ops, inode->ino, 0);
+        page = as ? radix_lookup(as, index) : NULL;
+        if (page && page->pa == pa) {
+            if (offset + chunk > page->valid)
+                page->valid = offset + chunk;
+            lru_touch(page);
+        }
+        spin_unlock_irqrestore(&pc_lock, flags);
+        free_page(pa);
+
+        src += chunk;
+        pos += chunk;
+    }
+}
+
+/* Drop all cached pages of an inode */
+void pagecache_invalidate(fs_ops_t *ops, inode_t *inode)
+{
+    struct address_space *as;
+    struct cached_page *page, *next;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pc_lock, flags);
+    as = find_mapping(ops, inode->ino, 0);
+    if (!as) {
+        spin_unlock_irqrestore(&pc_lock, flags);
+        return;
+    }
+
+    for (page = lru_head; page; page = next) {
+        next = page->lru_next;
+        if (page->mapping == as) {
+            /* drop_page() frees the mapping with its last page */
+            if (as->nrpages == 1) {
+                drop_page(page);
+                break;
+            }
+            drop_page(page);
+        }
+    }
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+/* Drop all cached pages of a filesystem */
+void pagecache_invalidate_fs(fs_ops_t *ops)
+{
+    struct cached_page *page, *next;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pc_lock, flags);
+    for (page = lru_head; page; page = next) {
+        next = page->lru_next;
+        if (page->mapping->ops == ops)
+            drop_page(page);
+    }
+    spin_unlock_irqrestore(&pc_lock, flags);
+}
+
+/* ============================================
+ * Shrinker
+ * ============================================ */
+
+static unsigned long pagecache_shrink_count(struct shrinker *s)
+{
+    (void)s;
+    return nr_cached;
+}
+
+/* Reclaim runs beside readers: skip a pass rather than wait for them */
+static unsigned long pagecache_shrink_scan(struct shrinker *s, unsigned long nr)
+{
+    unsigned long flags, freed;
+
+    (void)s;
+    flags = local_irq_save();
+    if (!spin_trylock(&pc_lock)) {
+        local_irq_restore(flags);
+        return 0;
+    }
+    freed = __pagecache_shrink(nr);
+    spin_unlock_irqrestore(&pc_lock, flags);
+
+    return freed;
+}
+
+static struct shrinker pagecache_shrinker = {
+    .name = "pagecache",
+    .count_objects = pagecache_shrink_count,
+    .scan_objects = pagecache_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+void pagecache_init(void)
+{
+    register_shrinker(&pagecache_shrinker);
+}
+
+/* Print page cache statistics */
+void pagecache_stats(void)
+{
+    early_puts("\n=== Page Cache Statistics ===\n");
+    early_puts("Cached pages: ");
+    early_puthex(nr_cached);
+    early_puts("\nHits:         ");
+    early_puthex(pc_hits);
+    early_puts("\nMisses:       ");
+    early_puthex(pc_misses);
+    early_puts("\nEvictions:    ");
+    early_puthex(pc_evictions);
+    early_puts("\n");
+}
@@ -3,6 +3,7 @@
 #include <minix/config.h>
 #include <types.h>
 #include <minix/vfs.h>
+#include <minix/pagecache.h>
 #include <early_print.h>
 
 #ifndef NULL
@@ -63,6 +64,8 @@ int vfs_init(void)
         inode_cache[i] = NULL;
     }
 
+    pagecache_init();
+
     return 0;
 }
 
@@ -197,6 +200,7 @@ int vfs_unmount(const char *mount_point)
 
         if (*a == '\0' && *b == '\0') {
             /* Found matching mount point */
+            pagecache_invalidate_fs(mnt->ops);
             if (mnt->ops->unmount) {
                 mnt->ops->unmount(mount_point);
             }
@@ -433,6 +437,11 @@ file_t *vfs_open(const char *path, int flags)
 
     /* Truncate if requested */
     if (flags & O_TRUNC) {
+        /* Cached pages are keyed by the mount vfs_read() uses */
+        mnt = vfs_find_mount("/");
+        if (mnt) {
+            pagecache_invalidate(mnt->ops, inode);
+        }
         inode->size = 0;
         /* Update filesystem-specific size */
         if (inode->fs_private) {
@@ -478,7 +487,8 @@ ssize_t vfs_read(file_t *file, void *buf, size_t count)
         return -1;
     }
 
-    return mnt->ops->read(file, buf, count);
+    /* Hot file data is served from the page cache */
+    return pagecache_read(mnt->ops, file, buf, count);
 }
 
 /* Write to file */
@@ -505,7 +515,13 @@ ssize_t vfs_write(file_t *file, const void *buf, size_t count)
     }
 
     early_puts("[vfs_write] Calling ramfs_write\n");
+    u64 pos = file->pos;
     ssize_t result = mnt->ops->write(file, buf, count);
+
+    /* Write-through: keep any cached copy coherent */
+    if (result > 0) {
+        pagecache_write(mnt->ops, file->inode, pos, buf, (size_t)result);
+    }
     early_puts("[vfs_write] Result: ");
     early_puthex(result);
     early_puts("\n");
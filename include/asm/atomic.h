@@ -0,0 +1,139 @@
+/* RISC-V atomic operations (A extension)
+ *
+ * Operations that return a value are fully ordered (.aqrl, or a
+ * trailing fence for LR/SC loops); the void ones are relaxed, as a
+ * bare counter update orders nothing else.
+ */
+
+#ifndef _ASM_ATOMIC_H
+#define _ASM_ATOMIC_H
+
+#include <types.h>
+
+typedef struct {
+    volatile long counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i)  { (i) }
+
+static inline long atomic_read(const atomic_t *v)
+{
+    return v->counter;
+}
+
+static inline void atomic_set(atomic_t *v, long i)
+{
+    v->counter = i;
+}
+
+static inline void atomic_add(long i, atomic_t *v)
+{
+    asm volatile ("amoadd.d zero, %1, %0"
+                  : "+A"(v->counter) : "r"(i) : "memory");
+}
+
+static inline void atomic_sub(long i, atomic_t *v)
+{
+    atomic_add(-i, v);
+}
+
+static inline void atomic_inc(atomic_t *v)
+{
+    atomic_add(1, v);
+}
+
+static inline void atomic_dec(atomic_t *v)
+{
+    atomic_add(-1, v);
+}
+
+/* Returns the value before the add */
+static inline long atomic_fetch_add(long i, atomic_t *v)
+{
+    long old;
+
+    asm volatile ("amoadd.d.aqrl %0, %2, %1"
+                  : "=r"(old), "+A"(v->counter) : "r"(i) : "memory");
+    return old;
+}
+
+static inline long atomic_add_return(long i, atomic_t *v)
+{
+    return atomic_fetch_add(i, v) + i;
+}
+
+static inline long atomic_sub_return(long i, atomic_t *v)
+{
+    return atomic_fetch_add(-i, v) - i;
+}
+
+static inline int atomic_inc_and_test(atomic_t *v)
+{
+    return atomic_add_return(1, v) == 0;
+}
+
+/* Dropping the last reference also orders the teardown after it */
+static inline int atomic_dec_and_test(atomic_t *v)
+{
+    return atomic_sub_return(1, v) == 0;
+}
+
+static inline long atomic_fetch_or(long mask, atomic_t *v)
+{
+    long old;
+
+    asm volatile ("amoor.d.aqrl %0, %2, %1"
+                  : "=r"(old), "+A"(v->counter) : "r"(mask) : "memory");
+    return old;
+}
+
+static inline long atomic_fetch_and(long mask, atomic_t *v)
+{
+    long old;
+
+    asm volatile ("amoand.d.aqrl %0, %2, %1"
+                  : "=r"(old), "+A"(v->counter) : "r"(mask) : "memory");
+    return old;
+}
+
+static inline long atomic_xchg(atomic_t *v, long new)
+{
+    long old;
+
+    asm volatile ("amoswap.d.aqrl %0, %2, %1"
+                  : "=r"(old), "+A"(v->counter) : "r"(new) : "memory");
+    return old;
+}
+
+/* Compare-and-swap on a doubleword; returns the value found */
+static inline u64 cmpxchg64(volatile u64 *ptr, u64 old, u64 new)
+{
+    u64 prev;
+    unsigned long rc;
+
+    asm volatile ("0:  lr.d     %0, %2\n"
+                  "    bne      %0, %3, 1f\n"
+                  "    sc.d.rl  %1, %4, %2\n"
+                  "    bnez     %1, 0b\n"
+                  "    fence    rw, rw\n"
+                  "1:\n"
+                  : "=&r"(prev), "=&r"(rc), "+A"(*ptr)
+                  : "r"(old), "r"(new)
+                  : "memory");
+    return prev;
+}
+
+static inline long atomic_cmpxchg(atomic_t *v, long old, long new)
+{
+    return (long)cmpxchg64((volatile u64 *)&v->counter, (u64)old, (u64)new);
+}
+
+/* Let a spinning hart yield pipeline resources (Zihintpause pause,
+ * a hint that executes as a no-op where unimplemented)
+ */
+static inline void cpu_relax(void)
+{
+    asm volatile (".word 0x0100000f" ::: "memory");
+}
+
+#endif /* _ASM_ATOMIC_H */
@@ -0,0 +1,40 @@
+/* RISC-V external interrupt (PLIC) interface */
+
+#ifndef _ASM_IRQ_H
+#define _ASM_IRQ_H
+
+#include <types.h>
+
+/* Maximum interrupt source number handled */
+#define NR_IRQS         128
+
+/* Interrupt handler: called with the registered device pointer */
+typedef void (*irq_handler_t)(unsigned int irq, void *dev);
+
+/* Initialize the PLIC for this hart's S-mode context */
+void plic_init(void);
+
+/* Claim, dispatch and complete pending external interrupts */
+void plic_handle_irq(void);
+
+/* Register a handler and enable the interrupt source */
+int request_irq(unsigned int irq, irq_handler_t handler, void *dev);
+
+/* Disable the interrupt source and drop its handler */
+void free_irq(unsigned int irq);
+
+/* Save/restore the S-mode interrupt enable bit */
+static inline unsigned long local_irq_save(void)
+{
+    unsigned long flags;
+    asm volatile ("csrrci %0, sstatus, 0x2" : "=r"(flags) :: "memory");
+    return flags & 0x2;
+}
+
+static inline void local_irq_restore(unsigned long flags)
+{
+    if (flags)
+        asm volatile ("csrsi sstatus, 0x2" ::: "memory");
+}
+
+#endif /* _ASM_IRQ_H */
@@ -0,0 +1,113 @@
+/* RISC-V Supervisor Binary Interface (S-mode calls) */
+
+#ifndef _ASM_SBI_H
+#define _ASM_SBI_H
+
+#include <types.h>
+
+/* Extension IDs */
+#define SBI_EXT_BASE            0x10
+#define SBI_EXT_TIME            0x54494D45  /* "TIME" */
+#define SBI_EXT_IPI             0x735049    /* "sPI" */
+#define SBI_EXT_HSM             0x48534D    /* "HSM" */
+#define SBI_EXT_RFENCE          0x52464E43  /* "RFNC" */
+
+/* Base extension functions */
+#define SBI_BASE_PROBE_EXT      3
+
+/* TIME extension functions */
+#define SBI_TIME_SET_TIMER      0
+
+/* IPI extension functions */
+#define SBI_IPI_SEND_IPI        0
+
+/* RFENCE extension functions */
+#define SBI_RFENCE_REMOTE_SFENCE_VMA    1
+
+/* HSM extension functions */
+#define SBI_HSM_HART_START      0
+#define SBI_HSM_HART_STOP       1
+#define SBI_HSM_HART_STATUS     2
+
+/* HSM hart states */
+#define SBI_HSM_STARTED         0
+#define SBI_HSM_STOPPED         1
+#define SBI_HSM_START_PENDING   2
+
+/* Error codes */
+#define SBI_SUCCESS             0
+#define SBI_ERR_FAILED          (-1)
+#define SBI_ERR_NOT_SUPPORTED   (-2)
+#define SBI_ERR_INVALID_PARAM   (-3)
+#define SBI_ERR_ALREADY_AVAILABLE (-6)
+
+struct sbiret {
+    long error;
+    long value;
+};
+
+static inline struct sbiret sbi_ecall(unsigned long ext, unsigned long fid,
+                                      unsigned long arg0, unsigned long arg1,
+                                      unsigned long arg2, unsigned long arg3)
+{
+    register unsigned long a0 asm("a0") = arg0;
+    register unsigned long a1 asm("a1") = arg1;
+    register unsigned long a2 asm("a2") = arg2;
+    register unsigned long a3 asm("a3") = arg3;
+    register unsigned long a6 asm("a6") = fid;
+    register unsigned long a7 asm("a7") = ext;
+    struct sbiret ret;
+
+    asm volatile ("ecall"
+                  : "+r"(a0), "+r"(a1)
+                  : "r"(a2), "r"(a3), "r"(a6), "r"(a7)
+                  : "memory");
+
+    ret.error = (long)a0;
+    ret.value = (long)a1;
+    return ret;
+}
+
+/* Set by the M-mode runtime when S-mode may program stimecmp (Sstc) */
+extern volatile int sbi_sstc_enabled;
+
+/* Program the next supervisor timer interrupt (absolute time) */
+static inline long sbi_set_timer(u64 stime_value)
+{
+    return sbi_ecall(SBI_EXT_TIME, SBI_TIME_SET_TIMER, stime_value, 0, 0, 0).error;
+}
+
+/* Start a stopped hart in S-mode at start_addr with a0 = hartid, a1 = opaque */
+static inline long sbi_hart_start(unsigned long hartid, unsigned long start_addr,
+                                  unsigned long opaque)
+{
+    return sbi_ecall(SBI_EXT_HSM, SBI_HSM_HART_START,
+                     hartid, start_addr, opaque, 0).error;
+}
+
+/* Returns an SBI_HSM_* state, or a negative SBI error */
+static inline long sbi_hart_get_status(unsigned long hartid)
+{
+    struct sbiret ret = sbi_ecall(SBI_EXT_HSM, SBI_HSM_HART_STATUS, hartid, 0, 0, 0);
+    return ret.error ? ret.error : ret.value;
+}
+
+/* Raise a supervisor software interrupt on every hart in the mask */
+static inline long sbi_send_ipi(unsigned long hart_mask, unsigned long hart_mask_base)
+{
+    return sbi_ecall(SBI_EXT_IPI, SBI_IPI_SEND_IPI,
+                     hart_mask, hart_mask_base, 0, 0).error;
+}
+
+/* Have every hart in the mask flush its TLB for [start, start + size)
+ * (size -1: everything); returns once they all have
+ */
+static inline long sbi_remote_sfence_vma(unsigned long hart_mask,
+                                         unsigned long hart_mask_base,
+                                         unsigned long start, unsigned long size)
+{
+    return sbi_ecall(SBI_EXT_RFENCE, SBI_RFENCE_REMOTE_SFENCE_VMA,
+                     hart_mask, hart_mask_base, start, size).error;
+}
+
+#endif /* _ASM_SBI_H */
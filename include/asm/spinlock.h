@@ -0,0 +1,90 @@
+/* RISC-V ticket spinlocks
+ *
+ * A hart takes the next ticket with one AMO and spins reading the
+ * owner field until its number comes up, so harts are served in FIFO
+ * order and waiters only read the lock's cache line. Both halves share
+ * a doubleword, which lets trylock claim a ticket with a single
+ * compare-and-swap; unlock is a release store of the owner half.
+ */
+
+#ifndef _ASM_SPINLOCK_H
+#define _ASM_SPINLOCK_H
+
+#include <types.h>
+#include <asm/atomic.h>
+#include <asm/irq.h>
+
+typedef struct {
+    union {
+        volatile u64 val;
+        struct {
+            volatile u32 owner;     /* Ticket being served */
+            volatile u32 next;      /* Next ticket to hand out */
+        } tickets;
+    };
+} spinlock_t;
+
+#define TICKET_NEXT     (1UL << 32)
+
+#define SPIN_LOCK_INIT  { { 0 } }
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+    lock->val = 0;
+}
+
+static inline int spin_is_locked(spinlock_t *lock)
+{
+    u64 val = lock->val;
+    return (u32)val != (u32)(val >> 32);
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    u64 old;
+    u32 ticket;
+
+    asm volatile ("amoadd.d.aq %0, %2, %1"
+                  : "=r"(old), "+A"(lock->val) : "r"(TICKET_NEXT) : "memory");
+    ticket = (u32)(old >> 32);
+    if ((u32)old == ticket) {
+        return;     /* Uncontended: the AMO acquired */
+    }
+
+    while (lock->tickets.owner != ticket) {
+        cpu_relax();
+    }
+    asm volatile ("fence r, rw" ::: "memory");
+}
+
+/* Returns non-zero if the lock was taken */
+static inline int spin_trylock(spinlock_t *lock)
+{
+    u64 old = lock->val;
+
+    if ((u32)old != (u32)(old >> 32)) {
+        return 0;
+    }
+    return cmpxchg64(&lock->val, old, old + TICKET_NEXT) == old;
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    asm volatile ("fence rw, w" ::: "memory");
+    lock->tickets.owner = lock->tickets.owner + 1;
+}
+
+/* Interrupt-safe variants for locks also taken from trap handlers */
+#define spin_lock_irqsave(lock, flags)          \
+    do {                                        \
+        (flags) = local_irq_save();             \
+        spin_lock(lock);                        \
+    } while (0)
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
+{
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+#endif /* _ASM_SPINLOCK_H */
@@ -5,7 +5,7 @@
 
 /* Physical memory map */
 #define CV1800B_DRAM_BASE       0x80000000UL
-#define CV1800B_DRAM_SIZE       (512 * 1024 * 1024)  /* 512MB */
+#define CV1800B_DRAM_SIZE       (64 * 1024 * 1024)   /* 64MB in-package DDR2 */
 
 /* I/O register base addresses */
 #define CV1800B_IO_BASE         0x07000000UL
@@ -18,6 +18,7 @@
 #define CV1800B_UART2_BASE      0x04142000UL
 #define CV1800B_UART3_BASE      0x04143000UL
 #define CV1800B_UART4_BASE      0x04144000UL
+#define CV1800B_UART0_IRQ       44          /* PLIC source of UART0 */
 
 /* UART register offsets */
 #define UART_RBR                0x00    /* Receiver Buffer Register */
@@ -40,6 +41,7 @@
 /* Timer */
 #define CV1800B_TIMER_BASE      0x02020000UL
 #define TIMER_BASE              CV1800B_TIMER_BASE
+#define CV1800B_TIMEBASE_FREQ   25000000    /* time CSR rate (25MHz) */
 
 /* Clock control */
 #define CV1800B_CLK_CONTROL     0x74    /* System clock control register */
@@ -30,6 +30,7 @@
 /* UART16550A */
 #define QEMU_VIRT_UART0_BASE  0x10000000UL
 #define QEMU_VIRT_UART1_BASE  0x10000100UL
+#define QEMU_VIRT_UART0_IRQ   10
 
 /* HTIF (Host Target Interface) for early console */
 #define HTIF_BASE             0x40008000UL
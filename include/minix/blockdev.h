@@ -4,6 +4,52 @@
 #define _MINIX_BLOCKDEV_H
 
 #include <types.h>
+#include <asm/spinlock.h>
+
+struct block_dev;
+struct bio;
+
+/* Bio completion callback, error is non-zero on I/O failure */
+typedef void (*bio_end_io_t)(struct bio *bio, int error);
+
+/* Block I/O unit: one contiguous range of blocks and one buffer */
+typedef struct bio {
+    u32 block_num;                  /* First block */
+    u32 count;                      /* Number of blocks */
+    void *buf;                      /* Data buffer */
+    int write;                      /* Non-zero for writes */
+    bio_end_io_t end_io;            /* Completion callback */
+    void *private;                  /* Owner data for end_io */
+    struct bio *next;               /* Next bio in a merged request */
+} bio_t;
+
+/* Request: adjacent bios merged into one device transfer */
+typedef struct request {
+    struct block_dev *dev;
+    u32 block_num;                  /* First block */
+    u32 count;                      /* Total blocks */
+    int write;
+    unsigned int nr_segments;       /* Page-bounded buffer pieces */
+    bio_t *bio;                     /* Bios in block order */
+    bio_t *biotail;
+    int error;                      /* Completion status */
+    struct request *next;           /* Queue order (sorted by block) */
+} request_t;
+
+/* Per-device request queue */
+typedef struct request_queue {
+    spinlock_t lock;                /* Protects head, done and the counts */
+    request_t *head;                /* Pending requests, sorted by block */
+    request_t *done;                /* Completed by the driver, not yet ended */
+    u32 last_pos;                   /* Elevator position (end of last dispatch) */
+    int plugged;                    /* Plug depth; dispatch is held while > 0 */
+    int running;                    /* Dispatch in progress */
+    unsigned int nr_inflight;       /* Dispatched, not yet completed */
+    unsigned int max_segments;      /* Driver limit per request */
+    u32 max_blocks;                 /* Driver limit per request */
+    unsigned long nr_merges;        /* Statistics */
+    unsigned long nr_dispatched;
+} request_queue_t;
 
 /* Block device operations */
 typedef struct block_dev_ops {
@@ -19,6 +65,15 @@ typedef struct block_dev_ops {
     /* Get total blocks */
     u64 (*get_total_blocks)(void);
 
+    /* Optional asynchronous interface used by the request queue.
+     * submit_request returns -1 when the device cannot take more
+     * requests; the driver calls blk_end_request() on completion,
+     * possibly from its interrupt handler.
+     */
+    int (*submit_request)(request_t *rq);
+    void (*kick)(void);             /* Start queued requests */
+    void (*poll)(void);             /* Reap completions */
+
     /* Device name */
     const char *name;
 } block_dev_ops_t;
@@ -30,6 +85,9 @@ typedef struct block_dev {
     void *private;
     u32 block_size;
     u64 total_blocks;
+    unsigned long cache_hits;       /* Buffer cache hits */
+    unsigned long cache_misses;     /* Buffer cache misses */
+    request_queue_t queue;          /* Request queue */
 } block_dev_t;
 
 #endif /* _MINIX_BLOCKDEV_H */
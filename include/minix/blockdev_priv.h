@@ -13,5 +13,17 @@ block_dev_t *blockdev_find(const char *name);
 ssize_t blockdev_read(block_dev_t *dev, u32 block_num, void *buf, u32 count);
 ssize_t blockdev_write(block_dev_t *dev, u32 block_num, const void *buf, u32 count);
 int blockdev_flush(block_dev_t *dev);
+void blockdev_set_cache_size(unsigned long nr_buffers);
+void blockdev_stats(void);
+
+/* Request queue functions */
+int blk_queue_init(void);
+void blk_queue_setup(block_dev_t *dev);
+void submit_bio(block_dev_t *dev, bio_t *bio);
+void blk_end_request(request_t *rq, int error);
+void blk_run_queue(block_dev_t *dev);
+void blk_start_plug(block_dev_t *dev);
+void blk_finish_plug(block_dev_t *dev);
+void blk_poll(block_dev_t *dev);
 
 #endif /* _MINIX_BLOCKDEV_PRIV_H */
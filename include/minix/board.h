@@ -31,8 +31,16 @@ void board_irq_init(void);
 /* Common board functions */
 #if BOARD == BOARD_MILKV_DUO
 #define BOARD_UART_BASE      CV1800B_UART0_BASE
+#define BOARD_UART_IRQ       CV1800B_UART0_IRQ
+#define BOARD_TIMEBASE_FREQ  CV1800B_TIMEBASE_FREQ
+#define BOARD_DRAM_BASE      CV1800B_DRAM_BASE
+#define BOARD_DRAM_SIZE      CV1800B_DRAM_SIZE
 #elif BOARD == BOARD_QEMU_VIRT
 #define BOARD_UART_BASE      QEMU_VIRT_UART0_BASE
+#define BOARD_UART_IRQ       QEMU_VIRT_UART0_IRQ
+#define BOARD_TIMEBASE_FREQ  QEMU_VIRT_CLOCK_FREQ
+#define BOARD_DRAM_BASE      QEMU_VIRT_DRAM_BASE
+#define BOARD_DRAM_SIZE      QEMU_VIRT_DRAM_SIZE
 #endif
 
 #endif /* _MINIX_BOARD_H */
\ No newline at end of file
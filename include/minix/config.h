@@ -10,7 +10,10 @@
 /* CPU configuration */
 #define RISCV_64           1
 #define RISCV_FREQ_MHZ     1000    /* 1GHz */
-#define SMP_CPUS           1       /* Single core initially */
+#ifndef SMP_CPUS
+#define SMP_CPUS           4       /* Max harts brought up; set from the Makefile */
+#endif
+#define L1_CACHE_BYTES     64      /* Data cache line */
 
 /* Memory configuration */
 #define KERNEL_BASE_ADDR   0x80000000
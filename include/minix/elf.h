@@ -204,6 +204,16 @@ typedef struct {
 /* Load ELF executable */
 int load_elf_binary(const char *path, struct task_struct *task);
 
+/* Load ELF from an image reference; the mm takes its own references */
+struct vm_image;
+int load_elf_image(struct vm_image *image, struct task_struct *task,
+                   char **argv, char **envp);
+
+/* Load ELF from memory that outlives the task (e.g., embedded) */
+int load_elf_from_memory(const void *elf_data, unsigned long elf_size,
+                         struct task_struct *task,
+                         char **argv, char **envp);
+
 /* Check if file is valid ELF */
 int is_elf_binary(const void *data, unsigned long size);
 
@@ -0,0 +1,77 @@
+/* Flattened Device Tree (FDT) parsing
+ *
+ * The boot loader hands the kernel a device tree blob in a1. These
+ * helpers walk it in place; nothing is copied or unflattened.
+ */
+
+#ifndef _MINIX_FDT_H
+#define _MINIX_FDT_H
+
+#include <types.h>
+
+#define FDT_MAGIC           0xd00dfeed
+
+/* Structure block tokens */
+#define FDT_BEGIN_NODE      0x1
+#define FDT_END_NODE        0x2
+#define FDT_PROP            0x3
+#define FDT_NOP             0x4
+#define FDT_END             0x9
+
+/* Header, all fields big-endian */
+struct fdt_header {
+    u32 magic;
+    u32 totalsize;
+    u32 off_dt_struct;
+    u32 off_dt_strings;
+    u32 off_mem_rsvmap;
+    u32 version;
+    u32 last_comp_version;
+    u32 boot_cpuid_phys;
+    u32 size_dt_strings;
+    u32 size_dt_struct;
+};
+
+/* One step of a structure block walk */
+struct fdt_token {
+    u32 type;                   /* FDT_BEGIN_NODE, FDT_END_NODE, FDT_PROP or FDT_END */
+    const char *name;           /* Node name, or property name */
+    const void *data;           /* Property value */
+    u32 len;                    /* Property length in bytes */
+};
+
+/* Device tree pointer passed in a1 at boot, 0 if none (start.S) */
+extern unsigned long boot_fdt;
+
+static inline u32 fdt32_to_cpu(u32 x)
+{
+    return __builtin_bswap32(x);
+}
+
+/* Read a value of cells 32-bit cells (1 or 2) from a property */
+static inline u64 fdt_read_cells(const u32 *p, int cells)
+{
+    u64 val = 0;
+
+    while (cells-- > 0) {
+        val = (val << 32) | fdt32_to_cpu(*p++);
+    }
+    return val;
+}
+
+/* Returns 0 if fdt points to a blob we can parse, -1 otherwise */
+int fdt_check_header(const void *fdt);
+
+/* Size of the whole blob in bytes */
+unsigned long fdt_totalsize(const void *fdt);
+
+/* Decode the token at offset (0 = start of the structure block) and
+ * return the offset of the next one, or -1 on a malformed blob.
+ * NOP tokens are skipped.
+ */
+int fdt_next_token(const void *fdt, int offset, struct fdt_token *tok);
+
+/* Entry n of the memory reservation map: 0, or -1 past the end */
+int fdt_get_mem_rsv(const void *fdt, int n, u64 *addr, u64 *size);
+
+#endif /* _MINIX_FDT_H */
@@ -19,6 +19,12 @@
 #define PTE_G               (1UL << 5)    /* Global */
 #define PTE_A               (1UL << 6)    /* Accessed */
 #define PTE_D               (1UL << 7)    /* Dirty */
+#define PTE_COW             (1UL << 8)    /* Software (RSW): copy-on-write */
+#define PTE_N               (1UL << 63)   /* Svnapot: part of a NAPOT range */
+
+/* PTE layout */
+#define PTE_PPN_SHIFT       10
+#define PTE_FLAGS_MASK      0x3FFUL       /* V/R/W/X/U/G/A/D + 2 RSW bits */
 
 /* Common flag combinations */
 #define PTE_KERNEL_RW       (PTE_V | PTE_R | PTE_W | PTE_A | PTE_D)
@@ -30,6 +36,11 @@
 #define PTE_USER_RX         (PTE_V | PTE_R | PTE_X | PTE_U | PTE_A)
 #define PTE_USER_RWX        (PTE_V | PTE_R | PTE_W | PTE_X | PTE_U | PTE_A | PTE_D)
 
+/* Svnapot 64KB ranges: 16 identical leaf PTEs, naturally aligned */
+#define NAPOT_ORDER         4
+#define NAPOT_PAGES         (1UL << NAPOT_ORDER)
+#define NAPOT_SIZE          (NAPOT_PAGES * PAGE_SIZE)
+
 /* ============================================
  * Memory Management Initialization
  * ============================================ */
@@ -37,11 +48,48 @@
 /* Initialize all memory management subsystems */
 void mm_init(void);
 
+/* ============================================
+ * Boot Memory Map (memblock)
+ * ============================================ */
+
+/* Highest physical address the kernel manages (64GB) */
+#define MAX_PHYSMEM_BITS    36
+
+/* Find RAM banks and reserved ranges (device tree or board default) */
+void memblock_init(void);
+
+/* Add a RAM bank / reserve a range; -1 if the table is full */
+int memblock_add(unsigned long base, unsigned long size);
+int memblock_reserve(unsigned long base, unsigned long size);
+
+/* RAM bank n as [base, end): 0, or -1 past the last bank */
+int memblock_memory_region(int n, unsigned long *base, unsigned long *end);
+
+/* Next unreserved RAM range [start, end) at or above *pos; advances *pos.
+ * Returns -1 when there is none.
+ */
+int memblock_next_free(unsigned long *pos, unsigned long *start, unsigned long *end);
+
+/* Reserve and return size bytes of boot memory, 0 if none fits */
+unsigned long memblock_alloc(unsigned long size, unsigned long align);
+
 /* ============================================
  * Physical Page Allocator (Buddy System)
  * ============================================ */
 
+/* Allocation context. The caller states whether it may sleep; the
+ * allocator never infers it from the interrupt state, since a spinlock
+ * can be held with interrupts enabled.
+ */
+typedef unsigned int gfp_t;
+#define __GFP_RECLAIM       0x1     /* May wait for kswapd after a failure */
+#define GFP_ATOMIC          0       /* Holds a lock or cannot sleep */
+#define GFP_KERNEL          __GFP_RECLAIM   /* Process context, no lock held */
+
 /* Allocate 2^order contiguous pages, returns physical address */
+unsigned long alloc_pages_gfp(int order, gfp_t gfp);
+
+/* alloc_pages_gfp(order, GFP_ATOMIC): never sleeps */
 unsigned long alloc_pages(int order);
 
 /* Free 2^order contiguous pages */
@@ -53,12 +101,46 @@ unsigned long alloc_page(void);
 /* Free single page (convenience function) */
 void free_page(unsigned long addr);
 
+/* Take an extra reference on an allocated page */
+void get_page(unsigned long addr);
+
+/* Get reference count of an allocated page */
+unsigned long page_count(unsigned long addr);
+
+/* Order of the allocated block at addr, -1 if addr does not start one */
+int page_order(unsigned long addr);
+
+/* Make the 2^order pages of an allocated block independent pages */
+void split_page(unsigned long addr, int order);
+
+/* Tag the pages of an allocated block as backing a slab (NULL untags) */
+void set_page_slab(unsigned long addr, int order, void *slab);
+
+/* Slab owning the page addr lies in, NULL if none */
+void *page_slab(unsigned long addr);
+
 /* Get memory statistics */
 void get_mem_info(unsigned long *total, unsigned long *free);
 
+/* Get number of free pages */
+unsigned long nr_free_pages(void);
+
+/* Return this hart's cached order-0 pages to the buddy lists */
+void drain_local_pages(void);
+
 /* Print buddy allocator statistics */
 void buddy_stats(void);
 
+/* Free page watermarks: below low the allocator wakes kswapd, which
+ * reclaims until free pages are back above high
+ */
+#define WMARK_LOW           0
+#define WMARK_HIGH          1
+#define NR_WMARK            2
+
+/* Free page count for a watermark */
+unsigned long zone_watermark(int wmark);
+
 /* ============================================
  * Slab Allocator (Object Allocator)
  * ============================================ */
@@ -66,8 +148,13 @@ void buddy_stats(void);
 /* Slab cache structure (opaque) */
 struct slab_cache;
 
-/* Create a new slab cache for objects of given size */
-struct slab_cache *kmem_cache_create(const char *name, unsigned long size);
+/* Create a new slab cache for objects of given size. ctor runs on each
+ * object when its slab is made and dtor when the slab is freed (either
+ * may be NULL); objects must be freed back in their constructed state.
+ */
+struct slab_cache *kmem_cache_create(const char *name, unsigned long size,
+                                     void (*ctor)(void *obj),
+                                     void (*dtor)(void *obj));
 
 /* Destroy a slab cache */
 void kmem_cache_destroy(struct slab_cache *cache);
@@ -78,6 +165,15 @@ void *kmem_cache_alloc(struct slab_cache *cache);
 /* Free object back to slab cache */
 void kmem_cache_free(struct slab_cache *cache, void *obj);
 
+/* Allocate nr objects into p, all or nothing: returns nr, or 0 */
+int kmem_cache_alloc_bulk(struct slab_cache *cache, unsigned long nr, void **p);
+
+/* Free nr objects from p */
+void kmem_cache_free_bulk(struct slab_cache *cache, unsigned long nr, void **p);
+
+/* Return this hart's cached objects to the cache's slabs */
+void kmem_cache_drain_local(struct slab_cache *cache);
+
 /* Generic kernel memory allocation (like malloc) */
 void *kmalloc(unsigned long size);
 
@@ -89,6 +185,47 @@ void kmalloc_stats(void);
 void kmalloc_dump(void);
 int kmalloc_verify(void);
 
+/* ============================================
+ * Memory Reclaim (shrinkers, kswapd)
+ * ============================================ */
+
+/* A cache that can give memory back under pressure. count_objects says
+ * how many objects could be freed, scan_objects frees up to nr of them
+ * and returns how many it did. Neither may sleep or allocate; a cache
+ * that is busy just returns 0.
+ */
+struct shrinker {
+    const char *name;
+    unsigned long (*count_objects)(struct shrinker *s);
+    unsigned long (*scan_objects)(struct shrinker *s, unsigned long nr);
+    int seeks;                      /* Cost to recreate an object */
+    unsigned long nr_scanned;       /* Statistics: objects asked for */
+    unsigned long nr_freed;         /* Statistics: objects freed */
+    struct shrinker *next;
+};
+
+#define DEFAULT_SEEKS       2
+
+void register_shrinker(struct shrinker *s);
+void unregister_shrinker(struct shrinker *s);
+
+/* Ask every shrinker for 1/2^priority of its objects; returns objects freed */
+unsigned long shrink_slab(int priority);
+
+/* Start the reclaim thread */
+void kswapd_init(void);
+
+/* Have kswapd reclaim up to the high watermark (safe with interrupts off) */
+void wakeup_kswapd(void);
+
+/* After a failed allocation: wait for a kswapd pass if gfp allows the
+ * caller to sleep. Returns 1 if it waited (worth retrying), 0 otherwise
+ */
+int reclaim_throttle(gfp_t gfp);
+
+/* Print reclaim statistics */
+void reclaim_stats(void);
+
 /* ============================================
  * Page Table Management
  * ============================================ */
@@ -97,18 +234,75 @@ int kmalloc_verify(void);
 typedef unsigned long pte_t;
 typedef unsigned long pgd_t;
 
+/* Physical address mapped by a page table entry */
+static inline unsigned long pte_to_pa(pte_t pte)
+{
+    return (pte >> PTE_PPN_SHIFT) << PAGE_SHIFT;
+}
+
+/* Build a page table entry for a physical address */
+static inline pte_t pa_to_pte(unsigned long pa, unsigned long flags)
+{
+    return ((pa >> PAGE_SHIFT) << PTE_PPN_SHIFT) | flags;
+}
+
+/* Entry is one of the 16 of a 64KB NAPOT range */
+static inline int pte_napot(pte_t pte)
+{
+    return (pte & PTE_N) != 0;
+}
+
+/* Physical address of the 4KB page at va mapped by pte: a NAPOT entry
+ * encodes only the 64KB block, the page within it comes from va
+ */
+static inline unsigned long pte_page_pa(pte_t pte, unsigned long va)
+{
+    if (pte_napot(pte))
+        return (pte_to_pa(pte) & ~(NAPOT_SIZE - 1)) |
+               (va & (NAPOT_SIZE - 1) & PAGE_MASK);
+    return pte_to_pa(pte);
+}
+
 /* Initialize kernel page tables */
 int pgtable_init(void);
 
 /* Enable MMU */
 void enable_mmu(void);
+void enable_mmu_secondary(void);
 
 /* Get kernel page directory */
 pgd_t *get_kernel_pgd(void);
 
+/* Populate the kernel's top-level slots for [start, end) up front */
+int pgtable_prealloc_kernel(unsigned long start, unsigned long end);
+
+/* Allocate a process root page table sharing the kernel mappings */
+pgd_t *pgd_alloc(void);
+
+/* Free a process page table (user levels only) */
+void pgd_free(pgd_t *pgd);
+
+/* Walk to the 4KB PTE for va, optionally creating tables (NULL on superpage) */
+pte_t *get_pte(pgd_t *pgd, unsigned long va, int create);
+
 /* Map a 4KB page */
 int map_page_4k(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags);
 
+/* Map a 64KB NAPOT range (16 pages); -1 without Svnapot or if any of
+ * the 16 entries is in use
+ */
+int map_page_64k(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags);
+
+/* Rewrite the NAPOT range holding va as 16 ordinary entries */
+void napot_split(pgd_t *pgd, unsigned long va);
+
+/* Svnapot: probe the device tree (boot, before the MMU) */
+void svnapot_init(void);
+int has_svnapot(void);
+
+/* Print NAPOT mapping statistics */
+void napot_stats(void);
+
 /* Map a 2MB megapage */
 int map_page_2m(pgd_t *pgd, unsigned long va, unsigned long pa, unsigned long flags);
 
@@ -138,10 +332,51 @@ void flush_tlb_page(unsigned long addr);
 void flush_tlb_mm(unsigned long asid);
 void flush_tlb_range(unsigned long start, unsigned long size);
 
-/* Address conversion (identity mapping for now) */
+/* Flush a kernel range on every online hart */
+void flush_tlb_kernel_range(unsigned long start, unsigned long size);
+
+/* Flush a user page / all user entries of an mm on every hart that has
+ * loaded it (see arch/riscv64/mm/context.c)
+ */
+struct mm_struct;
+void flush_tlb_user_page(struct mm_struct *mm, unsigned long addr);
+void flush_tlb_user_mm(struct mm_struct *mm);
+
+/* Clear kernel 4KB mappings without flushing (see flush_tlb_kernel_range) */
+void unmap_kernel_range_noflush(unsigned long start, unsigned long size);
+
+/* Address space IDs: probe satp (boot hart, MMU on) */
+struct mm_struct;
+void asid_init(void);
+
+/* Load an address space's page table and ASID on this hart */
+void switch_mm_asid(struct mm_struct *mm);
+
+/* Print ASID allocator statistics */
+void asid_stats(void);
+
+/* Kernel direct map: all RAM at PAGE_OFFSET + physical address */
+#define PAGE_OFFSET         0xFFFFFFC000000000UL
+#define DIRECT_MAP_SIZE     (1UL << MAX_PHYSMEM_BITS)
+
+/* The kernel itself still runs on an identity map of the Sv39 lower
+ * half. Only kernel_pgd holds it; process page tables share just the
+ * upper half.
+ */
+#define IDENTITY_MAP_END    0x4000000000UL
+
+/* Address conversion: physical to direct map, and back from the direct
+ * map, the identity map or a vmalloc/ioremap address (0 if unmapped)
+ */
 unsigned long virt_to_phys(unsigned long virt_addr);
 unsigned long phys_to_virt(unsigned long phys_addr);
 
+/* Map / unmap a 4KB page in the kernel page table (flags 0: read/write).
+ * map_page returns virt_addr, 0 on failure
+ */
+unsigned long map_page(unsigned long phys_addr, unsigned long virt_addr, int flags);
+void unmap_page(unsigned long virt_addr);
+
 /* Debug */
 void dump_pte(unsigned long va);
 
@@ -152,7 +387,7 @@ void dump_pte(unsigned long va);
 /* Initialize vmalloc subsystem */
 void vmalloc_init(void);
 
-/* Allocate virtually contiguous kernel memory */
+/* Allocate virtually contiguous kernel memory (process context: may sleep) */
 void *vmalloc(unsigned long size);
 
 /* Allocate zeroed virtually contiguous kernel memory */
@@ -176,4 +411,7 @@ void iounmap(void *addr);
 /* Debug */
 void vmalloc_dump(void);
 
+/* Stress benchmark: n areas allocated, freed and looked up */
+void vmalloc_bench(unsigned long n);
+
 #endif /* _MINIX_MM_H */
@@ -8,68 +8,14 @@
 #define _MINIX_MM_TYPES_H
 
 #include <types.h>
+#include <asm/atomic.h>
+#include <asm/spinlock.h>
 #include <minix/sched.h>
 
 /* Forward declarations */
 struct file;
 struct task_struct;
 
-/* Atomic type (simplified) */
-typedef struct {
-    volatile long counter;
-} atomic_t;
-
-#define ATOMIC_INIT(i)  { (i) }
-
-static inline long atomic_read(const atomic_t *v)
-{
-    return v->counter;
-}
-
-static inline void atomic_set(atomic_t *v, long i)
-{
-    v->counter = i;
-}
-
-static inline void atomic_inc(atomic_t *v)
-{
-    v->counter++;
-}
-
-static inline void atomic_dec(atomic_t *v)
-{
-    v->counter--;
-}
-
-static inline int atomic_dec_and_test(atomic_t *v)
-{
-    return --v->counter == 0;
-}
-
-/* Spinlock (simplified for single CPU) */
-typedef struct {
-    volatile unsigned long lock;
-} spinlock_t;
-
-#define SPIN_LOCK_INIT { 0 }
-
-static inline void spin_lock_init(spinlock_t *lock)
-{
-    lock->lock = 0;
-}
-
-static inline void spin_lock(spinlock_t *lock)
-{
-    while (__sync_lock_test_and_set(&lock->lock, 1)) {
-        /* Spin */
-    }
-}
-
-static inline void spin_unlock(spinlock_t *lock)
-{
-    __sync_lock_release(&lock->lock);
-}
-
 /* ============================================
  * VMA Flags
  * ============================================ */
@@ -85,9 +31,25 @@ static inline void spin_unlock(spinlock_t *lock)
 #define VM_LOCKED       0x00002000  /* Locked in memory */
 #define VM_STACK        0x00000100  /* Stack area (same as GROWSDOWN) */
 
+/* User space: the low half of Sv39. The high half is the kernel's,
+ * shared by every process page table
+ */
+#define TASK_SIZE       0x4000000000UL
+
 /* Page protection bits */
 typedef unsigned long pgprot_t;
 
+/* Reference on a program image, shared by the VMAs it backs (also
+ * across fork); the bytes are not copied, and release() runs with the
+ * last reference
+ */
+struct vm_image {
+    atomic_t count;
+    const unsigned char *data;      /* ELF file bytes */
+    unsigned long size;
+    void (*release)(struct vm_image *image);    /* Frees data; NULL if static */
+};
+
 /* ============================================
  * Virtual Memory Area (VMA)
  * ============================================ */
@@ -107,8 +69,10 @@ struct vm_area_struct {
     struct file *vm_file;           /* Mapped file (NULL for anonymous) */
     unsigned long vm_pgoff;         /* File offset (in pages) */
 
-    /* Private data */
+    /* Private data (exec: in-memory image bytes backing vm_start) */
     void *vm_private_data;
+    unsigned long vm_file_end;      /* End of image-backed bytes; zero-fill above */
+    struct vm_image *vm_image;      /* Holds vm_private_data's bytes */
 };
 
 /* ============================================
@@ -156,6 +120,10 @@ struct mm_struct {
     /* Locks */
     spinlock_t page_table_lock;     /* Page table lock */
 
+    /* Address space ID (see arch/riscv64/mm/context.c) */
+    unsigned long context_id;       /* ASID generation | ASID */
+    volatile unsigned long cpu_mask;    /* Harts that have loaded it */
+
     /* For exec */
     unsigned long saved_auxv[AT_VECTOR_SIZE];
 };
@@ -182,12 +150,23 @@ void mmget(struct mm_struct *mm);
 /* Exit mm (called on process exit) */
 void exit_mm(struct task_struct *tsk);
 
+/* Tear down all VMAs, user pages and the page table of an mm */
+void exit_mmap(struct mm_struct *mm);
+
 /* Allocate VMA */
 struct vm_area_struct *vm_area_alloc(struct mm_struct *mm);
 
-/* Free VMA */
+/* Free VMA (drops its image reference) */
 void vm_area_free(struct vm_area_struct *vma);
 
+/* Wrap a program image in a new vm_image holding one reference */
+struct vm_image *vm_image_alloc(const void *data, unsigned long size,
+                                void (*release)(struct vm_image *image));
+
+/* Take / drop a reference; the last put frees the image */
+void vm_image_get(struct vm_image *image);
+void vm_image_put(struct vm_image *image);
+
 /* Insert VMA into mm */
 int insert_vm_area(struct mm_struct *mm, struct vm_area_struct *vma);
 
@@ -198,9 +177,43 @@ struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr);
 int copy_page_range(struct mm_struct *dst, struct mm_struct *src,
                     struct vm_area_struct *vma);
 
+/* Drop user pages mapped in [start, end) */
+void zap_page_range(struct mm_struct *mm, unsigned long start, unsigned long end);
+
 /* Handle COW fault */
 int do_cow_fault(struct vm_area_struct *vma, unsigned long address);
 
+/* Page fault flags for handle_mm_fault() */
+#define FAULT_FLAG_WRITE    0x01    /* Store access */
+#define FAULT_FLAG_EXEC     0x02    /* Instruction fetch */
+
+/* Resolve a user page fault inside vma (demand paging and COW) */
+int handle_mm_fault(struct vm_area_struct *vma, unsigned long address,
+                    unsigned int flags);
+
+/* Fault in a user page and return its physical address (0 on failure) */
+unsigned long get_user_page(struct mm_struct *mm, unsigned long address,
+                            unsigned int flags);
+
+/* Physical address behind a user address of the current task, faulted
+ * in (for writing if write is set); 0 if not accessible
+ */
+unsigned long user_addr_to_phys(unsigned long uaddr, int write);
+
+/* Copy to/from the current task's user memory: 0, or -1 on a bad
+ * address
+ */
+int copy_from_user(void *dst, const void *usrc, unsigned long n);
+int copy_to_user(void *udst, const void *src, unsigned long n);
+
+/* Copy a NUL-terminated user string of at most n bytes including the
+ * NUL; returns its length, -1 on a bad address or if it does not fit
+ */
+long strncpy_from_user(char *dst, const char *usrc, long n);
+
+/* Move the program break, resizing the heap VMA */
+unsigned long do_brk(struct mm_struct *mm, unsigned long brk);
+
 /* Check if mapping is COW */
 static inline int is_cow_mapping(unsigned long flags)
 {
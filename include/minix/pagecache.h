@@ -0,0 +1,40 @@
+/* Page Cache Interface
+ *
+ * Per-file cache of file data in page-sized units, indexed by
+ * (filesystem ops, inode number, page index). Sits between vfs_read()/vfs_write() and the
+ * filesystem read/write hooks.
+ */
+
+#ifndef _MINIX_PAGECACHE_H
+#define _MINIX_PAGECACHE_H
+
+#include <types.h>
+#include <minix/vfs.h>
+
+/* Start reclaiming cached pages when the buddy allocator drops below this */
+#define PAGECACHE_MIN_FREE      256     /* pages (1MB) */
+#define PAGECACHE_SHRINK_BATCH  32      /* pages dropped per reclaim pass */
+
+/* Register the page cache shrinker */
+void pagecache_init(void);
+
+/* Read through the page cache, filling misses via ops->read */
+ssize_t pagecache_read(fs_ops_t *ops, file_t *file, void *buf, size_t count);
+
+/* Update cached pages after a successful write of count bytes at pos */
+void pagecache_write(fs_ops_t *ops, inode_t *inode, u64 pos,
+                     const void *buf, size_t count);
+
+/* Drop all cached pages of an inode (O_TRUNC) */
+void pagecache_invalidate(fs_ops_t *ops, inode_t *inode);
+
+/* Drop all cached pages of a filesystem (unmount) */
+void pagecache_invalidate_fs(fs_ops_t *ops);
+
+/* Drop up to nr least-recently-used pages, returns number freed */
+unsigned long pagecache_shrink(unsigned long nr);
+
+/* Print page cache statistics */
+void pagecache_stats(void);
+
+#endif /* _MINIX_PAGECACHE_H */
@@ -8,6 +8,7 @@
 #define _MINIX_SCHED_H
 
 #include <types.h>
+#include <asm/spinlock.h>
 
 /* ============================================
  * Process States
@@ -26,6 +27,7 @@
 #define PF_EXITING          0x00000004  /* Exiting process */
 #define PF_FORKNOEXEC       0x00000040  /* Forked but not exec'd */
 #define PF_IDLE             0x00000100  /* Idle process */
+#define PF_MEMALLOC         0x00000800  /* Reclaiming memory: never waits for reclaim */
 
 /* ============================================
  * Scheduling Policies
@@ -66,6 +68,9 @@
 /* Signal for child termination */
 #define SIGCHLD             17
 
+/* Signal for invalid memory access */
+#define SIGSEGV             11
+
 /* ============================================
  * List Head Structure (must be defined first)
  * ============================================ */
@@ -165,7 +170,7 @@ struct prio_array {
  * Run Queue (per-CPU)
  * ============================================ */
 struct rq {
-    unsigned long lock;             /* Spinlock */
+    spinlock_t lock;                /* Run queue lock */
     unsigned long nr_running;       /* Number of runnable tasks */
     unsigned long nr_switches;      /* Context switch count */
 
@@ -180,8 +185,16 @@ struct rq {
     /* Timing */
     unsigned long clock;            /* Run queue clock */
     unsigned long clock_task;       /* Task clock */
+
+    /* SMP load balancing */
+    int cpu;                        /* Hart owning this queue */
+    unsigned long next_balance;     /* clock value of next periodic balance */
+    unsigned long nr_migrations;    /* Tasks pulled from other queues */
 };
 
+/* Ticks between periodic load balancing passes */
+#define BALANCE_INTERVAL    20
+
 /* ============================================
  * Function Declarations
  * ============================================ */
@@ -210,6 +223,12 @@ void context_switch(struct rq *rq, struct task_struct *prev, struct task_struct
 /* Get current run queue */
 struct rq *this_rq(void);
 
+/* Get a hart's run queue */
+struct rq *cpu_rq(int cpu);
+
+/* Install a secondary hart's idle task (boot hart, before starting it) */
+void init_idle(struct task_struct *idle, int cpu);
+
 /* Check if rescheduling is needed */
 int need_resched(void);
 
@@ -227,6 +246,7 @@ void cpu_idle(void);
 
 /* Sleep/Wakeup */
 void sleep(void *chan);
+long sleep_timeout(void *chan, long timeout);
 void wakeup(void *chan);
 
 #endif /* _MINIX_SCHED_H */
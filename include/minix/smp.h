@@ -0,0 +1,44 @@
+/* Symmetric multiprocessing support */
+
+#ifndef _MINIX_SMP_H
+#define _MINIX_SMP_H
+
+#include <minix/config.h>
+#include <types.h>
+
+/* Bitmask of harts that have finished bring-up */
+extern volatile unsigned long cpu_online_mask;
+
+/* In the kernel, tp holds the hart id (reloaded on entry from user) */
+static inline int smp_processor_id(void)
+{
+    unsigned long id;
+    asm volatile ("mv %0, tp" : "=r"(id));
+    return (int)id;
+}
+
+static inline int cpu_online(int cpu)
+{
+    return (cpu_online_mask >> cpu) & 1;
+}
+
+static inline int num_online_cpus(void)
+{
+    int cpu, n = 0;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        n += cpu_online(cpu);
+    }
+    return n;
+}
+
+/* Start the secondary harts (boot hart only) */
+void smp_init(void);
+
+/* Ask another hart to reschedule */
+void smp_send_reschedule(int cpu);
+
+/* Software interrupt handler (IRQ_S_SOFT) */
+void smp_handle_ipi(void);
+
+#endif /* _MINIX_SMP_H */
@@ -187,6 +187,46 @@ static inline void init_waitqueue_head(wait_queue_head_t *q)
     INIT_LIST_HEAD(&q->head);
 }
 
+/* A task waiting on a queue. Exclusive waiters are queued after the
+ * others and woken a limited number at a time
+ */
+typedef struct wait_queue_entry {
+    unsigned int flags;             /* WQ_FLAG_* */
+    struct task_struct *task;       /* Task to wake */
+    void *key;                      /* Channel on a hashed queue, or NULL */
+    struct list_head entry;         /* Queue link */
+} wait_queue_entry_t;
+
+#define WQ_FLAG_EXCLUSIVE   0x01
+
+#define DEFINE_WAIT(name) \
+    wait_queue_entry_t name = { .flags = 0, .task = get_current(), .key = NULL, \
+                                .entry = LIST_HEAD_INIT((name).entry) }
+
+void add_wait_queue(wait_queue_head_t *q, wait_queue_entry_t *wait);
+void add_wait_queue_exclusive(wait_queue_head_t *q, wait_queue_entry_t *wait);
+void remove_wait_queue(wait_queue_head_t *q, wait_queue_entry_t *wait);
+
+/* Queue wait (once) and set the task state; finish_wait() undoes both */
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_entry_t *wait, long state);
+void prepare_to_wait_exclusive(wait_queue_head_t *q, wait_queue_entry_t *wait,
+                               long state);
+void finish_wait(wait_queue_head_t *q, wait_queue_entry_t *wait);
+
+/* Wake every non-exclusive waiter and up to nr_exclusive exclusive
+ * ones (0 = all) whose key matches (NULL key = any); returns the
+ * number of tasks woken
+ */
+int __wake_up(wait_queue_head_t *q, int nr_exclusive, void *key);
+
+#define wake_up(q)          __wake_up((q), 1, NULL)
+#define wake_up_nr(q, nr)   __wake_up((q), (nr), NULL)
+#define wake_up_all(q)      __wake_up((q), 0, NULL)
+
+/* Shared hashed queue that sleep()/wakeup() use for a channel */
+wait_queue_head_t *chan_waitqueue(const void *chan);
+void wait_table_init(void);
+
 /* ============================================
  * Task Structure (PCB)
  *
@@ -197,6 +237,7 @@ struct task_struct {
     volatile long state;            /* Process state (TASK_*) */
     unsigned int flags;             /* Process flags (PF_*) */
     int on_rq;                      /* Is on run queue? */
+    struct prio_array *array;       /* Priority array queued on */
 
     int prio;                       /* Dynamic priority */
     int static_prio;                /* Static priority */
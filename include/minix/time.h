@@ -0,0 +1,111 @@
+/* Kernel time keeping and the periodic tick */
+
+#ifndef _MINIX_TIME_H
+#define _MINIX_TIME_H
+
+#include <minix/config.h>
+#include <minix/board.h>
+#include <minix/mm_types.h>
+#include <types.h>
+
+/* Tick rate */
+#define HZ                  CLOCK_TICK_RATE
+
+/* time CSR increments per tick */
+#define TICK_CYCLES         (BOARD_TIMEBASE_FREQ / HZ)
+
+/* Ticks since boot (advanced by whichever hart is ticking) */
+extern volatile unsigned long jiffies;
+
+/* Harts idling with their periodic tick stopped */
+extern volatile unsigned long nohz_idle_mask;
+
+/* POSIX clocks; both count from reset (there is no RTC) */
+#define CLOCK_REALTIME      0
+#define CLOCK_MONOTONIC     1
+#define TIMER_ABSTIME       1
+
+#define NSEC_PER_SEC        1000000000UL
+
+struct timespec {
+    long tv_sec;
+    long tv_nsec;
+};
+
+/* Deadline that is never reached; time arithmetic saturates to it */
+#define CYCLES_NEVER        (~0ULL)
+
+/* ts must be normalized (0 <= tv_nsec < NSEC_PER_SEC, tv_sec >= 0) */
+static inline u64 timespec_to_cycles(const struct timespec *ts)
+{
+    u64 frac = (u64)ts->tv_nsec * BOARD_TIMEBASE_FREQ / NSEC_PER_SEC;
+
+    if ((u64)ts->tv_sec > (CYCLES_NEVER - frac) / BOARD_TIMEBASE_FREQ)
+        return CYCLES_NEVER;
+    return (u64)ts->tv_sec * BOARD_TIMEBASE_FREQ + frac;
+}
+
+/* a + b, saturating at CYCLES_NEVER */
+static inline u64 cycles_add(u64 a, u64 b)
+{
+    return (a > CYCLES_NEVER - b) ? CYCLES_NEVER : a + b;
+}
+
+static inline void cycles_to_timespec(u64 cycles, struct timespec *ts)
+{
+    ts->tv_sec = (long)(cycles / BOARD_TIMEBASE_FREQ);
+    ts->tv_nsec = (long)((cycles % BOARD_TIMEBASE_FREQ) * NSEC_PER_SEC / BOARD_TIMEBASE_FREQ);
+}
+
+/* Conversions between jiffies and time CSR values */
+u64 jiffies_to_time(unsigned long j);
+unsigned long time_to_jiffies(u64 when);
+
+/* Current value of the time CSR */
+static inline u64 get_cycles(void)
+{
+    u64 t;
+    asm volatile ("rdtime %0" : "=r"(t));
+    return t;
+}
+
+/* Start the tick on the boot hart */
+void timer_init(void);
+
+/* Start the tick on the calling hart */
+void timer_init_hart(void);
+
+/* Supervisor timer interrupt (IRQ_S_TIMER) */
+void timer_interrupt(void);
+
+/* ============================================
+ * One-shot Timer Events
+ * ============================================ */
+
+/* Fires once at an absolute time CSR value, in interrupt context on
+ * the hart it was added on
+ */
+struct timer_event {
+    struct list_head node;          /* Per-hart queue, sorted by expiry */
+    u64 expires;                    /* Deadline (time CSR value) */
+    void (*function)(struct timer_event *ev);
+    void *data;
+    int cpu;                        /* Queue it is on, -1 when idle */
+};
+
+void timer_event_init(struct timer_event *ev,
+                      void (*function)(struct timer_event *ev), void *data);
+
+/* Queue ev on the calling hart, replacing any pending expiry */
+void timer_event_add(struct timer_event *ev, u64 expires);
+
+/* Returns 1 if ev was pending */
+int timer_event_del(struct timer_event *ev);
+
+/* Stop the tick before idling in wfi and restart it afterwards; both
+ * are called with interrupts disabled
+ */
+void tick_nohz_idle_enter(void);
+void tick_nohz_idle_exit(void);
+
+#endif /* _MINIX_TIME_H */
@@ -0,0 +1,67 @@
+/* Kernel timers: hierarchical timing wheel in jiffies */
+
+#ifndef _MINIX_TIMER_H
+#define _MINIX_TIMER_H
+
+#include <minix/config.h>
+#include <minix/sched.h>
+#include <types.h>
+
+struct tvec_base;
+
+/* Runs once when jiffies reaches expires, from the tick of the hart
+ * it was added on, with interrupts disabled
+ */
+struct timer_list {
+    struct list_head entry;         /* Wheel slot */
+    unsigned long expires;          /* Expiry in jiffies */
+    void (*function)(unsigned long data);
+    unsigned long data;
+    struct tvec_base *base;         /* Wheel it is queued on, or NULL */
+};
+
+/* Wrap-safe jiffies comparisons */
+#define time_after(a, b)        ((long)((b) - (a)) < 0)
+#define time_before(a, b)       time_after(b, a)
+#define time_after_eq(a, b)     ((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)    time_after_eq(b, a)
+
+/* Sleep forever in schedule_timeout() */
+#define MAX_SCHEDULE_TIMEOUT    ((long)(~0UL >> 1))
+
+void init_timer(struct timer_list *timer);
+void setup_timer(struct timer_list *timer,
+                 void (*function)(unsigned long), unsigned long data);
+
+static inline int timer_pending(const struct timer_list *timer)
+{
+    return timer->base != 0;
+}
+
+/* Queue on the calling hart's wheel; O(1) */
+void add_timer(struct timer_list *timer);
+
+/* (Re)queue with a new expiry; returns 1 if it was pending */
+int mod_timer(struct timer_list *timer, unsigned long expires);
+
+/* Cancel; O(1). Returns 1 if it was pending */
+int del_timer(struct timer_list *timer);
+
+/* Expire due timers on this hart (from scheduler_tick()) */
+void run_local_timers(void);
+
+/* Keep a wakeup for the next timer while this hart is tickless */
+void timer_nohz_arm(void);
+
+/* Sleep for up to timeout jiffies; returns the jiffies left if woken
+ * early, 0 on timeout. The caller sets current->state first
+ */
+long schedule_timeout(long timeout);
+
+/* Sleep until the time CSR reaches when */
+void timer_sleep_until(u64 when);
+
+void init_timers(void);
+void timer_stats(void);
+
+#endif /* _MINIX_TIMER_H */
@@ -64,6 +64,8 @@ void uart_flush_tx(void);
 int uart_get_stats(uart_stats_t *stats);
 
 /* Interrupt-driven UART functions */
+int uart_irq_init(void);
+int uart_getc_wait(void);
 void uart_enable_rx_interrupt(void);
 void uart_disable_rx_interrupt(void);
 void uart_enable_tx_interrupt(void);
@@ -0,0 +1,115 @@
+/* VirtIO MMIO Transport Definitions */
+
+#ifndef _MINIX_VIRTIO_H
+#define _MINIX_VIRTIO_H
+
+#include <types.h>
+
+/* MMIO register offsets */
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000   /* "virt" */
+#define VIRTIO_MMIO_VERSION             0x004   /* 1 = legacy, 2 = modern */
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_GUEST_PAGE_SIZE     0x028   /* Legacy only */
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_ALIGN         0x03c   /* Legacy only */
+#define VIRTIO_MMIO_QUEUE_PFN           0x040   /* Legacy only */
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW     0x090
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH    0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW      0x0a0
+#define VIRTIO_MMIO_QUEUE_USED_HIGH     0x0a4
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_MMIO_MAGIC               0x74726976
+
+/* Feature bits (bit 32 and up live in feature word 1) */
+#define VIRTIO_F_VERSION_1              32
+
+/* Device IDs */
+#define VIRTIO_ID_NET                   1
+#define VIRTIO_ID_BLOCK                 2
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE       1
+#define VIRTIO_STATUS_DRIVER            2
+#define VIRTIO_STATUS_DRIVER_OK         4
+#define VIRTIO_STATUS_FEATURES_OK       8
+#define VIRTIO_STATUS_FAILED            128
+
+/* Interrupt status bits */
+#define VIRTIO_INT_USED_RING            1
+#define VIRTIO_INT_CONFIG               2
+
+/* Descriptor flags */
+#define VRING_DESC_F_NEXT               1
+#define VRING_DESC_F_WRITE              2
+
+/* Split virtqueue layout */
+struct vring_desc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+
+struct vring_avail {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+};
+
+struct vring_used_elem {
+    u32 id;
+    u32 len;
+};
+
+struct vring_used {
+    u16 flags;
+    u16 idx;
+    struct vring_used_elem ring[];
+};
+
+/* Number of virtio-mmio slots on the QEMU virt board */
+#define VIRTIO_MMIO_SLOTS               8
+#define VIRTIO_MMIO_IRQ_BASE            1       /* Slot n uses IRQ 1 + n */
+
+/* ============================================
+ * virtio-blk Driver
+ * ============================================ */
+
+/* Physically contiguous piece of a request buffer */
+struct vblk_seg {
+    void *buf;
+    u32 len;
+};
+
+/* Completion callback, error is non-zero on I/O failure */
+typedef void (*vblk_end_io_t)(void *arg, int error);
+
+/* Probe the MMIO bus and register the first disk as "vda" */
+int virtio_blk_init(void);
+
+/* Queue a scatter-gather request (call virtio_blk_kick() to start it) */
+int virtio_blk_submit(u64 sector, const struct vblk_seg *segs, int nsegs,
+                      int write, vblk_end_io_t end_io, void *arg);
+
+/* Notify the device of queued requests */
+void virtio_blk_kick(void);
+
+/* Reap completed requests without waiting for the interrupt */
+void virtio_blk_poll(void);
+
+#endif /* _MINIX_VIRTIO_H */
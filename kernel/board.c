@@ -3,6 +3,7 @@
 #include <minix/config.h>
 #include <minix/board.h>
 #include <early_print.h>
+#include <asm/irq.h>
 
 /* Initialize board-specific hardware */
 void board_init(void)
@@ -24,7 +25,7 @@ void board_irq_init(void)
 {
 #if BOARD == BOARD_QEMU_VIRT
     /* QEMU uses PLIC and CLINT */
-    /* TODO: Initialize PLIC */
+    plic_init();
 
 #elif BOARD == BOARD_MILKV_DUO
     /* CV1800B interrupt controller */
@@ -2,8 +2,12 @@
 
 #include <minix/config.h>
 
+/* Forward declarations for UART driver */
+extern int uart_irq_init(void);
+
 /* Forward declarations for block device driver */
 extern int blockdev_init(void);
+extern int virtio_blk_init(void);
 
 /* Forward declarations for filesystem drivers */
 extern int vfs_init(void);
@@ -19,11 +23,15 @@ extern int vfs_mount(const char *device, const char *mount_point, const char *fs
 /* Initialize all device drivers */
 void drivers_init(void)
 {
-    /* UART is already initialized in console_init() */
+    /* UART is already initialized in console_init(); move RX to interrupts */
+    uart_irq_init();
 
     /* Initialize block device subsystem */
     blockdev_init();
 
+    /* Probe block devices */
+    virtio_blk_init();
+
     /* Initialize filesystem support */
     vfs_init();
 
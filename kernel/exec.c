@@ -18,6 +18,12 @@
 #define ENOEXEC     8   /* Exec format error */
 #define ENOMEM      12  /* Out of memory */
 #define ENOENT      2   /* No such file */
+#define E2BIG       7   /* Argument list too long */
+#define EFAULT      14  /* Bad address */
+
+/* Limits on what execve() copies in from user space */
+#define EXEC_PATH_MAX   256             /* Path, including the NUL */
+#define EXEC_MAX_ARGS   32              /* Strings per argv/envp */
 
 /* External functions */
 extern void early_puts(const char *s);
@@ -34,7 +40,7 @@ extern void kfree(void *ptr);
 #define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & PAGE_MASK)
 
 /* User address space layout */
-#define USER_STACK_TOP      0x7FFFFFFFF000UL    /* Top of user stack */
+#define USER_STACK_TOP      0x3FFFFFF000UL      /* Top of user stack (Sv39) */
 #define USER_STACK_SIZE     0x100000            /* 1MB stack */
 #define USER_HEAP_START     0x10000000UL        /* Start of heap */
 
@@ -51,12 +57,31 @@ static void memcpy_local(void *dst, const void *src, unsigned long n)
     }
 }
 
-static void memset_local(void *dst, int c, unsigned long n)
+/* Copy into user memory of mm, faulting pages in as needed */
+static int copy_to_mm(struct mm_struct *mm, unsigned long uaddr,
+                      const void *src, unsigned long n)
 {
-    unsigned char *d = (unsigned char *)dst;
-    while (n--) {
-        *d++ = (unsigned char)c;
+    const unsigned char *s = (const unsigned char *)src;
+
+    while (n > 0) {
+        unsigned long off = uaddr & (PAGE_SIZE - 1);
+        unsigned long chunk = PAGE_SIZE - off;
+        unsigned long pa;
+
+        if (chunk > n)
+            chunk = n;
+
+        pa = get_user_page(mm, uaddr, FAULT_FLAG_WRITE);
+        if (!pa)
+            return -1;
+
+        memcpy_local((void *)(pa + off), s, chunk);
+        uaddr += chunk;
+        s += chunk;
+        n -= chunk;
     }
+
+    return 0;
 }
 
 /* ============================================
@@ -111,55 +136,49 @@ static unsigned long setup_user_stack(struct mm_struct *mm,
                                        unsigned long load_addr)
 {
     unsigned long stack_top = USER_STACK_TOP;
-    unsigned long stack_page;
+    struct vm_area_struct *vma;
+    unsigned long frame[3];
     unsigned long sp;
-    int argc = 0, envc = 0;
 
     /* Suppress unused warnings for future use */
     (void)ehdr;
     (void)load_addr;
+    (void)argv;
+    (void)envp;
 
-    /* Count arguments */
-    if (argv) {
-        while (argv[argc]) argc++;
-    }
-    if (envp) {
-        while (envp[envc]) envc++;
-    }
-
-    /* Allocate stack pages (4 pages = 16KB) */
-    stack_page = alloc_pages(2);  /* 4 pages */
-    if (!stack_page) {
+    /* Stack VMA; pages are faulted in on first touch */
+    vma = vm_area_alloc(mm);
+    if (!vma) {
         early_puts("[ELF] Failed to allocate user stack\n");
         return 0;
     }
+    vma->vm_start = stack_top - USER_STACK_SIZE;
+    vma->vm_end = stack_top;
+    vma->vm_flags = VM_READ | VM_WRITE | VM_MAYREAD | VM_MAYWRITE |
+                    VM_GROWSDOWN;
+    if (insert_vm_area(mm, vma) < 0) {
+        early_puts("[ELF] User stack overlaps a segment\n");
+        vm_area_free(vma);
+        return 0;
+    }
 
     /* Setup mm stack info */
-    mm->start_stack = stack_top - USER_STACK_SIZE;
-
-    /* For now, we work in kernel space since we don't have full VM yet */
-    /* In real implementation, this would be mapped to user space */
-
-    sp = stack_page + (4 * PAGE_SIZE);  /* Top of allocated stack */
-
-    /* Copy strings to stack (environment first, then arguments) */
-    /* This is simplified - real implementation needs proper user mapping */
-
-    /* For now, just setup minimal stack with argc = 0 */
-    sp -= 8;  /* Align */
-    sp &= ~0xF;  /* 16-byte alignment */
-
-    /* Push NULL for envp terminator */
-    sp -= 8;
-    *(unsigned long *)sp = 0;
-
-    /* Push NULL for argv terminator */
-    sp -= 8;
-    *(unsigned long *)sp = 0;
+    mm->start_stack = vma->vm_start;
+    mm->stack_vm = USER_STACK_SIZE >> PAGE_SHIFT;
 
-    /* Push argc */
-    sp -= 8;
-    *(unsigned long *)sp = argc;
+    /* Minimal initial frame: argc, argv NULL, envp NULL.
+     * Argument strings are not copied yet.
+     */
+    sp = (stack_top - 8) & ~0xFUL;
+    sp -= 3 * sizeof(unsigned long);
+    frame[0] = 0;       /* argc */
+    frame[1] = 0;       /* argv terminator */
+    frame[2] = 0;       /* envp terminator */
+
+    if (copy_to_mm(mm, sp, frame, sizeof(frame)) < 0) {
+        early_puts("[ELF] Failed to populate user stack\n");
+        return 0;
+    }
 
     early_puts("[ELF] User stack setup at ");
     early_puthex(sp);
@@ -172,13 +191,16 @@ static unsigned long setup_user_stack(struct mm_struct *mm,
  * Load ELF Segments
  * ============================================ */
 
-static int load_elf_segments(const void *elf_data, unsigned long elf_size,
+static int load_elf_segments(struct vm_image *image,
                              struct mm_struct *mm,
                              unsigned long *entry_point,
                              unsigned long *load_addr)
 {
+    const void *elf_data = image->data;
+    unsigned long elf_size = image->size;
     const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf_data;
     const Elf64_Phdr *phdr;
+    struct vm_area_struct *vma;
     int i;
     unsigned long min_addr = ~0UL;
     unsigned long max_addr = 0;
@@ -221,40 +243,39 @@ static int load_elf_segments(const void *elf_data, unsigned long elf_size,
         early_puthex(phdr->p_flags);
         early_puts("\n");
 
-        /* Allocate pages for segment */
-        unsigned long seg_pages = (PAGE_ALIGN(phdr->p_vaddr + phdr->p_memsz) -
-                                   (phdr->p_vaddr & PAGE_MASK)) >> PAGE_SHIFT;
-        if (seg_pages == 0) seg_pages = 1;
-
-        /* Calculate order for allocation */
-        int order = 0;
-        unsigned long p = 1;
-        while (p < seg_pages) {
-            p <<= 1;
-            order++;
-        }
-
-        unsigned long segment_mem = alloc_pages(order);
-        if (!segment_mem) {
-            early_puts("[ELF] Failed to allocate segment memory\n");
+        /* Describe the segment with a VMA; handle_mm_fault() copies
+         * file bytes and zero-fills BSS page by page on first touch.
+         */
+        vma = vm_area_alloc(mm);
+        if (!vma) {
+            early_puts("[ELF] Failed to allocate VMA\n");
             return -ENOMEM;
         }
 
-        /* Zero the segment memory */
-        memset_local((void *)segment_mem, 0, p << PAGE_SHIFT);
-
-        /* Copy segment data */
-        if (phdr->p_filesz > 0) {
-            memcpy_local((void *)(segment_mem + (phdr->p_vaddr & (PAGE_SIZE - 1))),
-                        (const char *)elf_data + phdr->p_offset,
-                        phdr->p_filesz);
+        vma->vm_start = phdr->p_vaddr & PAGE_MASK;
+        vma->vm_end = PAGE_ALIGN(phdr->p_vaddr + phdr->p_memsz);
+        if (phdr->p_flags & PF_R)
+            vma->vm_flags |= VM_READ | VM_MAYREAD;
+        if (phdr->p_flags & PF_W)
+            vma->vm_flags |= VM_WRITE | VM_MAYWRITE;
+        if (phdr->p_flags & PF_X)
+            vma->vm_flags |= VM_EXEC | VM_MAYEXEC;
+        vma->vm_pgoff = (phdr->p_offset & PAGE_MASK) >> PAGE_SHIFT;
+        vma->vm_private_data = (void *)((const char *)elf_data +
+                                        phdr->p_offset -
+                                        (phdr->p_vaddr - vma->vm_start));
+        vma->vm_file_end = phdr->p_vaddr + phdr->p_filesz;
+        vma->vm_image = image;
+        vm_image_get(image);
+
+        if (insert_vm_area(mm, vma) < 0) {
+            early_puts("[ELF] Overlapping segments\n");
+            vm_area_free(vma);
+            return -ENOEXEC;
         }
 
-        /* BSS is already zeroed */
-
-        /* TODO: Map to user address space with proper permissions */
-        /* For now we just track the mm info */
         if (phdr->p_flags & PF_X) {
+            mm->exec_vm += (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
             if (mm->start_code == 0) {
                 mm->start_code = phdr->p_vaddr;
             }
@@ -309,17 +330,19 @@ int load_elf_binary(const char *path, struct task_struct *task)
 }
 
 /* ============================================
- * Load ELF from Memory Buffer
+ * Load ELF from an Image Reference
  *
- * Used when ELF is already in memory (e.g., embedded)
+ * Segments are not copied here: each VMA holds a reference on the image
+ * and handle_mm_fault() copies one page at a time on first touch.
  * ============================================ */
 
-int load_elf_from_memory(const void *elf_data, unsigned long elf_size,
-                         struct task_struct *task,
-                         char **argv, char **envp)
+int load_elf_image(struct vm_image *image, struct task_struct *task,
+                   char **argv, char **envp)
 {
+    const void *elf_data = image->data;
+    unsigned long elf_size = image->size;
     const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf_data;
-    struct mm_struct *mm;
+    struct mm_struct *mm, *old_mm;
     unsigned long entry_point;
     unsigned long load_addr;
     unsigned long sp;
@@ -342,9 +365,17 @@ int load_elf_from_memory(const void *elf_data, unsigned long elf_size,
         return -ENOMEM;
     }
 
-    /* Load segments */
-    ret = load_elf_segments(elf_data, elf_size, mm, &entry_point, &load_addr);
+    mm->pgd = (unsigned long *)pgd_alloc();
+    if (!mm->pgd) {
+        early_puts("[ELF] Failed to allocate page table\n");
+        mm_free(mm);
+        return -ENOMEM;
+    }
+
+    /* Load segments; each VMA holds its own image reference */
+    ret = load_elf_segments(image, mm, &entry_point, &load_addr);
     if (ret < 0) {
+        exit_mmap(mm);
         mm_free(mm);
         return ret;
     }
@@ -352,17 +383,25 @@ int load_elf_from_memory(const void *elf_data, unsigned long elf_size,
     /* Setup user stack */
     sp = setup_user_stack(mm, argv, envp, (Elf64_Ehdr *)ehdr, load_addr);
     if (!sp) {
+        exit_mmap(mm);
         mm_free(mm);
         return -ENOMEM;
     }
 
     /* Replace task's mm */
-    if (task->mm) {
-        /* TODO: Properly free old mm */
-    }
+    old_mm = task->mm;
     task->mm = mm;
     task->active_mm = mm;
 
+    if (task == get_current()) {
+        switch_mm(old_mm, mm, task);
+    }
+
+    if (old_mm && atomic_dec_and_test(&old_mm->mm_users)) {
+        exit_mmap(old_mm);
+        mm_free(old_mm);
+    }
+
     /* Setup trapframe for return to user mode */
     if (task->trapframe) {
         task->trapframe->sepc = entry_point;
@@ -379,6 +418,31 @@ int load_elf_from_memory(const void *elf_data, unsigned long elf_size,
     return 0;
 }
 
+/* ============================================
+ * Load ELF from Memory Buffer
+ *
+ * Used when ELF is already in memory (e.g., embedded); elf_data is
+ * referenced, not copied, so it must outlive the task
+ * ============================================ */
+
+int load_elf_from_memory(const void *elf_data, unsigned long elf_size,
+                         struct task_struct *task,
+                         char **argv, char **envp)
+{
+    struct vm_image *image;
+    int ret;
+
+    image = vm_image_alloc(elf_data, elf_size, NULL);
+    if (!image) {
+        return -ENOMEM;
+    }
+
+    ret = load_elf_image(image, task, argv, envp);
+    vm_image_put(image);
+
+    return ret;
+}
+
 /* ============================================
  * Execve System Call
  * ============================================ */
@@ -401,7 +465,7 @@ int do_execve(const char *filename, char **argv, char **envp)
     /* TODO: Implementation
      * 1. Open file via VFS
      * 2. Read into buffer
-     * 3. Call load_elf_from_memory or load_elf_binary
+     * 3. Call load_elf_image with a release that frees the buffer
      * 4. On success, return to user mode won't return here
      */
 
@@ -418,8 +482,82 @@ int kernel_execve(const char *filename, char **argv, char **envp)
     return do_execve(filename, argv, envp);
 }
 
-/* sys_execve - execve system call wrapper */
+/* Copy a NULL-terminated user string vector into one kernel page:
+ * the pointer array first, then the strings. *kvec is NULL for a NULL
+ * uvec; otherwise kfree() it when done
+ */
+static int copy_strings_from_user(char **uvec, char ***kvec)
+{
+    char **vec;
+    char *area, *end;
+    int i;
+
+    *kvec = NULL;
+    if (!uvec)
+        return 0;
+
+    vec = (char **)kmalloc(PAGE_SIZE);
+    if (!vec)
+        return -ENOMEM;
+
+    area = (char *)(vec + EXEC_MAX_ARGS + 1);
+    end = (char *)vec + PAGE_SIZE;
+    for (i = 0; ; i++) {
+        char *up;
+        long len;
+
+        if (copy_from_user(&up, &uvec[i], sizeof(up)) < 0) {
+            kfree(vec);
+            return -EFAULT;
+        }
+        if (!up)
+            break;
+        if (i == EXEC_MAX_ARGS) {
+            kfree(vec);
+            return -E2BIG;
+        }
+
+        len = strncpy_from_user(area, up, end - area);
+        if (len < 0) {
+            kfree(vec);
+            return -EFAULT;
+        }
+        vec[i] = area;
+        area += len + 1;
+    }
+    vec[i] = NULL;
+
+    *kvec = vec;
+    return 0;
+}
+
+/* sys_execve - execve system call wrapper: the path and the argument
+ * and environment strings are copied in from user space first
+ */
 long sys_execve(const char *filename, char **argv, char **envp)
 {
-    return do_execve(filename, argv, envp);
+    char path[EXEC_PATH_MAX];
+    char **kargv, **kenvp;
+    long ret;
+
+    if (!filename || strncpy_from_user(path, filename, sizeof(path)) < 0)
+        return -EFAULT;
+
+    ret = copy_strings_from_user(argv, &kargv);
+    if (ret < 0)
+        return ret;
+    ret = copy_strings_from_user(envp, &kenvp);
+    if (ret < 0) {
+        if (kargv)
+            kfree(kargv);
+        return ret;
+    }
+
+    ret = do_execve(path, kargv, kenvp);
+
+    if (kargv)
+        kfree(kargv);
+    if (kenvp)
+        kfree(kenvp);
+    return ret;
 }
@@ -17,6 +17,7 @@
 /* Error codes */
 #define ECHILD      10      /* No child processes */
 #define EINTR       4       /* Interrupted */
+#define EFAULT      14      /* Bad address */
 
 /* Wait options */
 #define WNOHANG     1       /* Don't block */
@@ -42,6 +43,30 @@ extern struct task_struct init_task;
  * Exit Memory Management
  * ============================================ */
 
+/* Release all VMAs, user pages and the page table */
+void exit_mmap(struct mm_struct *mm)
+{
+    struct vm_area_struct *vma, *next;
+
+    for (vma = mm->mmap; vma; vma = next) {
+        next = vma->vm_next;
+
+        /* Unmap (drops page references, frees unshared frames) */
+        zap_page_range(mm, vma->vm_start, vma->vm_end);
+
+        vm_area_free(vma);
+    }
+
+    mm->mmap = NULL;
+    mm->map_count = 0;
+    mm->total_vm = 0;
+
+    if (mm->pgd) {
+        pgd_free((pgd_t *)mm->pgd);
+        mm->pgd = NULL;
+    }
+}
+
 /* Release process memory space */
 void exit_mm(struct task_struct *tsk)
 {
@@ -54,8 +79,7 @@ void exit_mm(struct task_struct *tsk)
     /* Decrease reference count */
     if (atomic_dec_and_test(&mm->mm_users)) {
         /* Last user - free mm */
-        /* TODO: exit_mmap(mm) - free all VMAs */
-        /* TODO: pgd_free(mm->pgd) - free page table */
+        exit_mmap(mm);
         mm_free(mm);
     }
 }
@@ -182,7 +206,7 @@ void do_exit(long code)
     /* 7. Notify parent */
     if (tsk->parent && tsk->parent != tsk) {
         /* Wake up parent if waiting */
-        wakeup(&tsk->parent->wait_chldexit);
+        wake_up(&tsk->parent->wait_chldexit);
     }
 
     /* 8. Give up CPU - never returns */
@@ -259,10 +283,13 @@ long do_wait(pid_t pid, int *stat_addr, int options)
     struct task_struct *child;
     int retval;
     pid_t child_pid;
+    DEFINE_WAIT(wait);
 
     if (!curr) return -ECHILD;
 
 repeat:
+    /* Queue before looking, so an exit while we scan is not missed */
+    prepare_to_wait(&curr->wait_chldexit, &wait, TASK_INTERRUPTIBLE);
     retval = -ECHILD;
 
     /* Search for matching child */
@@ -286,6 +313,7 @@ repeat:
             }
 
             /* Release the zombie */
+            finish_wait(&curr->wait_chldexit, &wait);
             release_task(child);
 
             return child_pid;
@@ -295,20 +323,15 @@ repeat:
         retval = 0;
     }
 
-    /* No children at all */
-    if (retval == -ECHILD) {
-        return -ECHILD;
-    }
-
-    /* WNOHANG: Don't block */
-    if (options & WNOHANG) {
-        return 0;
+    /* No children at all, or WNOHANG: don't block */
+    if (retval == -ECHILD || (options & WNOHANG)) {
+        finish_wait(&curr->wait_chldexit, &wait);
+        return retval;
     }
 
     /* Sleep waiting for child to exit */
-    curr->chan = &curr->wait_chldexit;
-    curr->state = TASK_INTERRUPTIBLE;
     schedule();
+    finish_wait(&curr->wait_chldexit, &wait);
 
     /* Check if we were interrupted */
     if (curr->killed) {
@@ -337,23 +360,37 @@ long sys_exit_group(int error_code)
     return 0;
 }
 
+/* do_wait() for a system call: the status goes to user memory */
+static long wait_user(pid_t pid, int *stat_addr, int options)
+{
+    int status = 0;
+    long ret;
+
+    ret = do_wait(pid, stat_addr ? &status : NULL, options);
+    if (ret > 0 && stat_addr &&
+        copy_to_user(stat_addr, &status, sizeof(status)) < 0) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
 /* wait4() system call */
 long sys_wait4(pid_t pid, int *stat_addr, int options, void *rusage)
 {
     (void)rusage;  /* TODO: Implement rusage */
-    return do_wait(pid, stat_addr, options);
+    return wait_user(pid, stat_addr, options);
 }
 
 /* waitpid() system call */
 long sys_waitpid(pid_t pid, int *stat_addr, int options)
 {
-    return do_wait(pid, stat_addr, options);
+    return wait_user(pid, stat_addr, options);
 }
 
 /* wait() system call */
 long sys_wait(int *stat_addr)
 {
-    return do_wait(-1, stat_addr, 0);
+    return wait_user(-1, stat_addr, 0);
 }
 
 /* ============================================
@@ -7,6 +7,7 @@
 #include <minix/config.h>
 #include <minix/task.h>
 #include <minix/mm.h>
+#include <minix/smp.h>
 #include <types.h>
 
 #ifndef NULL
@@ -16,7 +17,6 @@
 /* External functions */
 extern void early_puts(const char *s);
 extern void early_puthex(unsigned long val);
-extern unsigned long alloc_pages(int order);
 extern void free_pages(unsigned long addr, int order);
 extern void *kmalloc(unsigned long size);
 extern void kfree(void *ptr);
@@ -149,8 +149,8 @@ struct thread_info *alloc_thread_info(void)
     unsigned long page;
     struct thread_info *ti;
 
-    /* Allocate 2 pages (8KB) for kernel stack */
-    page = alloc_pages(THREAD_SIZE_ORDER);
+    /* Allocate 2 pages (8KB) for kernel stack; fork runs in process context */
+    page = alloc_pages_gfp(THREAD_SIZE_ORDER, GFP_KERNEL);
     if (!page) {
         early_puts("[FORK] Failed to allocate kernel stack\n");
         return NULL;
@@ -310,7 +310,42 @@ void mm_free(struct mm_struct *mm)
     }
 }
 
-/* Copy memory space (simplified - no COW yet) */
+/* Duplicate the VMA list of oldmm into mm, sharing pages copy-on-write */
+static int dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm)
+{
+    struct vm_area_struct *vma, *new_vma;
+
+    for (vma = oldmm->mmap; vma; vma = vma->vm_next) {
+        new_vma = vm_area_alloc(mm);
+        if (!new_vma)
+            return -1;
+
+        /* Copy VMA contents */
+        new_vma->vm_start = vma->vm_start;
+        new_vma->vm_end = vma->vm_end;
+        new_vma->vm_flags = vma->vm_flags;
+        new_vma->vm_page_prot = vma->vm_page_prot;
+        new_vma->vm_file = vma->vm_file;
+        new_vma->vm_pgoff = vma->vm_pgoff;
+        new_vma->vm_private_data = vma->vm_private_data;
+        new_vma->vm_file_end = vma->vm_file_end;
+        new_vma->vm_image = vma->vm_image;
+        vm_image_get(new_vma->vm_image);
+
+        if (insert_vm_area(mm, new_vma) < 0) {
+            vm_area_free(new_vma);
+            return -1;
+        }
+
+        /* Share page table entries (write-protected for COW) */
+        if (copy_page_range(mm, oldmm, new_vma) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Copy memory space with copy-on-write page sharing */
 int copy_mm(unsigned long clone_flags, struct task_struct *p)
 {
     struct mm_struct *mm, *oldmm;
@@ -343,7 +378,7 @@ int copy_mm(unsigned long clone_flags, struct task_struct *p)
     mm = mm_alloc();
     if (!mm) return -1;
 
-    /* Copy mm contents (shallow copy for now) */
+    /* Copy mm contents */
     mm->start_code = oldmm->start_code;
     mm->end_code = oldmm->end_code;
     mm->start_data = oldmm->start_data;
@@ -356,11 +391,19 @@ int copy_mm(unsigned long clone_flags, struct task_struct *p)
     mm->env_start = oldmm->env_start;
     mm->env_end = oldmm->env_end;
 
-    /* TODO: Allocate new page table and implement COW */
-    /* For now, we don't copy page tables */
-    mm->pgd = NULL;
-    mm->mmap = NULL;
-    mm->map_count = 0;
+    /* Allocate new page table */
+    mm->pgd = (unsigned long *)pgd_alloc();
+    if (!mm->pgd) {
+        mm_free(mm);
+        return -1;
+    }
+
+    /* Copy all VMAs, sharing pages COW */
+    if (dup_mmap(mm, oldmm) < 0) {
+        exit_mmap(mm);
+        mm_free(mm);
+        return -1;
+    }
 
     p->mm = mm;
     p->active_mm = mm;
@@ -736,18 +779,18 @@ pid_t sys_clone(unsigned long clone_flags, unsigned long newsp,
  * Current Task Management
  * ============================================ */
 
-static struct task_struct *current_task_ptr = NULL;
+/* Current task of each hart, indexed by smp_processor_id() */
+static struct task_struct *current_task_ptr[SMP_CPUS];
 
 struct task_struct *get_current(void)
 {
-    /* Try to get from thread_info first */
-    /* For now, use global pointer */
-    return current_task_ptr ? current_task_ptr : &init_task;
+    struct task_struct *p = current_task_ptr[smp_processor_id()];
+    return p ? p : &init_task;
 }
 
 void set_current(struct task_struct *p)
 {
-    current_task_ptr = p;
+    current_task_ptr[smp_processor_id()] = p;
 }
 
 /* ============================================
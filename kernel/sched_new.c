@@ -2,12 +2,27 @@
  *
  * Simplified O(1) scheduler with active/expired arrays
  * Following HowToFitPosix.md Stage 2 design
+ *
+ * Each hart has its own run queue. A task stays on the queue of the
+ * hart it last ran on; an idle hart steals work from the busiest
+ * queue and scheduler_tick() periodically evens out queue lengths.
+ *
+ * The run queue lock is held across context_switch() and released
+ * by the task switched to (finish_task_switch()), so a task being
+ * switched out cannot be pulled to another hart before its registers
+ * are saved. Remote queues are only ever taken with spin_trylock()
+ * while holding the local one, which keeps lock ordering trivial.
  */
 
 #include <minix/config.h>
 #include <minix/task.h>
 #include <minix/sched.h>
 #include <minix/mm.h>
+#include <minix/smp.h>
+#include <minix/time.h>
+#include <minix/timer.h>
+#include <asm/csr.h>
+#include <asm/irq.h>
 #include <types.h>
 
 #ifndef NULL
@@ -20,9 +35,24 @@ extern void early_puthex(unsigned long val);
 extern void swtch(struct context *old, struct context *new);
 
 /* ============================================
- * Global Run Queue (Single CPU)
+ * Per-Hart Run Queues
  * ============================================ */
-static struct rq runqueue;
+static struct rq runqueues[SMP_CPUS];
+
+#define rq_lockp(rq)    (&(rq)->lock)
+
+/* Hart a task last ran on, kept in its thread_info */
+static inline int task_cpu(struct task_struct *p)
+{
+    return p->stack ? ((struct thread_info *)p->stack)->cpu : 0;
+}
+
+static inline void set_task_cpu(struct task_struct *p, int cpu)
+{
+    if (p->stack) {
+        ((struct thread_info *)p->stack)->cpu = cpu;
+    }
+}
 
 /* ============================================
  * Bitmap Operations
@@ -66,18 +96,20 @@ static inline int test_bit(int nr, unsigned long *addr)
  * Scheduler Initialization
  * ============================================ */
 
-void sched_init(void)
+static void init_rq(struct rq *rq, int cpu)
 {
-    struct rq *rq = &runqueue;
     int i;
 
     /* Initialize spinlock */
-    spin_lock_init((spinlock_t *)&rq->lock);
+    spin_lock_init(rq_lockp(rq));
 
     rq->nr_running = 0;
     rq->nr_switches = 0;
     rq->clock = 0;
     rq->clock_task = 0;
+    rq->cpu = cpu;
+    rq->next_balance = BALANCE_INTERVAL;
+    rq->nr_migrations = 0;
 
     /* Initialize priority arrays */
     for (i = 0; i < 2; i++) {
@@ -100,55 +132,93 @@ void sched_init(void)
     rq->active = &rq->arrays[0];
     rq->expired = &rq->arrays[1];
 
-    /* Set idle task as init_task */
-    rq->idle = &init_task;
-    rq->curr = &init_task;
+    rq->idle = NULL;
+    rq->curr = NULL;
+}
+
+void sched_init(void)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        init_rq(&runqueues[cpu], cpu);
+    }
+
+    /* Boot hart: init_task is the idle task */
+    runqueues[0].idle = &init_task;
+    runqueues[0].curr = &init_task;
 
     early_puts("✓ O(1) Scheduler\n");
 }
 
+/* Install the idle task of a secondary hart before it is started */
+void init_idle(struct task_struct *idle, int cpu)
+{
+    struct rq *rq = cpu_rq(cpu);
+
+    idle->state = TASK_RUNNING;
+    idle->on_rq = 0;
+    set_task_cpu(idle, cpu);
+
+    rq->idle = idle;
+    rq->curr = idle;
+}
+
 /* ============================================
- * Get Current Run Queue
+ * Get Run Queues
  * ============================================ */
 
+struct rq *cpu_rq(int cpu)
+{
+    return &runqueues[cpu];
+}
+
 struct rq *this_rq(void)
 {
-    return &runqueue;
+    return &runqueues[smp_processor_id()];
 }
 
 /* ============================================
  * Enqueue/Dequeue Tasks
  * ============================================ */
 
-/* Add task to run queue */
-static void enqueue_task(struct rq *rq, struct task_struct *p)
+static inline int task_prio_index(struct task_struct *p)
 {
-    struct prio_array *array = rq->active;
     int prio = p->prio;
 
     if (prio < 0) prio = 0;
     if (prio >= MAX_PRIO) prio = MAX_PRIO - 1;
+    return prio;
+}
+
+/* Add task to one of the run queue's arrays */
+static void enqueue_task_array(struct rq *rq, struct task_struct *p,
+                               struct prio_array *array)
+{
+    int prio = task_prio_index(p);
 
     list_add_tail(&p->run_list, &array->queue[prio]);
     __set_bit(prio, array->bitmap);
     array->nr_active++;
     rq->nr_running++;
+    p->array = array;
     p->on_rq = 1;
 }
 
+/* Add task to run queue */
+static void enqueue_task(struct rq *rq, struct task_struct *p)
+{
+    enqueue_task_array(rq, p, rq->active);
+}
+
 /* Remove task from run queue */
 static void dequeue_task(struct rq *rq, struct task_struct *p)
 {
-    struct prio_array *array;
-    int prio = p->prio;
+    struct prio_array *array = p->array ? p->array : rq->active;
+    int prio = task_prio_index(p);
 
     if (!p->on_rq) return;
 
-    if (prio < 0) prio = 0;
-    if (prio >= MAX_PRIO) prio = MAX_PRIO - 1;
-
-    /* Try active array first */
-    array = rq->active;
     list_del(&p->run_list);
     INIT_LIST_HEAD(&p->run_list);
 
@@ -158,9 +228,21 @@ static void dequeue_task(struct rq *rq, struct task_struct *p)
 
     if (array->nr_active > 0) array->nr_active--;
     if (rq->nr_running > 0) rq->nr_running--;
+    p->array = NULL;
     p->on_rq = 0;
 }
 
+/* Make a hart's current task reschedule; rq must be locked */
+static void resched_curr(struct rq *rq)
+{
+    if (!rq->curr) return;
+
+    set_tsk_need_resched(rq->curr);
+    if (rq->cpu != smp_processor_id()) {
+        smp_send_reschedule(rq->cpu);
+    }
+}
+
 /* ============================================
  * Task Selection
  * ============================================ */
@@ -200,6 +282,144 @@ static struct task_struct *pick_next_task(struct rq *rq)
     return next;
 }
 
+/* ============================================
+ * Load Balancing
+ * ============================================ */
+
+/* Queue with the most runnable tasks that has one to spare */
+static struct rq *find_busiest_queue(struct rq *this)
+{
+    struct rq *busiest = NULL;
+    unsigned long max = 1;  /* The running task cannot be moved */
+    int cpu;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        struct rq *rq = &runqueues[cpu];
+
+        if (rq == this || !cpu_online(cpu)) continue;
+        if (rq->nr_running > max) {
+            max = rq->nr_running;
+            busiest = rq;
+        }
+    }
+    return busiest;
+}
+
+/* A queued task that is not running; expired tasks first (cache cold) */
+static struct task_struct *pick_migrate_task(struct rq *src)
+{
+    struct prio_array *arrays[2];
+    struct task_struct *p;
+    int i, idx;
+
+    arrays[0] = src->expired;
+    arrays[1] = src->active;
+
+    for (i = 0; i < 2; i++) {
+        for (idx = 0; idx < MAX_PRIO; idx++) {
+            if (!test_bit(idx, arrays[i]->bitmap)) continue;
+
+            list_for_each_entry(p, &arrays[i]->queue[idx], run_list) {
+                if (p != src->curr && p != src->idle) {
+                    return p;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Move one task from src to this; both queues locked */
+static int pull_task(struct rq *this, struct rq *src)
+{
+    struct task_struct *p = pick_migrate_task(src);
+
+    if (!p) return 0;
+
+    dequeue_task(src, p);
+    set_task_cpu(p, this->cpu);
+    enqueue_task(this, p);
+    this->nr_migrations++;
+    return 1;
+}
+
+/* Work stealing when this hart is about to go idle; this is locked */
+static int idle_balance(struct rq *this)
+{
+    struct rq *busiest = find_busiest_queue(this);
+    int moved;
+
+    if (!busiest || !spin_trylock(rq_lockp(busiest))) {
+        return 0;
+    }
+
+    moved = pull_task(this, busiest);
+    spin_unlock(rq_lockp(busiest));
+    return moved;
+}
+
+/* Periodic balancing: pull half the difference from the busiest queue */
+static void load_balance(struct rq *this)
+{
+    struct rq *busiest = find_busiest_queue(this);
+    unsigned long flags, imbalance;
+    int moved = 0;
+
+    if (!busiest) return;
+
+    flags = local_irq_save();
+    spin_lock(rq_lockp(this));
+
+    if (spin_trylock(rq_lockp(busiest))) {
+        if (busiest->nr_running > this->nr_running + 1) {
+            imbalance = (busiest->nr_running - this->nr_running) / 2;
+            while (imbalance-- > 0 && pull_task(this, busiest)) {
+                moved++;
+            }
+        }
+        spin_unlock(rq_lockp(busiest));
+    }
+
+    if (moved && this->curr == this->idle) {
+        resched_curr(this);
+    }
+
+    spin_unlock(rq_lockp(this));
+    local_irq_restore(flags);
+}
+
+/* A tickless idle hart no longer polls for work; wake one to steal */
+static void nohz_balance_kick(struct rq *this)
+{
+    unsigned long idle = nohz_idle_mask & cpu_online_mask & ~(1UL << this->cpu);
+    int cpu;
+
+    if (this->nr_running < 2 || !idle) return;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        if (idle & (1UL << cpu)) {
+            smp_send_reschedule(cpu);
+            return;
+        }
+    }
+}
+
+/* Least loaded online hart for a new task (ties favour this hart) */
+static int select_task_rq(void)
+{
+    int this_cpu = smp_processor_id();
+    int best = this_cpu;
+    int cpu;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        if (!cpu_online(cpu)) continue;
+        if (runqueues[cpu].nr_running < runqueues[best].nr_running) {
+            best = cpu;
+        }
+    }
+    return best;
+}
+
 /* ============================================
  * Time Slice Calculation
  * ============================================ */
@@ -229,11 +449,12 @@ unsigned long task_timeslice(struct task_struct *p)
 
 void scheduler_tick(void)
 {
-    struct rq *rq = &runqueue;
+    struct rq *rq = this_rq();
     struct task_struct *curr = rq->curr;
+    int balance;
 
     /* Lock run queue */
-    spin_lock((spinlock_t *)&rq->lock);
+    spin_lock(rq_lockp(rq));
 
     /* Update clock */
     rq->clock++;
@@ -256,18 +477,7 @@ void scheduler_tick(void)
             /* Move to expired queue */
             if (curr->on_rq) {
                 dequeue_task(rq, curr);
-
-                /* Add to expired queue */
-                struct prio_array *array = rq->expired;
-                int prio = curr->prio;
-                if (prio < 0) prio = 0;
-                if (prio >= MAX_PRIO) prio = MAX_PRIO - 1;
-
-                list_add_tail(&curr->run_list, &array->queue[prio]);
-                __set_bit(prio, array->bitmap);
-                array->nr_active++;
-                rq->nr_running++;
-                curr->on_rq = 1;
+                enqueue_task_array(rq, curr, rq->expired);
             }
 
             /* Mark need reschedule */
@@ -275,7 +485,19 @@ void scheduler_tick(void)
         }
     }
 
-    spin_unlock((spinlock_t *)&rq->lock);
+    balance = (rq->clock >= rq->next_balance);
+    if (balance) {
+        rq->next_balance = rq->clock + BALANCE_INTERVAL;
+    }
+
+    spin_unlock(rq_lockp(rq));
+
+    run_local_timers();
+
+    if (balance) {
+        load_balance(rq);
+        nohz_balance_kick(rq);
+    }
 }
 
 /* ============================================
@@ -319,11 +541,8 @@ void switch_mm(struct mm_struct *prev_mm, struct mm_struct *next_mm,
     (void)next;
 
     if (next_mm && next_mm->pgd) {
-        /* Load new page table */
-        unsigned long satp = (8UL << 60) |
-                             ((unsigned long)next_mm->pgd >> 12);
-        asm volatile ("csrw satp, %0" :: "r"(satp));
-        asm volatile ("sfence.vma" ::: "memory");
+        /* Load new page table, tagged with its ASID */
+        switch_mm_asid(next_mm);
     }
 }
 
@@ -334,7 +553,8 @@ void context_switch(struct rq *rq, struct task_struct *prev,
     struct mm_struct *mm = next->mm;
     struct mm_struct *oldmm = prev->active_mm;
 
-    (void)rq;  /* Single CPU, rq not used */
+    /* Trap entry from user reloads tp (hart id) from here */
+    set_task_cpu(next, rq->cpu);
 
     /* Switch address space */
     if (!mm) {
@@ -359,18 +579,26 @@ void context_switch(struct rq *rq, struct task_struct *prev,
     swtch(&prev->context, &next->context);
 }
 
+/* Drop the run queue lock taken by the schedule() that switched to us */
+static void finish_task_switch(void)
+{
+    spin_unlock(rq_lockp(this_rq()));
+}
+
 /* ============================================
  * Main Scheduler Function
  * ============================================ */
 
 void schedule(void)
 {
-    struct rq *rq = &runqueue;
+    struct rq *rq;
     struct task_struct *prev, *next;
+    unsigned long flags;
 
     /* Disable interrupts and lock */
-    /* TODO: local_irq_save(flags); */
-    spin_lock((spinlock_t *)&rq->lock);
+    flags = local_irq_save();
+    rq = this_rq();
+    spin_lock(rq_lockp(rq));
 
     prev = rq->curr;
 
@@ -379,8 +607,11 @@ void schedule(void)
         dequeue_task(rq, prev);
     }
 
-    /* Pick next task */
+    /* Pick next task, stealing one if we would go idle */
     next = pick_next_task(rq);
+    if (next == rq->idle && idle_balance(rq)) {
+        next = pick_next_task(rq);
+    }
 
     /* Clear resched flag */
     if (prev) {
@@ -394,15 +625,17 @@ void schedule(void)
         /* Update current pointer */
         set_current(next);
 
-        /* Context switch */
-        spin_unlock((spinlock_t *)&rq->lock);
+        /* Context switch; next releases the lock */
         context_switch(rq, prev, next);
-        /* After switch, we're in new task context */
-        spin_lock((spinlock_t *)&rq->lock);
+
+        /* Back in prev, possibly on another hart */
+        finish_task_switch();
+        local_irq_restore(flags);
+        return;
     }
 
-    spin_unlock((spinlock_t *)&rq->lock);
-    /* TODO: local_irq_restore(flags); */
+    spin_unlock(rq_lockp(rq));
+    local_irq_restore(flags);
 }
 
 /* ============================================
@@ -415,15 +648,17 @@ void yield(void)
 
     if (curr && curr->state == TASK_RUNNING) {
         /* Move to end of run queue */
-        struct rq *rq = &runqueue;
-        spin_lock((spinlock_t *)&rq->lock);
+        unsigned long flags = local_irq_save();
+        struct rq *rq = this_rq();
+        spin_lock(rq_lockp(rq));
 
         if (curr->on_rq) {
             dequeue_task(rq, curr);
             enqueue_task(rq, curr);
         }
 
-        spin_unlock((spinlock_t *)&rq->lock);
+        spin_unlock(rq_lockp(rq));
+        local_irq_restore(flags);
     }
 
     schedule();
@@ -435,14 +670,19 @@ void yield(void)
 
 int wake_up_process(struct task_struct *p)
 {
-    struct rq *rq = &runqueue;
+    struct rq *rq;
+    unsigned long flags;
 
     if (!p) return 0;
 
-    spin_lock((spinlock_t *)&rq->lock);
+    /* A sleeping task is on no queue, so its hart cannot change under us */
+    flags = local_irq_save();
+    rq = cpu_rq(task_cpu(p));
+    spin_lock(rq_lockp(rq));
 
     if (p->state == TASK_RUNNING) {
-        spin_unlock((spinlock_t *)&rq->lock);
+        spin_unlock(rq_lockp(rq));
+        local_irq_restore(flags);
         return 0;
     }
 
@@ -452,61 +692,77 @@ int wake_up_process(struct task_struct *p)
         enqueue_task(rq, p);
     }
 
-    /* Preempt current if higher priority */
-    if (rq->curr && p->prio < rq->curr->prio) {
-        set_tsk_need_resched(rq->curr);
+    /* Preempt current if idle or lower priority */
+    if (rq->curr == rq->idle || (rq->curr && p->prio < rq->curr->prio)) {
+        resched_curr(rq);
     }
 
-    spin_unlock((spinlock_t *)&rq->lock);
+    spin_unlock(rq_lockp(rq));
+    local_irq_restore(flags);
     return 1;
 }
 
 void wake_up_new_task(struct task_struct *p)
 {
-    struct rq *rq = &runqueue;
+    struct rq *rq;
+    unsigned long flags;
 
     if (!p) return;
 
-    spin_lock((spinlock_t *)&rq->lock);
+    flags = local_irq_save();
+    set_task_cpu(p, select_task_rq());
+    rq = cpu_rq(task_cpu(p));
+    spin_lock(rq_lockp(rq));
 
     p->state = TASK_RUNNING;
     p->time_slice = task_timeslice(p);
 
     enqueue_task(rq, p);
 
-    spin_unlock((spinlock_t *)&rq->lock);
+    if (rq->curr == rq->idle) {
+        resched_curr(rq);
+    }
+
+    spin_unlock(rq_lockp(rq));
+    local_irq_restore(flags);
 }
 
 /* ============================================
  * Sleep/Wakeup (Legacy compatibility)
+ *
+ * Channels are waited on through the hashed queues of wait.c.
  * ============================================ */
 
 void sleep(void *chan)
+{
+    sleep_timeout(chan, MAX_SCHEDULE_TIMEOUT);
+}
+
+/* sleep() that gives up after timeout jiffies; returns the jiffies
+ * left, 0 on timeout
+ */
+long sleep_timeout(void *chan, long timeout)
 {
     struct task_struct *p = get_current();
+    wait_queue_head_t *q = chan_waitqueue(chan);
+    DEFINE_WAIT(wait);
 
-    if (!p) return;
+    if (!p) return 0;
 
     p->chan = chan;
-    p->state = TASK_INTERRUPTIBLE;
+    wait.key = chan;
+    prepare_to_wait(q, &wait, TASK_INTERRUPTIBLE);
 
-    schedule();
+    timeout = schedule_timeout(timeout);
+
+    finish_wait(q, &wait);
+    p->chan = NULL;
+    return timeout;
 }
 
 void wakeup(void *chan)
 {
-    int i;
-    struct task_struct *p;
-
-    for (i = 0; i < MAX_PROCS; i++) {
-        p = task_table[i];
-        if (p && (p->state == TASK_INTERRUPTIBLE ||
-                  p->state == TASK_UNINTERRUPTIBLE) &&
-            p->chan == chan) {
-            p->chan = NULL;
-            wake_up_process(p);
-        }
-    }
+    __wake_up(chan_waitqueue(chan), 0, chan);
 }
 
 /* ============================================
@@ -515,25 +771,40 @@ void wakeup(void *chan)
 
 void schedule_tail(void)
 {
-    /* Called by ret_from_fork after context switch completes */
-    /* Finish any pending scheduler work */
-    struct rq *rq = &runqueue;
-    (void)rq;
-
-    /* For now, nothing special needed */
+    /* Called by ret_from_fork after context switch completes: release
+     * the run queue lock schedule() held across the switch
+     */
+    finish_task_switch();
+    set_csr(sstatus, SSTATUS_SIE);
 }
 
 /* ============================================
  * CPU Idle
  * ============================================ */
 
+/* Another hart has a task this one could run */
+static int idle_has_work(void)
+{
+    return find_busiest_queue(this_rq()) != NULL;
+}
+
 void cpu_idle(void)
 {
+    unsigned long flags;
+
     while (1) {
-        while (!need_resched()) {
-            /* Wait for interrupt */
+        /* Check with interrupts off: a pending interrupt still ends wfi */
+        flags = local_irq_save();
+        if (!need_resched() && !idle_has_work()) {
+            /* No tick while idle: wake for the next timer event only */
+            tick_nohz_idle_enter();
             asm volatile ("wfi");
+            tick_nohz_idle_exit();
+        }
+        local_irq_restore(flags);
+
+        if (need_resched() || idle_has_work()) {
+            schedule();
         }
-        schedule();
     }
 }
@@ -32,6 +32,21 @@ extern long vfs_write(file_t *file, const void *buf, unsigned long count);
 extern int vfs_mkdir(const char *path, int mode);
 extern int vfs_readdir(const char *path, void *dirents, int count);
 extern int vfs_mount(const char *device, const char *mount_point, const char *fstype);
+extern void pagecache_stats(void);
+
+/* Block device functions */
+extern void blockdev_stats(void);
+extern void blockdev_set_cache_size(unsigned long nr_buffers);
+
+/* Timer functions */
+extern void timer_stats(void);
+
+/* Memory functions */
+extern void buddy_stats(void);
+extern void reclaim_stats(void);
+extern void asid_stats(void);
+extern void napot_stats(void);
+extern void vmalloc_bench(unsigned long n);
 
 /* VFS dirent structure - must match vfs.h */
 struct vfs_dirent {
@@ -62,6 +77,11 @@ int cmd_ps(int argc, char **argv);
 int cmd_kill(int argc, char **argv);
 int cmd_reboot(int argc, char **argv);
 int cmd_uname(int argc, char **argv);
+int cmd_pcache(int argc, char **argv);
+int cmd_bcache(int argc, char **argv);
+int cmd_timers(int argc, char **argv);
+int cmd_mem(int argc, char **argv);
+int cmd_vmbench(int argc, char **argv);
 
 /* Command table */
 static struct shell_cmd commands[] = {
@@ -81,6 +101,11 @@ static struct shell_cmd commands[] = {
     {"kill", "Kill process", cmd_kill},
     {"reboot", "Reboot system", cmd_reboot},
     {"uname", "Show system information", cmd_uname},
+    {"pcache", "Show page cache statistics", cmd_pcache},
+    {"bcache", "Show/resize buffer cache", cmd_bcache},
+    {"timers", "Show timer wheel and sleep precision", cmd_timers},
+    {"mem", "Show page allocator, reclaim and ASID statistics", cmd_mem},
+    {"vmbench", "Benchmark vmalloc/vfree [nr_areas]", cmd_vmbench},
     {NULL, NULL, NULL}
 };
 
@@ -122,6 +147,23 @@ static int shell_parse(char *cmdline, char **argv)
     return argc;
 }
 
+/* Parse a decimal number, returns 0 on success */
+static int shell_parse_ulong(const char *s, unsigned long *val)
+{
+    unsigned long v = 0;
+
+    if (*s == '\0') return -1;
+
+    while (*s) {
+        if (*s < '0' || *s > '9') return -1;
+        v = v * 10 + (unsigned long)(*s - '0');
+        s++;
+    }
+
+    *val = v;
+    return 0;
+}
+
 /* Execute a command */
 int shell_execute(const char *cmdline)
 {
@@ -497,3 +539,62 @@ int cmd_uname(int argc, char **argv)
     early_puts("\n");
     return 0;
 }
+
+int cmd_pcache(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    pagecache_stats();
+    return 0;
+}
+
+int cmd_bcache(int argc, char **argv)
+{
+    unsigned long nr;
+
+    if (argc > 1) {
+        if (shell_parse_ulong(argv[1], &nr) < 0) {
+            early_puts("Usage: bcache [nr_buffers]\n");
+            return -1;
+        }
+        blockdev_set_cache_size(nr);
+    }
+
+    blockdev_stats();
+    return 0;
+}
+
+int cmd_timers(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    timer_stats();
+    return 0;
+}
+
+int cmd_mem(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    buddy_stats();
+    reclaim_stats();
+    asid_stats();
+    napot_stats();
+    return 0;
+}
+
+int cmd_vmbench(int argc, char **argv)
+{
+    unsigned long nr = 2048;
+
+    if (argc > 1 && shell_parse_ulong(argv[1], &nr) < 0) {
+        early_puts("Usage: vmbench [nr_areas]\n");
+        return -1;
+    }
+
+    vmalloc_bench(nr);
+    return 0;
+}
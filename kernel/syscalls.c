@@ -6,7 +6,10 @@
 
 #include <minix/config.h>
 #include <minix/task.h>
+#include <minix/mm.h>
 #include <minix/vfs.h>
+#include <minix/time.h>
+#include <minix/timer.h>
 #include <types.h>
 
 /* Define NULL and error codes */
@@ -15,6 +18,7 @@
 #endif
 
 #define EBADF   (-9)    /* Bad file descriptor */
+#define EFAULT  (-14)   /* Bad address */
 #define EINVAL  (-22)   /* Invalid argument */
 #define EIO     (-5)    /* I/O error */
 #define ENOSYS  (-38)   /* Function not implemented */
@@ -37,6 +41,8 @@
 #define SYS_mmap        222
 #define SYS_munmap      215
 #define SYS_execve      221
+#define SYS_nanosleep   101
+#define SYS_clock_nanosleep 115
 
 /* Legacy syscall numbers for compatibility */
 #define SYS_fork_legacy     1
@@ -77,30 +83,48 @@ static int fdalloc(struct task_struct *p, file_desc_t *f)
     return -1;
 }
 
+/* Longest path accepted from user space, including the NUL */
+#define SYSCALL_PATH_MAX    256
+
 /* ============================================
  * System call implementations
+ *
+ * User pointers are never dereferenced directly: the kernel runs on
+ * its own page table. Buffers go through copy_{from,to}_user(), or are
+ * transferred a page at a time straight into the frame behind them.
  * ============================================ */
 
+/* Bytes of a user transfer at uaddr that stay within one page */
+static size_t user_chunk(unsigned long uaddr, size_t left)
+{
+    size_t chunk = PAGE_SIZE - (uaddr & (PAGE_SIZE - 1));
+
+    return (chunk < left) ? chunk : left;
+}
+
 /* sys_read: Read from file descriptor */
 ssize_t sys_read(int fd, void *buf, size_t count)
 {
     struct task_struct *p = get_current();
     file_desc_t *f;
     file_t *vfs_file;
+    size_t done = 0;
 
     if (p == NULL || buf == NULL) {
         return EINVAL;
     }
 
-    /* Handle stdin (fd 0) - read from UART */
+    /* Handle stdin (fd 0) - read a line from the UART */
     if (fd == 0) {
-        extern int uart_getchar(void);
+        extern int uart_getc_wait(void);
         char *cbuf = (char *)buf;
         size_t i;
         for (i = 0; i < count; i++) {
-            int c = uart_getchar();
-            if (c < 0) break;
-            cbuf[i] = (char)c;
+            int c = uart_getc_wait();
+            char ch = (char)c;
+            if (copy_to_user(cbuf + i, &ch, 1) < 0) {
+                return i ? (ssize_t)i : EFAULT;
+            }
             if (c == '\n') {
                 i++;
                 break;
@@ -123,7 +147,27 @@ ssize_t sys_read(int fd, void *buf, size_t count)
         return EBADF;
     }
 
-    return vfs_read(vfs_file, buf, count);
+    /* Read each page of the buffer straight into its frame */
+    while (done < count) {
+        unsigned long uaddr = (unsigned long)buf + done;
+        size_t chunk = user_chunk(uaddr, count - done);
+        unsigned long pa = user_addr_to_phys(uaddr, 1);
+        ssize_t n;
+
+        if (!pa) {
+            return done ? (ssize_t)done : EFAULT;
+        }
+        n = vfs_read(vfs_file, (void *)pa, chunk);
+        if (n < 0) {
+            return done ? (ssize_t)done : n;
+        }
+        done += n;
+        if ((size_t)n < chunk) {
+            break;
+        }
+    }
+
+    return (ssize_t)done;
 }
 
 /* sys_write: Write to file descriptor */
@@ -131,8 +175,9 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
 {
     struct task_struct *p = get_current();
     file_desc_t *f;
-    file_t *vfs_file;
+    file_t *vfs_file = NULL;
     const char *cbuf;
+    size_t done = 0;
     size_t i;
 
     if (p == NULL || buf == NULL) {
@@ -140,29 +185,53 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
     }
 
     /* Special case: fd 1 (stdout) and fd 2 (stderr) go to console */
-    if (fd == 1 || fd == 2) {
-        cbuf = (const char *)buf;
-        for (i = 0; i < count; i++) {
-            early_putchar(cbuf[i]);
+    if (fd != 1 && fd != 2) {
+        if (fd < 0 || fd >= MAX_OPEN_FILES) {
+            return EBADF;
         }
-        return (ssize_t)count;
-    }
 
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
-        return EBADF;
-    }
+        f = p->ofile[fd];
+        if (f == NULL || !f->writable) {
+            return EBADF;
+        }
 
-    f = p->ofile[fd];
-    if (f == NULL || !f->writable) {
-        return EBADF;
+        vfs_file = (file_t *)f->data;
+        if (vfs_file == NULL) {
+            return EBADF;
+        }
     }
 
-    vfs_file = (file_t *)f->data;
-    if (vfs_file == NULL) {
-        return EBADF;
+    /* Write each page of the buffer straight from its frame */
+    while (done < count) {
+        unsigned long uaddr = (unsigned long)buf + done;
+        size_t chunk = user_chunk(uaddr, count - done);
+        unsigned long pa = user_addr_to_phys(uaddr, 0);
+        ssize_t n;
+
+        if (!pa) {
+            return done ? (ssize_t)done : EFAULT;
+        }
+
+        if (vfs_file == NULL) {
+            cbuf = (const char *)pa;
+            for (i = 0; i < chunk; i++) {
+                early_putchar(cbuf[i]);
+            }
+            n = (ssize_t)chunk;
+        } else {
+            n = vfs_write(vfs_file, (const void *)pa, chunk);
+        }
+
+        if (n < 0) {
+            return done ? (ssize_t)done : n;
+        }
+        done += n;
+        if ((size_t)n < chunk) {
+            break;
+        }
     }
 
-    return vfs_write(vfs_file, buf, count);
+    return (ssize_t)done;
 }
 
 /* sys_open: Open file (openat with AT_FDCWD) */
@@ -171,14 +240,19 @@ int sys_open(const char *path, int flags)
     struct task_struct *p = get_current();
     file_desc_t *f;
     file_t *vfs_file;
+    char kpath[SYSCALL_PATH_MAX];
     int fd;
 
     if (p == NULL || path == NULL) {
         return EINVAL;
     }
 
+    if (strncpy_from_user(kpath, path, sizeof(kpath)) < 0) {
+        return EFAULT;
+    }
+
     /* Open file through VFS */
-    vfs_file = vfs_open(path, flags);
+    vfs_file = vfs_open(kpath, flags);
     if (vfs_file == NULL) {
         return EIO;
     }
@@ -258,7 +332,7 @@ pid_t sys_getppid(void)
     return (p != NULL) ? p->ppid : -1;
 }
 
-/* sys_brk: Change data segment size (simplified) */
+/* sys_brk: Change data segment size */
 long sys_brk(unsigned long brk)
 {
     struct task_struct *p = get_current();
@@ -270,12 +344,53 @@ long sys_brk(unsigned long brk)
         return (long)p->mm->brk;
     }
 
-    /* Simple implementation - just update brk pointer */
-    if (brk >= p->mm->start_brk) {
-        p->mm->brk = brk;
+    /* Heap VMA grows/shrinks; pages are faulted in on demand */
+    return (long)do_brk(p->mm, brk);
+}
+
+/* sys_clock_nanosleep: Sleep on a clock, relative or until an absolute time */
+long sys_clock_nanosleep(int clockid, int flags, const struct timespec *req,
+                         struct timespec *rem)
+{
+    struct timespec ts;
+    u64 when;
+
+    if (req == NULL) {
+        return EINVAL;
     }
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC) {
+        return EINVAL;
+    }
+    if (copy_from_user(&ts, req, sizeof(ts)) < 0) {
+        return EFAULT;
+    }
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= (long)NSEC_PER_SEC) {
+        return EINVAL;
+    }
+
+    /* Huge intervals saturate to a sleep that never times out */
+    when = timespec_to_cycles(&ts);
+    if (!(flags & TIMER_ABSTIME)) {
+        when = cycles_add(when, get_cycles());
+    }
+
+    /* No signals can interrupt the sleep, so nothing is ever left */
+    timer_sleep_until(when);
+
+    if (rem != NULL && !(flags & TIMER_ABSTIME)) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = 0;
+        if (copy_to_user(rem, &ts, sizeof(ts)) < 0) {
+            return EFAULT;
+        }
+    }
+    return 0;
+}
 
-    return (long)p->mm->brk;
+/* sys_nanosleep: Sleep for a relative interval */
+long sys_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    return sys_clock_nanosleep(CLOCK_MONOTONIC, 0, req, rem);
 }
 
 /* ============================================
@@ -353,6 +468,16 @@ long syscall_handler(unsigned long a0, unsigned long a1,
         ret = sys_close((int)a0);
         break;
 
+    /* Time */
+    case SYS_nanosleep:
+        ret = sys_nanosleep((const struct timespec *)a0, (struct timespec *)a1);
+        break;
+
+    case SYS_clock_nanosleep:
+        ret = sys_clock_nanosleep((int)a0, (int)a1, (const struct timespec *)a2,
+                                  (struct timespec *)a3);
+        break;
+
     /* Memory management */
     case SYS_brk:
         ret = sys_brk(a0);
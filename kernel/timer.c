@@ -0,0 +1,481 @@
+/* Kernel timers
+ *
+ * Each hart has a hierarchical timing wheel: timers due within 256
+ * jiffies hang in the slot of their exact expiry in tv1, later ones in
+ * one of four coarser 64-slot levels that are cascaded down as tv1
+ * wraps. Insert and cancel are O(1) list operations and the wheel is
+ * advanced one jiffy at a time from scheduler_tick(). While a hart is
+ * tickless the next pending timer is kept as a one-shot clock event.
+ */
+
+#include <minix/config.h>
+#include <minix/board.h>
+#include <minix/task.h>
+#include <minix/sched.h>
+#include <minix/smp.h>
+#include <minix/time.h>
+#include <minix/timer.h>
+#include <asm/irq.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+extern void early_puts(const char *s);
+extern void early_puthex(unsigned long val);
+
+/* Wheel geometry */
+#define TVN_BITS            6
+#define TVR_BITS            8
+#define TVN_SIZE            (1 << TVN_BITS)
+#define TVR_SIZE            (1 << TVR_BITS)
+#define TVN_MASK            (TVN_SIZE - 1)
+#define TVR_MASK            (TVR_SIZE - 1)
+#define MAX_TVAL            ((1UL << (TVR_BITS + 4 * TVN_BITS)) - 1)
+
+struct tvec {
+    struct list_head vec[TVN_SIZE];
+};
+
+struct tvec_root {
+    struct list_head vec[TVR_SIZE];
+};
+
+struct tvec_base {
+    spinlock_t lock;
+    unsigned long timer_jiffies;    /* Next jiffy to expire */
+    unsigned long active;           /* Timers queued */
+    struct timer_event nohz_event;  /* Wakeup while tickless */
+    struct tvec_root tv1;
+    struct tvec tv2;
+    struct tvec tv3;
+    struct tvec tv4;
+    struct tvec tv5;
+};
+
+static struct tvec_base timer_bases[SMP_CPUS];
+
+/* Wakeup precision of timer_sleep_until(), log2 microsecond buckets */
+#define TIMER_HIST_BUCKETS  16
+#define CYCLES_PER_US       (BOARD_TIMEBASE_FREQ / 1000000)
+
+static unsigned long slack_hist[TIMER_HIST_BUCKETS];
+static unsigned long late_hist[TIMER_HIST_BUCKETS];
+static unsigned long nr_sleeps;
+
+/* Move every entry of from onto the empty list to */
+static inline void list_move_all(struct list_head *from, struct list_head *to)
+{
+    INIT_LIST_HEAD(to);
+    if (!list_empty(from)) {
+        to->next = from->next;
+        to->prev = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        INIT_LIST_HEAD(from);
+    }
+}
+
+/* ============================================
+ * Wheel
+ * ============================================ */
+
+/* Base is locked */
+static void internal_add_timer(struct tvec_base *base, struct timer_list *timer)
+{
+    unsigned long expires = timer->expires;
+    unsigned long idx = expires - base->timer_jiffies;
+    struct list_head *vec;
+
+    if (idx < TVR_SIZE) {
+        vec = base->tv1.vec + (expires & TVR_MASK);
+    } else if (idx < 1UL << (TVR_BITS + TVN_BITS)) {
+        vec = base->tv2.vec + ((expires >> TVR_BITS) & TVN_MASK);
+    } else if (idx < 1UL << (TVR_BITS + 2 * TVN_BITS)) {
+        vec = base->tv3.vec + ((expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK);
+    } else if (idx < 1UL << (TVR_BITS + 3 * TVN_BITS)) {
+        vec = base->tv4.vec + ((expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK);
+    } else if ((long)idx < 0) {
+        /* Already due: expire on the next jiffy processed */
+        vec = base->tv1.vec + (base->timer_jiffies & TVR_MASK);
+    } else {
+        /* Beyond the wheel: park at the far end, cascaded again later */
+        if (idx > MAX_TVAL) {
+            expires = base->timer_jiffies + MAX_TVAL;
+        }
+        vec = base->tv5.vec + ((expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK);
+    }
+
+    list_add_tail(&timer->entry, vec);
+    timer->base = base;
+}
+
+/* Re-sort one slot of a coarse level into the levels below */
+static int cascade(struct tvec_base *base, struct tvec *tv, int index)
+{
+    struct timer_list *timer, *tmp;
+    struct list_head work;
+
+    list_move_all(tv->vec + index, &work);
+    list_for_each_entry_safe(timer, tmp, &work, entry) {
+        internal_add_timer(base, timer);
+    }
+    return index;
+}
+
+#define INDEX(N)    ((base->timer_jiffies >> (TVR_BITS + (N) * TVN_BITS)) & TVN_MASK)
+
+/* Lock the wheel timer is queued on; NULL if it is not pending */
+static struct tvec_base *lock_timer_base(struct timer_list *timer,
+                                         unsigned long *flags)
+{
+    struct tvec_base *base;
+
+    while (1) {
+        base = timer->base;
+        if (!base) {
+            return NULL;
+        }
+        *flags = local_irq_save();
+        spin_lock(&base->lock);
+        if (timer->base == base) {
+            return base;
+        }
+        spin_unlock(&base->lock);
+        local_irq_restore(*flags);
+    }
+}
+
+/* Base is locked */
+static void detach_timer(struct tvec_base *base, struct timer_list *timer)
+{
+    list_del(&timer->entry);
+    INIT_LIST_HEAD(&timer->entry);
+    timer->base = NULL;
+    base->active--;
+}
+
+void init_timer(struct timer_list *timer)
+{
+    INIT_LIST_HEAD(&timer->entry);
+    timer->expires = 0;
+    timer->function = NULL;
+    timer->data = 0;
+    timer->base = NULL;
+}
+
+void setup_timer(struct timer_list *timer,
+                 void (*function)(unsigned long), unsigned long data)
+{
+    init_timer(timer);
+    timer->function = function;
+    timer->data = data;
+}
+
+int del_timer(struct timer_list *timer)
+{
+    struct tvec_base *base;
+    unsigned long flags;
+
+    base = lock_timer_base(timer, &flags);
+    if (!base) {
+        return 0;
+    }
+
+    detach_timer(base, timer);
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+    return 1;
+}
+
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+    struct tvec_base *base;
+    unsigned long flags;
+    int pending;
+
+    flags = local_irq_save();
+    pending = del_timer(timer);
+
+    base = &timer_bases[smp_processor_id()];
+    spin_lock(&base->lock);
+
+    /* An empty wheel may lag behind after an idle period */
+    if (!base->active && time_after(jiffies, base->timer_jiffies)) {
+        base->timer_jiffies = jiffies;
+    }
+
+    timer->expires = expires;
+    internal_add_timer(base, timer);
+    base->active++;
+
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+    return pending;
+}
+
+void add_timer(struct timer_list *timer)
+{
+    mod_timer(timer, timer->expires);
+}
+
+void run_local_timers(void)
+{
+    struct tvec_base *base = &timer_bases[smp_processor_id()];
+    struct timer_list *timer;
+    struct list_head work;
+    unsigned long flags;
+    int index;
+
+    if (time_before(jiffies, base->timer_jiffies)) {
+        return;
+    }
+
+    flags = local_irq_save();
+    spin_lock(&base->lock);
+
+    while (time_after_eq(jiffies, base->timer_jiffies)) {
+        if (!base->active) {
+            base->timer_jiffies = jiffies + 1;
+            break;
+        }
+
+        /* tv1 wrapped: pull the next slot of each level down */
+        index = base->timer_jiffies & TVR_MASK;
+        if (!index &&
+            !cascade(base, &base->tv2, INDEX(0)) &&
+            !cascade(base, &base->tv3, INDEX(1)) &&
+            !cascade(base, &base->tv4, INDEX(2))) {
+            cascade(base, &base->tv5, INDEX(3));
+        }
+        base->timer_jiffies++;
+
+        list_move_all(base->tv1.vec + index, &work);
+        while (!list_empty(&work)) {
+            void (*fn)(unsigned long);
+            unsigned long data;
+
+            timer = list_first_entry(&work, struct timer_list, entry);
+            fn = timer->function;
+            data = timer->data;
+            detach_timer(base, timer);
+
+            /* Unlocked: the callback may re-add the timer */
+            spin_unlock(&base->lock);
+            fn(data);
+            spin_lock(&base->lock);
+        }
+    }
+
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+}
+
+/* ============================================
+ * NO_HZ Support
+ * ============================================ */
+
+/* Earliest expiry on a locked base; returns 0 if the wheel is empty */
+static int next_timer_jiffies(struct tvec_base *base, unsigned long *next)
+{
+    struct list_head *heads[5];
+    int sizes[5] = { TVR_SIZE, TVN_SIZE, TVN_SIZE, TVN_SIZE, TVN_SIZE };
+    struct timer_list *timer;
+    int found = 0;
+    int i, j;
+
+    if (!base->active) {
+        return 0;
+    }
+
+    heads[0] = base->tv1.vec;
+    heads[1] = base->tv2.vec;
+    heads[2] = base->tv3.vec;
+    heads[3] = base->tv4.vec;
+    heads[4] = base->tv5.vec;
+
+    for (i = 0; i < 5; i++) {
+        for (j = 0; j < sizes[i]; j++) {
+            list_for_each_entry(timer, &heads[i][j], entry) {
+                if (!found || time_before(timer->expires, *next)) {
+                    *next = timer->expires;
+                    found = 1;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+static void timer_nohz_wakeup(struct timer_event *ev)
+{
+    (void)ev;
+    run_local_timers();
+}
+
+void timer_nohz_arm(void)
+{
+    struct tvec_base *base = &timer_bases[smp_processor_id()];
+    unsigned long flags, next = 0;
+    int found;
+
+    flags = local_irq_save();
+    spin_lock(&base->lock);
+    found = next_timer_jiffies(base, &next);
+    spin_unlock(&base->lock);
+
+    if (found) {
+        timer_event_add(&base->nohz_event, jiffies_to_time(next));
+    } else {
+        timer_event_del(&base->nohz_event);
+    }
+    local_irq_restore(flags);
+}
+
+/* ============================================
+ * Sleeping
+ * ============================================ */
+
+static void process_timeout(unsigned long data)
+{
+    wake_up_process((struct task_struct *)data);
+}
+
+/* Sleep until jiffies reaches expire; the caller set current->state */
+static void schedule_until(unsigned long expire)
+{
+    struct timer_list timer;
+
+    setup_timer(&timer, process_timeout, (unsigned long)get_current());
+    mod_timer(&timer, expire);
+    schedule();
+    del_timer(&timer);
+}
+
+long schedule_timeout(long timeout)
+{
+    unsigned long expire;
+
+    if (timeout == MAX_SCHEDULE_TIMEOUT) {
+        schedule();
+        return timeout;
+    }
+    if (timeout < 0) {
+        get_current()->state = TASK_RUNNING;
+        return 0;
+    }
+
+    expire = jiffies + timeout;
+    schedule_until(expire);
+
+    timeout = (long)(expire - jiffies);
+    return timeout < 0 ? 0 : timeout;
+}
+
+static void hist_add(unsigned long *hist, u64 cycles)
+{
+    unsigned long us = cycles / CYCLES_PER_US;
+    int b = 0;
+
+    while (us > 1 && b < TIMER_HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    __sync_fetch_and_add(&hist[b], 1);
+}
+
+void timer_sleep_until(u64 when)
+{
+    struct task_struct *p = get_current();
+    unsigned long expire;
+    u64 now;
+
+    /* No deadline: sleep until killed */
+    if (when == CYCLES_NEVER) {
+        while (!p->killed) {
+            p->state = TASK_INTERRUPTIBLE;
+            schedule();
+        }
+        return;
+    }
+
+    expire = time_to_jiffies(when);
+
+    /* Slack: how much later than asked the tick-granular expiry is */
+    hist_add(slack_hist, jiffies_to_time(expire) - when);
+
+    while ((now = get_cycles()) < when) {
+        p->state = TASK_INTERRUPTIBLE;
+        schedule_until(expire);
+        expire = time_to_jiffies(when);
+    }
+
+    hist_add(late_hist, now - when);
+    __sync_fetch_and_add(&nr_sleeps, 1);
+}
+
+/* ============================================
+ * Init and Statistics
+ * ============================================ */
+
+void init_timers(void)
+{
+    int cpu, j;
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        struct tvec_base *base = &timer_bases[cpu];
+
+        spin_lock_init(&base->lock);
+        base->timer_jiffies = jiffies;
+        base->active = 0;
+        timer_event_init(&base->nohz_event, timer_nohz_wakeup, base);
+
+        for (j = 0; j < TVR_SIZE; j++) {
+            INIT_LIST_HEAD(base->tv1.vec + j);
+        }
+        for (j = 0; j < TVN_SIZE; j++) {
+            INIT_LIST_HEAD(base->tv2.vec + j);
+            INIT_LIST_HEAD(base->tv3.vec + j);
+            INIT_LIST_HEAD(base->tv4.vec + j);
+            INIT_LIST_HEAD(base->tv5.vec + j);
+        }
+    }
+}
+
+void timer_stats(void)
+{
+    int cpu, b;
+
+    early_puts("\n=== Timer Statistics ===\n");
+    early_puts("Jiffies:       ");
+    early_puthex(jiffies);
+    early_puts("\nTickless:      ");
+    early_puthex(nohz_idle_mask);
+    early_puts("\n");
+
+    for (cpu = 0; cpu < SMP_CPUS; cpu++) {
+        if (!cpu_online(cpu)) continue;
+        early_puts("Hart ");
+        early_puthex(cpu);
+        early_puts(": pending=");
+        early_puthex(timer_bases[cpu].active);
+        early_puts(" wheel=");
+        early_puthex(timer_bases[cpu].timer_jiffies);
+        early_puts("\n");
+    }
+
+    early_puts("Sleeps:        ");
+    early_puthex(nr_sleeps);
+    early_puts("\n\n   us from    slack     late\n");
+    for (b = 0; b < TIMER_HIST_BUCKETS; b++) {
+        if (!slack_hist[b] && !late_hist[b]) continue;
+        early_puts("  ");
+        early_puthex(b ? 1UL << b : 0);
+        early_puts("  ");
+        early_puthex(slack_hist[b]);
+        early_puts("  ");
+        early_puthex(late_hist[b]);
+        early_puts("\n");
+    }
+}
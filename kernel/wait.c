@@ -0,0 +1,147 @@
+/* Wait queues
+ *
+ * A wait queue is a locked list of waiting tasks, so waking costs time
+ * in the number of waiters only. Queues may be woken from interrupt
+ * handlers, so their locks are always taken with interrupts disabled.
+ *
+ * Channels passed to sleep()/wakeup() have no queue of their own: they
+ * hash to one of a fixed table of shared queues and waiters carry the
+ * channel as their key.
+ */
+
+#include <minix/config.h>
+#include <minix/task.h>
+#include <minix/sched.h>
+#include <asm/irq.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Hashed channel queues */
+#define WAIT_TABLE_BITS     6
+#define WAIT_TABLE_SIZE     (1 << WAIT_TABLE_BITS)
+
+static wait_queue_head_t wait_table[WAIT_TABLE_SIZE];
+
+void add_wait_queue(wait_queue_head_t *q, wait_queue_entry_t *wait)
+{
+    unsigned long flags;
+
+    wait->flags &= ~WQ_FLAG_EXCLUSIVE;
+    spin_lock_irqsave(&q->lock, flags);
+    list_add(&wait->entry, &q->head);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void add_wait_queue_exclusive(wait_queue_head_t *q, wait_queue_entry_t *wait)
+{
+    unsigned long flags;
+
+    wait->flags |= WQ_FLAG_EXCLUSIVE;
+    spin_lock_irqsave(&q->lock, flags);
+    list_add_tail(&wait->entry, &q->head);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void remove_wait_queue(wait_queue_head_t *q, wait_queue_entry_t *wait)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&q->lock, flags);
+    list_del(&wait->entry);
+    INIT_LIST_HEAD(&wait->entry);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* The state is set under the queue lock, so a wakeup after this point
+ * is never lost: it either sees the entry or finds the task running
+ */
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_entry_t *wait, long state)
+{
+    unsigned long flags;
+
+    wait->flags &= ~WQ_FLAG_EXCLUSIVE;
+    spin_lock_irqsave(&q->lock, flags);
+    if (list_empty(&wait->entry)) {
+        list_add(&wait->entry, &q->head);
+    }
+    wait->task->state = state;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void prepare_to_wait_exclusive(wait_queue_head_t *q, wait_queue_entry_t *wait,
+                               long state)
+{
+    unsigned long flags;
+
+    wait->flags |= WQ_FLAG_EXCLUSIVE;
+    spin_lock_irqsave(&q->lock, flags);
+    if (list_empty(&wait->entry)) {
+        list_add_tail(&wait->entry, &q->head);
+    }
+    wait->task->state = state;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void finish_wait(wait_queue_head_t *q, wait_queue_entry_t *wait)
+{
+    unsigned long flags;
+
+    wait->task->state = TASK_RUNNING;
+
+    if (list_empty(&wait->entry)) {
+        return;
+    }
+
+    spin_lock_irqsave(&q->lock, flags);
+    list_del(&wait->entry);
+    INIT_LIST_HEAD(&wait->entry);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+int __wake_up(wait_queue_head_t *q, int nr_exclusive, void *key)
+{
+    wait_queue_entry_t *wait;
+    unsigned long flags;
+    int woken = 0;
+
+    spin_lock_irqsave(&q->lock, flags);
+
+    list_for_each_entry(wait, &q->head, entry) {
+        if (key && wait->key != key) {
+            continue;
+        }
+        if (!wake_up_process(wait->task)) {
+            continue;   /* Already running: does not use up nr_exclusive */
+        }
+        woken++;
+        if ((wait->flags & WQ_FLAG_EXCLUSIVE) && !--nr_exclusive) {
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&q->lock, flags);
+    return woken;
+}
+
+/* ============================================
+ * Hashed Channel Queues
+ * ============================================ */
+
+wait_queue_head_t *chan_waitqueue(const void *chan)
+{
+    unsigned long h = (unsigned long)chan * 0x9E3779B97F4A7C15UL;
+
+    return &wait_table[h >> (64 - WAIT_TABLE_BITS)];
+}
+
+void wait_table_init(void)
+{
+    int i;
+
+    for (i = 0; i < WAIT_TABLE_SIZE; i++) {
+        init_waitqueue_head(&wait_table[i]);
+    }
+}
@@ -0,0 +1,125 @@
+/* Flattened Device Tree walker
+ *
+ * Only reads the blob: the structure block is decoded token by token
+ * and every offset is checked against the sizes in the header, so a
+ * corrupt tree ends the walk instead of running off into memory.
+ */
+
+#include <minix/fdt.h>
+#include <types.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Oldest layout with size_dt_struct in the header */
+#define FDT_MIN_VERSION     17
+
+static inline const struct fdt_header *fdt_hdr(const void *fdt)
+{
+    return (const struct fdt_header *)fdt;
+}
+
+int fdt_check_header(const void *fdt)
+{
+    const struct fdt_header *h = fdt_hdr(fdt);
+    u32 size;
+
+    if (!fdt || ((unsigned long)fdt & 3))
+        return -1;
+    if (fdt32_to_cpu(h->magic) != FDT_MAGIC)
+        return -1;
+    if (fdt32_to_cpu(h->last_comp_version) > FDT_MIN_VERSION ||
+        fdt32_to_cpu(h->version) < FDT_MIN_VERSION)
+        return -1;
+
+    size = fdt32_to_cpu(h->totalsize);
+    if (fdt32_to_cpu(h->off_dt_struct) + fdt32_to_cpu(h->size_dt_struct) > size ||
+        fdt32_to_cpu(h->off_dt_strings) + fdt32_to_cpu(h->size_dt_strings) > size ||
+        fdt32_to_cpu(h->off_mem_rsvmap) >= size)
+        return -1;
+
+    return 0;
+}
+
+unsigned long fdt_totalsize(const void *fdt)
+{
+    return fdt32_to_cpu(fdt_hdr(fdt)->totalsize);
+}
+
+int fdt_next_token(const void *fdt, int offset, struct fdt_token *tok)
+{
+    const struct fdt_header *h = fdt_hdr(fdt);
+    const char *base = (const char *)fdt + fdt32_to_cpu(h->off_dt_struct);
+    const char *strings = (const char *)fdt + fdt32_to_cpu(h->off_dt_strings);
+    u32 size = fdt32_to_cpu(h->size_dt_struct);
+    u32 strsize = fdt32_to_cpu(h->size_dt_strings);
+    u32 nameoff;
+    const u32 *p;
+
+    do {
+        if (offset < 0 || (u32)offset + 4 > size)
+            return -1;
+        p = (const u32 *)(base + offset);
+        tok->type = fdt32_to_cpu(*p);
+        offset += 4;
+    } while (tok->type == FDT_NOP);
+
+    tok->name = NULL;
+    tok->data = NULL;
+    tok->len = 0;
+
+    switch (tok->type) {
+    case FDT_BEGIN_NODE:
+        /* NUL-terminated name, padded to a cell */
+        tok->name = base + offset;
+        while ((u32)offset < size && base[offset])
+            offset++;
+        if ((u32)offset >= size)
+            return -1;
+        offset = (offset + 1 + 3) & ~3;
+        break;
+
+    case FDT_PROP:
+        if ((u32)offset + 8 > size)
+            return -1;
+        p = (const u32 *)(base + offset);
+        tok->len = fdt32_to_cpu(p[0]);
+        nameoff = fdt32_to_cpu(p[1]);
+        offset += 8;
+        if (nameoff >= strsize || tok->len > size - (u32)offset)
+            return -1;
+        tok->name = strings + nameoff;
+        tok->data = base + offset;
+        offset = (offset + tok->len + 3) & ~3;
+        break;
+
+    case FDT_END_NODE:
+    case FDT_END:
+        break;
+
+    default:
+        return -1;
+    }
+
+    return offset;
+}
+
+int fdt_get_mem_rsv(const void *fdt, int n, u64 *addr, u64 *size)
+{
+    const struct fdt_header *h = fdt_hdr(fdt);
+    u32 off = fdt32_to_cpu(h->off_mem_rsvmap) + (u32)n * 16;
+    const u32 *p;
+
+    if (n < 0 || off + 16 > fdt32_to_cpu(h->totalsize))
+        return -1;
+
+    /* The map ends with an all-zero entry */
+    p = (const u32 *)((const char *)fdt + off);
+    *addr = fdt_read_cells(p, 2);
+    *size = fdt_read_cells(p + 2, 2);
+    if (*addr == 0 && *size == 0)
+        return -1;
+
+    return 0;
+}